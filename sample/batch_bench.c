@@ -0,0 +1,131 @@
+//
+// Created by Administrator on 2026/10/19.
+//
+// Small-message publish rate with MQTTClient_publishMessage in a loop against
+// MQTTClient_publishBatch, against the in-process stand-in broker of bench_broker.h.
+// A message the client could not take at once, because an earlier write is still
+// pending, is offered again.
+//
+// usage: batch_bench [messages] [payload bytes] [batch size] [qos]
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "MQTTClient.h"
+#include "bench_broker.h"
+
+#define CLIENTID    "batch_bench"
+#define TOPIC       "bench/batch/telemetry"
+#define WINDOW      1000
+
+static volatile int delivered = 0;
+
+static int messageArrived(void *context, char *topicName, int topicLen, MQTTClient_message *message) {
+    return 1;
+}
+
+static void deliveryComplete(void *context, MQTTClient_deliveryToken dt) {
+    delivered++;
+}
+
+static int run(bench_broker *broker, const char *uri, int count, int payloadlen, int batch, int qos) {
+    MQTTClient client;
+    MQTTClient_connectOptions conn_opts = MQTTClient_connectOptions_initializer;
+    MQTTClient_message *messages = calloc(batch, sizeof(MQTTClient_message));
+    MQTTClient_deliveryToken *tokens = calloc(batch, sizeof(MQTTClient_deliveryToken));
+    char **topics = calloc(batch, sizeof(char *));
+    int *results = calloc(batch, sizeof(int));
+    char *payload = malloc(payloadlen);
+    long base = broker->publishes, retries = 0;
+    struct timeval start;
+    long us;
+    int i, sent = 0, rc;
+
+    if ((rc = MQTTClient_createWithOptions(&client, uri, CLIENTID, MQTTCLIENT_PERSISTENCE_NONE, NULL, NULL)) !=
+        MQTTCLIENT_SUCCESS) {
+        printf("Failed to create client, return code %d\n", rc);
+        goto exit;
+    }
+    MQTTClient_setCallbacks(client, NULL, NULL, messageArrived, deliveryComplete);
+    conn_opts.keepAliveInterval = 60;
+    conn_opts.connectTimeout = 10;
+    conn_opts.MQTTVersion = MQTTVERSION_3_1_1;
+    if ((rc = MQTTClient_connect(client, &conn_opts)) != MQTTCLIENT_SUCCESS) {
+        printf("Failed to connect, return code %d\n", rc);
+        MQTTClient_destroy(&client);
+        goto exit;
+    }
+
+    memset(payload, 'x', payloadlen);
+    for (i = 0; i < batch; ++i) {
+        MQTTClient_message m = MQTTClient_message_initializer;
+
+        m.payload = payload;
+        m.payloadlen = payloadlen;
+        m.qos = qos;
+        messages[i] = m;
+        topics[i] = TOPIC;
+    }
+    delivered = 0;
+    gettimeofday(&start, NULL);
+    while (sent < count) {
+        int n = (count - sent < batch) ? count - sent : batch;
+
+        while (qos > 0 && sent - delivered + n > WINDOW)
+            usleep(50);
+        if (batch == 1) {
+            if ((rc = MQTTClient_publishMessage(client, TOPIC, &messages[0], &tokens[0])) == MQTTCLIENT_SUCCESS)
+                ++sent;
+        } else {
+            MQTTClient_publishBatch(client, n, topics, messages, tokens, results);
+            for (i = 0, rc = MQTTCLIENT_SUCCESS; i < n; ++i) {
+                if (results[i] == MQTTCLIENT_SUCCESS)
+                    ++sent;
+                else if (rc == MQTTCLIENT_SUCCESS)
+                    rc = results[i];
+            }
+        }
+        if (rc != MQTTCLIENT_SUCCESS) {
+            ++retries;
+            usleep(10);
+        }
+    }
+    while (broker->publishes - base < sent && bench_elapsed_us(start) < 30000000L)
+        usleep(100);
+    while (qos > 0 && delivered < sent && bench_elapsed_us(start) < 30000000L)
+        usleep(100);
+    us = bench_elapsed_us(start);
+    printf("%-6s %6d batch %8ld msgs %6d bytes qos %d %10.0f msgs/s %8.2f MB/s %8ld retries\n",
+           batch == 1 ? "single" : "batch", batch, broker->publishes - base, payloadlen, qos,
+           (broker->publishes - base) * 1e6 / us, (double) (broker->publishes - base) * payloadlen / us, retries);
+    MQTTClient_destroy(&client);
+    exit:
+    free(payload);
+    free(results);
+    free(topics);
+    free(tokens);
+    free(messages);
+    return rc;
+}
+
+int main(int argc, char *argv[]) {
+    int count = (argc > 1) ? atoi(argv[1]) : 200000;
+    int payloadlen = (argc > 2) ? atoi(argv[2]) : 32;
+    int batch = (argc > 3) ? atoi(argv[3]) : 256;
+    int qos = (argc > 4) ? atoi(argv[4]) : 0;
+    bench_broker broker;
+    char uri[64];
+
+    if (bench_broker_start(&broker) != 0) {
+        printf("Failed to start the stand-in broker\n");
+        return EXIT_FAILURE;
+    }
+    snprintf(uri, sizeof(uri), "tcp://127.0.0.1:%d", broker.port);
+
+    run(&broker, uri, count, payloadlen, 1, qos);
+    run(&broker, uri, count, payloadlen, batch, qos);
+    bench_broker_stop(&broker);
+    return EXIT_SUCCESS;
+}
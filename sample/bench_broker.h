@@ -0,0 +1,593 @@
+//
+// Created by Administrator on 2026/10/19.
+//
+// A minimal in-process MQTT broker stand-in for the benchmark programs.  It accepts
+// any number of plain TCP connections on 127.0.0.1, answers CONNECT, SUBSCRIBE,
+// PUBLISH (QoS 1 and 2), PUBREL and PINGREQ, and otherwise discards what it reads.
+// It is not a broker: messages are counted, never routed, though with echo set each
+// PUBLISH is sent back to its sender at QoS 0.
+//
+// With BENCH_BROKER_WEBSOCKET defined before this is included, bench_broker_start_with
+// can have connections upgraded to WebSockets first.  That needs src/utils on the include path.
+// With BENCH_BROKER_DEFLATE as well, it can take up permessage-deflate offers, which needs zlib:
+// compressed messages are inflated, as long as they come in single frames, and everything sent
+// back is compressed.
+//
+
+#ifndef MQTT_CLIENT_BENCH_BROKER_H
+#define MQTT_CLIENT_BENCH_BROKER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#if defined(BENCH_BROKER_WEBSOCKET)
+#include <endian.h>
+#include <strings.h>
+#include "Base64.h"
+#include "SHA1.h"
+#include "WebSocketMask.h"
+#endif
+#if defined(BENCH_BROKER_DEFLATE)
+#include <zlib.h>
+#endif
+
+#define BENCH_BROKER_MAX_CONNS 4096
+
+/** the websocket argument of bench_broker_start_with which takes up permessage-deflate offers too */
+#define BENCH_BROKER_WS_DEFLATE 2
+
+typedef struct {
+    int fd;
+    char *buf;
+    size_t buflen;
+    size_t datalen;
+    size_t mqttlen;     /**< how much of the data is MQTT packets, the rest being frames not yet read */
+    int upgraded;       /**< the WebSocket upgrade has been answered */
+#if defined(BENCH_BROKER_DEFLATE)
+    z_stream *zin;      /**< inflates the messages received, if permessage-deflate was agreed */
+    z_stream *zout;     /**< compresses the messages sent */
+    int zreset;         /**< each message sent is compressed on its own */
+#endif
+} bench_conn;
+
+typedef struct {
+    int listen_fd;
+    int port;
+    volatile int stop;
+    int websocket;                  /**< connections are upgraded to WebSockets, or BENCH_BROKER_WS_DEFLATE */
+    int echo;                       /**< each PUBLISH is sent back to its sender */
+    volatile long publishes;        /**< PUBLISH packets received */
+    volatile long long bytes;       /**< bytes received on all connections */
+    volatile long long sent;        /**< bytes sent on all connections */
+    volatile int connections;       /**< currently open connections */
+    int conn_count;
+    struct pollfd fds[BENCH_BROKER_MAX_CONNS + 1];
+    bench_conn conns[BENCH_BROKER_MAX_CONNS + 1];
+    pthread_t thread;
+} bench_broker;
+
+
+static long bench_elapsed_us(struct timeval start) {
+    struct timeval now, res;
+
+    gettimeofday(&now, NULL);
+    timersub(&now, &start, &res);
+    return res.tv_sec * 1000000L + res.tv_usec;
+}
+
+
+static void bench_broker_write(int fd, const unsigned char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t rc = send(fd, buf, len, MSG_NOSIGNAL);
+        if (rc < 0) {
+            struct pollfd p = {fd, POLLOUT, 0};
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                return; /* the connection has gone, the read side will notice */
+            poll(&p, 1, 100);
+            continue;
+        }
+        buf += rc;
+        len -= (size_t) rc;
+    }
+}
+
+
+#if defined(BENCH_BROKER_WEBSOCKET)
+/* send a final frame, with first as its first byte */
+static void bench_broker_frame(bench_broker *b, bench_conn *c, unsigned char first, const unsigned char *buf,
+                               size_t len) {
+    unsigned char frame[256 + 10];
+    size_t hdr = 2;
+
+    frame[0] = first;
+    if (len < 126)
+        frame[1] = (unsigned char) len;
+    else if (len < 65536) {
+        uint16_t len16 = htobe16((uint16_t) len);
+        frame[1] = 126;
+        memcpy(&frame[2], &len16, 2);
+        hdr += 2;
+    } else {
+        uint64_t len64 = htobe64((uint64_t) len);
+        frame[1] = 127;
+        memcpy(&frame[2], &len64, 8);
+        hdr += 8;
+    }
+    b->sent += (long long) (hdr + len);
+    if (len <= 256) { /* small packets in one write */
+        memcpy(&frame[hdr], buf, len);
+        bench_broker_write(c->fd, frame, hdr + len);
+        return;
+    }
+    bench_broker_write(c->fd, frame, hdr);
+    bench_broker_write(c->fd, buf, len);
+}
+#endif
+
+
+#if defined(BENCH_BROKER_DEFLATE)
+/* send an MQTT packet as a compressed message, returns 0 if it was */
+static int bench_broker_sendCompressed(bench_broker *b, bench_conn *c, const unsigned char *buf, size_t len) {
+    size_t size = deflateBound(c->zout, (uLong) len) + 16;
+    unsigned char *out = malloc(size);
+    int rc = -1;
+
+    if (out == NULL)
+        return rc;
+    c->zout->next_in = (Bytef *) buf;
+    c->zout->avail_in = (uInt) len;
+    c->zout->next_out = out;
+    c->zout->avail_out = (uInt) size;
+    if (deflate(c->zout, Z_SYNC_FLUSH) == Z_OK && c->zout->avail_in == 0 && c->zout->avail_out > 0) {
+        /* without the 0x00 0x00 0xff 0xff which ends the flush */
+        bench_broker_frame(b, c, 0xC2, out, size - c->zout->avail_out - 4);
+        rc = 0;
+    }
+    if (c->zreset)
+        deflateReset(c->zout);
+    free(out);
+    return rc;
+}
+#endif
+
+
+/* send an MQTT packet to a connection, in a binary frame if it is a WebSocket */
+static void bench_broker_send(bench_broker *b, bench_conn *c, const unsigned char *buf, size_t len) {
+#if defined(BENCH_BROKER_DEFLATE)
+    if (c->zout && bench_broker_sendCompressed(b, c, buf, len) == 0)
+        return;
+#endif
+#if defined(BENCH_BROKER_WEBSOCKET)
+    if (b->websocket) {
+        bench_broker_frame(b, c, 0x82, buf, len); /* final binary frame */
+        return;
+    }
+#endif
+    b->sent += (long long) len;
+    bench_broker_write(c->fd, buf, len);
+}
+
+
+/* send a PUBLISH back to its sender at QoS 0, without its packet identifier */
+static void bench_broker_echo(bench_broker *b, bench_conn *c, unsigned char type, unsigned char *data, size_t len) {
+    size_t topic = 2 + (data[0] << 8) + data[1];
+    size_t skip = ((type >> 1) & 0x03) ? 2 : 0;
+    size_t remaining = len - skip, hdr = 1, rl;
+    unsigned char *out;
+
+    if (topic + skip > len || (out = malloc(len + 5)) == NULL)
+        return;
+    out[0] = 0x30;
+    rl = remaining;
+    do {
+        out[hdr] = rl % 128;
+        rl /= 128;
+        out[hdr++] |= (rl > 0) ? 128 : 0;
+    } while (rl > 0);
+    memcpy(&out[hdr], data, topic);
+    memcpy(&out[hdr + topic], &data[topic + skip], len - topic - skip);
+    bench_broker_send(b, c, out, hdr + remaining);
+    free(out);
+}
+
+
+/* handle one complete packet, returns 0 to keep the connection open */
+static int bench_broker_packet(bench_broker *b, bench_conn *c, unsigned char type, unsigned char *data, size_t len) {
+    unsigned char reply[8];
+    int rc = 0;
+
+    switch (type >> 4) {
+        case 1: /* CONNECT: reply with the version the client asked for */
+        {
+            int v5 = (len > 6 && data[6] == 5);
+            reply[0] = 0x20;
+            reply[1] = v5 ? 3 : 2;
+            reply[2] = reply[3] = 0;
+            reply[4] = 0; /* empty v5 property block */
+            bench_broker_send(b, c, reply, v5 ? 5 : 4);
+            break;
+        }
+        case 3: /* PUBLISH */
+        {
+            int qos = (type >> 1) & 0x03;
+            b->publishes++;
+            if (qos > 0 && len >= 2) {
+                size_t topiclen = (data[0] << 8) + data[1];
+                if (len >= topiclen + 4) {
+                    reply[0] = (qos == 1) ? 0x40 : 0x50;
+                    reply[1] = 2;
+                    reply[2] = data[2 + topiclen];
+                    reply[3] = data[3 + topiclen];
+                    bench_broker_send(b, c, reply, 4);
+                }
+            }
+            if (b->echo && len >= 2)
+                bench_broker_echo(b, c, type, data, len);
+            break;
+        }
+        case 6: /* PUBREL */
+            reply[0] = 0x70;
+            reply[1] = 2;
+            reply[2] = data[0];
+            reply[3] = data[1];
+            bench_broker_send(b, c, reply, 4);
+            break;
+        case 8: /* SUBSCRIBE: grant QoS 1 to a single topic */
+            reply[0] = 0x90;
+            reply[1] = 3;
+            reply[2] = data[0];
+            reply[3] = data[1];
+            reply[4] = 1;
+            bench_broker_send(b, c, reply, 5);
+            break;
+        case 12: /* PINGREQ */
+            reply[0] = 0xD0;
+            reply[1] = 0;
+            bench_broker_send(b, c, reply, 2);
+            break;
+        case 14: /* DISCONNECT */
+            rc = -1;
+            break;
+        default:
+            break;
+    }
+    return rc;
+}
+
+
+#if defined(BENCH_BROKER_WEBSOCKET)
+#if defined(BENCH_BROKER_DEFLATE)
+/* take up a permessage-deflate offer, writing the answer to it into answer */
+static void bench_broker_deflateAnswer(bench_conn *c, const char *offer, size_t len, char *answer, size_t size) {
+    int bits = 15, n = 0;
+    char line[256];
+    const char *p;
+
+    snprintf(line, sizeof(line), "%.*s", (int) len, offer);
+    if (strstr(line, "permessage-deflate") == NULL || (c->zin = calloc(1, sizeof(z_stream))) == NULL)
+        return;
+    if ((c->zout = calloc(1, sizeof(z_stream))) == NULL) {
+        free(c->zin);
+        c->zin = NULL;
+        return;
+    }
+    n = snprintf(answer, size, "Sec-WebSocket-Extensions: permessage-deflate");
+    if ((p = strstr(line, "server_max_window_bits=")) != NULL) {
+        bits = atoi(&p[23]);
+        bits = (bits < 9) ? 9 : (bits > 15) ? 15 : bits; /* zlib makes 9 bit streams when asked for 8 */
+        n += snprintf(&answer[n], size - n, "; server_max_window_bits=%d", bits);
+    }
+    if (strstr(line, "server_no_context_takeover")) {
+        c->zreset = 1;
+        n += snprintf(&answer[n], size - n, "; server_no_context_takeover");
+    }
+    if (strstr(line, "client_no_context_takeover"))
+        n += snprintf(&answer[n], size - n, "; client_no_context_takeover");
+    snprintf(&answer[n], size - n, "\r\n");
+    inflateInit2(c->zin, -15);
+    deflateInit2(c->zout, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -bits, 8, Z_DEFAULT_STRATEGY);
+}
+
+
+/* inflate the compressed message in the frame after the MQTT data onto it, returns 0 if it could be */
+static int bench_broker_inflate(bench_conn *c, size_t hdr, size_t len) {
+    static const unsigned char tail[4] = {0x00, 0x00, 0xff, 0xff};
+    size_t rest = c->datalen - c->mqttlen - hdr - len, size = len * 4 + 256, outlen = 0;
+    unsigned char *out = malloc(size);
+    int zrc = Z_OK, part;
+
+    if (out == NULL)
+        return -1;
+    for (part = 0; part < 2 && (zrc == Z_OK || zrc == Z_BUF_ERROR); ++part) {
+        c->zin->next_in = (part == 0) ? (Bytef *) &c->buf[c->mqttlen + hdr] : (Bytef *) tail;
+        c->zin->avail_in = (uInt) ((part == 0) ? len : sizeof(tail));
+        do {
+            if (outlen == size) {
+                size *= 2;
+                out = realloc(out, size);
+            }
+            c->zin->next_out = &out[outlen];
+            c->zin->avail_out = (uInt) (size - outlen);
+            zrc = inflate(c->zin, Z_SYNC_FLUSH);
+            outlen = size - c->zin->avail_out;
+        } while ((zrc == Z_OK || zrc == Z_BUF_ERROR) && (c->zin->avail_in > 0 || c->zin->avail_out == 0));
+    }
+    if (zrc != Z_OK && zrc != Z_BUF_ERROR) {
+        free(out);
+        return -1;
+    }
+    if (c->mqttlen + outlen + rest > c->buflen) {
+        c->buflen = c->mqttlen + outlen + rest;
+        c->buf = realloc(c->buf, c->buflen);
+    }
+    memmove(&c->buf[c->mqttlen + outlen], &c->buf[c->mqttlen + hdr + len], rest);
+    memcpy(&c->buf[c->mqttlen], out, outlen);
+    c->datalen = c->mqttlen + outlen + rest;
+    c->mqttlen += outlen;
+    free(out);
+    return 0;
+}
+#endif
+
+
+/* answer the upgrade request at the start of the buffer, returns 0 once it has been */
+static int bench_broker_upgrade(bench_broker *b, bench_conn *c) {
+    static const char *guid = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+    char key[64 + 37] = "", accept[32], response[512], extensions[256] = "";
+    unsigned char digest[SHA1_DIGEST_LENGTH];
+    size_t pos = 0, end;
+    SHA_CTX ctx;
+    int len;
+
+    for (end = 0; end + 4 <= c->datalen && memcmp(&c->buf[end], "\r\n\r\n", 4) != 0; ++end);
+    if (end + 4 > c->datalen)
+        return -1; /* not all here yet */
+    while (pos < end) {
+        char *eol = memchr(&c->buf[pos], '\r', end + 2 - pos);
+        size_t linelen = (size_t) (eol - &c->buf[pos]);
+
+        if (linelen > 18 && linelen - 18 < 64 && strncasecmp(&c->buf[pos], "Sec-WebSocket-Key:", 18) == 0) {
+            size_t from = pos + 18;
+
+            while (c->buf[from] == ' ')
+                ++from;
+            memcpy(key, &c->buf[from], pos + linelen - from);
+            key[pos + linelen - from] = '\0';
+        }
+#if defined(BENCH_BROKER_DEFLATE)
+        if (b->websocket == BENCH_BROKER_WS_DEFLATE && linelen > 25 &&
+            strncasecmp(&c->buf[pos], "Sec-WebSocket-Extensions:", 25) == 0)
+            bench_broker_deflateAnswer(c, &c->buf[pos + 25], linelen - 25, extensions, sizeof(extensions));
+#endif
+        pos += linelen + 2;
+    }
+    strcat(key, guid);
+    SHA1_Init(&ctx);
+    SHA1_Update(&ctx, key, strlen(key));
+    SHA1_Final(digest, &ctx);
+    Base64_encode(accept, sizeof(accept), digest, SHA1_DIGEST_LENGTH);
+    len = snprintf(response, sizeof(response), "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\n"
+                   "Connection: Upgrade\r\nSec-WebSocket-Accept: %s\r\nSec-WebSocket-Protocol: mqtt\r\n%s\r\n",
+                   accept, extensions);
+    bench_broker_write(c->fd, (unsigned char *) response, (size_t) len);
+    memmove(c->buf, &c->buf[end + 4], c->datalen - end - 4);
+    c->datalen -= end + 4;
+    c->mqttlen = 0;
+    c->upgraded = 1;
+    return 0;
+}
+
+
+/* unmask the complete frames after the MQTT data and join their payloads onto it, returns 0 to keep the connection */
+static int bench_broker_unframe(bench_conn *c) {
+    while (c->datalen - c->mqttlen >= 2) {
+        unsigned char *f = (unsigned char *) &c->buf[c->mqttlen];
+        size_t hdr = 2, len = f[1] & 0x7F;
+        int opcode = f[0] & 0x0F;
+
+        if (len == 126) {
+            uint16_t len16;
+            if (c->datalen - c->mqttlen < 4)
+                break;
+            memcpy(&len16, &f[2], 2);
+            len = be16toh(len16);
+            hdr += 2;
+        } else if (len == 127) {
+            uint64_t len64;
+            if (c->datalen - c->mqttlen < 10)
+                break;
+            memcpy(&len64, &f[2], 8);
+            len = (size_t) be64toh(len64);
+            hdr += 8;
+        }
+        if (f[1] & 0x80)
+            hdr += 4;
+        if (c->datalen - c->mqttlen < hdr + len)
+            break;
+        if (opcode == 0x8)
+            return -1; /* close */
+        if (f[1] & 0x80)
+            WebSocket_mask((char *) &f[hdr], (char *) &f[hdr], len, &f[hdr - 4], 0);
+        if (opcode >= 0x8) /* ping or pong: dropped */
+            len = 0;
+#if defined(BENCH_BROKER_DEFLATE)
+        if ((f[0] & 0x40) && c->zin) {
+            if (bench_broker_inflate(c, hdr, len) != 0)
+                return -1;
+            continue;
+        }
+#endif
+        memmove(f, &f[hdr], c->datalen - c->mqttlen - hdr);
+        c->datalen -= hdr;
+        c->mqttlen += len;
+    }
+    return 0;
+}
+#endif
+
+
+/* parse as many complete packets as the connection buffer holds */
+static int bench_broker_consume(bench_broker *b, bench_conn *c) {
+    size_t pos = 0;
+    int rc = 0;
+
+#if defined(BENCH_BROKER_WEBSOCKET)
+    if (b->websocket) {
+        if (!c->upgraded && bench_broker_upgrade(b, c) != 0)
+            return 0;
+        if (bench_broker_unframe(c) != 0)
+            return -1;
+    } else
+#endif
+        c->mqttlen = c->datalen;
+    while (rc == 0 && c->mqttlen - pos >= 2) {
+        size_t remaining = 0, multiplier = 1, hdr = 1;
+        unsigned char d;
+
+        do {
+            if (pos + hdr >= c->mqttlen)
+                goto incomplete;
+            d = (unsigned char) c->buf[pos + hdr++];
+            remaining += (d & 127) * multiplier;
+            multiplier *= 128;
+        } while (d & 128);
+        if (c->mqttlen - pos < hdr + remaining)
+            break;
+        rc = bench_broker_packet(b, c, (unsigned char) c->buf[pos], (unsigned char *) &c->buf[pos + hdr], remaining);
+        pos += hdr + remaining;
+    }
+    incomplete:
+    if (pos > 0) {
+        memmove(c->buf, &c->buf[pos], c->datalen - pos);
+        c->datalen -= pos;
+        c->mqttlen -= pos;
+    }
+    return rc;
+}
+
+
+static void bench_broker_close(bench_broker *b, int i) {
+    close(b->conns[i].fd);
+    free(b->conns[i].buf);
+#if defined(BENCH_BROKER_DEFLATE)
+    if (b->conns[i].zin) {
+        inflateEnd(b->conns[i].zin);
+        deflateEnd(b->conns[i].zout);
+        free(b->conns[i].zin);
+        free(b->conns[i].zout);
+    }
+#endif
+    b->conns[i] = b->conns[b->conn_count];
+    b->fds[i] = b->fds[b->conn_count];
+    b->conn_count--;
+    b->connections--;
+}
+
+
+static void *bench_broker_run(void *n) {
+    bench_broker *b = n;
+
+    while (!b->stop) {
+        int i;
+
+        b->fds[0].fd = b->listen_fd;
+        b->fds[0].events = POLLIN;
+        if (poll(b->fds, b->conn_count + 1, 50) <= 0)
+            continue;
+        if ((b->fds[0].revents & POLLIN) && b->conn_count < BENCH_BROKER_MAX_CONNS) {
+            int fd = accept(b->listen_fd, NULL, NULL);
+            if (fd >= 0) {
+                int one = 1;
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+                b->conn_count++;
+                b->connections++;
+                b->fds[b->conn_count].fd = fd;
+                b->fds[b->conn_count].events = POLLIN;
+                b->fds[b->conn_count].revents = 0;
+                b->conns[b->conn_count].fd = fd;
+                b->conns[b->conn_count].buflen = 64 * 1024;
+                b->conns[b->conn_count].buf = malloc(b->conns[b->conn_count].buflen);
+                b->conns[b->conn_count].datalen = 0;
+                b->conns[b->conn_count].mqttlen = 0;
+                b->conns[b->conn_count].upgraded = 0;
+#if defined(BENCH_BROKER_DEFLATE)
+                b->conns[b->conn_count].zin = b->conns[b->conn_count].zout = NULL;
+                b->conns[b->conn_count].zreset = 0;
+#endif
+            }
+        }
+        for (i = b->conn_count; i >= 1; --i) {
+            bench_conn *c = &b->conns[i];
+            ssize_t rc;
+
+            if ((b->fds[i].revents & (POLLIN | POLLHUP | POLLERR)) == 0)
+                continue;
+            if (c->datalen == c->buflen) {
+                c->buflen *= 2;
+                c->buf = realloc(c->buf, c->buflen);
+            }
+            rc = recv(c->fd, &c->buf[c->datalen], c->buflen - c->datalen, 0);
+            if (rc <= 0 || (c->datalen += (size_t) rc, b->bytes += rc, bench_broker_consume(b, c) != 0))
+                bench_broker_close(b, i);
+        }
+    }
+    while (b->conn_count > 0)
+        bench_broker_close(b, b->conn_count);
+    close(b->listen_fd);
+    return NULL;
+}
+
+
+/**
+ * Start the stand-in broker on an ephemeral port of the loopback interface
+ * @param b the broker structure to fill in
+ * @param websocket upgrade connections to WebSockets, which needs BENCH_BROKER_WEBSOCKET, or
+ * BENCH_BROKER_WS_DEFLATE to take up permessage-deflate too, which needs BENCH_BROKER_DEFLATE
+ * @param echo send each PUBLISH back to its sender
+ * @return 0 on success
+ */
+static int bench_broker_start_with(bench_broker *b, int websocket, int echo) {
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    int one = 1;
+
+    memset(b, '\0', sizeof(bench_broker));
+    b->websocket = websocket;
+    b->echo = echo;
+    if ((b->listen_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+        return -1;
+    setsockopt(b->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    memset(&addr, '\0', sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    if (bind(b->listen_fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 || listen(b->listen_fd, 1024) != 0 ||
+        getsockname(b->listen_fd, (struct sockaddr *) &addr, &addrlen) != 0) {
+        close(b->listen_fd);
+        return -1;
+    }
+    b->port = ntohs(addr.sin_port);
+    return pthread_create(&b->thread, NULL, bench_broker_run, b);
+}
+
+
+static inline int bench_broker_start(bench_broker *b) {
+    return bench_broker_start_with(b, 0, 0);
+}
+
+
+static inline void bench_broker_stop(bench_broker *b) {
+    b->stop = 1;
+    pthread_join(b->thread, NULL);
+}
+
+#endif //MQTT_CLIENT_BENCH_BROKER_H
@@ -0,0 +1,89 @@
+//
+// Created by Administrator on 2026/10/19.
+//
+// Time taken to bring up many clients, one MQTTClient_connect after another and with
+// MQTTClient_connectMany, against the in-process stand-in broker of bench_broker.h.
+// With select, the client count is limited to a little under FD_SETSIZE.
+//
+// usage: connect_bench [clients] [max connects in progress]
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "MQTTClient.h"
+#include "bench_broker.h"
+
+static volatile int completed = 0;
+
+static int messageArrived(void *context, char *topicName, int topicLen, MQTTClient_message *message) {
+    return 1;
+}
+
+static void connectComplete(void *context, MQTTClient handle, int rc) {
+    completed++;
+}
+
+static int createAll(MQTTClient *clients, int count, const char *uri, const char *prefix) {
+    char clientid[32];
+    int i;
+
+    for (i = 0; i < count; ++i) {
+        snprintf(clientid, sizeof(clientid), "%s%d", prefix, i);
+        if (MQTTClient_create(&clients[i], uri, clientid) != MQTTCLIENT_SUCCESS)
+            return -1;
+        MQTTClient_setCallbacks(clients[i], NULL, NULL, messageArrived, NULL);
+    }
+    return 0;
+}
+
+static void destroyAll(MQTTClient *clients, int count) {
+    int i;
+
+    for (i = 0; i < count; ++i)
+        MQTTClient_destroy(&clients[i]);
+}
+
+int main(int argc, char *argv[]) {
+    int count = (argc > 1) ? atoi(argv[1]) : 500;
+    int maxInProgress = (argc > 2) ? atoi(argv[2]) : 100;
+    MQTTClient_connectOptions conn_opts = MQTTClient_connectOptions_initializer;
+    MQTTClient *clients = calloc((size_t) count, sizeof(MQTTClient));
+    bench_broker broker;
+    struct timeval start;
+    char uri[64];
+    long us;
+    int i, connected = 0;
+
+    if (bench_broker_start(&broker) != 0) {
+        printf("Failed to start the stand-in broker\n");
+        return EXIT_FAILURE;
+    }
+    snprintf(uri, sizeof(uri), "tcp://127.0.0.1:%d", broker.port);
+    conn_opts.keepAliveInterval = 60;
+    conn_opts.connectTimeout = 10;
+
+    if (createAll(clients, count, uri, "seq") == 0) {
+        gettimeofday(&start, NULL);
+        for (i = 0; i < count; ++i)
+            if (MQTTClient_connect(clients[i], &conn_opts) == MQTTCLIENT_SUCCESS)
+                ++connected;
+        us = bench_elapsed_us(start);
+        printf("%-12s %6d/%d clients in %8.1f ms %10.0f connects/s\n", "sequential", connected, count, us / 1000.0,
+               connected * 1e6 / us);
+    }
+    destroyAll(clients, count);
+
+    if (createAll(clients, count, uri, "many") == 0) {
+        gettimeofday(&start, NULL);
+        connected = MQTTClient_connectMany(clients, count, &conn_opts, maxInProgress, connectComplete, NULL);
+        us = bench_elapsed_us(start);
+        printf("%-12s %6d/%d clients in %8.1f ms %10.0f connects/s (%d in progress, %d reported)\n", "connectMany",
+               connected, count, us / 1000.0, connected * 1e6 / us, maxInProgress, completed);
+    }
+    destroyAll(clients, count);
+
+    free(clients);
+    bench_broker_stop(&broker);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,153 @@
+//
+// Created by Administrator on 2026/10/19.
+//
+// QoS 1 publish rate with and without the persistence store, against the in-process
+// stand-in broker of bench_broker.h, followed by the allocation pool statistics.
+//
+// usage: persistence_bench [messages] [payload bytes] [store directory]
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <unistd.h>
+#include "MQTTClient.h"
+#include "bench_broker.h"
+
+#define CLIENTID    "persistence_bench"
+#define TOPIC       "bench/persistence"
+#define WINDOW      1000
+
+static volatile int delivered = 0;
+
+static int messageArrived(void *context, char *topicName, int topicLen, MQTTClient_message *message) {
+    return 1;
+}
+
+static void deliveryComplete(void *context, MQTTClient_deliveryToken dt) {
+    delivered++;
+}
+
+static void removeStore(const char *dir) {
+    char path[1024];
+    struct dirent *entry;
+    DIR *d;
+
+    if ((d = opendir(dir)) == NULL)
+        return;
+    while ((entry = readdir(d)) != NULL) {
+        DIR *sub;
+        struct dirent *seg;
+        char store[1024];
+
+        if (strncmp(entry->d_name, CLIENTID, strlen(CLIENTID)) != 0)
+            continue;
+        if (snprintf(store, sizeof(store), "%s/%s", dir, entry->d_name) >= (int) sizeof(store) ||
+            (sub = opendir(store)) == NULL)
+            continue;
+        while ((seg = readdir(sub)) != NULL) {
+            if (seg->d_name[0] == '.')
+                continue;
+            if (snprintf(path, sizeof(path), "%s/%s", store, seg->d_name) < (int) sizeof(path))
+                unlink(path);
+        }
+        closedir(sub);
+        rmdir(store);
+    }
+    closedir(d);
+}
+
+static void printPoolStats(void) {
+    Pool_stats stats[POOL_TYPES];
+    int i, count = MQTTClient_getPoolStats(stats, POOL_TYPES);
+    size_t bytes = 0;
+
+    printf("%-14s %6s %12s %8s %8s %10s\n", "pool", "size", "allocs", "hit %", "in use", "resident");
+    for (i = 0; i < count; ++i)
+        printf("%-14s %6zu %12lu %8.1f %8ld %10zu\n", stats[i].name, stats[i].size, stats[i].allocs,
+               stats[i].allocs ? stats[i].hits * 100.0 / stats[i].allocs : 0.0, stats[i].inUse, stats[i].resident);
+    count = MQTTClient_getStoredPublications(&bytes);
+    printf("stored publications %d, %zu bytes\n", count, bytes);
+}
+
+static int run(const char *uri, int persistence_type, const char *dir, int count, int payloadlen) {
+    MQTTClient client;
+    MQTTClient_connectOptions conn_opts = MQTTClient_connectOptions_initializer;
+    MQTTClient_message pubmsg = MQTTClient_message_initializer;
+    MQTTClient_deliveryToken token;
+    struct timeval start;
+    long us;
+    int i, rc;
+
+    if ((rc = MQTTClient_createWithOptions(&client, uri, CLIENTID, persistence_type, (void *) dir, NULL)) !=
+        MQTTCLIENT_SUCCESS) {
+        printf("Failed to create client, return code %d\n", rc);
+        return rc;
+    }
+    MQTTClient_setCallbacks(client, NULL, NULL, messageArrived, deliveryComplete);
+    conn_opts.keepAliveInterval = 60;
+    conn_opts.connectTimeout = 10;
+    conn_opts.MQTTVersion = MQTTVERSION_3_1_1;
+    if ((rc = MQTTClient_connect(client, &conn_opts)) != MQTTCLIENT_SUCCESS) {
+        printf("Failed to connect, return code %d\n", rc);
+        MQTTClient_destroy(&client);
+        return rc;
+    }
+
+    pubmsg.payload = malloc(payloadlen);
+    memset(pubmsg.payload, 'x', payloadlen);
+    pubmsg.payloadlen = payloadlen;
+    pubmsg.qos = 1;
+    delivered = 0;
+    gettimeofday(&start, NULL);
+    for (i = 0; i < count; ++i) {
+        while (i - delivered >= WINDOW)
+            usleep(50);
+        if ((rc = MQTTClient_publishMessage(client, TOPIC, &pubmsg, &token)) != MQTTCLIENT_SUCCESS) {
+            printf("Failed to publish message %d, return code %d\n", i, rc);
+            break;
+        }
+    }
+    while (delivered < i && bench_elapsed_us(start) < 30000000L)
+        usleep(100);
+    us = bench_elapsed_us(start);
+    printf("%-12s %8d msgs %6d bytes %10.0f msgs/s %8.2f MB/s\n",
+           persistence_type == MQTTCLIENT_PERSISTENCE_NONE ? "none" : "persistence",
+           delivered, payloadlen, delivered * 1e6 / us, (double) delivered * payloadlen / us);
+    free(pubmsg.payload);
+    MQTTClient_destroy(&client);
+    return rc;
+}
+
+int main(int argc, char *argv[]) {
+    int count = (argc > 1) ? atoi(argv[1]) : 100000;
+    int payloadlen = (argc > 2) ? atoi(argv[2]) : 64;
+    const char *dir = (argc > 3) ? argv[3] : "/tmp";
+    bench_broker broker;
+    MQTTClient client;
+    struct timeval start;
+    char uri[64];
+
+    if (bench_broker_start(&broker) != 0) {
+        printf("Failed to start the stand-in broker\n");
+        return EXIT_FAILURE;
+    }
+    snprintf(uri, sizeof(uri), "tcp://127.0.0.1:%d", broker.port);
+
+    removeStore(dir);
+    run(uri, MQTTCLIENT_PERSISTENCE_NONE, dir, count, payloadlen);
+    run(uri, MQTTCLIENT_PERSISTENCE_DEFAULT, dir, count, payloadlen);
+
+    /* reopening replays what the run left behind */
+    gettimeofday(&start, NULL);
+    if (MQTTClient_createWithOptions(&client, uri, CLIENTID, MQTTCLIENT_PERSISTENCE_DEFAULT, (void *) dir, NULL) ==
+        MQTTCLIENT_SUCCESS) {
+        printf("reopened store in %ld us\n", bench_elapsed_us(start));
+        MQTTClient_destroy(&client);
+    }
+    removeStore(dir);
+    bench_broker_stop(&broker);
+    printPoolStats();
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,143 @@
+//
+// Created by Administrator on 2026/10/19.
+//
+// Encoding rate of MQTT 5 PUBLISH packets that carry user properties, with no socket: the
+// properties built for each message, encoded from a property list, and written from a block
+// encoded once with MQTTProperties_encodeBlock, as a prepared topic does.  Each packet is
+// copied out of its buffers, as a write would, and the last of each kind is checked against
+// the others.
+//
+// usage: property_bench [messages] [user properties] [payload bytes]
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include "MQTTPacket.h"
+
+#define TOPIC       "bench/properties/telemetry"
+
+static long elapsed_us(struct timeval start) {
+    struct timeval now, res;
+
+    gettimeofday(&now, NULL);
+    timersub(&now, &start, &res);
+    return res.tv_sec * 1000000L + res.tv_usec;
+}
+
+static int buildProperties(MQTTProperties *props, int users) {
+    static char names[16][16], values[16][24]; /* room for any int */
+    MQTTProperty prop;
+    int i, rc = 0;
+
+    prop.identifier = MQTTPROPERTY_CODE_MESSAGE_EXPIRY_INTERVAL;
+    prop.value.integer4 = 3600;
+    rc |= MQTTProperties_add(props, &prop);
+    prop.identifier = MQTTPROPERTY_CODE_CONTENT_TYPE;
+    prop.value.data.data = "application/json";
+    prop.value.data.len = (int) strlen(prop.value.data.data);
+    rc |= MQTTProperties_add(props, &prop);
+    for (i = 0; i < users; ++i) {
+        snprintf(names[i % 16], sizeof(names[0]), "key%d", i);
+        snprintf(values[i % 16], sizeof(values[0]), "value-%d", i);
+        prop.identifier = MQTTPROPERTY_CODE_USER_PROPERTY;
+        prop.value.data.data = names[i % 16];
+        prop.value.data.len = (int) strlen(names[i % 16]);
+        prop.value.value.data = values[i % 16];
+        prop.value.value.len = (int) strlen(values[i % 16]);
+        rc |= MQTTProperties_add(props, &prop);
+    }
+    return rc;
+}
+
+/* Encode one packet and copy it out of its buffers, returning its length */
+static size_t encode(Publish *p, char *header, char *out) {
+    struct iovec iovecs[MQTTPACKET_PUBLISH_IOVECS];
+    size_t len = 0;
+    int i, n;
+
+    n = MQTTPacket_encodePublish(p, 1, 0, header, iovecs);
+    for (i = 0; i < n; ++i) {
+        memcpy(&out[len], iovecs[i].iov_base, iovecs[i].iov_len);
+        len += iovecs[i].iov_len;
+    }
+    return len;
+}
+
+static void report(const char *name, int count, long us, size_t len) {
+    printf("%-10s %8d msgs %5d bytes %8.1f ns/msg %10.0f msgs/s\n", name, count, (int) len,
+           us * 1000.0 / count, count * 1e6 / us);
+}
+
+int main(int argc, char *argv[]) {
+    int count = (argc > 1) ? atoi(argv[1]) : 1000000;
+    int users = (argc > 2) ? atoi(argv[2]) : 4;
+    int payloadlen = (argc > 3) ? atoi(argv[3]) : 64;
+    MQTTProperties props = MQTTProperties_initializer;
+    MQTTPropertyBlock block;
+    char *payload = malloc(payloadlen), *header = NULL, *out = NULL, *last[3];
+    size_t lens[3] = {0, 0, 0};
+    struct timeval start;
+    Publish p;
+    int i, k;
+
+    if (buildProperties(&props, users) != 0 || MQTTProperties_encodeBlock(&props, &block) != 0) {
+        printf("Failed to build the properties\n");
+        return EXIT_FAILURE;
+    }
+    memset(payload, 'x', payloadlen);
+    memset(&p, '\0', sizeof(Publish));
+    p.topic = TOPIC;
+    p.topiclen = (int) strlen(TOPIC);
+    p.payload = payload;
+    p.payloadlen = payloadlen;
+    p.msgId = 1;
+    p.MQTTVersion = 5;
+    p.properties = props;
+    header = malloc(MQTTPacket_publishHeaderLen(&p, 1));
+    out = malloc(MQTTPacket_publishHeaderLen(&p, 1) + strlen(TOPIC) + payloadlen);
+    for (k = 0; k < 3; ++k)
+        last[k] = malloc(MQTTPacket_publishHeaderLen(&p, 1) + strlen(TOPIC) + payloadlen);
+
+    /* the properties built and freed for each message */
+    gettimeofday(&start, NULL);
+    for (i = 0; i < count; ++i) {
+        MQTTProperties each = MQTTProperties_initializer;
+
+        buildProperties(&each, users);
+        p.properties = each;
+        lens[0] = encode(&p, header, out);
+        MQTTProperties_free(&each);
+    }
+    report("build", count, elapsed_us(start), lens[0]);
+    memcpy(last[0], out, lens[0]);
+
+    /* the same property list encoded for each message */
+    p.properties = props;
+    gettimeofday(&start, NULL);
+    for (i = 0; i < count; ++i)
+        lens[1] = encode(&p, header, out);
+    report("list", count, elapsed_us(start), lens[1]);
+    memcpy(last[1], out, lens[1]);
+
+    /* the block encoded once */
+    p.propBlock = &block;
+    gettimeofday(&start, NULL);
+    for (i = 0; i < count; ++i)
+        lens[2] = encode(&p, header, out);
+    report("block", count, elapsed_us(start), lens[2]);
+    memcpy(last[2], out, lens[2]);
+
+    if (lens[0] != lens[1] || lens[1] != lens[2] || memcmp(last[0], last[1], lens[0]) != 0 ||
+        memcmp(last[1], last[2], lens[1]) != 0)
+        printf("The encodings differ\n");
+    for (k = 0; k < 3; ++k)
+        free(last[k]);
+    MQTTProperties_freeBlock(&block);
+    MQTTProperties_free(&props);
+    free(out);
+    free(header);
+    free(payload);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,121 @@
+//
+// Created by Administrator on 2026/10/19.
+//
+// What a trace entry costs the thread that records it.  Threads record the PUBLISH trace
+// message over and over: at a level which is filtered out, then recorded in their rings with
+// nowhere to write it, then with a trace callback, which the writer thread calls, and last the
+// way it was done before the rings, formatting each entry with its time under a lock on the
+// recording thread.  For each, the CPU time per entry of the recording threads is shown, and with
+// a callback, how many of the entries reached it: the rings keep only the most recent entries of
+// a thread which records faster than the writer can write them out.
+//
+// usage: trace_bench [threads] [entries per thread]
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include "Log.h"
+
+#define FORMAT  "%d %s -> PUBLISH msgid: %d qos: %d retained: %d rc %d payload len(%d): %.*s"
+#define PAYLOAD "{\"device\":\"sensor-0001\",\"value\":21.5}"
+
+enum bench_mode {
+    FILTERED, RECORDED, WRITTEN, EAGER
+};
+
+static int entries = 1000000;
+static enum bench_mode mode;
+static volatile long delivered = 0;
+static pthread_mutex_t eager_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void traceCallback(enum LOG_LEVELS level, const char *message) {
+    delivered++;
+}
+
+/* An entry as it was traced before: formatted, with its time, under a lock */
+static void eagerLog(enum LOG_LEVELS level, const char *format, ...) {
+    static char msg_buf[512], line[512 + 64]; /* room for the time before the message */
+    struct timeval ts;
+    struct tm *timeinfo;
+    va_list args;
+
+    pthread_mutex_lock(&eager_mutex);
+    va_start(args, format);
+    vsnprintf(msg_buf, sizeof(msg_buf), format, args);
+    va_end(args);
+    gettimeofday(&ts, NULL);
+    timeinfo = localtime(&ts.tv_sec);
+    strftime(line, 80, "%Y%m%d %H%M%S ", timeinfo);
+    snprintf(&line[15], sizeof(line) - 15, ".%.3lu %s", (unsigned long) ts.tv_usec / 1000L, msg_buf);
+    traceCallback(level, line);
+    pthread_mutex_unlock(&eager_mutex);
+}
+
+static long long cpu_ns(clockid_t clock) {
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Record the entries, returning the CPU time of the thread in *n */
+static void *recorder(void *n) {
+    long long start = cpu_ns(CLOCK_THREAD_CPUTIME_ID);
+    int i;
+
+    for (i = 0; i < entries; ++i) {
+        if (mode == EAGER)
+            eagerLog(TRACE_MINIMUM, FORMAT, 3, "trace_bench", i, 1, 0, 0, (int) strlen(PAYLOAD), 20, PAYLOAD);
+        else
+            Log(TRACE_MINIMUM, -1, FORMAT, 3, "trace_bench", i, 1, 0, 0, (int) strlen(PAYLOAD), 20, PAYLOAD);
+    }
+    *(long long *) n = cpu_ns(CLOCK_THREAD_CPUTIME_ID) - start;
+    return NULL;
+}
+
+static void run(const char *name, enum bench_mode m, int threads) {
+    pthread_t *ids = calloc((size_t) threads, sizeof(pthread_t));
+    long long *ns = calloc((size_t) threads, sizeof(long long)), total = 0;
+    int t;
+
+    mode = m;
+    delivered = 0;
+    for (t = 0; t < threads; ++t)
+        pthread_create(&ids[t], NULL, recorder, &ns[t]);
+    for (t = 0; t < threads; ++t) {
+        pthread_join(ids[t], NULL);
+        total += ns[t];
+    }
+    if (m == WRITTEN)
+        Log_flush();
+    printf("%-10s %8d %10.1f %12ld\n", name, threads, (double) total / threads / entries,
+           (m == WRITTEN || m == EAGER) ? delivered : 0L);
+    free(ns);
+    free(ids);
+}
+
+int main(int argc, char *argv[]) {
+    int threads = (argc > 1) ? atoi(argv[1]) : 4;
+
+    if (argc > 2)
+        entries = atoi(argv[2]);
+    trace_settings.max_trace_entries = 4096;
+    Log_initialize(NULL);
+    printf("%-10s %8s %10s %12s\n", "mode", "threads", "ns/entry", "delivered");
+    Log_setTraceLevel(LOG_ERROR);
+    run("filtered", FILTERED, threads);
+    Log_setTraceLevel(TRACE_MINIMUM);
+    run("recorded", RECORDED, threads);
+    Log_flush(); /* nowhere to write them: this empties the rings */
+    Log_setTraceCallback(traceCallback);
+    run("written", WRITTEN, threads);
+    Log_setTraceCallback(NULL);
+    run("eager", EAGER, threads);
+    Log_terminate();
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,157 @@
+//
+// Created by Administrator on 2026/10/19.
+//
+// Many WebSocket clients in one process at once.  Each connects over ws:// to the stand-in
+// broker of bench_broker.h, which sends every PUBLISH back to its sender, and publishes its
+// own messages while all the others do.  Each message that comes back is checked against the
+// client it came back to, so that connections which mixed up their frames would show up as
+// mismatches.  The broker runs in a child process, so that with select only the clients have
+// to fit under FD_SETSIZE.
+//
+// usage: ws_clients_bench [clients] [messages per client] [payload bytes]
+//
+
+#define BENCH_BROKER_WEBSOCKET 1
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include "MQTTClient.h"
+#include "bench_broker.h"
+
+#define TOPIC       "bench/ws/echo"
+#define WINDOW      4
+
+static volatile int arrived = 0;
+static volatile int mismatched = 0;
+static int payloadlen = 64;
+
+/* the payload of a client's messages: its number, then bytes which depend on it */
+static void fillPayload(unsigned char *payload, int id) {
+    int k;
+
+    memcpy(payload, &id, sizeof(id));
+    for (k = sizeof(id); k < payloadlen; ++k)
+        payload[k] = (unsigned char) (k + id * 7);
+}
+
+static int messageArrived(void *context, char *topicName, int topicLen, MQTTClient_message *message) {
+    int id = *(int *) context, k, ok = (message->payloadlen == payloadlen);
+    unsigned char *payload = message->payload;
+
+    for (k = 0; ok && k < payloadlen; ++k)
+        ok = (k < (int) sizeof(id)) ? payload[k] == ((unsigned char *) &id)[k] : payload[k] == (unsigned char) (k + id * 7);
+    if (!ok)
+        mismatched++;
+    arrived++;
+    free(message->payload);
+    free(message);
+    free(topicName);
+    return 1;
+}
+
+/* Run the stand-in broker in a child process, until it is killed */
+static pid_t startBroker(int *port) {
+    int portpipe[2];
+    pid_t pid;
+
+    if (pipe(portpipe) != 0)
+        return -1;
+    if ((pid = fork()) == 0) {
+        static bench_broker broker;
+
+        close(portpipe[0]);
+        if (bench_broker_start_with(&broker, 1, 1) != 0)
+            broker.port = -1;
+        if (write(portpipe[1], &broker.port, sizeof(broker.port)) != sizeof(broker.port) || broker.port < 0)
+            _exit(EXIT_FAILURE);
+        for (;;)
+            pause();
+    }
+    close(portpipe[1]);
+    if (pid > 0 && (read(portpipe[0], port, sizeof(*port)) != sizeof(*port) || *port < 0)) {
+        waitpid(pid, NULL, 0);
+        pid = -1;
+    }
+    close(portpipe[0]);
+    return pid;
+}
+
+int main(int argc, char *argv[]) {
+    int count = (argc > 1) ? atoi(argv[1]) : 1000;
+    int messages = (argc > 2) ? atoi(argv[2]) : 100;
+    MQTTClient_connectOptions conn_opts = MQTTClient_connectOptions_initializer;
+    MQTTClient *clients = calloc((size_t) count, sizeof(MQTTClient));
+    int *ids = calloc((size_t) count, sizeof(int));
+    unsigned char *payload;
+    struct timeval start;
+    char uri[64], clientid[32];
+    long us, retries = 0;
+    int i, r, port, connected, sent = 0;
+    pid_t broker;
+
+    if (argc > 3)
+        payloadlen = atoi(argv[3]);
+    if (payloadlen < (int) sizeof(int))
+        payloadlen = sizeof(int);
+    payload = malloc((size_t) payloadlen);
+    signal(SIGPIPE, SIG_IGN);
+    if ((broker = startBroker(&port)) < 0) {
+        printf("Failed to start the stand-in broker\n");
+        return EXIT_FAILURE;
+    }
+    snprintf(uri, sizeof(uri), "ws://127.0.0.1:%d/mqtt", port);
+    conn_opts.keepAliveInterval = 60;
+    conn_opts.connectTimeout = 30;
+    conn_opts.MQTTVersion = MQTTVERSION_3_1_1;
+
+    for (i = 0; i < count; ++i) {
+        ids[i] = i;
+        snprintf(clientid, sizeof(clientid), "ws%d", i);
+        if (MQTTClient_create(&clients[i], uri, clientid) != MQTTCLIENT_SUCCESS) {
+            printf("Failed to create client %d\n", i);
+            count = i;
+            break;
+        }
+        MQTTClient_setCallbacks(clients[i], &ids[i], NULL, messageArrived, NULL);
+    }
+
+    gettimeofday(&start, NULL);
+    connected = MQTTClient_connectMany(clients, count, &conn_opts, 100, NULL, NULL);
+    us = bench_elapsed_us(start);
+    printf("connect  %6d/%d clients in %8.1f ms %10.0f connects/s\n", connected, count, us / 1000.0,
+           connected * 1e6 / us);
+
+    /* every client publishes a message in turn, with up to WINDOW of each not yet back */
+    gettimeofday(&start, NULL);
+    for (r = 0; r < messages && connected == count; ++r) {
+        for (i = 0; i < count; ++i) {
+            fillPayload(payload, i);
+            while (MQTTClient_publish5(clients[i], TOPIC, payloadlen, payload, 0, 0, NULL).reasonCode !=
+                   MQTTCLIENT_SUCCESS && bench_elapsed_us(start) < 60000000L) {
+                ++retries;
+                usleep(10);
+            }
+            ++sent;
+        }
+        while (sent - arrived > count * WINDOW && bench_elapsed_us(start) < 60000000L)
+            usleep(100);
+    }
+    while (arrived < sent && bench_elapsed_us(start) < 60000000L)
+        usleep(100);
+    us = bench_elapsed_us(start);
+    printf("echo     %8d/%d msgs %6d bytes %10.0f msgs/s %8.2f MB/s %8ld retries %d mismatched\n", arrived, sent,
+           payloadlen, arrived * 1e6 / us, (double) arrived * payloadlen / us, retries, mismatched);
+
+    for (i = 0; i < count; ++i)
+        MQTTClient_destroy(&clients[i]);
+    kill(broker, SIGTERM);
+    waitpid(broker, NULL, 0);
+    free(payload);
+    free(ids);
+    free(clients);
+    return (mismatched == 0 && arrived == sent) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,178 @@
+//
+// Created by Administrator on 2026/10/19.
+//
+// WebSocket permessage-deflate: what it saves on the wire and what it costs in CPU.  A client
+// publishes JSON telemetry over ws:// to the stand-in broker of bench_broker.h, which sends every
+// message back, compressed when compression was agreed.  This is done without compression, then
+// with the compression settings below.  For each, the bytes on the wire per message both ways,
+// their ratio to the uncompressed run, and the CPU time of the client per round trip are shown,
+// along with that of the publishing thread alone, which is where messages are compressed.  Each
+// message that comes back is checked against the one sent.
+//
+// usage: ws_deflate_bench [messages] [readings per message]
+//
+
+#define BENCH_BROKER_WEBSOCKET 1
+#define BENCH_BROKER_DEFLATE 1
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "MQTTClient.h"
+#include "bench_broker.h"
+
+#define TOPIC       "bench/ws/telemetry"
+#define WINDOW      16
+
+typedef struct {
+    const char *name;
+    int deflate;    /**< offer permessage-deflate */
+    int level;
+    int clientMaxWindowBits;
+    int serverMaxWindowBits;
+    int noContextTakeover;  /**< ask for both ends to compress each message on its own */
+} bench_setting;
+
+static volatile int arrived = 0;
+static volatile int mismatched = 0;
+static int readings = 8;
+
+/* The payload of message number n, returning its length */
+static int makePayload(char *buf, size_t size, int n) {
+    int len, r;
+
+    len = snprintf(buf, size, "{\"device\":\"sensor-%04d\",\"ts\":%ld,\"seq\":%d,\"readings\":[", n % 16,
+                   1760000000000L + n * 250L, n);
+    for (r = 0; r < readings; ++r)
+        len += snprintf(&buf[len], size - len, "%s{\"channel\":\"temperature-%d\",\"value\":%d.%02d,\"unit\":\"C\","
+                        "\"status\":\"ok\"}", r ? "," : "", r, 18 + (n + r) % 7, (n * 37 + r * 11) % 100);
+    len += snprintf(&buf[len], size - len, "]}");
+    return len;
+}
+
+static int messageArrived(void *context, char *topicName, int topicLen, MQTTClient_message *message) {
+    char *expected = context;
+    int len = makePayload(expected, 64 + readings * 96, arrived);
+
+    if (message->payloadlen != len || memcmp(message->payload, expected, (size_t) len) != 0)
+        mismatched++;
+    arrived++;
+    free(message->payload);
+    free(message);
+    free(topicName);
+    return 1;
+}
+
+static long long cpu_ns(clockid_t clock) {
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Run one setting, returning the wire bytes per message both ways, or -1 if it failed */
+static double runSetting(const bench_setting *s, int messages, double baseline) {
+    MQTTClient_connectOptions conn_opts = MQTTClient_connectOptions_initializer;
+    MQTTClient_deflateOptions deflate = MQTTClient_deflateOptions_initializer;
+    size_t size = 64 + (size_t) readings * 96;
+    char *payload = malloc(size), *expected = malloc(size);
+    long long up, down, process_ns, publisher_ns, payload_bytes = 0;
+    clockid_t broker_clock;
+    bench_broker broker;
+    struct timeval start;
+    char uri[64];
+    MQTTClient c;
+    double wire = -1;
+    int i, len, rc;
+    long us;
+
+    arrived = mismatched = 0;
+    if (bench_broker_start_with(&broker, BENCH_BROKER_WS_DEFLATE, 1) != 0) {
+        printf("Failed to start the stand-in broker\n");
+        goto exit;
+    }
+    pthread_getcpuclockid(broker.thread, &broker_clock);
+    snprintf(uri, sizeof(uri), "ws://127.0.0.1:%d/mqtt", broker.port);
+    MQTTClient_create(&c, uri, "ws_deflate_bench");
+    MQTTClient_setCallbacks(c, expected, NULL, messageArrived, NULL);
+    if (s->deflate) {
+        deflate.level = s->level;
+        deflate.clientMaxWindowBits = s->clientMaxWindowBits;
+        deflate.serverMaxWindowBits = s->serverMaxWindowBits;
+        deflate.clientNoContextTakeover = deflate.serverNoContextTakeover = s->noContextTakeover;
+        MQTTClient_setWebSocketDeflate(c, &deflate);
+    }
+    conn_opts.keepAliveInterval = 60;
+    conn_opts.MQTTVersion = MQTTVERSION_3_1_1;
+    if ((rc = MQTTClient_connect(c, &conn_opts)) != MQTTCLIENT_SUCCESS) {
+        printf("Failed to connect, return code %d\n", rc);
+        MQTTClient_destroy(&c);
+        bench_broker_stop(&broker);
+        goto exit;
+    }
+
+    up = broker.bytes;
+    down = broker.sent;
+    process_ns = cpu_ns(CLOCK_PROCESS_CPUTIME_ID) - cpu_ns(broker_clock);
+    publisher_ns = cpu_ns(CLOCK_THREAD_CPUTIME_ID);
+    gettimeofday(&start, NULL);
+    for (i = 0; i < messages; ++i) {
+        len = makePayload(payload, size, i);
+        payload_bytes += len;
+        while (MQTTClient_publish5(c, TOPIC, len, payload, 0, 0, NULL).reasonCode != MQTTCLIENT_SUCCESS &&
+               bench_elapsed_us(start) < 60000000L)
+            usleep(10);
+        while (i - arrived > WINDOW && bench_elapsed_us(start) < 60000000L)
+            usleep(10);
+    }
+    while (arrived < messages && bench_elapsed_us(start) < 60000000L)
+        usleep(100);
+    us = bench_elapsed_us(start);
+    publisher_ns = cpu_ns(CLOCK_THREAD_CPUTIME_ID) - publisher_ns;
+    process_ns = cpu_ns(CLOCK_PROCESS_CPUTIME_ID) - cpu_ns(broker_clock) - process_ns;
+    up = broker.bytes - up;
+    down = broker.sent - down;
+
+    wire = (double) (up + down) / messages;
+    printf("%-22s %7.1f %7.1f %7.1f %6.2f %8.0f %8.0f %8.0f%s\n", s->name, (double) payload_bytes / messages,
+           (double) up / messages, (double) down / messages, baseline > 0 ? baseline / wire : 1.0,
+           (double) process_ns / messages, (double) publisher_ns / messages, arrived * 1e6 / us,
+           (mismatched || arrived != messages) ? "  MISMATCHED" : "");
+    if (mismatched || arrived != messages)
+        wire = -1;
+    MQTTClient_destroy(&c);
+    bench_broker_stop(&broker);
+    exit:
+    free(expected);
+    free(payload);
+    return wire;
+}
+
+int main(int argc, char *argv[]) {
+    static const bench_setting settings[] = {
+            {"uncompressed",           0, -1, 15, 0,  0},
+            {"deflate",                1, -1, 15, 0,  0},
+            {"deflate level 1",        1, 1,  15, 0,  0},
+            {"deflate windows 10",     1, -1, 10, 10, 0},
+            {"deflate no takeover",    1, -1, 15, 0,  1},
+    };
+    int messages = (argc > 1) ? atoi(argv[1]) : 20000;
+    double baseline = 0;
+    int s, rc = EXIT_SUCCESS;
+
+    if (argc > 2)
+        readings = atoi(argv[2]);
+    printf("%-22s %7s %7s %7s %6s %8s %8s %8s\n", "setting", "payload", "up", "down", "ratio", "cpu ns",
+           "pub ns", "msgs/s");
+    for (s = 0; s < (int) (sizeof(settings) / sizeof(settings[0])); ++s) {
+        double wire = runSetting(&settings[s], messages, baseline);
+
+        if (wire < 0)
+            rc = EXIT_FAILURE;
+        else if (s == 0)
+            baseline = wire;
+    }
+    return rc;
+}
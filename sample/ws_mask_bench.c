@@ -0,0 +1,66 @@
+//
+// Created by Administrator on 2026/10/19.
+//
+// WebSocket masking rate of the byte loop frames used to be masked with, against WebSocket_mask
+// with the kernel chosen for this processor, masking from one buffer into another as a frame is
+// built.  Each size is masked at a few different offsets into the frame payload.
+//
+// usage: ws_mask_bench [megabytes per size]
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include "WebSocketMask.h"
+
+static long elapsed_us(struct timeval start) {
+    struct timeval now, res;
+
+    gettimeofday(&now, NULL);
+    timersub(&now, &start, &res);
+    return res.tv_sec * 1000000L + res.tv_usec;
+}
+
+static void maskBytes(char *dst, const char *src, size_t len, const uint8_t mask[4], size_t phase) {
+    size_t i;
+
+    for (i = 0; i < len; ++i, ++phase)
+        dst[i] = src[i] ^ mask[phase % 4];
+}
+
+int main(int argc, char *argv[]) {
+    static const size_t sizes[] = {16, 64, 256, 1024, 16384, 262144};
+    size_t volume = ((argc > 1) ? (size_t) atol(argv[1]) : 256) * 1024 * 1024;
+    uint8_t mask[4] = {0x12, 0x34, 0x56, 0x78};
+    char *src = malloc(sizes[5] + 3), *dst = malloc(sizes[5] + 3), *check = malloc(sizes[5] + 3);
+    int s;
+
+    for (s = 0; s < (int) sizes[5] + 3; ++s)
+        src[s] = (char) s;
+    printf("kernel %s\n", WebSocket_maskKernel());
+    for (s = 0; s < (int) (sizeof(sizes) / sizeof(sizes[0])); ++s) {
+        size_t len = sizes[s], rounds = volume / len, r;
+        struct timeval start;
+        long bytes_us, kernel_us;
+
+        gettimeofday(&start, NULL);
+        for (r = 0; r < rounds; ++r)
+            maskBytes(dst, &src[r % 3], len, mask, r % 4);
+        bytes_us = elapsed_us(start);
+        memcpy(check, dst, len);
+
+        gettimeofday(&start, NULL);
+        for (r = 0; r < rounds; ++r)
+            WebSocket_mask(dst, &src[r % 3], len, mask, r % 4);
+        kernel_us = elapsed_us(start);
+
+        printf("%7lu bytes  bytes %8.2f GB/s  kernel %8.2f GB/s  %5.1fx%s\n", (unsigned long) len,
+               (double) rounds * len / bytes_us / 1000.0, (double) rounds * len / kernel_us / 1000.0,
+               (double) bytes_us / kernel_us, memcmp(check, dst, len) == 0 ? "" : "  differ");
+    }
+    free(check);
+    free(dst);
+    free(src);
+    return EXIT_SUCCESS;
+}
@@ -2,7 +2,11 @@
 // Created by Administrator on 2022/11/3.
 //
 
+#include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
+#include <time.h>
+#include <poll.h>
 #include <Log.h>
 #include "Socket.h"
 #include "WebSocket.h"
@@ -11,6 +15,11 @@
 #include "Thread.h"
 #include "MQTTProtocol.h"
 #include "MQTTPacket.h"
+#include "MQTTPersistence.h"
+#include "Pool.h"
+#include "SocketBuffer.h"
+#include "utf-8.h"
+#include "MQTTTopicAlias.h"
 
 
 static ClientStates ClientState =
@@ -32,6 +41,7 @@ static pthread_mutex_t *socket_mutex = &socket_mutex_store;
 static pthread_mutex_t subscribe_mutex_store = PTHREAD_MUTEX_INITIALIZER;
 static pthread_mutex_t *subscribe_mutex = &subscribe_mutex_store;
 
+/* serializes the connects of clients without callbacks, which read their own sockets while waiting */
 static pthread_mutex_t connect_mutex_store = PTHREAD_MUTEX_INITIALIZER;
 static pthread_mutex_t *connect_mutex = &connect_mutex_store;
 
@@ -39,14 +49,40 @@ static pthread_mutex_t *connect_mutex = &connect_mutex_store;
 static volatile int library_initialized = 0;
 static List *handles = NULL;
 static int running = 0;
+static volatile int tostop = 0;
+static pthread_t run_id = 0; /* the run thread, joined by MQTTClient_stop */
 
 static void MQTTClient_terminate(void);
 
 static int clientSockCompare(void *a, void *b);
 
-_Noreturn static void *MQTTClient_run(void *n);
+static void *MQTTClient_run(void *n);
 
-static int MQTTClient_createWithOptions(MQTTClient *handle, const char *serverURI, const char *clientId);
+static void MQTTClient_stop(void);
+
+static void MQTTClient_writeComplete(SOCKET socket, int rc);
+
+static void MQTTClient_writeAvailable(SOCKET socket);
+
+static int MQTTClient_bufferPublish(MQTTClients *m, Publish *p, int qos, int retained, Messages **mm);
+
+static void MQTTClient_flushBuffered(MQTTClients *m);
+
+static int MQTTClient_connected(MQTTClients *m, Connack *connack);
+
+static void MQTTClient_pipeline(MQTTClients *m);
+
+static void MQTTClient_connectFinished(MQTTClients *m, int rc);
+
+static void MQTTClient_resume(MQTTClients *m);
+
+static void MQTTClient_disconnect_internal(MQTTClients *m, char *cause);
+
+static void MQTTClient_reconnectFailed(MQTTClients *m);
+
+static void MQTTClient_retry(void);
+
+static void MQTTClient_addSubscription(MQTTClients *m, const char *topic, int qos);
 
 
 static MQTTResponse MQTTClient_subscribe5(MQTTClient handle, const char *topic, int qos);
@@ -67,11 +103,22 @@ static MQTTResponse MQTTClient_connectURI(MQTTClient handle, MQTTClient_connectO
 
 static MQTTPacket *MQTTClient_cycle(SOCKET *sock, uint64_t timeout, int *rc);
 
+static void MQTTClient_deliverPart(MQTTClients *m, Publish *publish);
+
 static MQTTPacket *MQTTClient_waitfor(MQTTClient handle, int packet_type, int *rc, int64_t timeout);
 
+static void MQTTClient_handOver(SOCKET sock, MQTTPacket *pack);
+
 static MQTTResponse
 MQTTClient_connectAll(MQTTClient handle, MQTTClient_connectOptions *options);
 
+static void MQTTClient_setConnectOptions(MQTTClients *m, MQTTClient_connectOptions *options);
+
+static MQTTResponse MQTTClient_connectRace(MQTTClients *m, MQTTClient_connectOptions *options,
+                                           char *const *serverURIs, int count, int *winner);
+
+static MQTTResponse MQTTClient_connectAddresses(MQTTClients *m, MQTTClient_connectOptions *options);
+
 
 MQTTClient_nameValue *MQTTClient_getVersionInfo(void) {
 #define MAX_INFO_STRINGS 8
@@ -88,6 +135,58 @@ MQTTClient_nameValue *MQTTClient_getVersionInfo(void) {
     return libinfo;
 }
 
+/**
+ * Get the allocation statistics of the pools the message path allocates from
+ * @param stats array to fill in
+ * @param count the number of entries in stats
+ * @return the number of pools, which may be more than count
+ */
+int MQTTClient_getPoolStats(Pool_stats *stats, int count) {
+    return Pool_getStats(stats, count);
+}
+
+/**
+ * Set the limits of the receive buffer governor, which applies to all clients
+ * @param budget most bytes of receive buffers across all connections, 0 for no limit.  A
+ * connection which receives a packet that would go over it is closed
+ * @param keepSize receive buffers larger than this are shrunk to what their connection has
+ * needed over the last idleTimeout
+ * @param idleTimeout milliseconds without a packet after which a connection's receive buffer is
+ * released
+ */
+void MQTTClient_setBufferLimits(size_t budget, size_t keepSize, int idleTimeout) {
+    pthread_mutex_lock(mqttclient_mutex);
+    SocketBuffer_setLimits(budget, keepSize, idleTimeout);
+    pthread_mutex_unlock(mqttclient_mutex);
+}
+
+/**
+ * Get the current and peak receive buffer memory, across all clients
+ * @param stats the structure to fill in
+ */
+void MQTTClient_getBufferStats(SocketBuffer_stats *stats) {
+    pthread_mutex_lock(mqttclient_mutex);
+    SocketBuffer_getStats(stats);
+    pthread_mutex_unlock(mqttclient_mutex);
+}
+
+/**
+ * Get the number of publications stored for messages in flight, buffered or waiting for a
+ * write to complete, across all clients
+ * @param bytes if not NULL, returns the heap storage they use
+ * @return the number of stored publications
+ */
+int MQTTClient_getStoredPublications(size_t *bytes) {
+    int count;
+
+    pthread_mutex_lock(mqttclient_mutex);
+    count = state.publications;
+    if (bytes)
+        *bytes = state.publications_size;
+    pthread_mutex_unlock(mqttclient_mutex);
+    return count;
+}
+
 int MQTTClient_setCallbacks(MQTTClient handle, void *context, MQTTClient_connectionLost *cl,
                             MQTTClient_messageArrived *ma, MQTTClient_deliveryComplete *dc) {
     int rc = MQTTCLIENT_SUCCESS;
@@ -99,6 +198,7 @@ int MQTTClient_setCallbacks(MQTTClient handle, void *context, MQTTClient_connect
         rc = MQTTCLIENT_FAILURE;
     else {
         m->context = context;
+        m->cl = cl;
         m->ma = ma;
         m->dc = dc;
     }
@@ -106,13 +206,126 @@ int MQTTClient_setCallbacks(MQTTClient handle, void *context, MQTTClient_connect
     return rc;
 }
 
-static int MQTTClient_createWithOptions(MQTTClient *handle, const char *serverURI, const char *clientId) {
-    int rc = 0;
+/**
+ * Have large messages delivered in parts as they are read from the socket, rather than to
+ * messageArrived once they have been read whole.  The parts are passed straight from the receive
+ * buffer, so a message of any size is received in a buffer of MQTTPACKET_STREAM_PART bytes.
+ * The callback is called on the thread reading the socket, with the client locked: it must not
+ * call other MQTTClient functions.  Messages over WebSockets are always read whole.
+ * @param handle the client
+ * @param threshold PUBLISH packets longer than this are streamed, 0 to stream none
+ * @param pa the callback, given the context set by MQTTClient_setCallbacks
+ * @return MQTTCLIENT_SUCCESS, or MQTTCLIENT_FAILURE if the client is connecting
+ */
+int MQTTClient_setStreamCallback(MQTTClient handle, size_t threshold, MQTTClient_partArrived *pa) {
+    int rc = MQTTCLIENT_SUCCESS;
+    MQTTClients *m = handle;
+
+    pthread_mutex_lock(mqttclient_mutex);
+    if (m == NULL || (threshold > 0 && pa == NULL) || m->c->connect_state != NOT_IN_PROGRESS)
+        rc = MQTTCLIENT_FAILURE;
+    else {
+        m->pa = pa;
+        m->c->net.streamThreshold = threshold;
+    }
+    pthread_mutex_unlock(mqttclient_mutex);
+    return rc;
+}
+
+/**
+ * Set the largest packet the client accepts.  The connection is closed when a longer packet
+ * starts to arrive, before any buffer is allocated for it.
+ * @param handle the client
+ * @param maxPacketSize the most bytes after the fixed header, 0 for no limit
+ * @return MQTTCLIENT_SUCCESS, or MQTTCLIENT_FAILURE if the client is connecting
+ */
+int MQTTClient_setMaxPacketSize(MQTTClient handle, size_t maxPacketSize) {
+    int rc = MQTTCLIENT_SUCCESS;
+    MQTTClients *m = handle;
+
+    pthread_mutex_lock(mqttclient_mutex);
+    if (m == NULL || m->c->connect_state != NOT_IN_PROGRESS)
+        rc = MQTTCLIENT_FAILURE;
+    else
+        m->c->net.maxPacketSize = maxPacketSize;
+    pthread_mutex_unlock(mqttclient_mutex);
+    return rc;
+}
+
+/**
+ * Set the most MQTT 5 topic aliases the client sends on a connection, each holding a copy of
+ * its topic.  The server's Topic Alias Maximum, from CONNACK, caps it.  Once they are all in use,
+ * the one used least recently is moved to the next new topic.  Takes effect on the next connect.
+ * @param handle the client
+ * @param maximum the most aliases, 0 to send none
+ * @return MQTTCLIENT_SUCCESS, or MQTTCLIENT_FAILURE if maximum is out of range
+ */
+int MQTTClient_setTopicAliases(MQTTClient handle, int maximum) {
+    MQTTClients *m = handle;
+
+    if (m == NULL || maximum < 0 || maximum > 65535)
+        return MQTTCLIENT_FAILURE;
+    pthread_mutex_lock(mqttclient_mutex);
+    m->topicAliases = maximum;
+    pthread_mutex_unlock(mqttclient_mutex);
+    return MQTTCLIENT_SUCCESS;
+}
+
+/**
+ * Offer permessage-deflate compression (RFC 7692) on the client's ws:// connections.  What the
+ * server answers decides whether it is used, and with which windows; a server which does not
+ * know it connects uncompressed.  A compressed message may not inflate to more than the largest
+ * packet set by MQTTClient_setMaxPacketSize.  Takes effect on the next connect.
+ * @param handle the client
+ * @param options what to offer, which is copied, or NULL to offer nothing
+ * @return MQTTCLIENT_SUCCESS, or MQTTCLIENT_FAILURE if the client is connecting or the options
+ * are not valid
+ */
+int MQTTClient_setWebSocketDeflate(MQTTClient handle, const MQTTClient_deflateOptions *options) {
+    int rc = MQTTCLIENT_SUCCESS;
+    MQTTClients *m = handle;
+
+    pthread_mutex_lock(mqttclient_mutex);
+    if (m == NULL || m->c->connect_state != NOT_IN_PROGRESS)
+        rc = MQTTCLIENT_FAILURE;
+    else if (options == NULL)
+        m->c->net.deflateOptions = NULL;
+    else if (strncmp(options->struct_id, "MQWD", 4) != 0 || options->struct_version != 0 ||
+             options->clientMaxWindowBits < 9 || options->clientMaxWindowBits > 15 ||
+             (options->serverMaxWindowBits != 0 &&
+              (options->serverMaxWindowBits < 8 || options->serverMaxWindowBits > 15)))
+        rc = MQTTCLIENT_FAILURE;
+    else {
+        m->deflate = *options;
+        m->c->net.deflateOptions = &m->deflate;
+    }
+    pthread_mutex_unlock(mqttclient_mutex);
+    return rc;
+}
+
+/**
+ * Create a client.
+ * @param handle returns the new client
+ * @param serverURI the server to connect to
+ * @param clientId the MQTT client identifier
+ * @param persistence_type MQTTCLIENT_PERSISTENCE_DEFAULT to keep in-flight and undelivered messages
+ * in an append-only store, so that they survive a restart, or MQTTCLIENT_PERSISTENCE_NONE
+ * @param persistence_context for MQTTCLIENT_PERSISTENCE_DEFAULT, the directory to keep stores in
+ * (NULL for the working directory)
+ * @param options optional create options, may be NULL
+ * @return MQTTCLIENT_SUCCESS, or MQTTCLIENT_PERSISTENCE_ERROR if the store could not be opened or
+ * recovered, in which case the client is still returned, without a store, to be destroyed
+ */
+int MQTTClient_createWithOptions(MQTTClient *handle, const char *serverURI, const char *clientId,
+                                 int persistence_type, void *persistence_context, MQTTClient_createOptions *options) {
+    int rc = 0, thread_rc = 0;
     MQTTClients *m = NULL;
     if (!library_initialized) {
         Log_initialize((Log_nameValue *) MQTTClient_getVersionInfo());
         bstate->clients = ListInitialize();
         Socket_outInitialize();
+        Socket_setWriteCompleteCallback(MQTTClient_writeComplete);
+        Socket_setWriteAvailableCallback(MQTTClient_writeAvailable);
         handles = ListInitialize();
         library_initialized = 1;
     }
@@ -123,8 +336,25 @@ static int MQTTClient_createWithOptions(MQTTClient *handle, const char *serverUR
     *handle = m;
     memset(m, '\0', sizeof(MQTTClients));
     m->commandTimeout = 10000L;
+    m->topicAliases = MQTTTOPICALIAS_DEFAULT_MAXIMUM;
+    if (options && options->struct_version >= 1) {
+        m->sendWhileDisconnected = options->sendWhileDisconnected;
+        m->maxBufferedMessages = options->maxBufferedMessages;
+        m->maxBufferedBytes = (options->maxBufferedBytes > 0) ? (size_t) options->maxBufferedBytes : 0;
+        m->bufferDropPolicy = options->bufferDropPolicy;
+    }
+    if (options && options->struct_version >= 2 && options->poolReserve > 0) {
+        int type;
+
+        for (type = 0; type < POOL_TYPES; ++type)
+            Pool_reserve((Pool_type) type, options->poolReserve);
+    }
     if (strncmp(URI_TCP, serverURI, strlen(URI_TCP)) == 0)
         serverURI += strlen(URI_TCP);
+    else if (strncmp(URI_WS, serverURI, strlen(URI_WS)) == 0) {
+        serverURI += strlen(URI_WS);
+        m->websocket = 1;
+    }
 
     m->serverURI = MQTTStrdup(serverURI);
     ListAppend(handles, m, sizeof(MQTTClients));
@@ -140,10 +370,28 @@ static int MQTTClient_createWithOptions(MQTTClient *handle, const char *serverUR
     m->c->inboundMsgs = ListInitialize();
     m->c->messageQueue = ListInitialize();
     m->c->outboundQueue = ListInitialize();
+    m->c->bufferedMsgs = ListInitialize();
+    m->subscriptions = ListInitialize();
+    m->reconnectSeed = (unsigned int) time(NULL) ^ (unsigned int) (uintptr_t) m;
     m->c->clientID = MQTTStrdup(clientId);
-    m->connect_sem = Thread_create_sem(&rc);
-    m->connack_sem = Thread_create_sem(&rc);
-    m->suback_sem = Thread_create_sem(&rc);
+    if (options && options->MQTTVersion > 0)
+        m->c->MQTTVersion = options->MQTTVersion;
+    if (persistence_type == MQTTCLIENT_PERSISTENCE_DEFAULT) {
+#if !defined(NO_PERSISTENCE)
+        if (MQTTPersistence_create(m->c, (const char *) persistence_context, m->serverURI) != 0 ||
+            MQTTPersistence_restore(m->c) != 0)
+            rc = MQTTCLIENT_PERSISTENCE_ERROR;
+#else
+        rc = MQTTCLIENT_PERSISTENCE_ERROR;
+#endif
+    }
+    /* into a separate variable, so as not to hide a persistence error */
+    m->connect_mutex = Thread_create_mutex(&thread_rc);
+    m->connect_sem = Thread_create_sem(&thread_rc);
+    m->connack_sem = Thread_create_sem(&thread_rc);
+    m->suback_sem = Thread_create_sem(&thread_rc);
+    if (rc == 0)
+        rc = thread_rc;
 
     ListAppend(bstate->clients, m->c, sizeof(Clients) + 3 * sizeof(List));
 
@@ -151,7 +399,7 @@ static int MQTTClient_createWithOptions(MQTTClient *handle, const char *serverUR
 }
 
 int MQTTClient_create(MQTTClient *handle, const char *serverURI, const char *clientId) {
-    return MQTTClient_createWithOptions(handle, serverURI, clientId);
+    return MQTTClient_createWithOptions(handle, serverURI, clientId, MQTTCLIENT_PERSISTENCE_NONE, NULL, NULL);
 }
 
 static void MQTTClient_terminate(void) {
@@ -160,11 +408,63 @@ static void MQTTClient_terminate(void) {
         ListFree(handles);
         handles = NULL;
         WebSocket_terminate();
+        Resolver_terminate();
         Log_terminate();
         library_initialized = 0;
     }
 }
 
+/*
+ * Stop the run thread and wait for it to exit, called with mqttclient_mutex held.  From a callback
+ * on the run thread itself, the thread only exits once the callback has returned.
+ */
+static void MQTTClient_stop(void) {
+    if (running && !tostop) {
+        pthread_t thread = run_id;
+
+        tostop = 1;
+        run_id = 0;
+        if (thread == 0) /* it could not be started */
+            running = tostop = 0;
+        else if (pthread_equal(thread, pthread_self()))
+            pthread_detach(thread);
+        else {
+            pthread_mutex_unlock(mqttclient_mutex);
+            pthread_join(thread, NULL);
+            pthread_mutex_lock(mqttclient_mutex);
+        }
+    }
+}
+
+/* A partial write has completed: free any QoS 0 publication it was holding */
+static void MQTTClient_writeComplete(SOCKET socket, int rc) {
+    pthread_mutex_lock(mqttclient_mutex);
+    MQTTProtocol_checkPendingWrites();
+    pthread_mutex_unlock(mqttclient_mutex);
+}
+
+/* The socket can take more data: carry on resending in-flight messages and sending buffered ones */
+static void MQTTClient_writeAvailable(SOCKET socket) {
+    pthread_mutex_lock(mqttclient_mutex);
+    if (ListFindItem(handles, &socket, clientSockCompare) != NULL)
+        MQTTClient_resume((MQTTClients *) (handles->current->content));
+    pthread_mutex_unlock(mqttclient_mutex);
+}
+
+#if !defined(NO_PERSISTENCE)
+/* Complete any group commits that have been waiting for longer than the commit interval */
+static void MQTTClient_flushPersistence(void) {
+    static struct timeval last;
+    ListElement *current = NULL;
+
+    if (MQTTTime_elapsed(last) < 10L)
+        return;
+    last = MQTTTime_now();
+    while (ListNextElement(bstate->clients, &current))
+        MQTTPersistence_flush((Clients *) (current->content));
+}
+#endif
+
 static int clientSockCompare(void *a, void *b) {
     MQTTClients *m = (MQTTClients *) a;
     return m->c->net.socket == *(int *) b;
@@ -176,7 +476,7 @@ static void *MQTTClient_run(void *n) {
     running = 1;
     Thread_getid();
     pthread_mutex_lock(mqttclient_mutex);
-    while (1) { //todo
+    while (!tostop) {
         int rc = SOCKET_ERROR;
         SOCKET sock = -1;
         MQTTClients *m = NULL;
@@ -186,6 +486,11 @@ static void *MQTTClient_run(void *n) {
         pack = MQTTClient_cycle(&sock, timeout, &rc);
         pthread_mutex_lock(mqttclient_mutex);
         timeout = 100L;
+#if !defined(NO_PERSISTENCE)
+        MQTTClient_flushPersistence();
+#endif
+        MQTTClient_retry();
+        SocketBuffer_trim(0);
 
         /* find client corresponding to socket */
         if (ListFindItem(handles, &sock, clientSockCompare) == NULL) {
@@ -197,6 +502,24 @@ static void *MQTTClient_run(void *n) {
             /* assert: should not happen */
             continue;
         }
+        WebSocket_trim(&m->c->net);
+        if (rc == SOCKET_ERROR && sock > 0) {
+            if (m->connectPending)
+                MQTTClient_connectFinished(m, SOCKET_ERROR);
+            else if (m->reconnecting)
+                MQTTClient_reconnectFailed(m);
+            else {
+                int waiting = (m->c->connect_state == WAIT_FOR_CONNACK ||
+                               m->c->connect_state == WEBSOCKET_IN_PROGRESS);
+
+                MQTTClient_disconnect_internal(m, "socket error");
+                if (waiting) { /* wake the connect call rather than have it wait out its timeout */
+                    m->pack = NULL;
+                    Thread_post_sem(m->connack_sem);
+                }
+            }
+            continue;
+        }
         if (m->c->messageQueue->count > 0 && m->ma) {
             qEntry *qe = (qEntry *) (m->c->messageQueue->first->content);
             int topicLen = qe->topicLen;
@@ -214,32 +537,258 @@ static void *MQTTClient_run(void *n) {
              * so we must be careful how we use it.
              */
             if (rc) {
-                ListRemove(m->c->messageQueue, qe);
+                unsigned int seqno = qe->seqno;
+
+                ListDetachElement(m->c->messageQueue, &qe->link);
+                Pool_free(POOL_QENTRY, qe);
+#if !defined(NO_PERSISTENCE)
+                if (m->c->persistence)
+                    MQTTPersistence_remove(m->c, PERSISTENCE_QUEUED, seqno);
+#endif
             } else
                 Log(TRACE_MIN, -1, "False returned from messageArrived for client %s, message remains on queue",
                     m->c->clientID);
         }
         if (pack) {
-            if (pack->header.bits.type == CONNACK) {
+            if (pack->header.bits.type == CONNACK && m->connectPending) {
+                MQTTClient_connectFinished(m, MQTTClient_connected(m, (Connack *) pack));
+                MQTTPacket_free(pack);
+            } else if (pack->header.bits.type == CONNACK && m->reconnecting) {
+                if (MQTTClient_connected(m, (Connack *) pack) != MQTTCLIENT_SUCCESS)
+                    MQTTClient_reconnectFailed(m);
+                MQTTPacket_free(pack);
+            } else if (pack->header.bits.type == CONNACK) {
                 Log(TRACE_MIN, -1, "Posting connack semaphore for client %s", m->c->clientID);
                 m->pack = pack;
                 Thread_post_sem(m->connack_sem);
+            } else if (pack->header.bits.type == SUBACK && ((Suback *) pack)->msgId == m->resubscribeId) {
+                /* answers our own resubscribe, which nobody is waiting for */
+                m->resubscribeId = 0;
+                MQTTPacket_free(pack);
             } else if (pack->header.bits.type == SUBACK) {
                 Log(TRACE_MIN, -1, "Posting suback semaphore for client %s", m->c->clientID);
                 m->pack = pack;
                 Thread_post_sem(m->suback_sem);
-            }
+            } else
+                MQTTPacket_free(pack); /* nobody is waiting for it */
         } else if (m->c->connect_state == TCP_IN_PROGRESS) {
             int error;
             socklen_t len = sizeof(error);
 
             if ((m->rc = getsockopt(m->c->net.socket, SOL_SOCKET, SO_ERROR, (char *) &error, &len)) == 0)
                 m->rc = error;
+            if (m->reconnecting || m->connectPending) {
+                if (m->rc == 0 && MQTTProtocol_handshake(m->currentServerURI ? m->currentServerURI : m->serverURI,
+                                                         m->c, m->websocket, m->c->MQTTVersion) != 0)
+                    m->rc = SOCKET_ERROR;
+                if (m->rc != 0 && m->connectPending)
+                    MQTTClient_connectFinished(m, SOCKET_ERROR);
+                else if (m->rc != 0)
+                    MQTTClient_reconnectFailed(m);
+                else
+                    MQTTClient_pipeline(m);
+                continue;
+            }
             Log(TRACE_MIN, -1, "Posting connect semaphore for client %s rc %d", m->c->clientID, m->rc);
             m->c->connect_state = NOT_IN_PROGRESS;
             Thread_post_sem(m->connect_sem);
         }
     }
+    running = 0;
+    tostop = 0;
+    pthread_mutex_unlock(mqttclient_mutex);
+    return NULL;
+}
+
+/* Subscribe again to all the topics the application has subscribed to */
+static void MQTTClient_resubscribe(MQTTClients *m) {
+    List *topics = ListInitialize();
+    List *qoss = ListInitialize();
+    ListElement *current = NULL;
+
+    while (ListNextElement(m->subscriptions, &current)) {
+        MQTTClient_subscription *sub = (MQTTClient_subscription *) (current->content);
+
+        ListAppend(topics, sub->topic, strlen(sub->topic));
+        ListAppend(qoss, &sub->qos, sizeof(int));
+    }
+    Log(TRACE_MIN, -1, "Resubscribing to %d topics for client %s", topics->count, m->c->clientID);
+    m->resubscribeId = MQTTProtocol_assignMsgId(m->c);
+    MQTTProtocol_subscribe(m->c, topics, qoss, m->resubscribeId, NULL);
+    ListFreeNoContent(topics);
+    ListFreeNoContent(qoss);
+}
+
+/**
+ * The CONNECT has been written: if the application asked for it, send the subscriptions and the
+ * buffered messages straight after it, rather than waiting a round trip for the CONNACK.  The
+ * server processes them in order, once it has accepted the connection.
+ */
+static void MQTTClient_pipeline(MQTTClients *m) {
+    if (!m->pipelineConnect || m->c->connect_state != WAIT_FOR_CONNACK)
+        return;
+    if (m->subscriptions->count > 0 && Socket_noPendingWrites(m->c->net.socket)) {
+        MQTTClient_resubscribe(m);
+        m->pipelined = 1;
+    }
+    MQTTClient_flushBuffered(m);
+}
+
+/**
+ * Complete a connection on receipt of a successful CONNACK: resubscribe if the server has no
+ * session for us, then resend the messages that were in flight and those buffered while disconnected.
+ * @return the CONNACK return code
+ */
+static int MQTTClient_connected(MQTTClients *m, Connack *connack) {
+    Clients *c = m->c;
+    int rc = connack->rc;
+    int sessionPresent = connack->flags.bits.sessionPresent;
+
+    if (rc != MQTTCLIENT_SUCCESS) {
+        Log(TRACE_MIN, -1, "Connect refused for client %s, rc %d", c->clientID, rc);
+        m->pipelined = 0;
+        goto exit;
+    }
+    c->connected = 1;
+    c->good = 1;
+    c->connect_state = NOT_IN_PROGRESS;
+    /* topic aliases last only as long as the connection */
+    MQTTTopicAlias_free(c->topicAliases);
+    c->topicAliases = NULL;
+    c->topicAliasMaximum = (c->MQTTVersion >= 5) ? connack->topicAliasMaximum : 0;
+    c->receiveMaximum = (c->MQTTVersion >= 5) ? connack->receiveMaximum : 65535;
+    if (min(c->topicAliasMaximum, m->topicAliases) > 0 &&
+        (c->topicAliases = MQTTTopicAlias_create(min(c->topicAliasMaximum, m->topicAliases))) == NULL)
+        Log(LOG_ERROR, -1, "Could not create the topic alias table for client %s", c->clientID);
+    if (m->reconnecting)
+        Log(TRACE_MIN, -1, "Client %s reconnected after %d failed attempts", c->clientID, m->reconnectAttempts);
+    m->reconnecting = 0;
+    m->reconnectAttempts = 0;
+    if (!sessionPresent && !m->pipelined && m->subscriptions->count > 0)
+        MQTTClient_resubscribe(m);
+    m->pipelined = 0;
+    c->connect_count = c->outboundMsgs->count;
+    c->connect_sent = 0;
+    MQTTClient_resume(m);
+    exit:
+    return rc;
+}
+
+/**
+ * Send the acknowledgements queued while a write was pending, then resend the messages that
+ * were in flight when the connection was made, oldest first, then carry on with the buffered
+ * ones.  Each is written directly from its stored publication; if the socket stops taking data,
+ * MQTTClient_writeAvailable calls back in here to continue.
+ */
+static void MQTTClient_resume(MQTTClients *m) {
+    Clients *c = m->c;
+    ListElement *current = NULL;
+    int exhausted = 0;
+
+    if (c->connected && MQTTProtocol_flushAcks(c) == SOCKET_ERROR)
+        return;
+
+    while (c->connected && c->connect_sent < c->connect_count && Socket_noPendingWrites(c->net.socket)) {
+        Messages *msg;
+
+        if (ListNextElement(c->outboundMsgs, &current) == NULL) {
+            exhausted = 1; /* some were completed or removed while we waited */
+            break;
+        }
+        msg = (Messages *) (current->content);
+        if (!timercmp(&msg->lastTouch, &m->connectTime, <))
+            continue; /* already sent on this connection */
+        ++c->connect_sent;
+        if (MQTTProtocol_retryPublish(c, msg) == SOCKET_ERROR)
+            break;
+    }
+    if (exhausted)
+        c->connect_sent = c->connect_count;
+    if (c->connect_sent >= c->connect_count)
+        MQTTClient_flushBuffered(m);
+}
+
+/* The connection has gone: close it, and if it was established, tell the application and schedule a reconnect */
+static void MQTTClient_disconnect_internal(MQTTClients *m, char *cause) {
+    Clients *c = m->c;
+    int was_connected = c->connected;
+
+    Log(TRACE_MIN, -1, "Connection lost for client %s: %s", c->clientID, cause);
+    if (c->net.socket > 0) {
+        Socket_close(c->net.socket);
+        c->net.socket = 0;
+    }
+    MQTTPacket_endStream(&c->net);
+    MQTTProtocol_checkPendingWrites();
+    MQTTTopicAlias_free(c->topicAliases);
+    c->topicAliases = NULL;
+    MQTTTopicAlias_freeInbound(c->inboundAliases);
+    c->inboundAliases = NULL;
+    c->connected = 0;
+    c->connect_state = NOT_IN_PROGRESS;
+    if (!was_connected)
+        return;
+    if (m->automaticReconnect) {
+        m->reconnecting = 1;
+        m->reconnectAttempts = 0;
+        m->reconnectDelay = 0;
+        m->reconnectTime = MQTTTime_now();
+    }
+    if (m->cl) {
+        Log(TRACE_MIN, -1, "Calling connectionLost for client %s", c->clientID);
+        pthread_mutex_unlock(mqttclient_mutex);
+        (*(m->cl))(m->context, cause);
+        pthread_mutex_lock(mqttclient_mutex);
+    }
+}
+
+/* A reconnect attempt failed: back off exponentially, with equal jitter, before the next */
+static void MQTTClient_reconnectFailed(MQTTClients *m) {
+    int delay = m->maxReconnectDelay;
+
+    if (m->c->net.socket > 0)
+        Socket_close(m->c->net.socket);
+    m->c->net.socket = 0;
+    m->c->connect_state = NOT_IN_PROGRESS;
+    if (m->reconnectAttempts < 30 && ((int64_t) m->minReconnectDelay << m->reconnectAttempts) < delay)
+        delay = m->minReconnectDelay << m->reconnectAttempts;
+    ++m->reconnectAttempts;
+    m->reconnectDelay = delay / 2 + (int) (rand_r(&m->reconnectSeed) % (unsigned int) (delay / 2 + 1));
+    m->reconnectTime = MQTTTime_now();
+    Log(TRACE_MIN, -1, "Reconnect attempt %d failed for client %s, next in %d ms", m->reconnectAttempts,
+        m->c->clientID, m->reconnectDelay);
+}
+
+/* Start the reconnect attempts that are due, and abandon those that have taken too long */
+static void MQTTClient_retry(void) {
+    ListElement *current = NULL;
+
+    while (ListNextElement(handles, &current)) {
+        MQTTClients *m = (MQTTClients *) (current->content);
+        int64_t elapsed;
+
+        if (!m->reconnecting)
+            continue;
+        elapsed = (int64_t) MQTTTime_elapsed(m->reconnectTime);
+        if (m->c->connect_state != NOT_IN_PROGRESS && elapsed > m->connectTimeout)
+            MQTTClient_reconnectFailed(m);
+        else if ((m->c->connect_state == NOT_IN_PROGRESS && elapsed >= m->reconnectDelay) ||
+                 m->c->connect_state == RESOLVE_IN_PROGRESS) {
+            const char *serverURI = m->currentServerURI ? m->currentServerURI : m->serverURI;
+
+            if (m->c->connect_state == NOT_IN_PROGRESS) {
+                Log(TRACE_MIN, -1, "Reconnecting client %s to %s", m->c->clientID, serverURI);
+                m->reconnectTime = MQTTTime_now();
+                m->connectTime = m->reconnectTime;
+            }
+            /* a zero timeout: if the host name is not in the cache, this is called again until it is */
+            if (MQTTProtocol_connect(serverURI, m->c, m->websocket, m->c->MQTTVersion, 0) != 0 &&
+                m->c->connect_state == NOT_IN_PROGRESS)
+                MQTTClient_reconnectFailed(m);
+            else
+                MQTTClient_pipeline(m);
+        }
+    }
 }
 
 static MQTTResponse
@@ -251,18 +800,27 @@ MQTTClient_connectURIVersion(MQTTClient handle, MQTTClient_connectOptions *optio
     MQTTResponse resp = MQTTResponse_initializer;
     resp.reasonCode = SOCKET_ERROR;
     if (m->ma && !running) {
-        Thread_start(MQTTClient_run, handle);
-        if (MQTTTime_elapsed(start) >= millisecsTimeout) {
-            rc = SOCKET_ERROR;
-            goto exit;
-        }
-        MQTTTime_sleep(100L);
+        running = 1; /* set here, so that the thread is not started twice */
+        run_id = Thread_start(MQTTClient_run, handle);
     }
     Log(TRACE_MIN, -1, "Connecting to serverURI %s with MQTT version %d", serverURI, MQTTVersion);
-    rc = MQTTProtocol_connect(serverURI, m->c, m->websocket, MQTTVersion,
-                              millisecsTimeout - MQTTTime_elapsed(start));
-    if (rc == SOCKET_ERROR)
+    m->connectTime = MQTTTime_now();
+    rc = MQTTProtocol_connect(serverURI, m->c, m->websocket, MQTTVersion, 0);
+    if (rc == RESOLVER_IN_PROGRESS) { /* wait for the host name lookup without holding the client lock */
+        Resolver_result addresses;
+        int port;
+
+        pthread_mutex_unlock(mqttclient_mutex);
+        MQTTProtocol_resolve(serverURI, m->websocket, (long) (millisecsTimeout - MQTTTime_elapsed(start)),
+                             &addresses, &port);
+        pthread_mutex_lock(mqttclient_mutex);
+        rc = MQTTProtocol_connect(serverURI, m->c, m->websocket, MQTTVersion, 0);
+    }
+    if (rc == SOCKET_ERROR || rc == RESOLVER_IN_PROGRESS) {
+        m->c->connect_state = NOT_IN_PROGRESS;
+        rc = SOCKET_ERROR;
         goto exit;
+    }
 
     if (m->c->connect_state == NOT_IN_PROGRESS) {
         rc = SOCKET_ERROR;
@@ -276,15 +834,14 @@ MQTTClient_connectURIVersion(MQTTClient handle, MQTTClient_connectOptions *optio
         if (rc != 0) {
             rc = SOCKET_ERROR;
             goto exit;
-        } else {
-            m->c->connect_state = WAIT_FOR_CONNACK; /* TCP connect completed, in which case send the MQTT connect packet */
-            if (MQTTPacket_send_connect(m->c, MQTTVersion) == SOCKET_ERROR) {
-                rc = SOCKET_ERROR;
-                goto exit;
-            }
+        } else if (MQTTProtocol_handshake(serverURI, m->c, m->websocket, MQTTVersion) != 0) {
+            rc = SOCKET_ERROR; /* TCP connect completed, in which case send the MQTT connect packet */
+            goto exit;
         }
     }
-    if (m->c->connect_state == WAIT_FOR_CONNACK) /* MQTT connect sent - wait for CONNACK */
+    MQTTClient_pipeline(m);
+    /* MQTT connect sent, or will be once the websocket is upgraded - wait for CONNACK */
+    if (m->c->connect_state == WAIT_FOR_CONNACK || m->c->connect_state == WEBSOCKET_IN_PROGRESS)
     {
         MQTTPacket *pack = NULL;
         pthread_mutex_unlock(mqttclient_mutex);
@@ -292,8 +849,21 @@ MQTTClient_connectURIVersion(MQTTClient handle, MQTTClient_connectOptions *optio
         pthread_mutex_lock(mqttclient_mutex);
         if (pack == NULL)
             rc = SOCKET_ERROR;
+        else {
+            Connack *connack = (Connack *) pack;
+
+            if ((rc = MQTTClient_connected(m, connack)) == MQTTCLIENT_SUCCESS)
+                sessionPresent = connack->flags.bits.sessionPresent;
+            free(connack);
+            m->pack = NULL;
+        }
     }
     exit:
+    if (rc != MQTTCLIENT_SUCCESS && m->c->net.socket > 0) {
+        Socket_close(m->c->net.socket);
+        m->c->net.socket = 0;
+        m->c->connect_state = NOT_IN_PROGRESS;
+    }
     if (rc == MQTTCLIENT_SUCCESS) {
         if (options->struct_version >= 4) /* means we have to fill out return values */
         {
@@ -306,28 +876,53 @@ MQTTClient_connectURIVersion(MQTTClient handle, MQTTClient_connectOptions *optio
     return resp;
 }
 
-static MQTTResponse
-MQTTClient_connectURI(MQTTClient handle, MQTTClient_connectOptions *options, const char *serverURI) {
-    MQTTClients *m = handle;
-    struct timeval start;
-    uint64_t millisecsTimeout = 30000L;
-    MQTTResponse rc = MQTTResponse_initializer;
-    int MQTTVersion = 0;
-    rc.reasonCode = SOCKET_ERROR;
-    millisecsTimeout = options->connectTimeout * 1000;
-    start = MQTTTime_start_clock();
-    m->currentServerURI = serverURI;
+/* Take the connect options that outlive the connect call */
+static void MQTTClient_setConnectOptions(MQTTClients *m, MQTTClient_connectOptions *options) {
+    m->connectTimeout = options->connectTimeout * 1000;
+    if (options->struct_version >= 11) {
+        m->c->fastOpen = options->fastOpen;
+        m->pipelineConnect = options->pipelineConnect;
+    }
+    if (options->struct_version >= 9) {
+        m->automaticReconnect = options->automaticReconnect;
+        m->minReconnectDelay = (options->minReconnectDelay > 0) ? options->minReconnectDelay : 1;
+        m->maxReconnectDelay = (options->maxReconnectDelay > m->minReconnectDelay) ? options->maxReconnectDelay
+                                                                                    : m->minReconnectDelay;
+    }
+    if (m->reconnecting) { /* an explicit connect takes over from the automatic one */
+        m->reconnecting = 0;
+        if (m->c->net.socket > 0 && !m->c->connected) {
+            Socket_close(m->c->net.socket);
+            m->c->net.socket = 0;
+        }
+    }
     m->c->MQTTVersion = options->MQTTVersion;
     if (m->c->username)
         free((void *) m->c->username);
+    m->c->username = NULL;
     if (options->username)
         m->c->username = MQTTStrdup(options->username);
     if (m->c->password)
         free((void *) m->c->password);
+    m->c->password = NULL;
     if (options->password) {
         m->c->password = MQTTStrdup(options->password);
         m->c->passwordlen = (int) strlen(options->password);
     }
+}
+
+static MQTTResponse
+MQTTClient_connectURI(MQTTClient handle, MQTTClient_connectOptions *options, const char *serverURI) {
+    MQTTClients *m = handle;
+    struct timeval start;
+    uint64_t millisecsTimeout = 30000L;
+    MQTTResponse rc = MQTTResponse_initializer;
+    int MQTTVersion = 0;
+    rc.reasonCode = SOCKET_ERROR;
+    millisecsTimeout = options->connectTimeout * 1000;
+    start = MQTTTime_start_clock();
+    MQTTClient_setConnectOptions(m, options);
+    m->currentServerURI = serverURI;
     MQTTVersion = options->MQTTVersion;
     rc = MQTTClient_connectURIVersion(handle, options, serverURI, MQTTVersion, start, millisecsTimeout);
 
@@ -344,14 +939,410 @@ static MQTTResponse
 MQTTClient_connectAll(MQTTClient handle, MQTTClient_connectOptions *options) {
     MQTTClients *m = handle;
     MQTTResponse rc = MQTTResponse_initializer;
-    pthread_mutex_lock(connect_mutex);
+    int serialize = (m->ma == NULL); /* no run thread is started: the waits read the sockets themselves */
+
+    pthread_mutex_lock(m->connect_mutex);
+    if (serialize)
+        pthread_mutex_lock(connect_mutex);
     pthread_mutex_lock(mqttclient_mutex);
-    rc = MQTTClient_connectURI(handle, options, m->serverURI);
+    if (options->serverURIcount > 0) {
+        int winner = -1;
+
+        rc = MQTTClient_connectRace(m, options, options->serverURIs, options->serverURIcount, &winner);
+    } else if (!m->websocket) /* the websocket handshake needs the host name in the URI */
+        rc = MQTTClient_connectAddresses(m, options);
+    else
+        rc = MQTTClient_connectURI(handle, options, m->serverURI);
     pthread_mutex_unlock(mqttclient_mutex);
-    pthread_mutex_unlock(connect_mutex);
+    if (serialize)
+        pthread_mutex_unlock(connect_mutex);
+    pthread_mutex_unlock(m->connect_mutex);
     return rc;
 }
 
+/* An asynchronous connect has finished: clean up if it failed, and tell MQTTClient_connectMany */
+static void MQTTClient_connectFinished(MQTTClients *m, int rc) {
+    if (rc != MQTTCLIENT_SUCCESS) {
+        if (m->c->net.socket > 0) {
+            Socket_close(m->c->net.socket);
+            m->c->net.socket = 0;
+            MQTTProtocol_checkPendingWrites();
+        }
+        m->c->connect_state = NOT_IN_PROGRESS;
+    }
+    m->connectPending = 0;
+    m->connectRc = rc;
+    if (m->connectDone_sem)
+        Thread_post_sem(m->connectDone_sem);
+}
+
+/*
+ * Start the connect of one client for MQTTClient_connectMany, called with mqttclient_mutex held.
+ * Returns MQTTCLIENT_SUCCESS if the connect is under way, when the client's connect_mutex is held.
+ */
+static int MQTTClient_startConnect(MQTTClients *m, MQTTClient_connectOptions *options, sem_t *done) {
+    int rc = MQTTCLIENT_FAILURE;
+
+    if (m == NULL || pthread_mutex_trylock(m->connect_mutex) != 0) /* another connect is in progress */
+        goto exit;
+    if (m->c->connected) {
+        pthread_mutex_unlock(m->connect_mutex);
+        goto exit;
+    }
+    MQTTClient_setConnectOptions(m, options);
+    m->currentServerURI = m->serverURI;
+    m->connectTime = MQTTTime_now();
+    m->connectDone_sem = done;
+    m->connectPending = 1;
+    rc = MQTTCLIENT_SUCCESS;
+    Log(TRACE_MIN, -1, "Connecting client %s to serverURI %s", m->c->clientID, m->serverURI);
+    MQTTProtocol_connect(m->serverURI, m->c, m->websocket, m->c->MQTTVersion, 0);
+    if (m->c->connect_state == NOT_IN_PROGRESS)
+        MQTTClient_connectFinished(m, SOCKET_ERROR);
+    else
+        MQTTClient_pipeline(m);
+    exit:
+    return rc;
+}
+
+/**
+ * Connect a number of clients at once.  Up to maxInProgress connects are under way at any time,
+ * each started as soon as an earlier one finishes, and driven by the run thread rather than by
+ * the caller, so one slow server does not hold up the others.  Clients are connected to their
+ * own serverURI only: the HA serverURIs of the options are not used.
+ * @param clients the clients to connect
+ * @param count the number of clients
+ * @param options the connect options, used for every client
+ * @param maxInProgress the most connects in progress at once, or 0 for no limit
+ * @param complete if not NULL, called on the calling thread as each connect finishes
+ * @param context passed to complete
+ * @return the number of clients connected, or MQTTCLIENT_FAILURE
+ */
+int MQTTClient_connectMany(MQTTClient *clients, int count, MQTTClient_connectOptions *options, int maxInProgress,
+                           MQTTClient_connectComplete *complete, void *context) {
+    enum {WAITING, CONNECTING, FINISHED};
+    char *state = NULL;
+    int *results = NULL;
+    sem_t *done = NULL;
+    int next = 0, active = 0, finished = 0, connected = 0, rc = MQTTCLIENT_SUCCESS, i;
+
+    if (clients == NULL || count <= 0 || options == NULL)
+        return MQTTCLIENT_FAILURE;
+    if (maxInProgress <= 0 || maxInProgress > count)
+        maxInProgress = count;
+    state = calloc((size_t) count, sizeof(char));
+    results = malloc((size_t) count * sizeof(int));
+    done = Thread_create_sem(&rc);
+    if (state == NULL || results == NULL || done == NULL) {
+        connected = PAHO_MEMORY_ERROR;
+        goto exit;
+    }
+    pthread_mutex_lock(mqttclient_mutex);
+    if (!running) { /* the run thread drives the connects */
+        running = 1;
+        run_id = Thread_start(MQTTClient_run, NULL);
+    }
+    while (finished < count) {
+        int resolving = 0, first = -1, last = -1;
+
+        while (next < count && active < maxInProgress) {
+            if (MQTTClient_startConnect((MQTTClients *) clients[next], options, done) == MQTTCLIENT_SUCCESS) {
+                state[next] = CONNECTING;
+                ++active;
+            } else {
+                state[next] = FINISHED;
+                results[next] = MQTTCLIENT_FAILURE;
+                if (first < 0)
+                    first = next;
+                last = next;
+            }
+            ++next;
+        }
+        for (i = 0; i < next; ++i) {
+            MQTTClients *m = (MQTTClients *) clients[i];
+
+            if (state[i] != CONNECTING)
+                continue;
+            if (m->connectPending && MQTTTime_elapsed(m->connectTime) > (uint64_t) m->connectTimeout) {
+                Log(TRACE_MIN, -1, "Connect timed out for client %s", m->c->clientID);
+                MQTTClient_connectFinished(m, SOCKET_ERROR);
+            } else if (m->connectPending && m->c->connect_state == RESOLVE_IN_PROGRESS) {
+                MQTTProtocol_connect(m->serverURI, m->c, m->websocket, m->c->MQTTVersion, 0);
+                if (m->c->connect_state == NOT_IN_PROGRESS)
+                    MQTTClient_connectFinished(m, SOCKET_ERROR);
+                else if (m->c->connect_state == RESOLVE_IN_PROGRESS)
+                    resolving = 1;
+                else
+                    MQTTClient_pipeline(m);
+            }
+            if (!m->connectPending) {
+                m->connectDone_sem = NULL;
+                state[i] = FINISHED;
+                results[i] = m->connectRc;
+                pthread_mutex_unlock(m->connect_mutex);
+                --active;
+                if (first < 0)
+                    first = i;
+                last = i;
+            }
+        }
+        if (first >= 0) {
+            pthread_mutex_unlock(mqttclient_mutex);
+            for (i = first; i <= last; ++i) {
+                if (state[i] != FINISHED)
+                    continue;
+                state[i] = FINISHED + 1; /* reported */
+                ++finished;
+                if (results[i] == MQTTCLIENT_SUCCESS)
+                    ++connected;
+                if (complete)
+                    (*complete)(context, clients[i], results[i]);
+            }
+            pthread_mutex_lock(mqttclient_mutex);
+            continue;
+        }
+        pthread_mutex_unlock(mqttclient_mutex);
+        Thread_wait_sem(done, resolving ? 10 : 100);
+        pthread_mutex_lock(mqttclient_mutex);
+    }
+    pthread_mutex_unlock(mqttclient_mutex);
+    exit:
+    if (done)
+        Thread_destroy_sem(done);
+    free(results);
+    free(state);
+    return connected;
+}
+
+/** one serverURI being tried by MQTTClient_connectRace */
+typedef struct {
+    const char *serverURI;
+    Clients c;      /**< copy of the client's connect data with its own network handle */
+} MQTTClient_candidate;
+
+static void MQTTClient_abortCandidate(MQTTClient_candidate *cand) {
+    if (cand->c.net.socket > 0)
+        Socket_close(cand->c.net.socket);
+    cand->c.net.socket = 0;
+    free(cand->c.net.websocket_key);
+    cand->c.net.websocket_key = NULL;
+    WebSocket_free(&cand->c.net);
+    cand->c.connect_state = NOT_IN_PROGRESS;
+}
+
+/**
+ * Keep a candidate's socket out of the run thread's ready-socket selection, as no client owns it
+ * until it wins the race.
+ */
+static void MQTTClient_holdCandidate(MQTTClient_candidate *cand) {
+    if (cand->c.net.socket > 0 && cand->c.connect_state != RESOLVE_IN_PROGRESS)
+        Socket_hold(cand->c.net.socket);
+}
+
+/**
+ * Connect to whichever of a list of serverURIs answers first.  TCP connects are started in list
+ * order, one stagger interval apart or as soon as every earlier attempt has failed, and run
+ * concurrently; the first to receive a successful CONNACK becomes the connection and the others
+ * are closed.  The candidates' sockets are kept out of the ready-socket selection until one wins.
+ * Called with mqttclient_mutex held, which is released while waiting.
+ * @param winner returns the index of the serverURI connected to, or -1
+ */
+static MQTTResponse MQTTClient_connectRace(MQTTClients *m, MQTTClient_connectOptions *options,
+                                           char *const *serverURIs, int count, int *winner) {
+    MQTTResponse resp = MQTTResponse_initializer;
+    MQTTClient_candidate *candidates = NULL;
+    struct pollfd *fds = NULL;
+    int *index = NULL;
+    struct timeval start = MQTTTime_start_clock();
+    int64_t timeout = (int64_t) options->connectTimeout * 1000;
+    int64_t nextStart = 0;
+    int stagger = (options->struct_version >= 10) ? options->connectStagger : 250;
+    int started = 0, active = 0, i;
+    Connack *connack = NULL;
+
+    resp.reasonCode = SOCKET_ERROR;
+    MQTTClient_setConnectOptions(m, options);
+    if (m->ma && !running) {
+        running = 1;
+        run_id = Thread_start(MQTTClient_run, m);
+    }
+    m->connectTime = MQTTTime_now();
+    candidates = calloc((size_t) count, sizeof(MQTTClient_candidate));
+    fds = malloc((size_t) count * sizeof(struct pollfd));
+    index = malloc((size_t) count * sizeof(int));
+    if (candidates == NULL || fds == NULL || index == NULL) {
+        resp.reasonCode = PAHO_MEMORY_ERROR;
+        goto exit;
+    }
+    *winner = -1;
+    while (*winner < 0) {
+        int64_t elapsed = (int64_t) MQTTTime_elapsed(start);
+        int wait = (int) (timeout - elapsed);
+        int nfds = 0, resolving = 0;
+
+        if (elapsed >= timeout)
+            break;
+        if (started < count && (active == 0 || elapsed >= nextStart)) {
+            MQTTClient_candidate *cand = &candidates[started++];
+
+            cand->serverURI = serverURIs[started - 1];
+            if (strncmp(URI_TCP, cand->serverURI, strlen(URI_TCP)) == 0)
+                cand->serverURI += strlen(URI_TCP);
+            cand->c = *m->c;
+            memset(&cand->c.net, '\0', sizeof(networkHandles));
+            cand->c.net.maxPacketSize = m->c->net.maxPacketSize;
+            cand->c.net.streamThreshold = m->c->net.streamThreshold;
+            cand->c.net.deflateOptions = m->c->net.deflateOptions;
+            cand->c.connect_state = NOT_IN_PROGRESS;
+            Log(TRACE_MIN, -1, "Connecting client %s to serverURI %s", m->c->clientID, cand->serverURI);
+            MQTTProtocol_connect(cand->serverURI, &cand->c, m->websocket, m->c->MQTTVersion, 0);
+            if (cand->c.connect_state == NOT_IN_PROGRESS)
+                MQTTClient_abortCandidate(cand);
+            else {
+                MQTTClient_holdCandidate(cand);
+                ++active;
+            }
+            nextStart = elapsed + stagger;
+            continue;
+        }
+        if (active == 0)
+            break; /* every serverURI has failed */
+        for (i = 0; i < started; ++i) {
+            if (candidates[i].c.connect_state == RESOLVE_IN_PROGRESS) { /* see if the lookup has finished */
+                MQTTProtocol_connect(candidates[i].serverURI, &candidates[i].c, m->websocket, m->c->MQTTVersion, 0);
+                if (candidates[i].c.connect_state == NOT_IN_PROGRESS) {
+                    MQTTClient_abortCandidate(&candidates[i]);
+                    --active;
+                    nextStart = elapsed;
+                }
+                else
+                    MQTTClient_holdCandidate(&candidates[i]);
+            }
+            if (candidates[i].c.connect_state == RESOLVE_IN_PROGRESS)
+                ++resolving;
+            if (candidates[i].c.connect_state == NOT_IN_PROGRESS ||
+                candidates[i].c.connect_state == RESOLVE_IN_PROGRESS)
+                continue;
+            fds[nfds].fd = candidates[i].c.net.socket;
+            fds[nfds].events = (candidates[i].c.connect_state == TCP_IN_PROGRESS) ? POLLOUT : POLLIN;
+            fds[nfds].revents = 0;
+            index[nfds++] = i;
+        }
+        if (active == 0)
+            continue;
+        if (started < count && nextStart - elapsed < wait)
+            wait = (int) (nextStart - elapsed);
+        if (resolving > 0 && wait > 10)
+            wait = 10;
+        pthread_mutex_unlock(mqttclient_mutex);
+        poll(fds, (nfds_t) nfds, wait);
+        pthread_mutex_lock(mqttclient_mutex);
+        for (i = 0; i < nfds && *winner < 0; ++i) {
+            MQTTClient_candidate *cand = &candidates[index[i]];
+            MQTTPacket *pack = NULL;
+            int rc = 0;
+
+            if (fds[i].revents == 0)
+                continue;
+            if (cand->c.connect_state == TCP_IN_PROGRESS) {
+                int error = 0;
+                socklen_t len = sizeof(error);
+
+                if (getsockopt(cand->c.net.socket, SOL_SOCKET, SO_ERROR, (char *) &error, &len) == 0 && error == 0)
+                    rc = MQTTProtocol_handshake(cand->serverURI, &cand->c, m->websocket, m->c->MQTTVersion);
+                else
+                    rc = SOCKET_ERROR;
+            } else if (cand->c.connect_state == WEBSOCKET_IN_PROGRESS)
+                rc = MQTTProtocol_upgrade(&cand->c);
+            else if ((pack = MQTTPacket_Factory(m->c->MQTTVersion, &cand->c.net, &rc)) != NULL) {
+                if (pack->header.bits.type == CONNACK && ((Connack *) pack)->rc == MQTTCLIENT_SUCCESS) {
+                    connack = (Connack *) pack;
+                    *winner = index[i];
+                    continue;
+                }
+                MQTTPacket_free(pack);
+                rc = SOCKET_ERROR; /* refused */
+            }
+            if (rc == SOCKET_ERROR) {
+                Log(TRACE_MIN, -1, "Connect to serverURI %s failed for client %s", cand->serverURI, m->c->clientID);
+                MQTTClient_abortCandidate(cand);
+                --active;
+                nextStart = (int64_t) MQTTTime_elapsed(start); /* start the next one now */
+            }
+        }
+    }
+
+    for (i = 0; i < started; ++i) {
+        if (i != *winner)
+            MQTTClient_abortCandidate(&candidates[i]);
+    }
+    if (*winner >= 0) {
+        int connectTime = (int) MQTTTime_elapsed(start);
+
+        WebSocket_free(&m->c->net);
+        m->c->net = candidates[*winner].c.net;
+        Socket_release(m->c->net.socket);
+        if (m->connectedURI)
+            free(m->connectedURI);
+        m->connectedURI = MQTTStrdup(candidates[*winner].serverURI);
+        m->currentServerURI = m->connectedURI;
+        resp.reasonCode = MQTTClient_connected(m, connack);
+        Log(TRACE_MIN, -1, "Client %s connected to serverURI %s in %d ms", m->c->clientID, m->connectedURI,
+            connectTime);
+        if (options->struct_version >= 4) {
+            options->returned.serverURI = serverURIs[*winner];
+            options->returned.MQTTVersion = m->c->MQTTVersion;
+            options->returned.sessionPresent = connack->flags.bits.sessionPresent;
+            options->returned.connectTime = connectTime;
+        }
+        free(connack);
+    }
+    exit:
+    free(candidates);
+    free(fds);
+    free(index);
+    return resp;
+}
+
+/**
+ * Connect to a host name with more than one address the happy eyeballs way (RFC 8305): race
+ * the addresses, alternating address families, rather than letting each one time out in turn.
+ * The address that wins is tried first next time.  A host with one address connects as before.
+ */
+static MQTTResponse MQTTClient_connectAddresses(MQTTClients *m, MQTTClient_connectOptions *options) {
+    Resolver_result addresses;
+    char uris[RESOLVER_MAX_ADDRESSES][INET6_ADDRSTRLEN + 10];
+    char *list[RESOLVER_MAX_ADDRESSES];
+    MQTTResponse resp;
+    int port, i, rc, winner = -1;
+
+    pthread_mutex_unlock(mqttclient_mutex);
+    rc = MQTTProtocol_resolve(m->serverURI, m->websocket, options->connectTimeout * 1000L, &addresses, &port);
+    pthread_mutex_lock(mqttclient_mutex);
+    if (rc != 0 || addresses.count < 2)
+        return MQTTClient_connectURI(m, options, m->serverURI);
+
+    for (i = 0; i < addresses.count; ++i) {
+        char host[INET6_ADDRSTRLEN];
+
+        if (addresses.addr[i].ss_family == AF_INET6) {
+            inet_ntop(AF_INET6, &((struct sockaddr_in6 *) &addresses.addr[i])->sin6_addr, host, sizeof(host));
+            snprintf(uris[i], sizeof(uris[i]), "[%s]:%d", host, port);
+        } else {
+            inet_ntop(AF_INET, &((struct sockaddr_in *) &addresses.addr[i])->sin_addr, host, sizeof(host));
+            snprintf(uris[i], sizeof(uris[i]), "%s:%d", host, port);
+        }
+        list[i] = uris[i];
+    }
+    resp = MQTTClient_connectRace(m, options, list, addresses.count, &winner);
+    if (winner >= 0) {
+        MQTTProtocol_preferAddress(m->serverURI, m->websocket, (struct sockaddr *) &addresses.addr[winner]);
+        m->currentServerURI = m->serverURI; /* reconnect by name, through the cache */
+        if (options->struct_version >= 4)
+            options->returned.serverURI = m->serverURI;
+    }
+    return resp;
+}
 
 MQTTResponse MQTTClient_subscribeMany5(MQTTClient handle, char *const *topic, int *qos) {
     MQTTClients *m = handle;
@@ -368,7 +1359,12 @@ MQTTResponse MQTTClient_subscribeMany5(MQTTClient handle, char *const *topic, in
         ListAppend(topics, topic[i], strlen(topic[i]));
         ListAppend(qoss, &qos[i], sizeof(int));
     }
-    MQTTProtocol_subscribe(m->c, topics, qoss, msgid, 0);
+    for (i = 0; i < topics->count; i++)
+        MQTTClient_addSubscription(m, topic[i], qos[i]);
+    if (m->c->connected) {
+        msgid = MQTTProtocol_assignMsgId(m->c);
+        MQTTProtocol_subscribe(m->c, topics, qoss, msgid, 0);
+    }
     ListFreeNoContent(topics);
     ListFreeNoContent(qoss);
 
@@ -377,6 +1373,27 @@ MQTTResponse MQTTClient_subscribeMany5(MQTTClient handle, char *const *topic, in
     return resp;
 }
 
+/* Remember a subscription so it can be renewed when a reconnect finds no session on the server */
+static void MQTTClient_addSubscription(MQTTClients *m, const char *topic, int qos) {
+    ListElement *current = NULL;
+    MQTTClient_subscription *sub = NULL;
+    size_t len = strlen(topic) + 1;
+
+    while (ListNextElement(m->subscriptions, &current)) {
+        sub = (MQTTClient_subscription *) (current->content);
+        if (strcmp(sub->topic, topic) == 0) {
+            sub->qos = qos;
+            return;
+        }
+    }
+    if ((sub = malloc(sizeof(MQTTClient_subscription) + len)) == NULL)
+        return;
+    sub->topic = (char *) (sub + 1);
+    memcpy(sub->topic, topic, len);
+    sub->qos = qos;
+    ListAppend(m->subscriptions, sub, sizeof(MQTTClient_subscription) + len);
+}
+
 static MQTTResponse MQTTClient_subscribe5(MQTTClient handle, const char *topic, int qos) {
     MQTTResponse rc;
     rc = MQTTClient_subscribeMany5(handle, (char *const *) (&topic), &qos);
@@ -393,60 +1410,628 @@ int MQTTClient_subscribe(MQTTClient handle, const char *topic, int qos) {
     return response.reasonCode;
 }
 
-MQTTResponse
-MQTTClient_publish5(MQTTClient handle, const char *topicName, int payloadlen, const void *payload, int qos,
-                    int retained, MQTTClient_deliveryToken *deliveryToken) {
+static size_t MQTTClient_bufferedSize(Messages *msg) {
+    return strlen(msg->publish->topic) + (size_t) msg->publish->payloadlen;
+}
+
+static void MQTTClient_dropBuffered(Clients *c, Messages *msg) {
+    Log(TRACE_MIN, -1, "Dropping buffered message msgid %d qos %d for client %s", msg->msgid, msg->qos,
+        c->clientID);
+    c->bufferedBytes -= MQTTClient_bufferedSize(msg);
+    MQTTProtocol_removePublication(msg->publish);
+    ListDetachElement(c->bufferedMsgs, &msg->link);
+    Pool_free(POOL_MESSAGES, msg);
+}
+
+/**
+ * Keep a publish made while not connected, making room according to the drop policy.
+ * Takes ownership of the topic and payload of p on success.
+ */
+static int MQTTClient_bufferPublish(MQTTClients *m, Publish *p, int qos, int retained, Messages **mm) {
+    Clients *c = m->c;
+    size_t bytes = strlen(p->topic) + (size_t) p->payloadlen;
+    int rc = MQTTCLIENT_SUCCESS;
+
+    if (m->maxBufferedMessages <= 0 || (m->maxBufferedBytes > 0 && bytes > m->maxBufferedBytes)) {
+        rc = MQTTCLIENT_MAX_BUFFERED_MESSAGES;
+        goto exit;
+    }
+    while (c->bufferedMsgs->count >= m->maxBufferedMessages ||
+           (m->maxBufferedBytes > 0 && c->bufferedBytes + bytes > m->maxBufferedBytes)) {
+        ListElement *victim = NULL;
+
+        if (m->bufferDropPolicy == MQTTCLIENT_BUFFER_DROP_NEWEST) {
+            rc = MQTTCLIENT_MAX_BUFFERED_MESSAGES;
+            goto exit;
+        }
+        if (m->bufferDropPolicy == MQTTCLIENT_BUFFER_DROP_QOS0_FIRST) {
+            while (ListNextElement(c->bufferedMsgs, &victim) && ((Messages *) (victim->content))->qos != 0)
+                ;
+        }
+        if (victim == NULL)
+            victim = c->bufferedMsgs->first;
+        MQTTClient_dropBuffered(c, (Messages *) (victim->content));
+    }
+    if ((*mm = MQTTProtocol_createMessage(p, mm, qos, retained, 0)) == NULL) {
+        rc = PAHO_MEMORY_ERROR;
+        goto exit;
+    }
+    ListAppendNoMalloc(c->bufferedMsgs, *mm, &(*mm)->link, (size_t) (*mm)->len);
+    c->bufferedBytes += bytes;
+    exit:
+    return rc;
+}
+
+/**
+ * Send the messages buffered while disconnected, in order, until they are all written or the
+ * socket stops taking data.  In the second case MQTTClient_writeAvailable resumes the flush.
+ */
+static void MQTTClient_flushBuffered(MQTTClients *m) {
+    Clients *c = m->c;
+    int count = 0;
+
+    while ((c->connected || (m->pipelineConnect && c->connect_state == WAIT_FOR_CONNACK)) &&
+           c->bufferedMsgs->count > 0 && Socket_noPendingWrites(c->net.socket)) {
+        Messages *msg = (Messages *) (c->bufferedMsgs->first->content);
+
+        ListDetachElement(c->bufferedMsgs, &msg->link);
+        c->bufferedBytes -= MQTTClient_bufferedSize(msg);
+        ++count;
+        if (MQTTProtocol_startBufferedPublish(c, msg) == SOCKET_ERROR)
+            break;
+    }
+    if (count > 0)
+        Log(TRACE_MIN, -1, "Sent %d buffered messages for client %s, %d left", count, c->clientID,
+            c->bufferedMsgs->count);
+}
+
+/**
+ * Publish a message, or buffer it while disconnected, taking the payload, which must have been
+ * allocated with malloc.  Any MQTT 5 properties are copied if the message is kept.  Called with
+ * mqttclient_mutex held.
+ */
+static int MQTTClient_publishPayload(MQTTClients *m, const char *topicName, char *payload, int payloadlen, int qos,
+                                     int retained, const MQTTProperties *props,
+                                     MQTTClient_deliveryToken *deliveryToken) {
     int rc = MQTTCLIENT_SUCCESS;
-    MQTTClients *m = handle;
     Messages *msg = NULL;
     Publish *p = NULL;
     int msgid = 0;
-    MQTTResponse resp = MQTTResponse_initializer;
-    pthread_mutex_lock(mqttclient_mutex);
 
+    if (!m->c->connected && !m->sendWhileDisconnected) {
+        rc = MQTTCLIENT_DISCONNECTED;
+        goto exit;
+    }
     if (qos > 0 && (msgid = MQTTProtocol_assignMsgId(m->c)) ==
                    0) {    /* this should never happen as we've waited for spaces in the queue */
         rc = MQTTCLIENT_MAX_MESSAGES_INFLIGHT;
         goto exit;
     }
-    if ((p = malloc(sizeof(Publish))) == NULL) {
+    if ((p = Pool_alloc(POOL_PUBLISH)) == NULL) {
         rc = PAHO_MEMORY_ERROR;
-        goto exit_and_free;
+        goto exit;
     }
-    memset(p->mask, '\0', sizeof(p->mask));
-    p->payload = NULL;
+    memset(p, '\0', sizeof(Publish));
+    p->payload = payload;
     p->payloadlen = payloadlen;
-    if (payloadlen > 0) {
-        if ((p->payload = malloc(payloadlen)) == NULL) {
-            rc = PAHO_MEMORY_ERROR;
-            goto exit_and_free;
-        }
-        memcpy(p->payload, payload, payloadlen);
-    }
+    payload = NULL;
     if ((p->topic = MQTTStrdup(topicName)) == NULL) {
         rc = PAHO_MEMORY_ERROR;
-        goto exit_and_free;
+        goto exit;
     }
     p->msgId = msgid;
-    printf("p->msgId  = %d\n",p->msgId);
     p->MQTTVersion = m->c->MQTTVersion;
-    rc = MQTTProtocol_startPublish(m->c, p, qos, retained, &msg);
-    if (deliveryToken && qos > 0)
+    if (props && p->MQTTVersion >= 5)
+        p->properties = *props;
+    if (!m->c->connected)
+        rc = MQTTClient_bufferPublish(m, p, qos, retained, &msg);
+    else
+        rc = MQTTProtocol_startPublish(m->c, p, qos, retained, &msg);
+    if (deliveryToken && qos > 0 && msg)
         *deliveryToken = msg->msgid;
-    exit_and_free:
+    exit:
     if (p) {
         if (p->topic)
             free(p->topic);
-        if (p->payload)
-            free(p->payload);
-        free(p);
+        payload = p->payload;
+        Pool_free(POOL_PUBLISH, p);
     }
-    exit:
+    free(payload);
+    return rc;
+}
+
+MQTTResponse
+MQTTClient_publish5(MQTTClient handle, const char *topicName, int payloadlen, const void *payload, int qos,
+                    int retained, MQTTClient_deliveryToken *deliveryToken) {
+    MQTTClients *m = handle;
+    char *copy = NULL;
+    MQTTResponse resp = MQTTResponse_initializer;
+
+    if (payloadlen > 0) {
+        if ((copy = malloc(payloadlen)) == NULL) {
+            resp.reasonCode = PAHO_MEMORY_ERROR;
+            return resp;
+        }
+        memcpy(copy, payload, payloadlen);
+    }
+    pthread_mutex_lock(mqttclient_mutex);
+    resp.reasonCode = MQTTClient_publishPayload(m, topicName, copy, payloadlen, qos, retained, NULL, deliveryToken);
     pthread_mutex_unlock(mqttclient_mutex);
-    resp.reasonCode = rc;
     return resp;
 }
 
+/**
+ * Publish a message whose payload is in several buffers, such as a header structure and the
+ * data that follows it.  A QoS 0 message on a plain TCP connection is written straight from the
+ * buffers, and copied only if the socket does not take it all at once.  Otherwise the pieces are
+ * copied once, into the stored payload.
+ * @param handle the client
+ * @param topicName the topic
+ * @param parts the pieces of the payload, which can be reused as soon as the call returns
+ * @param count the number of pieces
+ * @param qos the QoS
+ * @param retained whether the message is retained
+ * @param deliveryToken returns the token of a QoS 1 or 2 message
+ * @return as MQTTClient_publishMessage, or MQTTCLIENT_BAD_QOS for a QoS other than 0, 1 or 2
+ */
+int MQTTClient_publishv(MQTTClient handle, const char *topicName, const struct iovec *parts, int count, int qos,
+                        int retained, MQTTClient_deliveryToken *deliveryToken) {
+    MQTTClients *m = handle;
+    size_t payloadlen = 0;
+    char *payload = NULL;
+    int rc = MQTTCLIENT_SUCCESS, i;
+
+    for (i = 0; i < count; ++i)
+        payloadlen += parts[i].iov_len;
+    if (m == NULL || count < 0 || payloadlen > INT_MAX)
+        return MQTTCLIENT_FAILURE;
+    if (qos < 0 || qos > 2)
+        return MQTTCLIENT_BAD_QOS;
+    pthread_mutex_lock(mqttclient_mutex);
+    if (qos == 0 && m->c->connected && !m->c->net.websocket && count <= IOV_MAX - 4 &&
+        Socket_noPendingWrites(m->c->net.socket)) {
+        Publish p;
+
+        memset(&p, '\0', sizeof(Publish));
+        p.topic = (char *) topicName;
+        p.MQTTVersion = m->c->MQTTVersion;
+        MQTTProtocol_setTopicAlias(m->c, &p);
+        if ((rc = MQTTPacket_send_publishv(&p, parts, count, retained, &m->c->net, m->c->clientID)) ==
+            TCPSOCKET_INTERRUPTED)
+            rc = MQTTCLIENT_SUCCESS; /* the rest has been copied, to be written when the socket drains */
+        goto exit;
+    }
+    pthread_mutex_unlock(mqttclient_mutex);
+    if (payloadlen > 0 && (payload = malloc(payloadlen)) == NULL)
+        return PAHO_MEMORY_ERROR;
+    for (i = 0, payloadlen = 0; i < count; ++i) {
+        memcpy(&payload[payloadlen], parts[i].iov_base, parts[i].iov_len);
+        payloadlen += parts[i].iov_len;
+    }
+    pthread_mutex_lock(mqttclient_mutex);
+    rc = MQTTClient_publishPayload(m, topicName, payload, (int) payloadlen, qos, retained, NULL, deliveryToken);
+    exit:
+    pthread_mutex_unlock(mqttclient_mutex);
+    return rc;
+}
+
+/**
+ * Publish the payload of a message, copied, as MQTTClient_publishMessage does.  Called with
+ * mqttclient_mutex held.
+ */
+static int MQTTClient_publishCopy(MQTTClients *m, const char *topicName, MQTTClient_message *message,
+                                  MQTTClient_deliveryToken *deliveryToken) {
+    char *copy = NULL;
+
+    if (message->payloadlen > 0) {
+        if ((copy = malloc(message->payloadlen)) == NULL)
+            return PAHO_MEMORY_ERROR;
+        memcpy(copy, message->payload, message->payloadlen);
+    }
+    return MQTTClient_publishPayload(m, topicName, copy, message->payloadlen, message->qos, message->retained,
+                                     (message->struct_version >= 1) ? &message->properties : NULL, deliveryToken);
+}
+
+/**
+ * Keep a copy of a QoS 1 or 2 message under a new message id, to be resent until it is
+ * acknowledged, and point p at the copy, which it is then written from.  Called with
+ * mqttclient_mutex held.
+ * @param p the message, with its topic length set
+ * @return MQTTCLIENT_SUCCESS, MQTTCLIENT_MAX_MESSAGES_INFLIGHT or PAHO_MEMORY_ERROR
+ */
+static int MQTTClient_storeOutbound(MQTTClients *m, Publish *p, int qos, int retained,
+                                    MQTTClient_deliveryToken *deliveryToken) {
+    Publish copy = *p;
+    Messages *msg = NULL;
+
+    if ((p->msgId = copy.msgId = MQTTProtocol_assignMsgId(m->c)) == 0)
+        return MQTTCLIENT_MAX_MESSAGES_INFLIGHT;
+    copy.payload = NULL;
+    if ((copy.topic = malloc((size_t) p->topiclen + 1)) == NULL ||
+        (p->payloadlen > 0 && (copy.payload = malloc(p->payloadlen)) == NULL))
+        goto error;
+    memcpy(copy.topic, p->topic, (size_t) p->topiclen + 1);
+    if (p->payloadlen > 0)
+        memcpy(copy.payload, p->payload, p->payloadlen);
+    if ((msg = MQTTProtocol_storeMessage(m->c, &copy, qos, retained)) == NULL)
+        goto error;
+    p->topic = msg->publish->topic;
+    p->payload = msg->publish->payload;
+    if (deliveryToken)
+        *deliveryToken = msg->msgid;
+    return MQTTCLIENT_SUCCESS;
+    error:
+    free(copy.topic);
+    free(copy.payload);
+    return PAHO_MEMORY_ERROR;
+}
+
+/**
+ * Publish several messages, taking the client lock once.  On a plain TCP connection with no
+ * write pending, the message ids are reserved and the packets encoded together, then written
+ * with one writev for each IOV_MAX buffers: QoS 0 payloads straight from the caller's buffers,
+ * QoS 1 and 2 payloads from their stored copies.  Otherwise each message is published, or
+ * buffered while disconnected, as MQTTClient_publishMessage would.
+ * @param handle the client
+ * @param count the number of messages
+ * @param topics the topic of each message
+ * @param messages the messages, whose payloads can be reused as soon as the call returns
+ * @param tokens returns the token of each QoS 1 or 2 message, or NULL
+ * @param results returns the completion code of each message, as MQTTClient_publishMessage, or NULL
+ * @return MQTTCLIENT_SUCCESS if every message was accepted, otherwise the code of the first that was not
+ */
+int MQTTClient_publishBatch(MQTTClient handle, int count, char *const *topics, MQTTClient_message *messages,
+                            MQTTClient_deliveryToken *tokens, int *results) {
+    MQTTClients *m = handle;
+    struct iovec *iovecs = NULL;
+    char *ptr = NULL;
+    int *codes = NULL;
+    size_t headerlen = 0;
+    int rc = MQTTCLIENT_SUCCESS, written = 0, n = 0, i;
+
+    if (m == NULL || count < 0 || (count > 0 && (topics == NULL || messages == NULL)))
+        return MQTTCLIENT_FAILURE;
+    if (count == 0)
+        return MQTTCLIENT_SUCCESS;
+    /* room for the headers as MQTT 5 would encode them, the most they can take */
+    for (i = 0; i < count; ++i) {
+        Publish p;
+
+        memset(&p, '\0', sizeof(Publish));
+        p.MQTTVersion = 5;
+        p.topicAlias = 1;
+        if (messages[i].struct_version >= 1)
+            p.properties = messages[i].properties;
+        headerlen += MQTTPacket_publishHeaderLen(&p, messages[i].qos);
+    }
+    if ((codes = malloc(count * sizeof(int) + (size_t) count * MQTTPACKET_PUBLISH_IOVECS * sizeof(struct iovec) +
+                        headerlen)) == NULL)
+        return PAHO_MEMORY_ERROR;
+    iovecs = (struct iovec *) &codes[count];
+    ptr = (char *) &iovecs[count * MQTTPACKET_PUBLISH_IOVECS];
+
+    pthread_mutex_lock(mqttclient_mutex);
+    if (!m->c->connected || m->c->net.websocket || !Socket_noPendingWrites(m->c->net.socket)) {
+        for (i = 0; i < count; ++i)
+            codes[i] = (topics[i] == NULL) ? MQTTCLIENT_FAILURE :
+                       MQTTClient_publishCopy(m, topics[i], &messages[i], tokens ? &tokens[i] : NULL);
+        goto exit;
+    }
+    for (i = 0; i < count; ++i) {
+        MQTTClient_message *message = &messages[i];
+        Publish p;
+
+        codes[i] = MQTTCLIENT_FAILURE;
+        if (topics[i] == NULL || message->qos < 0 || message->qos > 2 || message->payloadlen < 0)
+            continue;
+        memset(&p, '\0', sizeof(Publish));
+        p.topic = topics[i];
+        p.topiclen = (int) strlen(topics[i]);
+        p.payload = message->payload;
+        p.payloadlen = message->payloadlen;
+        p.MQTTVersion = m->c->MQTTVersion;
+        if (p.MQTTVersion >= 5 && message->struct_version >= 1)
+            p.properties = message->properties;
+        if (message->qos > 0 && (codes[i] = MQTTClient_storeOutbound(m, &p, message->qos, message->retained,
+                                                                     tokens ? &tokens[i] : NULL)) !=
+                                MQTTCLIENT_SUCCESS)
+            continue;
+        if (m->c->topicAliases)
+            p.topicAlias = MQTTTopicAlias_get(m->c->topicAliases, p.topic, (size_t) p.topiclen,
+                                              MQTTTopicAlias_hash(p.topic, (size_t) p.topiclen), &p.aliasOnly);
+        n += MQTTPacket_encodePublish(&p, message->qos, message->retained, ptr, &iovecs[n]);
+        ptr += MQTTPacket_publishHeaderLen(&p, message->qos);
+        codes[i] = MQTTCLIENT_SUCCESS;
+        ++written;
+    }
+    if (written > 0) {
+        int rc1 = Socket_putdatav(m->c->net.socket, iovecs, n);
+
+        /* whatever the socket did not take has been copied, to be written when it drains */
+        if (rc1 == TCPSOCKET_INTERRUPTED)
+            rc1 = MQTTCLIENT_SUCCESS;
+        else if (rc1 != PAHO_MEMORY_ERROR && rc1 != TCPSOCKET_COMPLETE)
+            rc1 = MQTTCLIENT_FAILURE;
+        Log(TRACE_MIN, -1, "Wrote %d of %d messages in %d buffers for client %s, rc %d", written, count, n,
+            m->c->clientID, rc1);
+        /* QoS 1 and 2 messages are stored and will be resent, as by MQTTClient_publishMessage */
+        for (i = 0; rc1 != MQTTCLIENT_SUCCESS && i < count; ++i) {
+            if (codes[i] == MQTTCLIENT_SUCCESS && messages[i].qos == 0)
+                codes[i] = rc1;
+        }
+    }
+    exit:
+    pthread_mutex_unlock(mqttclient_mutex);
+    for (i = 0; i < count; ++i) {
+        if (results)
+            results[i] = codes[i];
+        if (rc == MQTTCLIENT_SUCCESS)
+            rc = codes[i];
+    }
+    free(codes);
+    return rc;
+}
+
+/**
+ * Prepare a topic to be published to many times with MQTTClient_publishTopic.  The topic is
+ * checked, measured and hashed once, here, so that a publish does no work on it.  On an MQTT 5
+ * connection whose server takes topic aliases, the alias table is searched with the stored hash,
+ * and once the topic is bound only its alias is sent.
+ * @param handle the client
+ * @param topicName the topic, which is copied
+ * @param topic returns the prepared topic, to be freed with MQTTClient_freeTopic
+ * @return MQTTCLIENT_SUCCESS, MQTTCLIENT_BAD_UTF8_STRING, MQTTCLIENT_FAILURE for a topic that
+ * cannot be published to, or PAHO_MEMORY_ERROR
+ */
+int MQTTClient_prepareTopic(MQTTClient handle, const char *topicName, MQTTClient_topic *topic) {
+    MQTTClient_preparedTopic *t = NULL;
+    size_t len = 0;
+
+    if (handle == NULL || topicName == NULL || topic == NULL || (len = strlen(topicName)) == 0 || len > 65535 ||
+        strpbrk(topicName, "+#") != NULL)
+        return MQTTCLIENT_FAILURE;
+    if (!UTF8_validate((int) len, topicName))
+        return MQTTCLIENT_BAD_UTF8_STRING;
+    if ((t = malloc(sizeof(MQTTClient_preparedTopic) + len + 1)) == NULL)
+        return PAHO_MEMORY_ERROR;
+    memset(t, '\0', sizeof(MQTTClient_preparedTopic));
+    t->client = handle;
+    t->topic = (char *) (t + 1);
+    memcpy(t->topic, topicName, len + 1);
+    t->topiclen = (int) len;
+    t->hash = MQTTTopicAlias_hash(t->topic, len);
+    *topic = t;
+    return MQTTCLIENT_SUCCESS;
+}
+
+/**
+ * Set the MQTT 5 properties sent with every message to a prepared topic, such as user properties
+ * that say where the messages come from.  They are encoded once, here, and each message is
+ * written with the encoded block as it is.
+ * @param topic the prepared topic
+ * @param props the properties, which are copied, or NULL for none
+ * @return MQTTCLIENT_SUCCESS, or PAHO_MEMORY_ERROR
+ */
+int MQTTClient_setTopicProperties(MQTTClient_topic topic, const MQTTProperties *props) {
+    MQTTClient_preparedTopic *t = topic;
+    MQTTProperties copy = MQTTProperties_initializer;
+    MQTTPropertyBlock block = {NULL, 0};
+    int rc = MQTTCLIENT_SUCCESS;
+
+    if (t == NULL)
+        return MQTTCLIENT_FAILURE;
+    if (props && props->count > 0) {
+        copy = MQTTProperties_copy(props);
+        if (copy.length != props->length || (rc = MQTTProperties_encodeBlock(&copy, &block)) != 0) {
+            MQTTProperties_free(&copy);
+            return PAHO_MEMORY_ERROR;
+        }
+    }
+    pthread_mutex_lock(mqttclient_mutex);
+    MQTTProperties_free(&t->properties);
+    MQTTProperties_freeBlock(&t->block);
+    t->properties = copy;
+    t->block = block;
+    pthread_mutex_unlock(mqttclient_mutex);
+    return rc;
+}
+
+/**
+ * Free a prepared topic.  Any alias it was sent with stays bound until the connection's alias
+ * table needs it for another topic.
+ */
+void MQTTClient_freeTopic(MQTTClient_topic *topic) {
+    if (topic && *topic) {
+        MQTTProperties_free(&(*topic)->properties);
+        MQTTProperties_freeBlock(&(*topic)->block);
+        free(*topic);
+        *topic = NULL;
+    }
+}
+
+/**
+ * Publish a message to a prepared topic.  On a plain TCP connection with no write pending, the
+ * packet is encoded on the stack and written in one writev, with the topic, or only its alias,
+ * and a QoS 0 payload straight from where they are.  A QoS 1 or 2 message still keeps its own
+ * copy of the topic and payload, to be resent in full.  Otherwise the message is published, or
+ * buffered while disconnected, as MQTTClient_publishMessage would.
+ * @param handle the client
+ * @param topic the topic, prepared for this client
+ * @param payloadlen the length of the payload
+ * @param payload the payload, which can be reused as soon as the call returns
+ * @param qos the QoS
+ * @param retained whether the message is retained
+ * @param deliveryToken returns the token of a QoS 1 or 2 message
+ * @return as MQTTClient_publishMessage
+ */
+int MQTTClient_publishTopic(MQTTClient handle, MQTTClient_topic topic, int payloadlen, const void *payload, int qos,
+                            int retained, MQTTClient_deliveryToken *deliveryToken) {
+    MQTTClients *m = handle;
+    MQTTClient_preparedTopic *t = topic;
+    struct iovec iovecs[MQTTPACKET_PUBLISH_IOVECS];
+    char header[16];
+    Publish p;
+    int rc = MQTTCLIENT_SUCCESS, n;
+
+    if (m == NULL || t == NULL || t->client != handle || payloadlen < 0 || qos < 0 || qos > 2)
+        return MQTTCLIENT_FAILURE;
+    pthread_mutex_lock(mqttclient_mutex);
+    if (!m->c->connected || m->c->net.websocket || !Socket_noPendingWrites(m->c->net.socket)) {
+        char *copy = NULL;
+
+        if (payloadlen > 0) {
+            if ((copy = malloc(payloadlen)) == NULL) {
+                rc = PAHO_MEMORY_ERROR;
+                goto exit;
+            }
+            memcpy(copy, payload, payloadlen);
+        }
+        rc = MQTTClient_publishPayload(m, t->topic, copy, payloadlen, qos, retained, &t->properties, deliveryToken);
+        goto exit;
+    }
+    memset(&p, '\0', sizeof(Publish));
+    p.topic = t->topic;
+    p.topiclen = t->topiclen;
+    p.payload = (char *) payload;
+    p.payloadlen = payloadlen;
+    p.MQTTVersion = m->c->MQTTVersion;
+    if (p.MQTTVersion >= 5 && t->block.length > 0) {
+        p.properties = t->properties; /* copied if the message is kept, for a resend */
+        p.propBlock = &t->block;
+    }
+    if (qos > 0 && (rc = MQTTClient_storeOutbound(m, &p, qos, retained, deliveryToken)) != MQTTCLIENT_SUCCESS)
+        goto exit;
+    if (m->c->topicAliases)
+        p.topicAlias = MQTTTopicAlias_get(m->c->topicAliases, t->topic, (size_t) t->topiclen, t->hash, &p.aliasOnly);
+    n = MQTTPacket_encodePublish(&p, qos, retained, header, iovecs);
+    /* whatever the socket does not take is copied, to be written when it drains */
+    if ((rc = Socket_putdatav(m->c->net.socket, iovecs, n)) == TCPSOCKET_INTERRUPTED)
+        rc = TCPSOCKET_COMPLETE;
+    if (rc != TCPSOCKET_COMPLETE && rc != PAHO_MEMORY_ERROR)
+        rc = MQTTCLIENT_FAILURE;
+    if (qos == 0)
+        Log(LOG_PROTOCOL, 27, NULL, m->c->net.socket, m->c->clientID, retained, rc, payloadlen,
+            min(20, payloadlen), payload);
+    else
+        Log(LOG_PROTOCOL, 10, NULL, m->c->net.socket, m->c->clientID, p.msgId, qos, retained, rc, payloadlen,
+            min(20, payloadlen), payload);
+    exit:
+    pthread_mutex_unlock(mqttclient_mutex);
+    return rc;
+}
+
+/**
+ * Publish a message whose payload is read from a file or a callback as it is written, so that a
+ * payload of any size takes a small, fixed amount of memory.  The header is written first, then
+ * the payload: from a file over plain TCP with sendfile, otherwise a piece at a time.  The call
+ * returns once the whole packet has been written.  The client is not locked during the write,
+ * but its socket counts as having a pending write, so other writes wait or are queued while
+ * what arrives is still read; the client must not be destroyed until the call returns.
+ * A QoS 1 or 2 message is resent from the same source, which must stay valid until the message
+ * is delivered; it is not persisted.
+ * @param handle the client
+ * @param topicName the topic
+ * @param source where the payload is read from, copied for QoS 1 and 2
+ * @param qos the QoS
+ * @param retained whether the message is retained
+ * @param deliveryToken returns the token of a QoS 1 or 2 message
+ * @return MQTTCLIENT_SUCCESS, MQTTCLIENT_DISCONNECTED, or MQTTCLIENT_FAILURE if an earlier write
+ * did not finish within the command timeout or this one failed, in which case the connection
+ * is closed
+ */
+int MQTTClient_publishSource(MQTTClient handle, const char *topicName, MQTTClient_payloadSource *source,
+                             int qos, int retained, MQTTClient_deliveryToken *deliveryToken) {
+    int rc = MQTTCLIENT_SUCCESS;
+    MQTTClients *m = handle;
+    Messages *msg = NULL;
+    Publish p;
+    networkHandles net;
+    char *clientID = NULL;
+    SOCKET sock = 0;
+    struct timeval start = MQTTTime_start_clock();
+
+    pthread_mutex_lock(mqttclient_mutex);
+    if (m == NULL || source == NULL || (source->fd < 0 && source->read == NULL)) {
+        rc = MQTTCLIENT_FAILURE;
+        goto exit;
+    }
+    /* the packet is written past the pending write machinery, so let any pending write finish first */
+    while (m->c->connected && !Socket_noPendingWrites(m->c->net.socket)) {
+        if (MQTTTime_elapsed(start) > m->commandTimeout) {
+            rc = MQTTCLIENT_FAILURE;
+            goto exit;
+        }
+        pthread_mutex_unlock(mqttclient_mutex);
+        if (running)
+            MQTTTime_sleep(10L);
+        else {
+            SOCKET ready = 0;
+            int rc1 = 0;
+            MQTTPacket *pack = MQTTClient_cycle(&ready, 10L, &rc1);
+
+            if (pack)
+                MQTTClient_handOver(ready, pack);
+        }
+        pthread_mutex_lock(mqttclient_mutex);
+    }
+    if (!m->c->connected) {
+        rc = MQTTCLIENT_DISCONNECTED;
+        goto exit;
+    }
+    memset(&p, '\0', sizeof(Publish));
+    if (qos > 0 && (p.msgId = MQTTProtocol_assignMsgId(m->c)) == 0) {
+        rc = MQTTCLIENT_MAX_MESSAGES_INFLIGHT;
+        goto exit;
+    }
+    if ((p.topic = MQTTStrdup(topicName)) == NULL || (clientID = MQTTStrdup(m->c->clientID)) == NULL) {
+        free(p.topic);
+        rc = PAHO_MEMORY_ERROR;
+        goto exit;
+    }
+    p.topiclen = (int) strlen(topicName);
+    p.MQTTVersion = m->c->MQTTVersion;
+    if ((rc = MQTTProtocol_prepareSourcePublish(m->c, &p, source, qos, retained, &msg)) != 0) {
+        free(p.topic);
+        goto exit;
+    }
+    net = m->c->net; /* the write uses only the socket, which is not closed until it is no longer busy */
+    sock = net.socket;
+    if ((rc = Socket_setBusy(sock)) != 0) {
+        if (qos == 0)
+            free(p.topic);
+        else { /* forget the stored message, which was never written */
+            ListDetachElement(m->c->outboundMsgs, &msg->link);
+#if !defined(NO_PERSISTENCE)
+            if (m->c->persistence)
+                MQTTPersistence_remove(m->c, PERSISTENCE_OUTBOUND, (unsigned int) msg->msgid);
+#endif
+            MQTTProtocol_removePublication(msg->publish);
+            Pool_free(POOL_MESSAGES, msg);
+        }
+        goto exit;
+    }
+    if (qos > 0 && deliveryToken)
+        *deliveryToken = msg->msgid;
+    pthread_mutex_unlock(mqttclient_mutex);
+
+    rc = MQTTPacket_send_publishSource(&p, source, 0, qos, retained, &net, clientID);
+
+    pthread_mutex_lock(mqttclient_mutex);
+    Socket_clearBusy(sock);
+    if (rc != TCPSOCKET_COMPLETE) {
+        rc = MQTTCLIENT_FAILURE;
+        if (m->c->net.socket == sock)
+            MQTTClient_disconnect_internal(m, "payload write failed");
+    } else if (m->c->connected)
+        MQTTClient_resume(m); /* what was held back by the write */
+    if (qos == 0)
+        free(p.topic); /* a QoS 1 or 2 message points at its stored topic */
+    exit:
+    pthread_mutex_unlock(mqttclient_mutex);
+    free(clientID);
+    return rc;
+}
+
 MQTTResponse MQTTClient_publishMessage5(MQTTClient handle, const char *topicName, MQTTClient_message *message,
                                                MQTTClient_deliveryToken *deliveryToken) {
     MQTTResponse rc = MQTTResponse_initializer;
@@ -469,27 +2054,43 @@ static MQTTPacket *MQTTClient_cycle(SOCKET *sock, uint64_t timeout, int *rc) {
     int rc1 = 0;
     struct timeval start;
     start = MQTTTime_start_clock();
-    *sock = Socket_getReadySocket(0, (int) timeout, socket_mutex, rc);
+    *sock = Socket_getReadySocket(0, (int) timeout, socket_mutex, &rc1);
     *rc = rc1;
     if (*sock == 0 && timeout >= 100L && MQTTTime_elapsed(start) < (int64_t) 10)
         MQTTTime_sleep(100L);
     pthread_mutex_lock(mqttclient_mutex);
     MQTTClients *m = NULL;
-    if (ListFindItem(handles, sock, clientSockCompare) != NULL)
+    if (*sock > 0 && ListFindItem(handles, sock, clientSockCompare) != NULL)
         m = (MQTTClient) (handles->current->content);
     if (m != NULL) {
         if (m->c->connect_state == TCP_IN_PROGRESS)
             *rc = 0;  /* waiting for connect state to clear */
-        else {
+        else if (m->c->connect_state == WEBSOCKET_IN_PROGRESS) {
+            if ((*rc = MQTTProtocol_upgrade(m->c)) == 0 && m->c->connect_state == WAIT_FOR_CONNACK)
+                MQTTClient_pipeline(m);
+        } else {
             pack = MQTTPacket_Factory(m->c->MQTTVersion, &m->c->net, rc);
             if (*rc == TCPSOCKET_INTERRUPTED)
                 *rc = 0;
         }
     }
+    if (pack && m && pack->header.bits.type == PUBLISH && ((Publish *) pack)->offset == 0 &&
+        MQTTProtocol_resolveTopicAlias(m->c, (Publish *) pack) != 0) {
+        if (m->c->net.stream == (Publish *) pack)
+            MQTTPacket_endStream(&m->c->net);
+        else
+            MQTTPacket_freePublish((Publish *) pack);
+        pack = NULL;
+        *rc = SOCKET_ERROR;
+    }
     if (pack) {
         int freed = 1;
         /* Note that these handle... functions free the packet structure that they are dealing with */
-        if (pack->header.bits.type == PUBLISH)
+        if (pack->header.bits.type == PUBLISH && ((Publish *) pack)->total > 0) {
+            if (m && MQTTProtocol_wantPublishPart(m->c, (Publish *) pack) && m->pa)
+                MQTTClient_deliverPart(m, (Publish *) pack);
+            *rc = MQTTProtocol_handlePublishPart(pack, *sock);
+        } else if (pack->header.bits.type == PUBLISH)
             *rc = MQTTProtocol_handlePublishes(pack, *sock);
         else if (pack->header.bits.type == PUBACK) {
             int msgid;
@@ -500,7 +2101,9 @@ static MQTTPacket *MQTTClient_cycle(SOCKET *sock, uint64_t timeout, int *rc) {
                 Log(TRACE_MIN, -1, "Calling deliveryComplete for client %s, msgid %d", m->c->clientID, msgid);
                 (*(m->dc))(m->context, msgid);
             }
-        } else
+        } else if (pack->header.bits.type == PUBREL)
+            *rc = MQTTProtocol_handlePubrels(pack, *sock);
+        else
             freed = 0;
         if (freed)
             pack = NULL;
@@ -509,6 +2112,42 @@ static MQTTPacket *MQTTClient_cycle(SOCKET *sock, uint64_t timeout, int *rc) {
     return pack;
 }
 
+/* Give a part of a streamed message to the application, straight from the socket buffer */
+static void MQTTClient_deliverPart(MQTTClients *m, Publish *publish) {
+    MQTTClient_messagePart part;
+
+    part.msgid = publish->msgId;
+    part.qos = publish->header.bits.qos;
+    part.retained = publish->header.bits.retain;
+    part.dup = publish->header.bits.dup;
+    part.total = publish->total;
+    part.offset = publish->offset;
+    part.data = publish->payload;
+    part.len = (size_t) publish->payloadlen;
+    Log(TRACE_MIN, -1, "Calling partArrived for client %s, msgid %d, %d bytes at %d of %d", m->c->clientID,
+        part.msgid, (int) part.len, (int) part.offset, (int) part.total);
+    (*(m->pa))(m->context, publish->topic, (strlen(publish->topic) == (size_t) publish->topiclen) ? 0 :
+                                          publish->topiclen, &part);
+}
+
+/*
+ * Give a packet read by MQTTClient_cycle without the run thread to the client it came for, for its
+ * MQTTClient_waitfor to take.  Publications are handled as they are read, so this is one of the
+ * acknowledgements that a call waits for.
+ */
+static void MQTTClient_handOver(SOCKET sock, MQTTPacket *pack) {
+    MQTTClients *m = NULL;
+
+    pthread_mutex_lock(mqttclient_mutex);
+    if (ListFindItem(handles, &sock, clientSockCompare) != NULL)
+        m = (MQTTClient) (handles->current->content);
+    if (m && m->pack == NULL)
+        m->pack = pack;
+    else
+        MQTTPacket_free(pack);
+    pthread_mutex_unlock(mqttclient_mutex);
+}
+
 static MQTTPacket *MQTTClient_waitfor(MQTTClient handle, int packet_type, int *rc, int64_t timeout) {
     MQTTPacket *pack = NULL;
     MQTTClients *m = handle;
@@ -529,13 +2168,25 @@ static MQTTPacket *MQTTClient_waitfor(MQTTClient handle, int packet_type, int *r
         pack = m->pack;
     } else {
         *rc = TCPSOCKET_COMPLETE;
+        pthread_mutex_lock(mqttclient_mutex);
+        if (m->pack && m->pack->header.bits.type == packet_type) { /* read by another caller for this one */
+            pack = m->pack;
+            m->pack = NULL;
+        }
+        pthread_mutex_unlock(mqttclient_mutex);
+        if (pack)
+            goto exit;
         while (1) {
             SOCKET sock = -1;
             pack = MQTTClient_cycle(&sock, 100L, rc);
+            if (pack && (sock != m->c->net.socket || pack->header.bits.type != packet_type)) {
+                MQTTClient_handOver(sock, pack);
+                pack = NULL;
+            }
             if (sock == m->c->net.socket) {
                 if (*rc == SOCKET_ERROR)
                     break;
-                if (pack && (pack->header.bits.type == packet_type))
+                if (pack)
                     break;
                 if (m->c->connect_state == TCP_IN_PROGRESS) {
                     int error;
@@ -544,7 +2195,8 @@ static MQTTPacket *MQTTClient_waitfor(MQTTClient handle, int packet_type, int *r
                     if ((*rc = getsockopt(m->c->net.socket, SOL_SOCKET, SO_ERROR, (char *) &error, &len)) == 0)
                         *rc = error;
                     break;
-                } else if (m->c->connect_state == WAIT_FOR_CONNACK) {
+                } else if (m->c->connect_state == WAIT_FOR_CONNACK ||
+                           m->c->connect_state == WEBSOCKET_IN_PROGRESS) {
                     int error;
                     socklen_t len = sizeof(error);
                     if (getsockopt(m->c->net.socket, SOL_SOCKET, SO_ERROR, (char *) &error, &len) == 0) {
@@ -567,13 +2219,25 @@ static MQTTPacket *MQTTClient_waitfor(MQTTClient handle, int packet_type, int *r
 
 void MQTTClient_destroy(MQTTClient *handle) {
     MQTTClients *m = *handle;
-    pthread_mutex_lock(connect_mutex);
-    pthread_mutex_lock(mqttclient_mutex);
+    pthread_mutex_t *client_connect_mutex = NULL;
+
     if (m == NULL)
-        goto exit;
+        return;
+    client_connect_mutex = m->connect_mutex;
+    pthread_mutex_lock(client_connect_mutex); /* wait for any connect of this client to finish */
+    pthread_mutex_lock(mqttclient_mutex);
+    if (bstate->clients->count == 1) /* the last client: the run thread must not touch it once freed */
+        MQTTClient_stop();
+    m->reconnecting = 0;
     if (m->c) {
         SOCKET saved_socket = m->c->net.socket;
         char *saved_clientid = MQTTStrdup(m->c->clientID);
+
+        if (saved_socket > 0)
+            Socket_close(saved_socket);
+#if !defined(NO_PERSISTENCE)
+        MQTTPersistence_close(m->c);
+#endif
         MQTTProtocol_freeClient(m->c);
         if (!ListRemove(bstate->clients, m->c))
             Log(LOG_ERROR, 0, NULL);
@@ -583,6 +2247,9 @@ void MQTTClient_destroy(MQTTClient *handle) {
     }
     if (m->serverURI)
         free(m->serverURI);
+    if (m->connectedURI)
+        free(m->connectedURI);
+    ListFree(m->subscriptions);
     Thread_destroy_sem(m->connect_sem);
     Thread_destroy_sem(m->connack_sem);
     Thread_destroy_sem(m->suback_sem);
@@ -591,9 +2258,8 @@ void MQTTClient_destroy(MQTTClient *handle) {
     *handle = NULL;
     if (bstate->clients->count == 0)
         MQTTClient_terminate();
-
-    exit:
     pthread_mutex_unlock(mqttclient_mutex);
-    pthread_mutex_unlock(connect_mutex);
+    pthread_mutex_unlock(client_connect_mutex);
+    Thread_destroy_mutex(client_connect_mutex);
 }
 
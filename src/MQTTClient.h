@@ -6,21 +6,65 @@
 #define MQTT_CLIENT_MQTTCLIENT_H
 
 #include <stdio.h>
+#include <sys/uio.h>
 #include "utils/TypeDefine.h"
 #include "MQTTProperties.h"
+#include "utils/Pool.h"
+#include "utils/SocketBuffer.h"
 
 extern MQTTClient_nameValue *MQTTClient_getVersionInfo(void);
 
+extern int MQTTClient_getPoolStats(Pool_stats *stats, int count);
+
+extern int MQTTClient_getStoredPublications(size_t *bytes);
+
+extern void MQTTClient_setBufferLimits(size_t budget, size_t keepSize, int idleTimeout);
+
+extern void MQTTClient_getBufferStats(SocketBuffer_stats *stats);
+
 extern int MQTTClient_setCallbacks(MQTTClient handle, void *context, MQTTClient_connectionLost *cl,
                                    MQTTClient_messageArrived *ma, MQTTClient_deliveryComplete *dc);
 
+extern int MQTTClient_setStreamCallback(MQTTClient handle, size_t threshold, MQTTClient_partArrived *pa);
+
+extern int MQTTClient_setMaxPacketSize(MQTTClient handle, size_t maxPacketSize);
+
+extern int MQTTClient_setTopicAliases(MQTTClient handle, int maximum);
+
+extern int MQTTClient_setWebSocketDeflate(MQTTClient handle, const MQTTClient_deflateOptions *options);
+
 extern int MQTTClient_create(MQTTClient *handle, const char *serverURI, const char *clientId);
 
+extern int MQTTClient_createWithOptions(MQTTClient *handle, const char *serverURI, const char *clientId,
+                                        int persistence_type, void *persistence_context,
+                                        MQTTClient_createOptions *options);
+
 extern int MQTTClient_connect(MQTTClient handle, MQTTClient_connectOptions *options);
 
+extern int MQTTClient_connectMany(MQTTClient *clients, int count, MQTTClient_connectOptions *options,
+                                  int maxInProgress, MQTTClient_connectComplete *complete, void *context);
+
 extern int MQTTClient_publishMessage(MQTTClient handle, const char *topicName, MQTTClient_message *msg,
                                      MQTTClient_deliveryToken *dt);
 
+extern int MQTTClient_publishv(MQTTClient handle, const char *topicName, const struct iovec *parts, int count,
+                               int qos, int retained, MQTTClient_deliveryToken *dt);
+
+extern int MQTTClient_publishBatch(MQTTClient handle, int count, char *const *topics, MQTTClient_message *messages,
+                                   MQTTClient_deliveryToken *tokens, int *results);
+
+extern int MQTTClient_prepareTopic(MQTTClient handle, const char *topicName, MQTTClient_topic *topic);
+
+extern int MQTTClient_publishTopic(MQTTClient handle, MQTTClient_topic topic, int payloadlen, const void *payload,
+                                   int qos, int retained, MQTTClient_deliveryToken *dt);
+
+extern int MQTTClient_setTopicProperties(MQTTClient_topic topic, const MQTTProperties *props);
+
+extern void MQTTClient_freeTopic(MQTTClient_topic *topic);
+
+extern int MQTTClient_publishSource(MQTTClient handle, const char *topicName, MQTTClient_payloadSource *source,
+                                    int qos, int retained, MQTTClient_deliveryToken *dt);
+
 extern int MQTTClient_subscribe(MQTTClient handle, const char *topic, int qos);
 
 
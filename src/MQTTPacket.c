@@ -6,6 +6,8 @@
 #include "Log.h"
 #include "WebSocket.h"
 #include "MQTTTime.h"
+#include "Pool.h"
+#include "MQTTTopicAlias.h"
 #include <string.h>
 
 
@@ -32,9 +34,100 @@ pf new_packets[] =
 
 
 static char* readUTFlen(char** pptr, const char* enddata, int* len);
-static int MQTTPacket_send_ack(int msgid, networkHandles *net);
+static int MQTTPacket_send_ack(int type, int msgid, networkHandles *net);
 
 
+/* Read the first part of a streamed PUBLISH, which must hold the whole variable header */
+static void* MQTTPacket_startStream(int MQTTVersion, networkHandles* net, unsigned char aHeader,
+                                    size_t remaining_length, int* error)
+{
+    size_t bytes = min(remaining_length, MQTTPACKET_STREAM_PART);
+    size_t actual_len = 0;
+    char* data = NULL;
+    Publish* pack = NULL;
+
+    if ((data = Socket_getdata(net->socket, bytes, &actual_len, error)) == NULL)
+    {
+        *error = SOCKET_ERROR;
+        goto exit;
+    }
+    if (actual_len < bytes)
+    {
+        *error = TCPSOCKET_INTERRUPTED;
+        goto exit;
+    }
+    *error = TCPSOCKET_COMPLETE;
+    if ((pack = MQTTPacket_publish(MQTTVersion, aHeader, data, bytes)) == NULL)
+    {
+        *error = SOCKET_ERROR;
+        Log(LOG_ERROR, -1, "Bad MQTT packet, the header of a streamed PUBLISH must be in its first %d bytes",
+            (int)bytes);
+        goto exit;
+    }
+    pack->total = remaining_length - (size_t)(pack->payload - data);
+    pack->offset = 0;
+    if ((size_t)pack->payloadlen < pack->total)
+        net->stream = pack;
+    exit:
+    return pack;
+}
+
+
+/* Read the next part of the streamed PUBLISH in progress */
+static void* MQTTPacket_streamPart(networkHandles* net, int* error)
+{
+    Publish* pack = net->stream;
+    size_t offset = pack->offset + (size_t)pack->payloadlen;
+    size_t bytes = min(pack->total - offset, MQTTPACKET_STREAM_PART);
+    size_t actual_len = 0;
+    char* data = NULL;
+
+    if ((data = Socket_getdata(net->socket, bytes, &actual_len, error)) == NULL)
+    {
+        *error = SOCKET_ERROR;
+        return NULL;
+    }
+    if (actual_len < bytes)
+    {
+        *error = TCPSOCKET_INTERRUPTED;
+        return NULL;
+    }
+    *error = TCPSOCKET_COMPLETE;
+    pack->offset = offset;
+    pack->payload = data;
+    pack->payloadlen = (int)bytes;
+    if (offset + bytes == pack->total)
+        net->stream = NULL; /* the last part: the packet is now the reader's to free */
+    return pack;
+}
+
+
+/**
+ * Free the streamed PUBLISH in progress on a connection, if any, when the connection is closed
+ * @param net the network handle of the connection
+ */
+void MQTTPacket_endStream(networkHandles* net)
+{
+    if (net->stream)
+    {
+        Log(TRACE_MIN, -1, "Streamed PUBLISH msgid %d ended after %d of %d bytes", net->stream->msgId,
+            (int)(net->stream->offset + (size_t)net->stream->payloadlen), (int)net->stream->total);
+        MQTTPacket_freePublish(net->stream);
+        net->stream = NULL;
+    }
+}
+
+
+/**
+ * Read the next packet from a connection.  A PUBLISH larger than the connection's stream
+ * threshold is returned in parts as they are read, each with total set: the packet is the
+ * connection's, and is returned again for each part, until the last.
+ * @param MQTTVersion the MQTT version of the connection
+ * @param net the network handle of the connection
+ * @param error returns TCPSOCKET_COMPLETE, TCPSOCKET_INTERRUPTED if the packet is not all there
+ * yet, or SOCKET_ERROR
+ * @return the packet, or NULL
+ */
 void* MQTTPacket_Factory(int MQTTVersion, networkHandles* net, int* error)
 {
     char* data = NULL;
@@ -46,7 +139,13 @@ void* MQTTPacket_Factory(int MQTTVersion, networkHandles* net, int* error)
 
     *error = SOCKET_ERROR;  /* indicate whether an error occurred, or not */
 
-    const size_t headerWsFramePos = WebSocket_framePos();
+    if (net->stream)
+    {
+        pack = MQTTPacket_streamPart(net, error);
+        goto exit;
+    }
+
+    WebSocket_packetStart(net);
 
     /* read the packet data from the socket */
     *error = WebSocket_getch(net, &header.byte);
@@ -57,6 +156,21 @@ void* MQTTPacket_Factory(int MQTTVersion, networkHandles* net, int* error)
     if ((*error = MQTTPacket_decode(net, &remaining_length)) != TCPSOCKET_COMPLETE)
         goto exit; /* packet not read, *error indicates whether SOCKET_ERROR occurred */
 
+    if (net->maxPacketSize > 0 && remaining_length > net->maxPacketSize)
+    {
+        Log(LOG_ERROR, -1, "A %d byte packet on socket %d is over the maximum packet size of %d bytes",
+            (int)remaining_length, net->socket, (int)net->maxPacketSize);
+        *error = SOCKET_ERROR;
+        goto exit;
+    }
+
+    if (header.bits.type == PUBLISH && net->streamThreshold > 0 && remaining_length > net->streamThreshold &&
+        !net->websocket)
+    {
+        pack = MQTTPacket_startStream(MQTTVersion, net, header.byte, remaining_length, error);
+        goto exit;
+    }
+
     /* now read the rest, the variable header and payload */
     data = WebSocket_getdata(net, remaining_length, &actual_len);
     if (remaining_length && data == NULL)
@@ -84,11 +198,11 @@ void* MQTTPacket_Factory(int MQTTVersion, networkHandles* net, int* error)
             }
         }
     }
+    exit:
     if (pack)
         net->lastReceived = MQTTTime_now();
-    exit:
     if (*error == TCPSOCKET_INTERRUPTED)
-        WebSocket_framePosSeekTo(headerWsFramePos);
+        WebSocket_packetRewind(net);
 
     return pack;
 }
@@ -114,7 +228,6 @@ int MQTTPacket_send(networkHandles *net, Header header, char *buffer, size_t buf
     packetbufs.buffers = &buffer;
     packetbufs.buflens = &buflen;
     packetbufs.frees = &freeData;
-    memset(packetbufs.mask, '\0', sizeof(packetbufs.mask));
     rc = WebSocket_putdatas(net, &buf, &buf0len, &packetbufs);
 
     if (rc == TCPSOCKET_COMPLETE)
@@ -268,14 +381,16 @@ void* MQTTPacket_publish(int MQTTVersion, unsigned char aHeader, char* data, siz
     Publish* pack = NULL;
     char* curdata = data;
     char* enddata = &data[datalen];
-    if ((pack = malloc(sizeof(Publish))) == NULL)
+    if ((pack = Pool_alloc(POOL_PUBLISH)) == NULL)
         goto exit;
     memset(pack, '\0', sizeof(Publish));
     pack->MQTTVersion = MQTTVersion;
     pack->header.byte = aHeader;
-    if ((pack->topic = readUTFlen(&curdata, enddata, &pack->topiclen)) == NULL) /* Topic name on which to publish */
+    if (MQTTVersion >= 5 && enddata - curdata >= 2 && curdata[0] == 0 && curdata[1] == 0)
+        curdata += 2; /* no topic: it is resolved from the topic alias, without allocating */
+    else if ((pack->topic = readUTFlen(&curdata, enddata, &pack->topiclen)) == NULL) /* Topic name on which to publish */
     {
-        free(pack);
+        Pool_free(POOL_PUBLISH, pack);
         pack = NULL;
         goto exit;
     }
@@ -283,7 +398,7 @@ void* MQTTPacket_publish(int MQTTVersion, unsigned char aHeader, char* data, siz
     {
         if (enddata - curdata < 2)  /* Is there enough data for the msgid? */
         {
-            free(pack);
+            MQTTPacket_freePublish(pack);
             pack = NULL;
             goto exit;
         }
@@ -291,6 +406,17 @@ void* MQTTPacket_publish(int MQTTVersion, unsigned char aHeader, char* data, siz
     }
     else
         pack->msgId = 0;
+    if (MQTTVersion >= 5)
+    {
+        if (MQTTProperties_index(&pack->propIndex, &curdata, enddata) != 0 ||
+            ((pack->topicAlias = (int)MQTTProperties_getInt(&pack->propIndex, MQTTPROPERTY_CODE_TOPIC_ALIAS, 0)) == 0 &&
+             pack->topic == NULL))
+        {
+            MQTTPacket_freePublish(pack);
+            pack = NULL;
+            goto exit;
+        }
+    }
     pack->payload = curdata;
     pack->payloadlen = (int)(datalen-(curdata-data));
     exit:
@@ -301,10 +427,30 @@ void MQTTPacket_freePublish(Publish* pack)
 {
     if (pack->topic != NULL)
         free(pack->topic);
-    free(pack);
+    Pool_free(POOL_PUBLISH, pack);
+}
+
+/**
+ * Free a packet returned by MQTTPacket_Factory, whichever type it is
+ * @param pack the packet
+ */
+void MQTTPacket_free(MQTTPacket *pack)
+{
+    int ptype = pack->header.bits.type;
+
+    if (ptype == PUBLISH)
+        MQTTPacket_freePublish((Publish *) pack);
+    else if (new_packets[ptype] == MQTTPacket_ack)
+        Pool_free(POOL_ACK, pack);
+    else
+    {
+        if (ptype == SUBACK)
+            ListFree(((Suback *) pack)->qoss);
+        free(pack);
+    }
 }
 
-static int MQTTPacket_send_ack(int msgid, networkHandles *net)
+static int MQTTPacket_send_ack(int type, int msgid, networkHandles *net)
 {
     Header header;
     int rc = SOCKET_ERROR;
@@ -313,7 +459,7 @@ static int MQTTPacket_send_ack(int msgid, networkHandles *net)
     if ((ptr = buf = malloc(2)) == NULL)
         goto exit;
     header.byte = 0;
-    header.bits.type = 4;
+    header.bits.type = type;
     header.bits.dup = 0;
     writeInt(&ptr, msgid);
     if ((rc = MQTTPacket_send(net, header, buf, 2, 1)) != TCPSOCKET_INTERRUPTED)
@@ -326,36 +472,111 @@ int MQTTPacket_send_puback(int msgid, networkHandles *net, const char *clientID)
 {
     int rc = 0;
 
-    rc = MQTTPacket_send_ack(msgid, net);
+    rc = MQTTPacket_send_ack(PUBACK, msgid, net);
     Log(LOG_PROTOCOL, 12, NULL, net->socket, clientID, msgid, rc);
     return rc;
 }
 
+int MQTTPacket_send_pubrec(int msgid, networkHandles *net, const char *clientID)
+{
+    int rc = 0;
+
+    rc = MQTTPacket_send_ack(PUBREC, msgid, net);
+    Log(LOG_PROTOCOL, 13, NULL, net->socket, clientID, msgid, rc);
+    return rc;
+}
+
+int MQTTPacket_send_pubcomp(int msgid, networkHandles *net, const char *clientID)
+{
+    int rc = 0;
+
+    rc = MQTTPacket_send_ack(PUBCOMP, msgid, net);
+    Log(LOG_PROTOCOL, 18, NULL, net->socket, clientID, msgid, rc);
+    return rc;
+}
+
 void* MQTTPacket_ack(int MQTTVersion, unsigned char aHeader, char* data, size_t datalen)
 {
     Ack* pack = NULL;
     char* curdata = data;
     char* enddata = &data[datalen];
 
-    if ((pack = malloc(sizeof(Ack))) == NULL)
+    if ((pack = Pool_alloc(POOL_ACK)) == NULL)
         goto exit;
     pack->MQTTVersion = MQTTVersion;
     pack->header.byte = aHeader;
-    if (pack->header.bits.type != DISCONNECT)
+    pack->msgId = 0;
+    pack->rc = 0; /* success, when an MQTT 5 ack leaves the reason code out */
+    pack->propIndex.present = 0;
+    pack->propIndex.count = pack->propIndex.length = 0;
+    if (pack->header.bits.type != DISCONNECT && pack->header.bits.type != AUTH)
     {
         if (enddata - curdata < 2)  /* Is there enough data for the msgid? */
         {
-            free(pack);
+            Pool_free(POOL_ACK, pack);
             pack = NULL;
             goto exit;
         }
         pack->msgId = readInt(&curdata);
     }
+    if (MQTTVersion >= 5 && curdata < enddata)
+    {
+        pack->rc = readChar(&curdata);
+        if (curdata < enddata && MQTTProperties_index(&pack->propIndex, &curdata, enddata) != 0)
+        {
+            Pool_free(POOL_ACK, pack);
+            pack = NULL;
+            goto exit;
+        }
+    }
 
     exit:
     return pack;
 }
 
+/* The bytes of the properties of an outbound PUBLISH, with its topic alias added, not counting their length */
+static int MQTTPacket_publishPropertyBytes(Publish* pack)
+{
+    return ((pack->propBlock) ? pack->propBlock->length : pack->properties.length) + ((pack->topicAlias > 0) ? 3 : 0);
+}
+
+/* The length of the properties of an outbound PUBLISH, with its topic alias added */
+static int MQTTPacket_publishPropertiesLen(Publish* pack)
+{
+    int len = MQTTPacket_publishPropertyBytes(pack);
+
+    return (pack->MQTTVersion >= 5) ? len + MQTTPacket_VBIlen(len) : 0;
+}
+
+/* Write the property length and topic alias of an outbound PUBLISH, which the rest of its properties follow */
+static void MQTTPacket_writePublishPropertiesHead(char** pptr, Publish* pack)
+{
+    *pptr += MQTTPacket_encode(*pptr, (size_t)MQTTPacket_publishPropertyBytes(pack));
+    if (pack->topicAlias > 0)
+    {
+        writeChar(pptr, MQTTPROPERTY_CODE_TOPIC_ALIAS);
+        writeInt(pptr, pack->topicAlias);
+    }
+}
+
+/* Write the properties of an outbound PUBLISH, with its topic alias added */
+static void MQTTPacket_writePublishProperties(char** pptr, Publish* pack)
+{
+    int i;
+
+    MQTTPacket_writePublishPropertiesHead(pptr, pack);
+    if (pack->propBlock)
+    {
+        memcpy(*pptr, pack->propBlock->data, (size_t)pack->propBlock->length);
+        *pptr += pack->propBlock->length;
+    }
+    else
+    {
+        for (i = 0; i < pack->properties.count; ++i)
+            MQTTProperty_write(pptr, &pack->properties.array[i]);
+    }
+}
+
 int MQTTPacket_send_publish(Publish* pack, int dup, int qos, int retained, networkHandles* net, const char* clientID)
 {
     Header header;
@@ -371,12 +592,12 @@ int MQTTPacket_send_publish(Publish* pack, int dup, int qos, int retained, netwo
     header.bits.retain = retained;
     if (qos > 0 || pack->MQTTVersion >= 5)
     {
-        int buflen = ((qos > 0) ? 2 : 0) + ((pack->MQTTVersion >= 5) ? MQTTProperties_len(&pack->properties) : 0);
+        int buflen = ((qos > 0) ? 2 : 0) + (MQTTPacket_publishPropertiesLen(pack));
         char *ptr = NULL;
         char* bufs[4] = {topiclen, pack->topic, NULL, pack->payload};
-        size_t lens[4] = {2, strlen(pack->topic), buflen, pack->payloadlen};
+        size_t lens[4] = {2, pack->aliasOnly ? 0 : strlen(pack->topic), buflen, pack->payloadlen};
         int frees[4] = {1, 0, 1, 0};
-        PacketBuffers packetbufs = {4, bufs, lens, frees, {pack->mask[0], pack->mask[1], pack->mask[2], pack->mask[3]}};
+        PacketBuffers packetbufs = {4, bufs, lens, frees};
 
         bufs[2] = ptr = malloc(buflen);
         if (ptr == NULL)
@@ -384,14 +605,22 @@ int MQTTPacket_send_publish(Publish* pack, int dup, int qos, int retained, netwo
         if (qos > 0)
             writeInt(&ptr, pack->msgId);
         if (pack->MQTTVersion >= 5)
-            MQTTProperties_write(&ptr, &pack->properties);
+            MQTTPacket_writePublishProperties(&ptr, pack);
 
         ptr = topiclen;
         writeInt(&ptr, (int)lens[1]);
         rc = MQTTPacket_sends(net, header, &packetbufs);
         if (rc != TCPSOCKET_INTERRUPTED)
             free(bufs[2]);
-        memcpy(pack->mask, packetbufs.mask, sizeof(pack->mask));
+    } else {
+        char *ptr = topiclen;
+        char *bufs[3] = {topiclen, pack->topic, pack->payload};
+        size_t lens[3] = {2, pack->aliasOnly ? 0 : strlen(pack->topic), pack->payloadlen};
+        int frees[3] = {1, 0, 0};
+        PacketBuffers packetbufs = {3, bufs, lens, frees};
+
+        writeInt(&ptr, (int) lens[1]);
+        rc = MQTTPacket_sends(net, header, &packetbufs);
     }
     if (qos == 0)
         Log(LOG_PROTOCOL, 27, NULL, net->socket, clientID, retained, rc, pack->payloadlen,
@@ -406,6 +635,217 @@ int MQTTPacket_send_publish(Publish* pack, int dup, int qos, int retained, netwo
     return rc;
 }
 
+/**
+ * Write a QoS 0 PUBLISH with its payload in the caller's buffers, passed to writev as they are.
+ * Only what the socket does not take at once is copied, to be written later.  Not for WebSockets,
+ * which copy each packet into one masked frame.
+ * @param pack the topic and, for MQTT 5, properties of the message
+ * @param parts the pieces of the payload
+ * @param count the number of pieces, up to IOV_MAX - 4
+ * @return the completion code of the write
+ */
+int MQTTPacket_send_publishv(Publish* pack, const struct iovec* parts, int count, int retained, networkHandles* net,
+                             const char* clientID)
+{
+    Header header;
+    char fixed[5], topiclen[2];
+    char* props = NULL;
+    char* ptr = NULL;
+    struct iovec stackvecs[16];
+    struct iovec* iovecs = stackvecs;
+    size_t topicsize = pack->aliasOnly ? 0 : strlen(pack->topic), payloadlen = 0;
+    int proplen = MQTTPacket_publishPropertiesLen(pack);
+    int i, n = 0, rc = SOCKET_ERROR;
+
+    for (i = 0; i < count; ++i)
+        payloadlen += parts[i].iov_len;
+    if (count + 4 > (int)(sizeof(stackvecs) / sizeof(stackvecs[0])) &&
+        (iovecs = malloc((size_t)(count + 4) * sizeof(struct iovec))) == NULL)
+        goto exit;
+    if (proplen > 0 && (props = malloc((size_t)proplen)) == NULL)
+        goto exit;
+    header.byte = 0;
+    header.bits.type = PUBLISH;
+    header.bits.retain = retained;
+    fixed[0] = header.byte;
+    iovecs[n].iov_base = fixed;
+    iovecs[n++].iov_len = 1 + (size_t)MQTTPacket_encode(&fixed[1], 2 + topicsize + (size_t)proplen + payloadlen);
+    ptr = topiclen;
+    writeInt(&ptr, (int)topicsize);
+    iovecs[n].iov_base = topiclen;
+    iovecs[n++].iov_len = 2;
+    iovecs[n].iov_base = pack->topic;
+    iovecs[n++].iov_len = topicsize;
+    if (proplen > 0)
+    {
+        ptr = props;
+        MQTTPacket_writePublishProperties(&ptr, pack);
+        iovecs[n].iov_base = props;
+        iovecs[n++].iov_len = (size_t)proplen;
+    }
+    for (i = 0; i < count; ++i)
+        iovecs[n++] = parts[i];
+    rc = Socket_putdatav(net->socket, iovecs, n);
+    Log(LOG_PROTOCOL, 27, NULL, net->socket, clientID, retained, rc, (int)payloadlen, 0, "");
+    exit:
+    if (iovecs != stackvecs)
+        free(iovecs);
+    free(props);
+    return rc;
+}
+
+/**
+ * The most bytes MQTTPacket_encodePublish writes for the header of a packet: the fixed header,
+ * topic length, message id and properties, less any encoded ahead in a property block.
+ */
+size_t MQTTPacket_publishHeaderLen(Publish* pack, int qos)
+{
+    return 5 + 2 + ((qos > 0) ? 2 : 0) + (size_t)MQTTPacket_publishPropertiesLen(pack) -
+           ((pack->MQTTVersion >= 5 && pack->propBlock) ? (size_t)pack->propBlock->length : 0);
+}
+
+/**
+ * Encode a PUBLISH to be written with others, without copying its topic or payload.  The header
+ * bytes go into buf, and the packet is described by up to MQTTPACKET_PUBLISH_IOVECS buffers
+ * pointing into buf, at the topic, at any property block and at the payload, which must stay
+ * valid until written.
+ * Not for WebSockets.
+ * @param pack the message, with its topic length set
+ * @param buf room for MQTTPacket_publishHeaderLen bytes
+ * @param iovecs returns the buffers of the packet
+ * @return the number of buffers used
+ */
+int MQTTPacket_encodePublish(Publish* pack, int qos, int retained, char* buf, struct iovec* iovecs)
+{
+    Header header;
+    size_t topiclen = pack->aliasOnly ? 0 : (size_t)pack->topiclen;
+    int proplen = MQTTPacket_publishPropertiesLen(pack);
+    char* ptr = buf;
+    int n = 0;
+
+    header.byte = 0;
+    header.bits.type = PUBLISH;
+    header.bits.qos = qos;
+    header.bits.retain = retained;
+    writeChar(&ptr, header.byte);
+    ptr += MQTTPacket_encode(ptr, 2 + topiclen + ((qos > 0) ? 2 : 0) + (size_t)proplen + (size_t)pack->payloadlen);
+    writeInt(&ptr, (int)topiclen);
+    iovecs[n].iov_base = buf;
+    iovecs[n++].iov_len = (size_t)(ptr - buf);
+    iovecs[n].iov_base = pack->topic;
+    iovecs[n++].iov_len = topiclen;
+    if (qos > 0 || proplen > 0)
+    {
+        buf = ptr;
+        if (qos > 0)
+            writeInt(&ptr, pack->msgId);
+        if (pack->MQTTVersion >= 5 && pack->propBlock)
+            MQTTPacket_writePublishPropertiesHead(&ptr, pack);
+        else if (pack->MQTTVersion >= 5)
+            MQTTPacket_writePublishProperties(&ptr, pack);
+        iovecs[n].iov_base = buf;
+        iovecs[n++].iov_len = (size_t)(ptr - buf);
+    }
+    if (pack->MQTTVersion >= 5 && pack->propBlock && pack->propBlock->length > 0)
+    {   /* written straight from the block, as the payload is */
+        iovecs[n].iov_base = pack->propBlock->data;
+        iovecs[n++].iov_len = (size_t)pack->propBlock->length;
+    }
+    if (pack->payloadlen > 0)
+    {
+        iovecs[n].iov_base = pack->payload;
+        iovecs[n++].iov_len = (size_t)pack->payloadlen;
+    }
+    return n;
+}
+
+/**
+ * Write a PUBLISH whose payload is read from a file or a callback rather than from memory.  The
+ * header is written first, then the payload: with sendfile from a file over plain TCP, otherwise
+ * a piece at a time through one buffer of at most MQTTPACKET_STREAM_PART bytes, each piece in
+ * its own WebSocket frame if need be.  The call waits whenever the socket is full, so the socket
+ * must have no pending write.
+ * @return TCPSOCKET_COMPLETE or SOCKET_ERROR, after which the connection is unusable as part of
+ * the packet may have been written
+ */
+int MQTTPacket_send_publishSource(Publish* pack, MQTTClient_payloadSource* source, int dup, int qos, int retained,
+                                  networkHandles* net, const char* clientID)
+{
+    Header header;
+    size_t topiclen = pack->aliasOnly ? 0 : strlen(pack->topic);
+    int proplen = MQTTPacket_publishPropertiesLen(pack);
+    size_t remaining_length = 2 + topiclen + ((qos > 0) ? 2 : 0) + (size_t)proplen + source->len;
+    size_t headerlen, done = 0;
+    char* buf = NULL;
+    char* ptr = NULL;
+    int rc = SOCKET_ERROR;
+
+    if (remaining_length > MQTTPACKET_MAX_LENGTH)
+    {
+        Log(LOG_ERROR, -1, "A %lu byte payload is too long for an MQTT packet", (unsigned long)source->len);
+        goto exit;
+    }
+    header.byte = 0;
+    header.bits.type = PUBLISH;
+    header.bits.dup = dup;
+    header.bits.qos = qos;
+    header.bits.retain = retained;
+    headerlen = 1 + (size_t)MQTTPacket_encode(NULL, remaining_length) + remaining_length - source->len;
+    if ((ptr = buf = malloc(headerlen)) == NULL)
+        goto exit;
+    writeChar(&ptr, header.byte);
+    ptr += MQTTPacket_encode(ptr, remaining_length);
+    writeInt(&ptr, (int)topiclen);
+    memcpy(ptr, pack->topic, topiclen);
+    ptr += topiclen;
+    if (qos > 0)
+        writeInt(&ptr, pack->msgId);
+    if (pack->MQTTVersion >= 5)
+        MQTTPacket_writePublishProperties(&ptr, pack);
+    if ((rc = WebSocket_putdataFully(net, buf, headerlen, MQTTPACKET_WRITE_TIMEOUT)) != TCPSOCKET_COMPLETE)
+        goto exit;
+    free(buf);
+    buf = NULL;
+
+    if (source->fd >= 0 && !net->websocket &&
+        (rc = Socket_sendfile(net->socket, source->fd, source->offset, source->len, MQTTPACKET_WRITE_TIMEOUT)) != EINVAL)
+        goto exit;
+    if (source->len > 0 && (buf = malloc(min(source->len, MQTTPACKET_STREAM_PART))) == NULL)
+    {
+        rc = SOCKET_ERROR;
+        goto exit;
+    }
+    rc = TCPSOCKET_COMPLETE;
+    while (done < source->len)
+    {
+        size_t want = min(source->len - done, MQTTPACKET_STREAM_PART);
+        ssize_t count = (source->fd >= 0) ? pread(source->fd, buf, want, source->offset + (off_t)done)
+                                          : (*source->read)(source->context, buf, want, done);
+
+        if (count < 0 && errno == ESPIPE) /* a pipe or socket: read in order */
+            count = read(source->fd, buf, want);
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count <= 0)
+        {
+            Log(LOG_ERROR, -1, "Could not read the payload at %lu of %lu bytes", (unsigned long)done,
+                (unsigned long)source->len);
+            rc = SOCKET_ERROR;
+            break;
+        }
+        if ((rc = WebSocket_putdataFully(net, buf, (size_t)count, MQTTPACKET_WRITE_TIMEOUT)) != TCPSOCKET_COMPLETE)
+            break;
+        done += (size_t)count;
+    }
+    exit:
+    if (qos == 0)
+        Log(LOG_PROTOCOL, 27, NULL, net->socket, clientID, retained, rc, (int)source->len, 0, "");
+    else
+        Log(LOG_PROTOCOL, 10, NULL, net->socket, clientID, pack->msgId, qos, retained, rc, (int)source->len, 0, "");
+    free(buf);
+    return rc;
+}
+
 void writeInt4(char** pptr, int anInt)
 {
     **pptr = (char)(anInt / 16777216);
@@ -450,6 +890,8 @@ int MQTTPacket_send_connect(Clients *client, int MQTTVersion) {
     packet.header.bits.type = CONNECT;
 
     len = 10 + (int) strlen(client->clientID) + 2;
+    if (MQTTVersion >= 5)
+        len += 4; /* the properties: Topic Alias Maximum */
     if (client->username)
         len += (int) strlen(client->username) + 2;
     if (client->password)
@@ -470,6 +912,12 @@ int MQTTPacket_send_connect(Clients *client, int MQTTVersion) {
 
     writeChar(&ptr, packet.flags.all);
     writeInt(&ptr, client->keepAliveInterval);
+    if (MQTTVersion >= 5)
+    {
+        writeChar(&ptr, 3);
+        writeChar(&ptr, MQTTPROPERTY_CODE_TOPIC_ALIAS_MAXIMUM);
+        writeInt(&ptr, MQTTTOPICALIAS_INBOUND_MAXIMUM);
+    }
     writeUTF(&ptr, client->clientID);
     if (client->username)
         writeUTF(&ptr, client->username);
@@ -499,6 +947,18 @@ void *MQTTPacket_connack(int MQTTVersion, unsigned char aHeader, char *data, siz
     }
     pack->flags.all = readChar(&curdata); /* connect flags */
     pack->rc = readChar(&curdata); /* reason code */
+    pack->propIndex.present = 0;
+    pack->propIndex.count = pack->propIndex.length = 0;
+    if (MQTTVersion >= 5 && curdata < enddata &&
+        MQTTProperties_index(&pack->propIndex, &curdata, enddata) != 0)
+    {
+        free(pack);
+        pack = NULL;
+        goto exit;
+    }
+    /* decoded now, as the packet data may be gone by the time the connect completes */
+    pack->topicAliasMaximum = (int) MQTTProperties_getInt(&pack->propIndex, MQTTPROPERTY_CODE_TOPIC_ALIAS_MAXIMUM, 0);
+    pack->receiveMaximum = (int) MQTTProperties_getInt(&pack->propIndex, MQTTPROPERTY_CODE_RECEIVE_MAXIMUM, 65535);
 
     exit:
     return pack;
@@ -516,6 +976,8 @@ int MQTTPacket_send_subscribe(List *topics, List *qoss, int msgid, int dup, Clie
     header.bits.retain = 0;
 
     datalen = 2 + topics->count * 3; /* utf length + char qos == 3 */
+    if (client->MQTTVersion >= 5)
+        datalen += 1; /* no properties */
     while (ListNextElement(topics, &elem))
         datalen += (int) strlen((char *) (elem->content));
 
@@ -523,6 +985,8 @@ int MQTTPacket_send_subscribe(List *topics, List *qoss, int msgid, int dup, Clie
     if (ptr == NULL)
         goto exit;
     writeInt(&ptr, msgid);
+    if (client->MQTTVersion >= 5)
+        writeChar(&ptr, 0);
 
     elem = NULL;
     while (ListNextElement(topics, &elem)) {
@@ -549,6 +1013,7 @@ void *MQTTPacket_suback(int MQTTVersion, unsigned char aHeader, char *data, size
     char *enddata = &data[datalen];
     if ((pack = malloc(sizeof(Suback))) == NULL)
         goto exit;
+    memset(pack, '\0', sizeof(Suback));
     pack->MQTTVersion = MQTTVersion;
     pack->header.byte = aHeader;
     if (enddata - curdata < 2)  /* Is there enough data to read the msgid? */
@@ -558,6 +1023,12 @@ void *MQTTPacket_suback(int MQTTVersion, unsigned char aHeader, char *data, size
         goto exit;
     }
     pack->msgId = readInt(&curdata);
+    if (MQTTVersion >= 5 && MQTTProperties_index(&pack->propIndex, &curdata, enddata) != 0)
+    {
+        free(pack);
+        pack = NULL;
+        goto exit;
+    }
     pack->qoss = ListInitialize();
     while ((size_t) (curdata - data) < datalen) {
         unsigned int *newint;
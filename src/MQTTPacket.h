@@ -10,6 +10,18 @@
 #include "MQTTProperties.h"
 #include <endian.h>
 
+/** the most payload read from the socket at a time for a streamed PUBLISH */
+#define MQTTPACKET_STREAM_PART 65536
+
+/** the largest remaining length an MQTT packet can have */
+#define MQTTPACKET_MAX_LENGTH 268435455
+
+/** milliseconds a large packet waits for the socket to take more data before the write fails */
+#define MQTTPACKET_WRITE_TIMEOUT 10000
+
+/** the most buffers MQTTPacket_encodePublish describes a packet with */
+#define MQTTPACKET_PUBLISH_IOVECS 5
+
 int MQTTPacket_encode(char *buf, size_t length);
 
 int MQTTPacket_decode(networkHandles *net, size_t *value);
@@ -28,6 +40,8 @@ void writeData(char **pptr, const void *data, int datalen);
 
 void *MQTTPacket_Factory(int MQTTVersion, networkHandles *net, int *error);
 
+void MQTTPacket_endStream(networkHandles *net);
+
 int MQTTPacket_send(networkHandles *net, Header header, char *buffer, size_t buflen, int freeData);
 
 int MQTTPacket_sends(networkHandles *net, Header header, PacketBuffers *bufs);
@@ -36,10 +50,26 @@ void *MQTTPacket_publish(int MQTTVersion, unsigned char aHeader, char *data, siz
 
 void MQTTPacket_freePublish(Publish *pack);
 
+void MQTTPacket_free(MQTTPacket *pack);
+
 int MQTTPacket_send_publish(Publish *pack, int dup, int qos, int retained, networkHandles *net, const char *clientID);
 
+int MQTTPacket_send_publishv(Publish *pack, const struct iovec *parts, int count, int retained, networkHandles *net,
+                             const char *clientID);
+
+size_t MQTTPacket_publishHeaderLen(Publish *pack, int qos);
+
+int MQTTPacket_encodePublish(Publish *pack, int qos, int retained, char *buf, struct iovec *iovecs);
+
+int MQTTPacket_send_publishSource(Publish *pack, MQTTClient_payloadSource *source, int dup, int qos, int retained,
+                                  networkHandles *net, const char *clientID);
+
 int MQTTPacket_send_puback(int msgid, networkHandles *net, const char *clientID);
 
+int MQTTPacket_send_pubrec(int msgid, networkHandles *net, const char *clientID);
+
+int MQTTPacket_send_pubcomp(int msgid, networkHandles *net, const char *clientID);
+
 void *MQTTPacket_ack(int MQTTVersion, unsigned char aHeader, char *data, size_t datalen);
 
 void writeInt4(char **pptr, int anInt);
@@ -0,0 +1,849 @@
+//
+// Created by Administrator on 2026/10/19.
+//
+// Append-only persistence of the session state of a client: outboundMsgs, inboundMsgs
+// and messageQueue.
+//
+// Every change is appended as one record to a memory-mapped segment file, removals as
+// delete records, so nothing is rewritten in place.  A full segment is sealed and the next
+// one started.  When the sealed segments hold more than PERSISTENCE_COMPACT_RATIO times the
+// live state, the live state is written out as a snapshot into a fresh segment and the
+// older segments are unlinked.  Records are made durable in groups: one msync covers up to
+// PERSISTENCE_SYNC_RECORDS records or PERSISTENCE_SYNC_INTERVAL milliseconds of them.
+//
+// Recovery is a single sequential scan of the segments in order; the last record for a key
+// wins, and a torn or corrupt record ends the scan of its segment.  MQTT 5 properties are
+// not stored.
+//
+
+#if !defined(NO_PERSISTENCE)
+
+#include <string.h>
+#include <ctype.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "Log.h"
+#include "MQTTTime.h"
+#include "MQTTProtocol.h"
+#include "MQTTPersistence.h"
+#include "Pool.h"
+
+#define PERSISTENCE_SEGMENT_SIZE (4 * 1024 * 1024)
+#define PERSISTENCE_SYNC_RECORDS 64
+#define PERSISTENCE_SYNC_INTERVAL 10
+#define PERSISTENCE_COMPACT_RATIO 2
+#define PERSISTENCE_ALIGN(x) (((x) + 7) & ~(size_t) 7)
+
+enum {
+    PERSISTENCE_PUT = 1, PERSISTENCE_DEL
+};
+
+/**
+ * Header of a record in a segment
+ */
+typedef struct {
+    uint32_t checksum; /**< FNV-1a of the rest of the record */
+    uint32_t len;      /**< length of the whole record, a multiple of 8 */
+    uint8_t op;        /**< PERSISTENCE_PUT or PERSISTENCE_DEL */
+    uint8_t table;     /**< one of MQTTPersistence_tables */
+    uint16_t reserved;
+    uint32_t key;      /**< message id, or sequence number for queued messages */
+} PersistenceRecord;
+
+/**
+ * Body of a put record, followed by the topic and the payload
+ */
+typedef struct {
+    uint8_t qos;
+    uint8_t retain;
+    uint8_t dup;             /**< queued messages only */
+    uint8_t nextMessageType; /**< in-flight messages only */
+    int32_t MQTTVersion;
+    int32_t msgid;
+    int32_t topicLen;        /**< the topic length as known to the client structures */
+    int32_t topicsize;       /**< number of topic bytes stored */
+    int32_t payloadlen;
+} PersistenceMessage;
+
+struct MQTTPersistence_store {
+    Clients *c;
+    char *dir;
+    int fd;                  /**< current segment */
+    char *base;              /**< mapping of the current segment */
+    size_t size;             /**< size of the current segment */
+    size_t used;             /**< bytes appended to the current segment */
+    size_t synced;           /**< bytes of the current segment known to be on disk */
+    unsigned int segno;      /**< number of the current segment */
+    unsigned int firstSegno; /**< oldest segment still on disk */
+    size_t sealedBytes;      /**< bytes in the segments before the current one */
+    int unsynced;            /**< records appended since the last msync */
+    struct timeval firstUnsynced;
+    int compacting;
+};
+
+typedef struct MQTTPersistence_store MQTTPersistence_store;
+
+/**
+ * An in-flight message found during recovery, with the position of its last put record
+ */
+typedef struct {
+    Messages *m;
+    unsigned long seq;
+} PersistenceRecovered;
+
+/**
+ * A queued message found during recovery.  A slot with no entry is a deleted sequence number.
+ */
+typedef struct {
+    qEntry *qe;
+    unsigned int seqno;
+    int used;
+    unsigned long seq;
+} PersistenceQueued;
+
+/**
+ * Open addressed hash of the queued messages found during recovery, keyed by sequence number
+ */
+typedef struct {
+    PersistenceQueued *slots;
+    size_t size;             /**< a power of 2 */
+    size_t used;             /**< slots holding a sequence number, with or without an entry */
+} PersistenceQueuedTable;
+
+static int MQTTPersistence_compact(MQTTPersistence_store *store);
+
+
+static uint32_t MQTTPersistence_checksum(const char *data, size_t len) {
+    uint32_t hash = 2166136261U;
+    size_t i;
+
+    for (i = 0; i < len; ++i) {
+        hash ^= (unsigned char) data[i];
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+
+static char *MQTTPersistence_segmentName(MQTTPersistence_store *store, unsigned int segno) {
+    size_t len = strlen(store->dir) + 16;
+    char *name = malloc(len);
+
+    if (name)
+        snprintf(name, len, "%s/%08u.seg", store->dir, segno);
+    return name;
+}
+
+
+static size_t MQTTPersistence_recordSize(size_t topicsize, size_t payloadlen) {
+    return PERSISTENCE_ALIGN(sizeof(PersistenceRecord) + sizeof(PersistenceMessage) + topicsize + payloadlen);
+}
+
+
+/**
+ * The number of bytes a snapshot of the client's current state would take
+ */
+static size_t MQTTPersistence_liveBytes(Clients *c) {
+    ListElement *current = NULL;
+    size_t bytes = 0;
+
+    while (ListNextElement(c->outboundMsgs, &current)) {
+        Messages *m = (Messages *) (current->content);
+        bytes += MQTTPersistence_recordSize(strlen(m->publish->topic), m->publish->payloadlen);
+    }
+    current = NULL;
+    while (ListNextElement(c->inboundMsgs, &current)) {
+        Messages *m = (Messages *) (current->content);
+
+        if (m->publish) /* a streamed message is held without it, and not stored */
+            bytes += MQTTPersistence_recordSize(strlen(m->publish->topic), m->publish->payloadlen);
+    }
+    current = NULL;
+    while (ListNextElement(c->messageQueue, &current)) {
+        qEntry *qe = (qEntry *) (current->content);
+        bytes += MQTTPersistence_recordSize(strlen(qe->topicName), qe->msg->payloadlen);
+    }
+    return bytes;
+}
+
+
+static int MQTTPersistence_sync(MQTTPersistence_store *store) {
+    int rc = 0;
+
+    if (store->used > store->synced) {
+        size_t start = store->synced & ~((size_t) sysconf(_SC_PAGESIZE) - 1);
+
+        if ((rc = msync(store->base + start, store->used - start, MS_SYNC)) != 0)
+            Log(LOG_ERROR, -1, "msync failed for persistence segment %u: %s", store->segno, strerror(errno));
+        else
+            store->synced = store->used;
+    }
+    store->unsynced = 0;
+    return rc;
+}
+
+
+static int MQTTPersistence_openSegment(MQTTPersistence_store *store, unsigned int segno, size_t minsize) {
+    size_t pagesize = (size_t) sysconf(_SC_PAGESIZE);
+    char *name = NULL;
+    int error = 0;
+    int rc = MQTTCLIENT_PERSISTENCE_ERROR;
+
+    store->size = PERSISTENCE_SEGMENT_SIZE;
+    if (minsize > store->size)
+        store->size = (minsize + pagesize - 1) & ~(pagesize - 1);
+    if ((name = MQTTPersistence_segmentName(store, segno)) == NULL)
+        goto exit;
+    if ((store->fd = open(name, O_RDWR | O_CREAT | O_TRUNC, 0600)) < 0) {
+        Log(LOG_ERROR, -1, "Cannot create persistence segment %s: %s", name, strerror(errno));
+        goto exit;
+    }
+    /* reserve the blocks now, so that running out of disk space is an error here and not a SIGBUS later */
+    if ((error = posix_fallocate(store->fd, 0, (off_t) store->size)) != 0 ||
+        (store->base = mmap(NULL, store->size, PROT_READ | PROT_WRITE, MAP_SHARED, store->fd, 0)) == MAP_FAILED) {
+        /* posix_fallocate returns its error rather than setting errno */
+        Log(LOG_ERROR, -1, "Cannot map persistence segment %s: %s", name, strerror(error ? error : errno));
+        close(store->fd);
+        unlink(name);
+        store->fd = -1;
+        store->base = NULL;
+        goto exit;
+    }
+    store->segno = segno;
+    store->used = store->synced = 0;
+    rc = 0;
+    exit:
+    free(name);
+    return rc;
+}
+
+
+static void MQTTPersistence_sealSegment(MQTTPersistence_store *store) {
+    if (store->base == NULL)
+        return;
+    MQTTPersistence_sync(store);
+    munmap(store->base, store->size);
+    if (store->used == 0) {
+        char *name = MQTTPersistence_segmentName(store, store->segno);
+
+        if (name) {
+            unlink(name);
+            free(name);
+        }
+    } else if (ftruncate(store->fd, (off_t) store->used) != 0)
+        Log(LOG_ERROR, -1, "Cannot truncate persistence segment %u", store->segno);
+    close(store->fd);
+    store->sealedBytes += store->used;
+    store->base = NULL;
+    store->fd = -1;
+}
+
+
+/**
+ * Seal the current segment and start the next one, compacting if the log has grown too large
+ * @param store the store
+ * @param minsize the size of the record that did not fit
+ * @return 0 on success
+ */
+static int MQTTPersistence_rotate(MQTTPersistence_store *store, size_t minsize) {
+    int rc = 0;
+
+    MQTTPersistence_sealSegment(store);
+    if ((rc = MQTTPersistence_openSegment(store, store->segno + 1, minsize)) != 0)
+        goto exit;
+    if (!store->compacting &&
+        store->sealedBytes > PERSISTENCE_COMPACT_RATIO * MQTTPersistence_liveBytes(store->c))
+        rc = MQTTPersistence_compact(store);
+    exit:
+    return rc;
+}
+
+
+static int MQTTPersistence_append(MQTTPersistence_store *store, int op, int table, unsigned int key,
+                                  PersistenceMessage *body, const char *topic, const char *payload) {
+    PersistenceRecord *rec = NULL;
+    size_t len = PERSISTENCE_ALIGN(sizeof(PersistenceRecord));
+    char *ptr = NULL;
+    int rc = 0;
+
+    if (body)
+        len = MQTTPersistence_recordSize((size_t) body->topicsize, (size_t) body->payloadlen);
+    /* a compaction started by the rotation may leave too little room, hence the loop */
+    while (store->base == NULL || store->used + len > store->size) {
+        if ((rc = MQTTPersistence_rotate(store, len)) != 0)
+            goto exit;
+    }
+    rec = (PersistenceRecord *) (store->base + store->used);
+    ptr = (char *) rec + sizeof(PersistenceRecord);
+    rec->len = (uint32_t) len;
+    rec->op = (uint8_t) op;
+    rec->table = (uint8_t) table;
+    rec->reserved = 0;
+    rec->key = key;
+    if (body) {
+        memcpy(ptr, body, sizeof(PersistenceMessage));
+        ptr += sizeof(PersistenceMessage);
+        memcpy(ptr, topic, (size_t) body->topicsize);
+        ptr += body->topicsize;
+        if (body->payloadlen > 0)
+            memcpy(ptr, payload, (size_t) body->payloadlen);
+        ptr += body->payloadlen;
+    }
+    memset(ptr, '\0', (char *) rec + len - ptr);
+    rec->checksum = MQTTPersistence_checksum((char *) &rec->len, len - sizeof(rec->checksum));
+    store->used += len;
+
+    if (store->unsynced++ == 0)
+        store->firstUnsynced = MQTTTime_now();
+    if (store->unsynced >= PERSISTENCE_SYNC_RECORDS ||
+        MQTTTime_elapsed(store->firstUnsynced) >= PERSISTENCE_SYNC_INTERVAL)
+        rc = MQTTPersistence_sync(store);
+    exit:
+    return rc;
+}
+
+
+static int MQTTPersistence_appendMessage(MQTTPersistence_store *store, int table, Messages *m) {
+    PersistenceMessage body;
+
+    memset(&body, '\0', sizeof(body));
+    body.qos = (uint8_t) m->qos;
+    body.retain = (uint8_t) m->retain;
+    body.nextMessageType = (uint8_t) m->nextMessageType;
+    body.MQTTVersion = m->MQTTVersion;
+    body.msgid = m->msgid;
+    body.topicLen = m->publish->topiclen;
+    body.topicsize = (int32_t) strlen(m->publish->topic);
+    body.payloadlen = m->publish->payloadlen;
+    return MQTTPersistence_append(store, PERSISTENCE_PUT, table, (unsigned int) m->msgid, &body,
+                                  m->publish->topic, m->publish->payload);
+}
+
+
+static int MQTTPersistence_appendQueued(MQTTPersistence_store *store, qEntry *qe) {
+    PersistenceMessage body;
+
+    memset(&body, '\0', sizeof(body));
+    body.qos = (uint8_t) qe->msg->qos;
+    body.retain = (uint8_t) qe->msg->retained;
+    body.dup = (uint8_t) qe->msg->dup;
+    body.msgid = qe->msg->msgid;
+    body.topicLen = qe->topicLen;
+    body.topicsize = (int32_t) strlen(qe->topicName);
+    body.payloadlen = qe->msg->payloadlen;
+    return MQTTPersistence_append(store, PERSISTENCE_PUT, PERSISTENCE_QUEUED, qe->seqno, &body,
+                                  qe->topicName, qe->msg->payload);
+}
+
+
+/**
+ * Write the live state into a new segment and unlink all the segments before it
+ * @param store the store
+ * @return 0 on success
+ */
+static int MQTTPersistence_compact(MQTTPersistence_store *store) {
+    Clients *c = store->c;
+    ListElement *current = NULL;
+    unsigned int first = store->firstSegno, snapshot, i;
+    size_t oldBytes;
+    int rc = 0;
+
+    store->compacting = 1;
+    if (store->used > 0 && (rc = MQTTPersistence_rotate(store, 0)) != 0)
+        goto exit;
+    snapshot = store->segno;
+    oldBytes = store->sealedBytes;
+    Log(TRACE_MIN, -1, "Compacting persistence for client %s: %lu bytes in segments %u to %u",
+        c->clientID, (unsigned long) oldBytes, first, snapshot - 1);
+
+    while (rc == 0 && ListNextElement(c->outboundMsgs, &current)) {
+        Messages *m = (Messages *) (current->content);
+
+        if (m->publish->source == NULL) /* a payload read from a source is not stored */
+            rc = MQTTPersistence_appendMessage(store, PERSISTENCE_OUTBOUND, m);
+    }
+    current = NULL;
+    while (rc == 0 && ListNextElement(c->inboundMsgs, &current)) {
+        Messages *m = (Messages *) (current->content);
+
+        if (m->publish) /* a streamed message is not stored */
+            rc = MQTTPersistence_appendMessage(store, PERSISTENCE_INBOUND, m);
+    }
+    current = NULL;
+    while (rc == 0 && ListNextElement(c->messageQueue, &current))
+        rc = MQTTPersistence_appendQueued(store, (qEntry *) (current->content));
+    if (rc != 0 || (rc = MQTTPersistence_sync(store)) != 0)
+        goto exit;
+
+    /* the snapshot is durable: the older segments can go, oldest first so that a crash part way
+     * through leaves a suffix of the log which replays to the same state */
+    for (i = first; i < snapshot; ++i) {
+        char *name = MQTTPersistence_segmentName(store, i);
+
+        if (name) {
+            unlink(name);
+            free(name);
+        }
+    }
+    store->firstSegno = snapshot;
+    store->sealedBytes -= oldBytes;
+    exit:
+    store->compacting = 0;
+    return rc;
+}
+
+
+/**
+ * Open the persistence store of a client.  The state is not read until MQTTPersistence_restore.
+ * @param c the client
+ * @param dir the directory under which client stores are kept, NULL for the current directory
+ * @param serverURI the server the client connects to, part of the store name
+ * @return 0 on success, MQTTCLIENT_PERSISTENCE_ERROR otherwise
+ */
+int MQTTPersistence_create(Clients *c, const char *dir, const char *serverURI) {
+    MQTTPersistence_store *store = NULL;
+    size_t len, i, start;
+    int rc = MQTTCLIENT_PERSISTENCE_ERROR;
+
+    if (dir == NULL)
+        dir = ".";
+    if ((store = malloc(sizeof(MQTTPersistence_store))) == NULL)
+        goto exit;
+    memset(store, '\0', sizeof(MQTTPersistence_store));
+    store->c = c;
+    store->fd = -1;
+    len = strlen(dir) + strlen(c->clientID) + strlen(serverURI) + 3;
+    if ((store->dir = malloc(len)) == NULL) {
+        free(store);
+        goto exit;
+    }
+    snprintf(store->dir, len, "%s/%s-", dir, c->clientID);
+    start = strlen(dir) + 1;
+    for (i = start; store->dir[i]; ++i) {
+        char ch = store->dir[i];
+        if (ch == '/' || ch == ':' || ch == '\\')
+            store->dir[i] = '_';
+    }
+    /* the server part keeps only characters that are safe in a file name */
+    for (start = i; *serverURI; ++serverURI) {
+        char ch = *serverURI;
+        store->dir[i++] = (char) ((isalnum((unsigned char) ch) || ch == '.' || ch == '-') ? ch : '_');
+    }
+    store->dir[i] = '\0';
+
+    if ((mkdir(dir, 0700) != 0 && errno != EEXIST) || (mkdir(store->dir, 0700) != 0 && errno != EEXIST)) {
+        Log(LOG_ERROR, -1, "Cannot create persistence directory %s: %s", store->dir, strerror(errno));
+        free(store->dir);
+        free(store);
+        goto exit;
+    }
+    c->persistence = store;
+    rc = 0;
+    exit:
+    return rc;
+}
+
+
+static Messages *MQTTPersistence_newMessage(PersistenceMessage *body, const char *topic, const char *payload) {
+    Messages *m = NULL;
+    Publish publish;
+    int len = 0;
+
+    memset(&publish, '\0', sizeof(Publish));
+    if ((m = Pool_alloc(POOL_MESSAGES)) == NULL)
+        goto error;
+    memset(m, '\0', sizeof(Messages));
+    if ((publish.topic = malloc((size_t) body->topicsize + 1)) == NULL ||
+        (publish.payload = malloc(body->payloadlen > 0 ? (size_t) body->payloadlen : 1)) == NULL)
+        goto error;
+    memcpy(publish.topic, topic, (size_t) body->topicsize);
+    publish.topic[body->topicsize] = '\0';
+    memcpy(publish.payload, payload, (size_t) body->payloadlen);
+    publish.topiclen = body->topicLen;
+    publish.payloadlen = body->payloadlen;
+    if ((m->publish = MQTTProtocol_storePublication(&publish, &len)) == NULL)
+        goto error;
+    m->qos = body->qos;
+    m->retain = body->retain;
+    m->msgid = body->msgid;
+    m->MQTTVersion = body->MQTTVersion;
+    m->nextMessageType = (char) body->nextMessageType;
+    m->lastTouch = MQTTTime_now();
+    m->len = (int) sizeof(Messages) + len;
+    return m;
+
+    error:
+    free(publish.topic);
+    free(publish.payload);
+    Pool_free(POOL_MESSAGES, m);
+    return NULL;
+}
+
+
+static void MQTTPersistence_freeMessage(Messages *m) {
+    if (m) {
+        MQTTProtocol_removePublication(m->publish);
+        Pool_free(POOL_MESSAGES, m);
+    }
+}
+
+
+static qEntry *MQTTPersistence_newQueued(unsigned int seqno, PersistenceMessage *body, const char *topic,
+                                         const char *payload) {
+    MQTTClient_message initialized = MQTTClient_message_initializer;
+    qEntry *qe = NULL;
+
+    if ((qe = Pool_alloc(POOL_QENTRY)) == NULL)
+        goto exit;
+    qe->seqno = seqno;
+    qe->topicLen = body->topicLen;
+    qe->msg = malloc(sizeof(MQTTClient_message));
+    qe->topicName = malloc((size_t) body->topicsize + 1);
+    if (qe->msg == NULL || qe->topicName == NULL ||
+        (body->payloadlen > 0 && (initialized.payload = malloc((size_t) body->payloadlen)) == NULL)) {
+        free(qe->msg);
+        free(qe->topicName);
+        Pool_free(POOL_QENTRY, qe);
+        qe = NULL;
+        goto exit;
+    }
+    memcpy(qe->topicName, topic, (size_t) body->topicsize);
+    qe->topicName[body->topicsize] = '\0';
+    if (body->payloadlen > 0)
+        memcpy(initialized.payload, payload, (size_t) body->payloadlen);
+    initialized.payloadlen = body->payloadlen;
+    initialized.qos = body->qos;
+    initialized.retained = body->retain;
+    initialized.dup = body->dup;
+    initialized.msgid = body->msgid;
+    memcpy(qe->msg, &initialized, sizeof(MQTTClient_message));
+    exit:
+    return qe;
+}
+
+
+static void MQTTPersistence_freeQueued(qEntry *qe) {
+    free(qe->msg->payload);
+    free(qe->msg);
+    free(qe->topicName);
+    Pool_free(POOL_QENTRY, qe);
+}
+
+
+static PersistenceQueued *MQTTPersistence_probeQueued(PersistenceQueued *slots, size_t size, unsigned int seqno) {
+    size_t i = (seqno * 2654435761u) & (size - 1);
+
+    while (slots[i].used && slots[i].seqno != seqno)
+        i = (i + 1) & (size - 1);
+    return &slots[i];
+}
+
+
+/**
+ * Find the slot of a queued message during recovery
+ * @param insert whether to claim a slot for a sequence number not yet seen
+ * @return the slot, or NULL if it was not found or the table could not grow
+ */
+static PersistenceQueued *MQTTPersistence_findQueued(PersistenceQueuedTable *t, unsigned int seqno, int insert) {
+    PersistenceQueued *slot = NULL;
+
+    if (t->size > 0 && (slot = MQTTPersistence_probeQueued(t->slots, t->size, seqno))->used)
+        goto exit;
+    slot = NULL;
+    if (!insert)
+        goto exit;
+    if ((t->used + 1) * 2 > t->size) {
+        /* rehash, dropping the deleted sequence numbers */
+        size_t size = (t->size > 0) ? t->size * 2 : 1024, i;
+        PersistenceQueued *slots = calloc(size, sizeof(PersistenceQueued));
+
+        if (slots == NULL)
+            goto exit;
+        t->used = 0;
+        for (i = 0; i < t->size; ++i) {
+            if (t->slots[i].qe) {
+                *MQTTPersistence_probeQueued(slots, size, t->slots[i].seqno) = t->slots[i];
+                ++t->used;
+            }
+        }
+        free(t->slots);
+        t->slots = slots;
+        t->size = size;
+    }
+    slot = MQTTPersistence_probeQueued(t->slots, t->size, seqno);
+    slot->used = 1;
+    slot->seqno = seqno;
+    ++t->used;
+    exit:
+    return slot;
+}
+
+
+static int MQTTPersistence_queuedCompare(const void *a, const void *b) {
+    unsigned long sa = ((const PersistenceQueued *) a)->seq, sb = ((const PersistenceQueued *) b)->seq;
+
+    return (sa > sb) - (sa < sb);
+}
+
+
+static int MQTTPersistence_recoveredCompare(const void *a, const void *b) {
+    unsigned long sa = ((const PersistenceRecovered *) a)->seq, sb = ((const PersistenceRecovered *) b)->seq;
+
+    return (sa > sb) - (sa < sb);
+}
+
+
+/**
+ * Replay the records of one segment
+ * @return the number of bytes of valid records in the segment
+ */
+static size_t MQTTPersistence_replaySegment(Clients *c, const char *base, size_t size, PersistenceRecovered *out,
+                                            PersistenceRecovered *in, PersistenceQueuedTable *queued,
+                                            unsigned long *seq) {
+    size_t pos = 0;
+
+    while (size - pos >= sizeof(PersistenceRecord)) {
+        const PersistenceRecord *rec = (const PersistenceRecord *) (base + pos);
+        PersistenceMessage *body = (PersistenceMessage *) (base + pos + sizeof(PersistenceRecord));
+        const char *topic = (const char *) body + sizeof(PersistenceMessage);
+
+        if (rec->len < sizeof(PersistenceRecord) || rec->len > size - pos || (rec->len & 7) != 0 ||
+            MQTTPersistence_checksum((const char *) &rec->len, rec->len - sizeof(rec->checksum)) != rec->checksum)
+            break; /* end of the log, or a record torn by a crash */
+        if (rec->op == PERSISTENCE_PUT &&
+            (rec->len < sizeof(PersistenceRecord) + sizeof(PersistenceMessage) || body->topicsize < 0 ||
+             body->payloadlen < 0 ||
+             MQTTPersistence_recordSize((size_t) body->topicsize, (size_t) body->payloadlen) != rec->len))
+            break;
+        ++(*seq);
+        if (rec->table == PERSISTENCE_QUEUED) {
+            unsigned int seqno = rec->key;
+            PersistenceQueued *q = MQTTPersistence_findQueued(queued, seqno, rec->op == PERSISTENCE_PUT);
+
+            if (q && q->qe) {
+                MQTTPersistence_freeQueued(q->qe);
+                q->qe = NULL;
+            }
+            if (rec->op == PERSISTENCE_PUT) {
+                if (q) {
+                    q->qe = MQTTPersistence_newQueued(seqno, body, topic, topic + body->topicsize);
+                    q->seq = *seq;
+                }
+                if (seqno > c->qentry_seqno)
+                    c->qentry_seqno = seqno;
+            }
+        } else if ((rec->table == PERSISTENCE_OUTBOUND || rec->table == PERSISTENCE_INBOUND) &&
+                   rec->key > 0 && rec->key <= MAX_MSG_ID) {
+            PersistenceRecovered *r = (rec->table == PERSISTENCE_OUTBOUND) ? &out[rec->key] : &in[rec->key];
+
+            MQTTPersistence_freeMessage(r->m);
+            r->m = NULL;
+            if (rec->op == PERSISTENCE_PUT) {
+                r->m = MQTTPersistence_newMessage(body, topic, topic + body->topicsize);
+                r->seq = *seq;
+            }
+        }
+        pos += rec->len;
+    }
+    return pos;
+}
+
+
+/**
+ * Rebuild the in-flight lists, sorted into the order the messages were first stored
+ */
+static void MQTTPersistence_rebuild(List *list, PersistenceRecovered *recovered, int *lastMsgId) {
+    int i, count = 0;
+
+    for (i = 1; i <= MAX_MSG_ID; ++i)
+        if (recovered[i].m)
+            recovered[count++] = recovered[i];
+    qsort(recovered, (size_t) count, sizeof(PersistenceRecovered), MQTTPersistence_recoveredCompare);
+    for (i = 0; i < count; ++i)
+        ListAppendNoMalloc(list, recovered[i].m, &recovered[i].m->link, (size_t) recovered[i].m->len);
+    if (lastMsgId && count > 0)
+        *lastMsgId = recovered[count - 1].m->msgid;
+}
+
+
+/**
+ * Rebuild the queue of messages for the application, in the order they were stored
+ */
+static void MQTTPersistence_rebuildQueue(List *list, PersistenceQueuedTable *queued) {
+    size_t i, count = 0;
+
+    for (i = 0; i < queued->size; ++i)
+        if (queued->slots[i].qe)
+            queued->slots[count++] = queued->slots[i];
+    qsort(queued->slots, count, sizeof(PersistenceQueued), MQTTPersistence_queuedCompare);
+    for (i = 0; i < count; ++i) {
+        qEntry *qe = queued->slots[i].qe;
+
+        ListAppendNoMalloc(list, qe, &qe->link, sizeof(qEntry) + sizeof(MQTTClient_message) +
+                                                (size_t) qe->msg->payloadlen + strlen(qe->topicName) + 1);
+    }
+}
+
+
+static int MQTTPersistence_segmentCompare(const void *a, const void *b) {
+    unsigned int sa = *(const unsigned int *) a, sb = *(const unsigned int *) b;
+
+    return (sa > sb) - (sa < sb);
+}
+
+
+/**
+ * Recover the state of a client from its store, and start a new segment for further records
+ * @param c the client, whose lists must be empty
+ * @return 0 on success, MQTTCLIENT_PERSISTENCE_ERROR otherwise
+ */
+int MQTTPersistence_restore(Clients *c) {
+    MQTTPersistence_store *store = c->persistence;
+    PersistenceRecovered *out = NULL, *in = NULL;
+    PersistenceQueuedTable queued = {NULL, 0, 0};
+    unsigned int *segnos = NULL;
+    size_t nsegs = 0, maxsegs = 0, i;
+    unsigned long seq = 0;
+    int unsealed = 0; /* a segment was not sealed by MQTTPersistence_close */
+    struct dirent *entry;
+    DIR *dir = NULL;
+    int rc = MQTTCLIENT_PERSISTENCE_ERROR;
+
+    if (store == NULL)
+        goto exit;
+    if ((dir = opendir(store->dir)) == NULL)
+        goto exit;
+    while ((entry = readdir(dir)) != NULL) {
+        unsigned int segno;
+        char suffix[8];
+
+        if (sscanf(entry->d_name, "%8u.%3s", &segno, suffix) != 2 || strcmp(suffix, "seg") != 0)
+            continue;
+        if (nsegs == maxsegs) {
+            unsigned int *temp = realloc(segnos, (maxsegs = maxsegs ? maxsegs * 2 : 16) * sizeof(unsigned int));
+            if (temp == NULL)
+                goto exit;
+            segnos = temp;
+        }
+        segnos[nsegs++] = segno;
+    }
+    qsort(segnos, nsegs, sizeof(unsigned int), MQTTPersistence_segmentCompare);
+
+    if ((out = calloc(MAX_MSG_ID + 1, sizeof(PersistenceRecovered))) == NULL ||
+        (in = calloc(MAX_MSG_ID + 1, sizeof(PersistenceRecovered))) == NULL)
+        goto exit;
+    for (i = 0; i < nsegs; ++i) {
+        char *name = MQTTPersistence_segmentName(store, segnos[i]);
+        struct stat st;
+        int fd = (name) ? open(name, O_RDONLY) : -1;
+
+        if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size > 0) {
+            char *base = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+            if (base != MAP_FAILED) {
+                size_t valid = MQTTPersistence_replaySegment(c, base, (size_t) st.st_size, out, in, &queued,
+                                                             &seq);
+
+                store->sealedBytes += valid;
+                unsealed |= (valid < (size_t) st.st_size);
+                munmap(base, (size_t) st.st_size);
+            }
+        }
+        if (fd >= 0)
+            close(fd);
+        free(name);
+    }
+    MQTTPersistence_rebuild(c->outboundMsgs, out, &c->msgID);
+    MQTTPersistence_rebuild(c->inboundMsgs, in, NULL);
+    MQTTPersistence_rebuildQueue(c->messageQueue, &queued);
+    Log(TRACE_MIN, -1, "Restored %d outbound, %d inbound and %d queued messages for client %s from %u segments",
+        c->outboundMsgs->count, c->inboundMsgs->count, c->messageQueue->count, c->clientID, (unsigned int) nsegs);
+
+    /* never append to a recovered segment: its tail may be torn */
+    store->firstSegno = (nsegs > 0) ? segnos[0] : 0;
+    if (MQTTPersistence_openSegment(store, (nsegs > 0) ? segnos[nsegs - 1] + 1 : 0, 0) != 0)
+        goto exit;
+    rc = 0;
+    if (unsealed || store->sealedBytes > PERSISTENCE_COMPACT_RATIO * MQTTPersistence_liveBytes(c))
+        rc = MQTTPersistence_compact(store);
+    exit:
+    if (dir)
+        closedir(dir);
+    free(segnos);
+    free(out);
+    free(in);
+    free(queued.slots);
+    return rc;
+}
+
+
+/**
+ * Make all records durable and close the store.  The files are left for the next run.
+ * @param c the client
+ */
+void MQTTPersistence_close(Clients *c) {
+    MQTTPersistence_store *store = c->persistence;
+
+    if (store == NULL)
+        return;
+    MQTTPersistence_sealSegment(store);
+    free(store->dir);
+    free(store);
+    c->persistence = NULL;
+}
+
+
+/**
+ * Store an in-flight message, replacing any earlier one with the same message id
+ * @param c the client
+ * @param table PERSISTENCE_OUTBOUND or PERSISTENCE_INBOUND
+ * @param m the message
+ * @return 0 on success
+ */
+int MQTTPersistence_putMessage(Clients *c, int table, Messages *m) {
+    return MQTTPersistence_appendMessage(c->persistence, table, m);
+}
+
+
+/**
+ * Store a message queued for delivery to the application
+ * @param c the client
+ * @param qe the queue entry, with its sequence number set
+ * @return 0 on success
+ */
+int MQTTPersistence_putQueued(Clients *c, qEntry *qe) {
+    return MQTTPersistence_appendQueued(c->persistence, qe);
+}
+
+
+/**
+ * Record the removal of a stored message
+ * @param c the client
+ * @param table one of MQTTPersistence_tables
+ * @param key the message id, or the sequence number of a queued message
+ * @return 0 on success
+ */
+int MQTTPersistence_remove(Clients *c, int table, unsigned int key) {
+    return MQTTPersistence_append(c->persistence, PERSISTENCE_DEL, table, key, NULL, NULL, NULL);
+}
+
+
+/**
+ * Complete a group commit whose interval has expired.  Called from the receive loop, so that
+ * the last records of a burst do not wait for the next append.
+ * @param c the client
+ */
+void MQTTPersistence_flush(Clients *c) {
+    MQTTPersistence_store *store = c->persistence;
+
+    if (store && store->unsynced > 0 && MQTTTime_elapsed(store->firstUnsynced) >= PERSISTENCE_SYNC_INTERVAL)
+        MQTTPersistence_sync(store);
+}
+
+#endif
@@ -0,0 +1,31 @@
+//
+// Created by Administrator on 2026/10/19.
+//
+
+#ifndef MQTT_CLIENT_MQTTPERSISTENCE_H
+#define MQTT_CLIENT_MQTTPERSISTENCE_H
+
+#include "utils/TypeDefine.h"
+
+/** the lists of a client that are kept in the store */
+enum MQTTPersistence_tables {
+    PERSISTENCE_OUTBOUND = 1, /**< outboundMsgs, keyed by message id */
+    PERSISTENCE_INBOUND,      /**< inboundMsgs, keyed by message id */
+    PERSISTENCE_QUEUED        /**< messageQueue, keyed by qEntry sequence number */
+};
+
+int MQTTPersistence_create(Clients *c, const char *dir, const char *serverURI);
+
+int MQTTPersistence_restore(Clients *c);
+
+void MQTTPersistence_close(Clients *c);
+
+int MQTTPersistence_putMessage(Clients *c, int table, Messages *m);
+
+int MQTTPersistence_putQueued(Clients *c, qEntry *qe);
+
+int MQTTPersistence_remove(Clients *c, int table, unsigned int key);
+
+void MQTTPersistence_flush(Clients *c);
+
+#endif //MQTT_CLIENT_MQTTPERSISTENCE_H
@@ -7,39 +7,39 @@
 #include <memory.h>
 #include "Log.h"
 
-static struct nameToType
-{
-    enum MQTTPropertyCodes name;
-    enum MQTTPropertyTypes type;
-} namesToTypes[] =
+/**
+ * The type of each property, plus one, indexed by its one-byte identifier.  Zero marks an
+ * identifier that is not a property.
+ */
+static const unsigned char propertyTypes[256] =
         {
-                {MQTTPROPERTY_CODE_PAYLOAD_FORMAT_INDICATOR, MQTTPROPERTY_TYPE_BYTE},
-                {MQTTPROPERTY_CODE_MESSAGE_EXPIRY_INTERVAL, MQTTPROPERTY_TYPE_FOUR_BYTE_INTEGER},
-                {MQTTPROPERTY_CODE_CONTENT_TYPE, MQTTPROPERTY_TYPE_UTF_8_ENCODED_STRING},
-                {MQTTPROPERTY_CODE_RESPONSE_TOPIC, MQTTPROPERTY_TYPE_UTF_8_ENCODED_STRING},
-                {MQTTPROPERTY_CODE_CORRELATION_DATA, MQTTPROPERTY_TYPE_BINARY_DATA},
-                {MQTTPROPERTY_CODE_SUBSCRIPTION_IDENTIFIER, MQTTPROPERTY_TYPE_VARIABLE_BYTE_INTEGER},
-                {MQTTPROPERTY_CODE_SESSION_EXPIRY_INTERVAL, MQTTPROPERTY_TYPE_FOUR_BYTE_INTEGER},
-                {MQTTPROPERTY_CODE_ASSIGNED_CLIENT_IDENTIFER, MQTTPROPERTY_TYPE_UTF_8_ENCODED_STRING},
-                {MQTTPROPERTY_CODE_SERVER_KEEP_ALIVE, MQTTPROPERTY_TYPE_TWO_BYTE_INTEGER},
-                {MQTTPROPERTY_CODE_AUTHENTICATION_METHOD, MQTTPROPERTY_TYPE_UTF_8_ENCODED_STRING},
-                {MQTTPROPERTY_CODE_AUTHENTICATION_DATA, MQTTPROPERTY_TYPE_BINARY_DATA},
-                {MQTTPROPERTY_CODE_REQUEST_PROBLEM_INFORMATION, MQTTPROPERTY_TYPE_BYTE},
-                {MQTTPROPERTY_CODE_WILL_DELAY_INTERVAL, MQTTPROPERTY_TYPE_FOUR_BYTE_INTEGER},
-                {MQTTPROPERTY_CODE_REQUEST_RESPONSE_INFORMATION, MQTTPROPERTY_TYPE_BYTE},
-                {MQTTPROPERTY_CODE_RESPONSE_INFORMATION, MQTTPROPERTY_TYPE_UTF_8_ENCODED_STRING},
-                {MQTTPROPERTY_CODE_SERVER_REFERENCE, MQTTPROPERTY_TYPE_UTF_8_ENCODED_STRING},
-                {MQTTPROPERTY_CODE_REASON_STRING, MQTTPROPERTY_TYPE_UTF_8_ENCODED_STRING},
-                {MQTTPROPERTY_CODE_RECEIVE_MAXIMUM, MQTTPROPERTY_TYPE_TWO_BYTE_INTEGER},
-                {MQTTPROPERTY_CODE_TOPIC_ALIAS_MAXIMUM, MQTTPROPERTY_TYPE_TWO_BYTE_INTEGER},
-                {MQTTPROPERTY_CODE_TOPIC_ALIAS, MQTTPROPERTY_TYPE_TWO_BYTE_INTEGER},
-                {MQTTPROPERTY_CODE_MAXIMUM_QOS, MQTTPROPERTY_TYPE_BYTE},
-                {MQTTPROPERTY_CODE_RETAIN_AVAILABLE, MQTTPROPERTY_TYPE_BYTE},
-                {MQTTPROPERTY_CODE_USER_PROPERTY, MQTTPROPERTY_TYPE_UTF_8_STRING_PAIR},
-                {MQTTPROPERTY_CODE_MAXIMUM_PACKET_SIZE, MQTTPROPERTY_TYPE_FOUR_BYTE_INTEGER},
-                {MQTTPROPERTY_CODE_WILDCARD_SUBSCRIPTION_AVAILABLE, MQTTPROPERTY_TYPE_BYTE},
-                {MQTTPROPERTY_CODE_SUBSCRIPTION_IDENTIFIERS_AVAILABLE, MQTTPROPERTY_TYPE_BYTE},
-                {MQTTPROPERTY_CODE_SHARED_SUBSCRIPTION_AVAILABLE, MQTTPROPERTY_TYPE_BYTE}
+                [MQTTPROPERTY_CODE_PAYLOAD_FORMAT_INDICATOR] = MQTTPROPERTY_TYPE_BYTE + 1,
+                [MQTTPROPERTY_CODE_MESSAGE_EXPIRY_INTERVAL] = MQTTPROPERTY_TYPE_FOUR_BYTE_INTEGER + 1,
+                [MQTTPROPERTY_CODE_CONTENT_TYPE] = MQTTPROPERTY_TYPE_UTF_8_ENCODED_STRING + 1,
+                [MQTTPROPERTY_CODE_RESPONSE_TOPIC] = MQTTPROPERTY_TYPE_UTF_8_ENCODED_STRING + 1,
+                [MQTTPROPERTY_CODE_CORRELATION_DATA] = MQTTPROPERTY_TYPE_BINARY_DATA + 1,
+                [MQTTPROPERTY_CODE_SUBSCRIPTION_IDENTIFIER] = MQTTPROPERTY_TYPE_VARIABLE_BYTE_INTEGER + 1,
+                [MQTTPROPERTY_CODE_SESSION_EXPIRY_INTERVAL] = MQTTPROPERTY_TYPE_FOUR_BYTE_INTEGER + 1,
+                [MQTTPROPERTY_CODE_ASSIGNED_CLIENT_IDENTIFER] = MQTTPROPERTY_TYPE_UTF_8_ENCODED_STRING + 1,
+                [MQTTPROPERTY_CODE_SERVER_KEEP_ALIVE] = MQTTPROPERTY_TYPE_TWO_BYTE_INTEGER + 1,
+                [MQTTPROPERTY_CODE_AUTHENTICATION_METHOD] = MQTTPROPERTY_TYPE_UTF_8_ENCODED_STRING + 1,
+                [MQTTPROPERTY_CODE_AUTHENTICATION_DATA] = MQTTPROPERTY_TYPE_BINARY_DATA + 1,
+                [MQTTPROPERTY_CODE_REQUEST_PROBLEM_INFORMATION] = MQTTPROPERTY_TYPE_BYTE + 1,
+                [MQTTPROPERTY_CODE_WILL_DELAY_INTERVAL] = MQTTPROPERTY_TYPE_FOUR_BYTE_INTEGER + 1,
+                [MQTTPROPERTY_CODE_REQUEST_RESPONSE_INFORMATION] = MQTTPROPERTY_TYPE_BYTE + 1,
+                [MQTTPROPERTY_CODE_RESPONSE_INFORMATION] = MQTTPROPERTY_TYPE_UTF_8_ENCODED_STRING + 1,
+                [MQTTPROPERTY_CODE_SERVER_REFERENCE] = MQTTPROPERTY_TYPE_UTF_8_ENCODED_STRING + 1,
+                [MQTTPROPERTY_CODE_REASON_STRING] = MQTTPROPERTY_TYPE_UTF_8_ENCODED_STRING + 1,
+                [MQTTPROPERTY_CODE_RECEIVE_MAXIMUM] = MQTTPROPERTY_TYPE_TWO_BYTE_INTEGER + 1,
+                [MQTTPROPERTY_CODE_TOPIC_ALIAS_MAXIMUM] = MQTTPROPERTY_TYPE_TWO_BYTE_INTEGER + 1,
+                [MQTTPROPERTY_CODE_TOPIC_ALIAS] = MQTTPROPERTY_TYPE_TWO_BYTE_INTEGER + 1,
+                [MQTTPROPERTY_CODE_MAXIMUM_QOS] = MQTTPROPERTY_TYPE_BYTE + 1,
+                [MQTTPROPERTY_CODE_RETAIN_AVAILABLE] = MQTTPROPERTY_TYPE_BYTE + 1,
+                [MQTTPROPERTY_CODE_USER_PROPERTY] = MQTTPROPERTY_TYPE_UTF_8_STRING_PAIR + 1,
+                [MQTTPROPERTY_CODE_MAXIMUM_PACKET_SIZE] = MQTTPROPERTY_TYPE_FOUR_BYTE_INTEGER + 1,
+                [MQTTPROPERTY_CODE_WILDCARD_SUBSCRIPTION_AVAILABLE] = MQTTPROPERTY_TYPE_BYTE + 1,
+                [MQTTPROPERTY_CODE_SUBSCRIPTION_IDENTIFIERS_AVAILABLE] = MQTTPROPERTY_TYPE_BYTE + 1,
+                [MQTTPROPERTY_CODE_SHARED_SUBSCRIPTION_AVAILABLE] = MQTTPROPERTY_TYPE_BYTE + 1
         };
 
 
@@ -54,17 +54,7 @@ static char* datadup(const MQTTLenString* str)
 
 int MQTTProperty_getType(enum MQTTPropertyCodes value)
 {
-    int i, rc = -1;
-
-    for (i = 0; i < ARRAY_SIZE(namesToTypes); ++i)
-    {
-        if (namesToTypes[i].name == value)
-        {
-            rc = namesToTypes[i].type;
-            break;
-        }
-    }
-    return rc;
+    return ((unsigned int)value < ARRAY_SIZE(propertyTypes)) ? propertyTypes[value] - 1 : -1;
 }
 
 
@@ -231,3 +221,319 @@ int MQTTProperties_socketCompare(void* a, void* b)
 }
 
 
+
+
+/* Read a variable byte integer from a packet in memory, or return -1 if it runs past the end */
+int MQTTProperties_readVBI(char** pptr, const char* enddata)
+{
+    int value = 0, multiplier = 1;
+    unsigned char c;
+
+    do
+    {
+        if (*pptr >= enddata || multiplier > 128 * 128 * 128)
+            return -1;
+        c = readChar(pptr);
+        value += (c & 127) * multiplier;
+        multiplier *= 128;
+    } while (c & 128);
+    return value;
+}
+
+
+static unsigned int readInt4(char** pptr)
+{
+    unsigned char* ptr = (unsigned char*)*pptr;
+    unsigned int value = ((unsigned int)ptr[0] << 24) | ((unsigned int)ptr[1] << 16) | ((unsigned int)ptr[2] << 8) | ptr[3];
+
+    *pptr += 4;
+    return value;
+}
+
+
+/* The bytes taken by the value of a property of a type, or -1 if it runs past the end */
+static int MQTTProperty_valueLen(int type, char* ptr, const char* enddata)
+{
+    char* curdata = ptr;
+    int len = -1;
+
+    switch (type)
+    {
+        case MQTTPROPERTY_TYPE_BYTE:
+            len = 1;
+            break;
+        case MQTTPROPERTY_TYPE_TWO_BYTE_INTEGER:
+            len = 2;
+            break;
+        case MQTTPROPERTY_TYPE_FOUR_BYTE_INTEGER:
+            len = 4;
+            break;
+        case MQTTPROPERTY_TYPE_VARIABLE_BYTE_INTEGER:
+            if (MQTTProperties_readVBI(&curdata, enddata) >= 0)
+                len = (int)(curdata - ptr);
+            break;
+        case MQTTPROPERTY_TYPE_BINARY_DATA:
+        case MQTTPROPERTY_TYPE_UTF_8_ENCODED_STRING:
+            if (enddata - ptr >= 2)
+                len = 2 + readInt(&curdata);
+            break;
+        case MQTTPROPERTY_TYPE_UTF_8_STRING_PAIR:
+            if (enddata - ptr >= 2)
+            {
+                len = 2 + readInt(&curdata);  /* the name, then the value */
+                curdata = ptr + len;
+                if (len <= enddata - ptr - 2)
+                    len += 2 + readInt(&curdata);
+                else
+                    len = -1;
+            }
+            break;
+    }
+    return (len > enddata - ptr) ? -1 : len;
+}
+
+
+/* Decode the value of a property that has been checked by MQTTProperties_index, leaving strings in the packet */
+static void MQTTProperty_decode(int type, char* ptr, MQTTProperty* prop)
+{
+    switch (type)
+    {
+        case MQTTPROPERTY_TYPE_BYTE:
+            prop->value.byte = (unsigned char)*ptr;
+            break;
+        case MQTTPROPERTY_TYPE_TWO_BYTE_INTEGER:
+            prop->value.integer2 = (unsigned short)readInt(&ptr);
+            break;
+        case MQTTPROPERTY_TYPE_FOUR_BYTE_INTEGER:
+            prop->value.integer4 = readInt4(&ptr);
+            break;
+        case MQTTPROPERTY_TYPE_VARIABLE_BYTE_INTEGER:
+            prop->value.integer4 = (unsigned int)MQTTProperties_readVBI(&ptr, ptr + 4);
+            break;
+        case MQTTPROPERTY_TYPE_BINARY_DATA:
+        case MQTTPROPERTY_TYPE_UTF_8_ENCODED_STRING:
+        case MQTTPROPERTY_TYPE_UTF_8_STRING_PAIR:
+            prop->value.data.len = readInt(&ptr);
+            prop->value.data.data = ptr;
+            if (type == MQTTPROPERTY_TYPE_UTF_8_STRING_PAIR)
+            {
+                ptr += prop->value.data.len;
+                prop->value.value.len = readInt(&ptr);
+                prop->value.value.data = ptr;
+            }
+            break;
+    }
+}
+
+
+/**
+ * Index the MQTT 5 properties of an inbound packet where they lie, checking that each one is
+ * known and within the packet.  Nothing is copied or allocated.
+ * @param index the index to fill
+ * @param pptr the property length in the packet, moved past the properties
+ * @param enddata the end of the packet
+ * @return 0, or -1 if the properties are malformed
+ */
+int MQTTProperties_index(MQTTPropertyIndex* index, char** pptr, char* enddata)
+{
+    char* curdata = *pptr;
+    char* end = NULL;
+    int len, rc = -1;
+
+    index->present = 0;
+    index->count = 0;
+    index->length = 0;
+    if ((len = MQTTProperties_readVBI(&curdata, enddata)) < 0 || len > enddata - curdata)
+        goto exit;
+    index->data = curdata;
+    index->length = len;
+    end = curdata + len;
+    while (curdata < end)
+    {
+        int id = readChar(&curdata);
+        int type = MQTTProperty_getType(id);
+        int vlen = (type < 0) ? -1 : MQTTProperty_valueLen(type, curdata, end);
+
+        if (vlen < 0)
+        {
+            Log(LOG_ERROR, -1, "Malformed MQTT 5 property %d at offset %d of %d", id,
+                (int)(curdata - 1 - index->data), len);
+            index->present = 0;
+            goto exit;
+        }
+        if ((index->present & (1ULL << id)) == 0)
+        {
+            index->present |= 1ULL << id;
+            index->offsets[id] = (int)(curdata - 1 - index->data);
+        }
+        ++index->count;
+        curdata += vlen;
+    }
+    *pptr = curdata;
+    rc = 0;
+exit:
+    return rc;
+}
+
+
+/* The value of the first property with an identifier, or NULL if there is none */
+static char* MQTTProperties_find(const MQTTPropertyIndex* index, enum MQTTPropertyCodes id)
+{
+    if (id <= 0 || id > MQTTPROPERTY_CODE_MAX || (index->present & (1ULL << id)) == 0)
+        return NULL;
+    return &index->data[index->offsets[id] + 1];
+}
+
+
+int MQTTProperties_hasProperty(const MQTTPropertyIndex* index, enum MQTTPropertyCodes id)
+{
+    return MQTTProperties_find(index, id) != NULL;
+}
+
+
+/**
+ * Decode an integer property of an inbound packet
+ * @param index the properties of the packet
+ * @param id the property
+ * @param dflt the value to return if the property is absent
+ * @return the value of the first such property, or dflt
+ */
+unsigned int MQTTProperties_getInt(const MQTTPropertyIndex* index, enum MQTTPropertyCodes id, unsigned int dflt)
+{
+    char* ptr = MQTTProperties_find(index, id);
+    int type = MQTTProperty_getType(id);
+    MQTTProperty prop;
+
+    if (ptr == NULL || type > MQTTPROPERTY_TYPE_VARIABLE_BYTE_INTEGER)
+        return dflt;
+    MQTTProperty_decode(type, ptr, &prop);
+    if (type == MQTTPROPERTY_TYPE_BYTE)
+        return prop.value.byte;
+    return (type == MQTTPROPERTY_TYPE_TWO_BYTE_INTEGER) ? prop.value.integer2 : prop.value.integer4;
+}
+
+
+/**
+ * Find a string or binary property of an inbound packet, without copying it
+ * @param index the properties of the packet
+ * @param id the property
+ * @param value returns the first such property, pointing into the packet
+ * @return 0, or -1 if the property is absent
+ */
+int MQTTProperties_getString(const MQTTPropertyIndex* index, enum MQTTPropertyCodes id, MQTTLenString* value)
+{
+    char* ptr = MQTTProperties_find(index, id);
+    int type = MQTTProperty_getType(id);
+    MQTTProperty prop;
+
+    if (ptr == NULL || type < MQTTPROPERTY_TYPE_BINARY_DATA)
+        return -1;
+    MQTTProperty_decode(type, ptr, &prop);
+    *value = prop.value.data;
+    return 0;
+}
+
+
+/**
+ * Decode the properties of an inbound packet one after another, repeated ones included, with
+ * strings pointing into the packet
+ * @param index the properties of the packet
+ * @param pos 0 for the first property, moved on to the next
+ * @param prop returns the property
+ * @return 1, or 0 once there are no more
+ */
+int MQTTProperties_next(const MQTTPropertyIndex* index, int* pos, MQTTProperty* prop)
+{
+    char* ptr = NULL;
+    int type;
+
+    if (index->present == 0 || *pos >= index->length)
+        return 0;
+    ptr = &index->data[*pos];
+    prop->identifier = (enum MQTTPropertyCodes)readChar(&ptr);
+    type = MQTTProperty_getType(prop->identifier);
+    MQTTProperty_decode(type, ptr, prop);
+    *pos += 1 + MQTTProperty_valueLen(type, ptr, index->data + index->length);
+    return 1;
+}
+
+
+/**
+ * Copy the properties of an inbound packet into a property list of their own, which outlives
+ * the packet.  A topic alias, which only means something to the connection, is left out, so a
+ * message whose only property is its alias takes no allocation.
+ * @param index the properties of the packet
+ * @return the property list, to be freed with MQTTProperties_free
+ */
+MQTTProperties MQTTProperties_fromIndex(const MQTTPropertyIndex* index)
+{
+    MQTTProperties result = MQTTProperties_initializer;
+    MQTTProperty prop;
+    int pos = 0;
+
+    while (MQTTProperties_next(index, &pos, &prop))
+    {
+        int rc = 0;
+
+        if (prop.identifier == MQTTPROPERTY_CODE_TOPIC_ALIAS)
+            continue;
+        if ((rc = MQTTProperties_add(&result, &prop)) != 0)
+            Log(LOG_ERROR, -1, "Error from MQTTProperties add %d", rc);
+    }
+    return result;
+}
+
+
+/**
+ * Free the values and array of a property list built with MQTTProperties_add, and empty it
+ * @param props the property list
+ */
+void MQTTProperties_free(MQTTProperties* props)
+{
+    int i;
+
+    for (i = 0; i < props->count; ++i)
+    {
+        int type = MQTTProperty_getType(props->array[i].identifier);
+
+        if (type >= MQTTPROPERTY_TYPE_BINARY_DATA)
+            free(props->array[i].value.data.data);
+        if (type == MQTTPROPERTY_TYPE_UTF_8_STRING_PAIR)
+            free(props->array[i].value.value.data);
+    }
+    free(props->array);
+    memset(props, '\0', sizeof(MQTTProperties));
+}
+
+
+/**
+ * Encode a property list once, for messages that are all sent with the same properties.  The
+ * type and length of each property are worked out here, rather than for each message.
+ * @param props the properties
+ * @param block returns the encoded properties, to be freed with MQTTProperties_freeBlock
+ * @return 0, or PAHO_MEMORY_ERROR
+ */
+int MQTTProperties_encodeBlock(const MQTTProperties* props, MQTTPropertyBlock* block)
+{
+    char* ptr = NULL;
+    int i;
+
+    block->data = NULL;
+    block->length = 0;
+    if (props->length == 0)
+        return 0;
+    if ((ptr = block->data = malloc((size_t)props->length)) == NULL)
+        return PAHO_MEMORY_ERROR;
+    for (i = 0; i < props->count; ++i)
+        MQTTProperty_write(&ptr, &props->array[i]);
+    block->length = (int)(ptr - block->data);
+    return 0;
+}
+
+
+void MQTTProperties_freeBlock(MQTTPropertyBlock* block)
+{
+    free(block->data);
+    block->data = NULL;
+    block->length = 0;
+}
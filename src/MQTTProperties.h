@@ -15,9 +15,31 @@ extern int MQTTProperties_add(MQTTProperties *props, const MQTTProperty *prop);
 
 int MQTTProperties_write(char **pptr, const MQTTProperties *properties);
 
+int MQTTProperty_write(char **pptr, MQTTProperty *prop);
+
 extern MQTTProperties MQTTProperties_copy(const MQTTProperties *props);
 
 int MQTTProperties_socketCompare(void *a, void *b);
 
+int MQTTProperties_readVBI(char **pptr, const char *enddata);
+
+int MQTTProperties_index(MQTTPropertyIndex *index, char **pptr, char *enddata);
+
+int MQTTProperties_hasProperty(const MQTTPropertyIndex *index, enum MQTTPropertyCodes id);
+
+unsigned int MQTTProperties_getInt(const MQTTPropertyIndex *index, enum MQTTPropertyCodes id, unsigned int dflt);
+
+int MQTTProperties_getString(const MQTTPropertyIndex *index, enum MQTTPropertyCodes id, MQTTLenString *value);
+
+int MQTTProperties_next(const MQTTPropertyIndex *index, int *pos, MQTTProperty *prop);
+
+MQTTProperties MQTTProperties_fromIndex(const MQTTPropertyIndex *index);
+
+extern void MQTTProperties_free(MQTTProperties *props);
+
+int MQTTProperties_encodeBlock(const MQTTProperties *props, MQTTPropertyBlock *block);
+
+void MQTTProperties_freeBlock(MQTTPropertyBlock *block);
+
 
 #endif //MQTT_CLIENT_MQTTPROPERTIES_H
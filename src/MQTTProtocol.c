@@ -9,6 +9,10 @@
 #include "SocketBuffer.h"
 #include "MQTTProtocol.h"
 #include "MQTTPacket.h"
+#include "MQTTPersistence.h"
+#include "Pool.h"
+#include "MQTTTopicAlias.h"
+#include "WebSocket.h"
 
 extern MQTTProtocol state;
 extern ClientStates *bstate;
@@ -23,11 +27,6 @@ static int MQTTProtocol_startPublishCommon(
 
 static int MQTTProtocol_queueAck(Clients *client, int ackType, int msgId);
 
-typedef struct {
-    int messageId;
-    int ackType;
-} AckRequest;
-
 int messageIDCompare(void *a, void *b) {
     Messages *msg = (Messages *) a;
     return msg->msgid == *(int *) b;
@@ -37,7 +36,8 @@ int MQTTProtocol_assignMsgId(Clients *client) {
     int start_msgid = client->msgID;
     int msgid = start_msgid;
     msgid = (msgid == MAX_MSG_ID) ? 1 : msgid + 1;
-    while (ListFindItem(client->outboundMsgs, &msgid, messageIDCompare) != NULL) {
+    while (ListFindItem(client->outboundMsgs, &msgid, messageIDCompare) != NULL ||
+           ListFindItem(client->bufferedMsgs, &msgid, messageIDCompare) != NULL) {
         msgid = (msgid == MAX_MSG_ID) ? 1 : msgid + 1;
         if (msgid == start_msgid) { /* we've tried them all - none free */
             msgid = 0;
@@ -54,19 +54,15 @@ static void MQTTProtocol_storeQoS0(Clients *pubclient, Publish *publish) {
     pending_write *pw = NULL;
 
     /* store the publication until the write is finished */
-    if ((pw = malloc(sizeof(pending_write))) == NULL)
+    if ((pw = Pool_alloc(POOL_PENDING_WRITE)) == NULL)
         goto exit;
     Log(TRACE_MIN, 12, NULL);
     if ((pw->p = MQTTProtocol_storePublication(publish, &len)) == NULL) {
-        free(pw);
+        Pool_free(POOL_PENDING_WRITE, pw);
         goto exit;
     }
     pw->socket = pubclient->net.socket;
-    if (!ListAppend(&(state.pending_writes), pw, sizeof(pending_write) + len)) {
-        free(pw->p);
-        free(pw);
-        goto exit;
-    }
+    ListAppendNoMalloc(&(state.pending_writes), pw, &pw->link, sizeof(pending_write) + len);
     /* we don't copy QoS 0 messages unless we have to, so now we have to tell the socket buffer where
     the saved copy is */
     if (SocketBuffer_updateWrite(pw->socket, pw->p->topic, pw->p->payload) == NULL)
@@ -76,8 +72,28 @@ static void MQTTProtocol_storeQoS0(Clients *pubclient, Publish *publish) {
     return;
 }
 
+/**
+ * Choose the topic alias a publish packet is sent with, if the connection has an alias table.
+ * Aliases are only bound when no earlier write is pending, so that a packet which is not written
+ * never binds one.
+ * @param client the client
+ * @param publish the packet, whose topicAlias and aliasOnly are set
+ */
+void MQTTProtocol_setTopicAlias(Clients *client, Publish *publish) {
+    size_t len = 0;
+
+    publish->topicAlias = publish->aliasOnly = 0;
+    if (client->topicAliases == NULL || publish->topic == NULL || !Socket_noPendingWrites(client->net.socket))
+        return;
+    len = strlen(publish->topic);
+    publish->topicAlias = MQTTTopicAlias_get(client->topicAliases, publish->topic, len,
+                                             MQTTTopicAlias_hash(publish->topic, len), &publish->aliasOnly);
+}
+
 static int MQTTProtocol_startPublishCommon(Clients *pubclient, Publish *publish, int qos, int retained) {
     int rc = TCPSOCKET_COMPLETE;
+
+    MQTTProtocol_setTopicAlias(pubclient, publish);
     rc = MQTTPacket_send_publish(publish, 0, qos, retained, &pubclient->net, pubclient->clientID);
     if (qos == 0 && rc == TCPSOCKET_INTERRUPTED)
         MQTTProtocol_storeQoS0(pubclient, publish);
@@ -88,8 +104,8 @@ int MQTTProtocol_startPublish(Clients *pubclient, Publish *publish, int qos, int
     Publish qos12pub = *publish;
     int rc = 0;
     if (qos > 0) {
-        *mm = MQTTProtocol_createMessage(publish, mm, qos, retained, 0);
-        ListAppend(pubclient->outboundMsgs, *mm, (*mm)->len);
+        if ((*mm = MQTTProtocol_storeMessage(pubclient, publish, qos, retained)) == NULL)
+            return PAHO_MEMORY_ERROR;
         /* we change these pointers to the saved message location just in case the packet could not be written
         entirely; the socket buffer will use these locations to finish writing the packet */
         qos12pub.payload = (*mm)->publish->payload;
@@ -99,13 +115,155 @@ int MQTTProtocol_startPublish(Clients *pubclient, Publish *publish, int qos, int
         publish = &qos12pub;
     }
     rc = MQTTProtocol_startPublishCommon(pubclient, publish, qos, retained);
-    if (qos > 0)
-        memcpy((*mm)->publish->mask, publish->mask, sizeof((*mm)->publish->mask));
     return rc;
 }
 
+/**
+ * Keep a QoS 1 or 2 message in outboundMsgs until it is acknowledged, and persist it.  This is
+ * done ahead of writing the packet, so that a message the server may have seen is never lost.
+ * @param pubclient the client
+ * @param publish the message, whose topic and payload are taken
+ * @return the message record, or NULL if memory is exhausted
+ */
+Messages *MQTTProtocol_storeMessage(Clients *pubclient, Publish *publish, int qos, int retained) {
+    Messages *m = NULL;
+
+    if ((m = MQTTProtocol_createMessage(publish, &m, qos, retained, 0)) == NULL)
+        goto exit;
+    ListAppendNoMalloc(pubclient->outboundMsgs, m, &m->link, m->len);
+#if !defined(NO_PERSISTENCE)
+    if (pubclient->persistence)
+        MQTTPersistence_putMessage(pubclient, PERSISTENCE_OUTBOUND, m);
+#endif
+    exit:
+    return m;
+}
+
+/**
+ * Get ready to send a message whose payload is read from a source as it is written.  A QoS 1 or
+ * 2 message keeps a copy of the source, not the payload, to be read again if it is resent; it is
+ * not persisted.  The packet is then written with MQTTPacket_send_publishSource.
+ * @param pubclient the client
+ * @param publish the topic and message id, which is pointed at the stored topic and properties
+ * of a QoS 1 or 2 message, and given its topic alias
+ * @param source where the payload is read from
+ * @param mm returns the message record for a QoS 1 or 2 message
+ * @return 0 or PAHO_MEMORY_ERROR
+ */
+int MQTTProtocol_prepareSourcePublish(Clients *pubclient, Publish *publish, MQTTClient_payloadSource *source,
+                                      int qos, int retained, Messages **mm) {
+    MQTTClient_payloadSource *copy = NULL;
+
+    if (qos > 0) {
+        if ((copy = malloc(sizeof(MQTTClient_payloadSource))) == NULL ||
+            (*mm = MQTTProtocol_createMessage(publish, mm, qos, retained, 0)) == NULL) {
+            free(copy);
+            return PAHO_MEMORY_ERROR;
+        }
+        *copy = *source;
+        (*mm)->publish->source = copy;
+        (*mm)->publish->size += (int) sizeof(MQTTClient_payloadSource);
+        state.publications_size += sizeof(MQTTClient_payloadSource);
+        ListAppendNoMalloc(pubclient->outboundMsgs, *mm, &(*mm)->link, (*mm)->len);
+        publish->topic = (*mm)->publish->topic;
+        publish->properties = (*mm)->properties;
+    }
+    MQTTProtocol_setTopicAlias(pubclient, publish);
+    return 0;
+}
+
+/* Point a publish packet structure at the stored data of a message, so it can be sent without copying */
+static void MQTTProtocol_messagePublish(Messages *m, Publish *publish) {
+    memset(publish, '\0', sizeof(Publish));
+    publish->msgId = m->msgid;
+    publish->topic = m->publish->topic;
+    publish->topiclen = m->publish->topiclen;
+    publish->payload = m->publish->payload;
+    publish->payloadlen = m->publish->payloadlen;
+    publish->MQTTVersion = m->MQTTVersion;
+    if (m->MQTTVersion >= 5)
+        publish->properties = m->properties;
+}
+
+/**
+ * Resend an in-flight message after a reconnect, with the dup flag set.  The packet is written
+ * straight from the stored topic and payload.
+ * @param client the client
+ * @param m the message, which stays in outboundMsgs
+ * @return the completion code of the write
+ */
+int MQTTProtocol_retryPublish(Clients *client, Messages *m) {
+    Publish publish;
+    int rc = 0;
+
+    MQTTProtocol_messagePublish(m, &publish);
+    MQTTProtocol_setTopicAlias(client, &publish);
+    m->lastTouch = MQTTTime_now();
+    if (m->publish->source)
+        rc = MQTTPacket_send_publishSource(&publish, m->publish->source, 1, m->qos, m->retain, &client->net,
+                                           client->clientID);
+    else
+        rc = MQTTPacket_send_publish(&publish, 1, m->qos, m->retain, &client->net, client->clientID);
+    return rc;
+}
+
+/**
+ * Send a message that was buffered while the client was not connected.
+ * QoS 1 and 2 messages move to outboundMsgs; QoS 0 messages are freed once written.
+ * @param pubclient the client
+ * @param m the buffered message, which the caller has removed from bufferedMsgs
+ * @return the completion code of the write
+ */
+int MQTTProtocol_startBufferedPublish(Clients *pubclient, Messages *m) {
+    Publish publish;
+    int rc = 0;
+
+    MQTTProtocol_messagePublish(m, &publish);
+    if (m->qos > 0) {
+        m->lastTouch = MQTTTime_now();
+        ListAppendNoMalloc(pubclient->outboundMsgs, m, &m->link, m->len);
+#if !defined(NO_PERSISTENCE)
+        if (pubclient->persistence)
+            MQTTPersistence_putMessage(pubclient, PERSISTENCE_OUTBOUND, m);
+#endif
+    }
+    MQTTProtocol_setTopicAlias(pubclient, &publish);
+    rc = MQTTPacket_send_publish(&publish, 0, m->qos, m->retain, &pubclient->net, pubclient->clientID);
+    if (m->qos == 0) {
+        pending_write *pw = NULL;
+
+        /* the socket buffer already points at the stored publication, so it can be kept as it is */
+        if (rc == TCPSOCKET_INTERRUPTED && (pw = Pool_alloc(POOL_PENDING_WRITE)) != NULL) {
+            pw->socket = pubclient->net.socket;
+            pw->p = m->publish;
+            ListAppendNoMalloc(&(state.pending_writes), pw, &pw->link, sizeof(pending_write));
+        } else
+            MQTTProtocol_removePublication(m->publish);
+        Pool_free(POOL_MESSAGES, m);
+    }
+    return rc;
+}
+
+/**
+ * Free the stored QoS 0 publications whose writes have completed
+ */
+void MQTTProtocol_checkPendingWrites(void) {
+    ListElement *le = state.pending_writes.first;
+
+    while (le) {
+        pending_write *pw = (pending_write *) (le->content);
+
+        le = le->next;
+        if (Socket_noPendingWrites(pw->socket)) {
+            MQTTProtocol_removePublication(pw->p);
+            ListDetachElement(&(state.pending_writes), &pw->link);
+            Pool_free(POOL_PENDING_WRITE, pw);
+        }
+    }
+}
+
 Messages *MQTTProtocol_createMessage(Publish *publish, Messages **mm, int qos, int retained, int allocatePayload) {
-    Messages *m = malloc(sizeof(Messages));
+    Messages *m = Pool_alloc(POOL_MESSAGES);
     if (!m)
         goto exit;
     m->len = sizeof(Messages);
@@ -113,7 +271,8 @@ Messages *MQTTProtocol_createMessage(Publish *publish, Messages **mm, int qos, i
         int len1;
         *mm = m;
         if ((m->publish = MQTTProtocol_storePublication(publish, &len1)) == NULL) {
-            free(m);
+            Pool_free(POOL_MESSAGES, m);
+            *mm = m = NULL;
             goto exit;
         }
         m->len += len1;
@@ -121,7 +280,7 @@ Messages *MQTTProtocol_createMessage(Publish *publish, Messages **mm, int qos, i
             char *temp = m->publish->payload;
 
             if ((m->publish->payload = malloc(m->publish->payloadlen)) == NULL) {
-                free(m);
+                Pool_free(POOL_MESSAGES, m);
                 goto exit;
             }
             memcpy(m->publish->payload, temp, m->publish->payloadlen);
@@ -145,7 +304,7 @@ Messages *MQTTProtocol_createMessage(Publish *publish, Messages **mm, int qos, i
 }
 
 Publications *MQTTProtocol_storePublication(Publish *publish, int *len) {
-    Publications *p = malloc(sizeof(Publications));
+    Publications *p = Pool_alloc(POOL_PUBLICATIONS);
     if (!p)
         goto exit;
     p->refcount = 1;
@@ -158,12 +317,10 @@ Publications *MQTTProtocol_storePublication(Publish *publish, int *len) {
     p->payload = publish->payload;
     publish->payload = NULL;
     *len += publish->payloadlen;
-    memcpy(p->mask, publish->mask, sizeof(p->mask));
-
-    if ((ListAppend(&(state.publications), p, *len)) == NULL) {
-        free(p);
-        p = NULL;
-    }
+    p->source = NULL;
+    p->size = *len;
+    ++state.publications;
+    state.publications_size += (size_t) p->size;
     exit:
     return p;
 }
@@ -175,8 +332,44 @@ void MQTTProtocol_removePublication(Publications *p) {
         p->payload = NULL;
         free(p->topic);
         p->topic = NULL;
-        ListRemove(&(state.publications), p);
+        free(p->source);
+        --state.publications;
+        state.publications_size -= (size_t) p->size;
+        Pool_free(POOL_PUBLICATIONS, p);
+    }
+}
+
+/**
+ * Resolve the topic alias of an inbound MQTT 5 PUBLISH.  A topic sent with an alias binds the
+ * alias to it; a PUBLISH with an alias and no topic takes the topic the alias is bound to.
+ * @param client the client
+ * @param publish the packet, or the first part of a streamed one
+ * @return 0, or -1 for a protocol error: an alias out of range, or one that is not bound
+ */
+int MQTTProtocol_resolveTopicAlias(Clients *client, Publish *publish) {
+    const char *topic = NULL;
+    int rc = -1;
+
+    if (publish->topicAlias == 0)
+        return 0;
+    if (publish->topic) {
+        if (client->inboundAliases == NULL &&
+            (client->inboundAliases = calloc(1, sizeof(MQTTTopicAlias_inbound))) == NULL)
+            goto exit;
+        rc = MQTTTopicAlias_bind(client->inboundAliases, publish->topicAlias, publish->topic, publish->topiclen);
+    } else if (client->inboundAliases &&
+               (topic = MQTTTopicAlias_lookup(client->inboundAliases, publish->topicAlias, &publish->topiclen))) {
+        /* the one copy of the topic, which messageArrived is given to keep */
+        if ((publish->topic = malloc((size_t) publish->topiclen + 1)) != NULL) {
+            memcpy(publish->topic, topic, (size_t) publish->topiclen + 1);
+            rc = 0;
+        }
     }
+    exit:
+    if (rc != 0)
+        Log(LOG_ERROR, -1, "Bad topic alias %d from the server for client %s", publish->topicAlias,
+            client->clientID);
+    return rc;
 }
 
 int MQTTProtocol_handlePublishes(void *pack, SOCKET sock) {
@@ -209,9 +402,20 @@ int MQTTProtocol_handlePublishes(void *pack, SOCKET sock) {
         int len;
         int already_received = 0;
         ListElement *listElem = NULL;
-        Messages *m = malloc(sizeof(Messages));
+        Messages *m = NULL;
         Publications *p = NULL;
-        if (!m) {
+
+        if ((listElem = ListFindItem(client->inboundMsgs, &(publish->msgId), messageIDCompare)) != NULL &&
+            ((Messages *) (listElem->content))->publish == NULL &&
+            ((Messages *) (listElem->content))->nextMessageType == PUBREL) {
+            /* sent again, whole, after it was streamed: it has been delivered, so only acknowledge it */
+            if (socketHasPendingWrites)
+                rc = MQTTProtocol_queueAck(client, PUBREC, publish->msgId);
+            else
+                rc = MQTTPacket_send_pubrec(publish->msgId, &client->net, client->clientID);
+            goto exit;
+        }
+        if ((m = Pool_alloc(POOL_MESSAGES)) == NULL) {
             rc = PAHO_MEMORY_ERROR;
             goto exit;
         }
@@ -227,11 +431,12 @@ int MQTTProtocol_handlePublishes(void *pack, SOCKET sock) {
             NULL) {   /* discard queued publication with same msgID that the current incoming message */
             Messages *msg = (Messages *) (listElem->content);
             MQTTProtocol_removePublication(msg->publish);
-            ListInsert(client->inboundMsgs, m, sizeof(Messages) + len, listElem);
-            ListRemove(client->inboundMsgs, msg);
+            ListInsertNoMalloc(client->inboundMsgs, m, &m->link, sizeof(Messages) + len, listElem);
+            ListDetachElement(client->inboundMsgs, &msg->link);
+            Pool_free(POOL_MESSAGES, msg);
             already_received = 1;
         } else
-            ListAppend(client->inboundMsgs, m, sizeof(Messages) + len);
+            ListAppendNoMalloc(client->inboundMsgs, m, &m->link, sizeof(Messages) + len);
 
         {    /* allocate and copy payload data as it's needed for pubrel.
 		       For other cases, it's done in Protocol_processPublication */
@@ -243,8 +448,14 @@ int MQTTProtocol_handlePublishes(void *pack, SOCKET sock) {
             }
             memcpy(m->publish->payload, temp, m->publish->payloadlen);
         }
+#if !defined(NO_PERSISTENCE)
+        if (client->persistence)
+            MQTTPersistence_putMessage(client, PERSISTENCE_INBOUND, m);
+#endif
         if (socketHasPendingWrites)
             rc = MQTTProtocol_queueAck(client, PUBREC, publish->msgId);
+        else
+            rc = MQTTPacket_send_pubrec(publish->msgId, &client->net, client->clientID);
         publish->topic = NULL;
     }
     exit:
@@ -252,6 +463,72 @@ int MQTTProtocol_handlePublishes(void *pack, SOCKET sock) {
     return rc;
 }
 
+/**
+ * Whether a part of a streamed PUBLISH is to be delivered.  A QoS 2 message is held in
+ * inboundMsgs from its first part until its PUBREL, without its topic or payload, which have
+ * been delivered, so that a copy the server sends again before the PUBREL is not delivered
+ * again.  A message whose stream was cut off by the connection closing is still delivered
+ * again, from its first part, as it was never acknowledged.  The record is not persisted.
+ * @param client the client
+ * @param publish the part
+ * @return 1 to deliver the part, or 0 if the message has been delivered already
+ */
+int MQTTProtocol_wantPublishPart(Clients *client, Publish *publish) {
+    Messages *m = NULL;
+    int rc = 1;
+
+    if (publish->header.bits.qos < 2)
+        goto exit;
+    if (ListFindItem(client->inboundMsgs, &(publish->msgId), messageIDCompare) != NULL) {
+        m = (Messages *) (client->inboundMsgs->current->content);
+        if ((rc = (m->publish == NULL && m->nextMessageType == PUBLISH)) == 0 && publish->offset == 0)
+            Log(TRACE_MIN, -1, "Streamed PUBLISH msgid %d for client %s already received, not delivered",
+                publish->msgId, client->clientID);
+    } else if (publish->offset == 0 && (m = Pool_alloc(POOL_MESSAGES)) != NULL) {
+        memset(m, '\0', sizeof(Messages));
+        m->msgid = publish->msgId;
+        m->qos = publish->header.bits.qos;
+        m->retain = publish->header.bits.retain;
+        m->MQTTVersion = publish->MQTTVersion;
+        m->nextMessageType = PUBLISH; /* until the last part, then PUBREL */
+        ListAppendNoMalloc(client->inboundMsgs, m, &m->link, sizeof(Messages));
+    }
+    exit:
+    return rc;
+}
+
+/**
+ * Finish with a part of a streamed PUBLISH, once it has been delivered.  After the last part the
+ * message is acknowledged, with a PUBACK or PUBREC, and the packet freed; the earlier parts
+ * belong to the connection.  A QoS 2 message is then held, as MQTTProtocol_wantPublishPart
+ * recorded it, until its PUBREL.
+ */
+int MQTTProtocol_handlePublishPart(void *pack, SOCKET sock) {
+    Publish *publish = (Publish *) pack;
+    Clients *client = NULL;
+    int rc = TCPSOCKET_COMPLETE;
+
+    if (publish->offset + (size_t) publish->payloadlen < publish->total)
+        goto exit;
+    client = (Clients *) (ListFindItem(bstate->clients, &sock, MQTTProperties_socketCompare)->content);
+    Log(LOG_PROTOCOL, 11, NULL, sock, client->clientID, publish->msgId, publish->header.bits.qos,
+        publish->header.bits.retain, (int) publish->total, 0, "");
+    if (publish->header.bits.qos == 2 &&
+        ListFindItem(client->inboundMsgs, &(publish->msgId), messageIDCompare) != NULL)
+        ((Messages *) (client->inboundMsgs->current->content))->nextMessageType = PUBREL;
+    if (publish->header.bits.qos > 0) { /* acknowledged as handlePublishes does */
+        if (!Socket_noPendingWrites(sock))
+            rc = MQTTProtocol_queueAck(client, (publish->header.bits.qos == 1) ? PUBACK : PUBREC, publish->msgId);
+        else if (publish->header.bits.qos == 1)
+            rc = MQTTPacket_send_puback(publish->msgId, &client->net, client->clientID);
+        else
+            rc = MQTTPacket_send_pubrec(publish->msgId, &client->net, client->clientID);
+    }
+    MQTTPacket_freePublish(publish);
+    exit:
+    return rc;
+}
+
 int MQTTProtocol_handlePubacks(void *pack, SOCKET sock) {
     Puback *puback = (Puback *) pack;
     Clients *client = NULL;
@@ -270,33 +547,127 @@ int MQTTProtocol_handlePubacks(void *pack, SOCKET sock) {
             Log(TRACE_MIN, 6, NULL, "PUBACK", client->clientID, puback->msgId);
             MQTTProtocol_removePublication(m->publish);
 
-            ListRemove(client->outboundMsgs, m);
+            ListDetachElement(client->outboundMsgs, &m->link);
+            Pool_free(POOL_MESSAGES, m);
+#if !defined(NO_PERSISTENCE)
+            if (client->persistence)
+                MQTTPersistence_remove(client, PERSISTENCE_OUTBOUND, (unsigned int) puback->msgId);
+#endif
         }
     }
-    free(pack);
+    Pool_free(POOL_ACK, pack);
+    return rc;
+}
+
+/**
+ * Complete the delivery of a QoS 2 message: queue it for the application, forget it, and answer
+ * with a PUBCOMP, or queue the PUBCOMP if a write is pending.  A streamed message has already
+ * been delivered, and only its record is forgotten.
+ */
+int MQTTProtocol_handlePubrels(void *pack, SOCKET sock) {
+    Pubrel *pubrel = (Pubrel *) pack;
+    Clients *client = NULL;
+    int rc = TCPSOCKET_COMPLETE;
+
+    client = (Clients *) (ListFindItem(bstate->clients, &sock, MQTTProperties_socketCompare)->content);
+    Log(LOG_PROTOCOL, 17, NULL, sock, client->clientID, pubrel->msgId);
+    if (ListFindItem(client->inboundMsgs, &(pubrel->msgId), messageIDCompare) != NULL) {
+        Messages *m = (Messages *) (client->inboundMsgs->current->content);
+        Publish publish;
+
+        if (m->publish == NULL) /* streamed */
+            goto forget;
+        memset(&publish, '\0', sizeof(publish));
+        publish.header.bits.qos = m->qos;
+        publish.header.bits.retain = m->retain;
+        publish.msgId = m->msgid;
+        publish.topic = MQTTStrdup(m->publish->topic); /* taken by the queue entry */
+        publish.topiclen = m->publish->topiclen;
+        publish.payload = m->publish->payload;
+        publish.payloadlen = m->publish->payloadlen;
+        publish.MQTTVersion = m->MQTTVersion;
+        if (publish.topic)
+            Protocol_processPublication(&publish, client, 1);
+        free(publish.topic);
+#if !defined(NO_PERSISTENCE)
+        if (client->persistence)
+            MQTTPersistence_remove(client, PERSISTENCE_INBOUND, (unsigned int) pubrel->msgId);
+#endif
+        MQTTProtocol_removePublication(m->publish);
+        forget:
+        ListDetachElement(client->inboundMsgs, &m->link);
+        Pool_free(POOL_MESSAGES, m);
+    }
+    if (!Socket_noPendingWrites(sock))
+        rc = MQTTProtocol_queueAck(client, PUBCOMP, pubrel->msgId);
+    else
+        rc = MQTTPacket_send_pubcomp(pubrel->msgId, &client->net, client->clientID);
+    Pool_free(POOL_ACK, pack);
+    return rc;
+}
+
+/**
+ * Send the acknowledgements queued while the socket had a pending write, oldest first, for as
+ * long as the socket takes them without a write being left pending.
+ * @param client the client
+ * @return the completion code of the last write
+ */
+int MQTTProtocol_flushAcks(Clients *client) {
+    int rc = TCPSOCKET_COMPLETE;
+
+    while (client->outboundQueue->count > 0 && Socket_noPendingWrites(client->net.socket)) {
+        AckRequest *ackReq = (AckRequest *) (client->outboundQueue->first->content);
+
+        ListDetachElement(client->outboundQueue, &ackReq->link);
+        if (ackReq->ackType == PUBACK)
+            rc = MQTTPacket_send_puback(ackReq->messageId, &client->net, client->clientID);
+        else if (ackReq->ackType == PUBREC)
+            rc = MQTTPacket_send_pubrec(ackReq->messageId, &client->net, client->clientID);
+        else
+            rc = MQTTPacket_send_pubcomp(ackReq->messageId, &client->net, client->clientID);
+        Pool_free(POOL_ACK_REQUEST, ackReq);
+        if (rc == SOCKET_ERROR)
+            break;
+    }
     return rc;
 }
 
 int MQTTProtocol_queueAck(Clients *client, int ackType, int msgId) {
     int rc = 0;
     AckRequest *ackReq = NULL;
-    ackReq = malloc(sizeof(AckRequest));
+    ackReq = Pool_alloc(POOL_ACK_REQUEST);
     if (!ackReq)
         rc = PAHO_MEMORY_ERROR;
     else {
         ackReq->messageId = msgId;
         ackReq->ackType = ackType;
-        ListAppend(client->outboundQueue, ackReq, sizeof(AckRequest));
+        ListAppendNoMalloc(client->outboundQueue, ackReq, &ackReq->link, sizeof(AckRequest));
     }
     return rc;
 }
 
+/* Free a list whose items come from one of the pools, with their list elements embedded */
+static void MQTTProtocol_freePooledList(List *list, Pool_type type) {
+    while (list->first) {
+        void *content = list->first->content;
+
+        ListDetachElement(list, list->first);
+        Pool_free(type, content);
+    }
+    free(list);
+}
+
 void MQTTProtocol_freeClient(Clients *client) {
     /* free up pending message lists here, and any other allocated data */
+    MQTTPacket_endStream(&client->net);
+    WebSocket_free(&client->net);
     MQTTProtocol_freeMessageList(client->outboundMsgs);
     MQTTProtocol_freeMessageList(client->inboundMsgs);
-    ListFree(client->messageQueue);
-    ListFree(client->outboundQueue);
+    MQTTProtocol_freePooledList(client->messageQueue, POOL_QENTRY);
+    MQTTProtocol_freePooledList(client->outboundQueue, POOL_ACK_REQUEST);
+    MQTTProtocol_freeMessageList(client->bufferedMsgs);
+    MQTTTopicAlias_free(client->topicAliases);
+    MQTTTopicAlias_freeInbound(client->inboundAliases);
     free(client->clientID);
     client->clientID = NULL;
     if (client->username)
@@ -306,18 +677,19 @@ void MQTTProtocol_freeClient(Clients *client) {
 }
 
 void MQTTProtocol_emptyMessageList(List *msgList) {
-    ListElement *current = NULL;
+    while (msgList->first) {
+        Messages *m = (Messages *) (msgList->first->content);
 
-    while (ListNextElement(msgList, &current)) {
-        Messages *m = (Messages *) (current->content);
+        ListDetachElement(msgList, &m->link);
         MQTTProtocol_removePublication(m->publish);
+        Pool_free(POOL_MESSAGES, m);
     }
-    ListEmpty(msgList);
+    ListZero(msgList);
 }
 
 void MQTTProtocol_freeMessageList(List *msgList) {
     MQTTProtocol_emptyMessageList(msgList);
-    ListFree(msgList);
+    free(msgList);
 }
 
 char *MQTTStrncpy(char *dest, const char *src, size_t dest_size) {
@@ -398,21 +770,118 @@ int MQTTProtocol_connect(const char *ip_address, Clients *aClient, int websocket
     if (timeout < 0)
         rc = -1;
     else
-        rc = Socket_new(ip_address, addr_len, port, &(aClient->net.socket), timeout);
+        rc = Socket_new(ip_address, addr_len, port, &(aClient->net.socket), timeout, aClient->fastOpen);
 
-    if (rc == EINPROGRESS || rc == EWOULDBLOCK)
+    if (rc == RESOLVER_IN_PROGRESS)
+        aClient->connect_state = RESOLVE_IN_PROGRESS; /* host name lookup started - call again later */
+    else if (rc == EINPROGRESS || rc == EWOULDBLOCK)
         aClient->connect_state = TCP_IN_PROGRESS; /* TCP connect called - wait for connect completion */
-    else if (rc == 0) {    /* TCP connect completed. If SSL, send SSL connect */
+    else if (rc == 0)    /* TCP connect completed */
+        rc = MQTTProtocol_handshake(ip_address, aClient, websocket, MQTTVersion);
+    else
+        aClient->connect_state = NOT_IN_PROGRESS;
+    return rc;
+}
+
+/**
+ * Take a connect on from the completion of its TCP connect: send the WebSocket upgrade request
+ * when the connection is to be upgraded, otherwise the MQTT CONNECT packet.
+ * @param uri the serverURI, less any scheme, whose host, port and path go in the upgrade request
+ * @param aClient the client
+ * @param websocket whether the connection is to be upgraded to a WebSocket
+ * @param MQTTVersion the MQTT version to connect with
+ * @return 0, or SOCKET_ERROR when the connect has failed
+ */
+int MQTTProtocol_handshake(const char *uri, Clients *aClient, int websocket, int MQTTVersion) {
+    int rc = 0;
+
+    if (websocket) {
+        const char *path = NULL;
+        int port;
+        size_t addr_len = MQTTProtocol_addressPort(uri, &port, &path, WS_DEFAULT_PORT);
 
-        /* Now send the MQTT connect packet */
-        if ((rc = MQTTPacket_send_connect(aClient, MQTTVersion)) == 0)
-            aClient->connect_state = WAIT_FOR_CONNACK; /* MQTT Connect sent - wait for CONNACK */
+        aClient->net.websocket = 0; /* a new connection, not upgraded until the server agrees */
+        if (WebSocket_connect(&aClient->net, 0, uri, addr_len, port, path) == 1)
+            aClient->connect_state = WEBSOCKET_IN_PROGRESS; /* upgrade request sent - wait for the answer */
         else
-            aClient->connect_state = NOT_IN_PROGRESS;
+            rc = SOCKET_ERROR;
+    } else if ((rc = MQTTPacket_send_connect(aClient, MQTTVersion)) == 0)
+        aClient->connect_state = WAIT_FOR_CONNACK; /* MQTT Connect sent - wait for CONNACK */
+    if (rc != 0) {
+        aClient->connect_state = NOT_IN_PROGRESS;
+        rc = SOCKET_ERROR;
     }
     return rc;
 }
 
+/**
+ * Read the answer to the WebSocket upgrade request of a client and, once the connection has been
+ * upgraded, send the MQTT CONNECT packet.
+ * @param aClient the client, whose connect_state is WEBSOCKET_IN_PROGRESS
+ * @return 0, also when the answer is not all there yet, or SOCKET_ERROR when the connect has failed
+ */
+int MQTTProtocol_upgrade(Clients *aClient) {
+    int rc = WebSocket_upgrade(&aClient->net);
+
+    if (rc == TCPSOCKET_INTERRUPTED)
+        rc = 0;
+    else if (rc == 1 && MQTTPacket_send_connect(aClient, aClient->MQTTVersion) == 0) {
+        aClient->connect_state = WAIT_FOR_CONNACK; /* MQTT Connect sent - wait for CONNACK */
+        rc = 0;
+    } else {
+        aClient->connect_state = NOT_IN_PROGRESS;
+        rc = SOCKET_ERROR;
+    }
+    return rc;
+}
+
+/* Copy the host part of a serverURI, without IPv6 brackets */
+static char *MQTTProtocol_host(const char *uri, int websocket, int *port) {
+    size_t len = MQTTProtocol_addressPort(uri, port, NULL, websocket ? WS_DEFAULT_PORT : MQTT_DEFAULT_PORT);
+    char *host = NULL;
+
+    if (uri[0] == '[') {
+        ++uri;
+        --len;
+    }
+    if ((host = malloc(len + 1)) != NULL) {
+        memcpy(host, uri, len);
+        host[len] = '\0';
+    }
+    return host;
+}
+
+/**
+ * Look up the addresses of the host of a serverURI, through the shared cache.
+ * @param uri the serverURI, without a tcp:// prefix
+ * @param websocket whether the default port is the websocket one
+ * @param timeout milliseconds to wait for the lookup
+ * @param result returns the addresses
+ * @param port returns the port
+ * @return 0, RESOLVER_IN_PROGRESS or SOCKET_ERROR
+ */
+int MQTTProtocol_resolve(const char *uri, int websocket, long timeout, Resolver_result *result, int *port) {
+    char *host = MQTTProtocol_host(uri, websocket, port);
+    int rc = SOCKET_ERROR;
+
+    if (host) {
+        rc = Resolver_lookup(host, timeout, result);
+        free(host);
+    }
+    return rc;
+}
+
+/* Remember which address of the host of a serverURI a connect succeeded to */
+void MQTTProtocol_preferAddress(const char *uri, int websocket, const struct sockaddr *addr) {
+    int port;
+    char *host = MQTTProtocol_host(uri, websocket, &port);
+
+    if (host) {
+        Resolver_prefer(host, addr);
+        free(host);
+    }
+}
+
 int MQTTProtocol_subscribe(Clients *client, List *topics, List *qoss, int msgID, MQTTProperties *props) {
     int rc = 0;
     rc = MQTTPacket_send_subscribe(topics, qoss, msgID, 0, client);
@@ -423,12 +892,12 @@ void Protocol_processPublication(Publish *publish, Clients *client, int allocate
     qEntry *qe = NULL;
     MQTTClient_message *mm = NULL;
     MQTTClient_message initialized = MQTTClient_message_initializer;
-    qe = malloc(sizeof(qEntry));
+    qe = Pool_alloc(POOL_QENTRY);
     if (!qe)
         goto exit;
-    mm = malloc(sizeof(MQTTClient_message));
+    mm = malloc(sizeof(MQTTClient_message)); /* not pooled: it is handed to the application */
     if (!mm) {
-        free(qe);
+        Pool_free(POOL_QENTRY, qe);
         goto exit;
     }
     memcpy(mm, &initialized, sizeof(MQTTClient_message));
@@ -441,7 +910,7 @@ void Protocol_processPublication(Publish *publish, Clients *client, int allocate
         mm->payload = malloc(publish->payloadlen);
         if (mm->payload == NULL) {
             free(mm);
-            free(qe);
+            Pool_free(POOL_QENTRY, qe);
             goto exit;
         }
         memcpy(mm->payload, publish->payload, publish->payloadlen);
@@ -456,9 +925,14 @@ void Protocol_processPublication(Publish *publish, Clients *client, int allocate
         mm->dup = publish->header.bits.dup;
     mm->msgid = publish->msgId;
 
-    if (publish->MQTTVersion >= 5)
-        mm->properties = MQTTProperties_copy(&publish->properties);
-    ListAppend(client->messageQueue, qe, sizeof(qe) + sizeof(mm) + mm->payloadlen + strlen(qe->topicName) + 1);
+    if (publish->MQTTVersion >= 5) /* the application frees them with MQTTProperties_free */
+        mm->properties = MQTTProperties_fromIndex(&publish->propIndex);
+    qe->seqno = ++client->qentry_seqno;
+    ListAppendNoMalloc(client->messageQueue, qe, &qe->link, sizeof(qe) + sizeof(mm) + mm->payloadlen + strlen(qe->topicName) + 1);
+#if !defined(NO_PERSISTENCE)
+    if (client->persistence)
+        MQTTPersistence_putQueued(client, qe);
+#endif
     exit:
     FUNC_EXIT;
 }
\ No newline at end of file
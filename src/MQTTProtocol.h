@@ -6,9 +6,25 @@
 #define MQTT_CLIENT_MQTTPROTOCOL_H
 
 #include "Socket.h"
+#include "Resolver.h"
 
 int MQTTProtocol_startPublish(Clients *pubclient, Publish *publish, int qos, int retained, Messages **m);
 
+void MQTTProtocol_setTopicAlias(Clients *client, Publish *publish);
+
+int MQTTProtocol_resolveTopicAlias(Clients *client, Publish *publish);
+
+int MQTTProtocol_startBufferedPublish(Clients *pubclient, Messages *m);
+
+Messages *MQTTProtocol_storeMessage(Clients *pubclient, Publish *publish, int qos, int retained);
+
+int MQTTProtocol_prepareSourcePublish(Clients *pubclient, Publish *publish, MQTTClient_payloadSource *source,
+                                      int qos, int retained, Messages **mm);
+
+void MQTTProtocol_checkPendingWrites(void);
+
+int MQTTProtocol_retryPublish(Clients *client, Messages *m);
+
 Messages *MQTTProtocol_createMessage(Publish *publish, Messages **mm, int qos, int retained, int allocatePayload);
 
 Publications *MQTTProtocol_storePublication(Publish *publish, int *len);
@@ -23,8 +39,16 @@ void Protocol_processPublication(Publish *publish, Clients *client, int allocate
 
 int MQTTProtocol_handlePublishes(void *pack, SOCKET sock);
 
+int MQTTProtocol_wantPublishPart(Clients *client, Publish *publish);
+
+int MQTTProtocol_handlePublishPart(void *pack, SOCKET sock);
+
 int MQTTProtocol_handlePubacks(void *pack, SOCKET sock);
 
+int MQTTProtocol_handlePubrels(void *pack, SOCKET sock);
+
+int MQTTProtocol_flushAcks(Clients *client);
+
 void MQTTProtocol_freeClient(Clients *client);
 
 void MQTTProtocol_emptyMessageList(List *msgList);
@@ -39,6 +63,14 @@ size_t MQTTProtocol_addressPort(const char *uri, int *port, const char **topic,
 
 int MQTTProtocol_connect(const char *ip_address, Clients *aClient, int websocket, int MQTTVersion, long timeout);
 
+int MQTTProtocol_handshake(const char *uri, Clients *aClient, int websocket, int MQTTVersion);
+
+int MQTTProtocol_upgrade(Clients *aClient);
+
+int MQTTProtocol_resolve(const char *uri, int websocket, long timeout, Resolver_result *result, int *port);
+
+void MQTTProtocol_preferAddress(const char *uri, int websocket, const struct sockaddr *addr);
+
 int MQTTProtocol_subscribe(Clients *client, List *topics, List *qoss, int msgID,MQTTProperties *props);
 
 
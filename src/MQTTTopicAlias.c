@@ -0,0 +1,181 @@
+//
+// Created by Administrator on 2026/10/19.
+//
+
+#include "MQTTTopicAlias.h"
+#include "Log.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Create the alias table of a connection.
+ * @param maximum the most aliases to bind, 1 to 65535
+ * @return the table, or NULL if memory is exhausted
+ */
+MQTTTopicAlias_table *MQTTTopicAlias_create(int maximum) {
+    MQTTTopicAlias_table *table = NULL;
+    unsigned int buckets = 2;
+    int i;
+
+    while (buckets < (unsigned int) maximum * 2)
+        buckets *= 2;
+    if ((table = calloc(1, sizeof(MQTTTopicAlias_table))) == NULL)
+        goto exit;
+    if ((table->buckets = malloc(buckets * sizeof(int))) == NULL ||
+        (table->entries = calloc((size_t) maximum, sizeof(MQTTTopicAlias_entry))) == NULL) {
+        MQTTTopicAlias_free(table);
+        table = NULL;
+        goto exit;
+    }
+    table->maximum = maximum;
+    table->mask = buckets - 1;
+    for (i = 0; i < (int) buckets; ++i)
+        table->buckets[i] = -1;
+    exit:
+    return table;
+}
+
+void MQTTTopicAlias_free(MQTTTopicAlias_table *table) {
+    int i;
+
+    if (table == NULL)
+        return;
+    for (i = 0; table->entries && i < table->used; ++i)
+        free(table->entries[i].topic);
+    free(table->entries);
+    free(table->buckets);
+    free(table);
+}
+
+/* FNV-1a */
+unsigned int MQTTTopicAlias_hash(const char *topic, size_t len) {
+    unsigned int hash = 2166136261U;
+    size_t i;
+
+    for (i = 0; i < len; ++i) {
+        hash ^= (unsigned char) topic[i];
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+/* Move an entry to the front of the list in order of use */
+static void MQTTTopicAlias_touch(MQTTTopicAlias_table *table, MQTTTopicAlias_entry *e) {
+    if (table->first == e)
+        return;
+    if (e->prev)
+        e->prev->next = e->next;
+    if (e->next)
+        e->next->prev = e->prev;
+    if (table->last == e)
+        table->last = e->prev;
+    e->prev = NULL;
+    e->next = table->first;
+    if (table->first)
+        table->first->prev = e;
+    table->first = e;
+    if (table->last == NULL)
+        table->last = e;
+}
+
+/* Take an entry out of its hash bucket */
+static void MQTTTopicAlias_unchain(MQTTTopicAlias_table *table, int index) {
+    int *link = &table->buckets[table->entries[index].hash & table->mask];
+
+    while (*link != index)
+        link = &table->entries[*link].chain;
+    *link = table->entries[index].chain;
+}
+
+/**
+ * Get the alias to send a topic with.  A topic already bound needs only the alias; otherwise it
+ * is bound to a free alias, or to the one used least recently, and must be sent in full with it.
+ * @param table the alias table of the connection
+ * @param topic the topic
+ * @param len the length of the topic
+ * @param hash MQTTTopicAlias_hash of the topic
+ * @param bound returns 1 if the topic can be left out of the packet
+ * @return the alias, or 0 if the topic cannot be copied
+ */
+int MQTTTopicAlias_get(MQTTTopicAlias_table *table, const char *topic, size_t len, unsigned int hash, int *bound) {
+    MQTTTopicAlias_entry *e = NULL;
+    int index = table->buckets[hash & table->mask];
+    char *copy = NULL;
+
+    *bound = 0;
+    while (index >= 0) {
+        e = &table->entries[index];
+        if (e->hash == hash && e->topiclen == len && memcmp(e->topic, topic, len) == 0) {
+            MQTTTopicAlias_touch(table, e);
+            *bound = 1;
+            return index + 1;
+        }
+        index = e->chain;
+    }
+    if ((copy = malloc(len + 1)) == NULL)
+        return 0;
+    memcpy(copy, topic, len);
+    copy[len] = '\0';
+    if (table->used < table->maximum)
+        index = table->used++;
+    else {
+        index = (int) (table->last - table->entries);
+        MQTTTopicAlias_unchain(table, index);
+        Log(TRACE_MAX, -1, "Topic alias %d moves from %s to %s", index + 1, table->last->topic, copy);
+        free(table->last->topic);
+    }
+    e = &table->entries[index];
+    e->topic = copy;
+    e->topiclen = len;
+    e->hash = hash;
+    e->chain = table->buckets[hash & table->mask];
+    table->buckets[hash & table->mask] = index;
+    MQTTTopicAlias_touch(table, e);
+    return index + 1;
+}
+
+void MQTTTopicAlias_freeInbound(MQTTTopicAlias_inbound *table) {
+    int i;
+
+    if (table == NULL)
+        return;
+    for (i = 0; i < MQTTTOPICALIAS_INBOUND_MAXIMUM; ++i)
+        free(table->bindings[i].topic);
+    free(table);
+}
+
+/**
+ * Bind an alias the server has sent with a topic, replacing whatever it was bound to.
+ * @param table the inbound alias table of the connection
+ * @param alias the alias, 1 to MQTTTOPICALIAS_INBOUND_MAXIMUM
+ * @param topic the topic, which is copied
+ * @param topiclen the length of the topic
+ * @return 0, or -1 if the alias is out of range or the topic cannot be copied
+ */
+int MQTTTopicAlias_bind(MQTTTopicAlias_inbound *table, int alias, const char *topic, int topiclen) {
+    char *copy = NULL;
+
+    if (alias < 1 || alias > MQTTTOPICALIAS_INBOUND_MAXIMUM || (copy = malloc((size_t) topiclen + 1)) == NULL)
+        return -1;
+    memcpy(copy, topic, (size_t) topiclen);
+    copy[topiclen] = '\0';
+    free(table->bindings[alias - 1].topic);
+    table->bindings[alias - 1].topic = copy;
+    table->bindings[alias - 1].topiclen = topiclen;
+    return 0;
+}
+
+/**
+ * Find the topic an alias the server has sent is bound to.
+ * @param table the inbound alias table of the connection
+ * @param alias the alias
+ * @param topiclen returns the length of the topic
+ * @return the topic, which belongs to the table, or NULL if the alias is not bound
+ */
+const char *MQTTTopicAlias_lookup(MQTTTopicAlias_inbound *table, int alias, int *topiclen) {
+    if (alias < 1 || alias > MQTTTOPICALIAS_INBOUND_MAXIMUM || table->bindings[alias - 1].topic == NULL)
+        return NULL;
+    *topiclen = table->bindings[alias - 1].topiclen;
+    return table->bindings[alias - 1].topic;
+}
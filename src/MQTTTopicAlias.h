@@ -0,0 +1,63 @@
+//
+// Created by Administrator on 2026/10/19.
+//
+// MQTT 5 outbound topic aliases.  Each connection keeps a table of the topics it has bound to
+// aliases, up to the Topic Alias Maximum the server sent in CONNACK.  Once the table is full,
+// the alias used least recently is bound to the next new topic.  The table lasts as long as
+// the connection.
+//
+// Inbound, the client takes up to MQTTTOPICALIAS_INBOUND_MAXIMUM aliases from the server, as it
+// says in CONNECT.  They are held in a table of that fixed size, so that a PUBLISH which carries
+// only an alias is resolved by indexing, with nothing to search or allocate.
+//
+
+#ifndef MQTT_CLIENT_MQTTTOPICALIAS_H
+#define MQTT_CLIENT_MQTTTOPICALIAS_H
+
+#include <stddef.h>
+
+/** the most aliases a connection uses, unless MQTTClient_setTopicAliases says otherwise */
+#define MQTTTOPICALIAS_DEFAULT_MAXIMUM 128
+
+/** the topic aliases a connection takes from the server, its Topic Alias Maximum in CONNECT */
+#define MQTTTOPICALIAS_INBOUND_MAXIMUM 32
+
+typedef struct MQTTTopicAlias_entry {
+    char *topic;                /**< a copy of the topic, NULL while the alias is free */
+    size_t topiclen;
+    unsigned int hash;
+    int chain;                  /**< the next entry in the same hash bucket, or -1 */
+    struct MQTTTopicAlias_entry *prev, *next; /**< in order of use, most recent first */
+} MQTTTopicAlias_entry;
+
+typedef struct MQTTTopicAlias_table {
+    int maximum;                /**< the aliases that can be bound */
+    int used;                   /**< the aliases bound so far */
+    unsigned int mask;          /**< the number of hash buckets less one */
+    int *buckets;               /**< the first entry in each hash bucket, or -1 */
+    MQTTTopicAlias_entry *entries; /**< entry i holds alias i + 1 */
+    MQTTTopicAlias_entry *first, *last;
+} MQTTTopicAlias_table;
+
+typedef struct MQTTTopicAlias_inbound {
+    struct {
+        char *topic;            /**< a copy of the topic, NULL while the alias is unbound */
+        int topiclen;
+    } bindings[MQTTTOPICALIAS_INBOUND_MAXIMUM]; /**< alias n is bindings[n - 1] */
+} MQTTTopicAlias_inbound;
+
+MQTTTopicAlias_table *MQTTTopicAlias_create(int maximum);
+
+void MQTTTopicAlias_free(MQTTTopicAlias_table *table);
+
+unsigned int MQTTTopicAlias_hash(const char *topic, size_t len);
+
+int MQTTTopicAlias_get(MQTTTopicAlias_table *table, const char *topic, size_t len, unsigned int hash, int *bound);
+
+void MQTTTopicAlias_freeInbound(MQTTTopicAlias_inbound *table);
+
+int MQTTTopicAlias_bind(MQTTTopicAlias_inbound *table, int alias, const char *topic, int topiclen);
+
+const char *MQTTTopicAlias_lookup(MQTTTopicAlias_inbound *table, int alias, int *topiclen);
+
+#endif //MQTT_CLIENT_MQTTTOPICALIAS_H
@@ -25,6 +25,7 @@
  * */
 
 #include "LinkedList.h"
+#include "Pool.h"
 #include <string.h>
 
 
@@ -85,7 +86,7 @@ void ListAppendNoMalloc(List* aList, void* content, ListElement* newel, size_t s
  */
 ListElement* ListAppend(List* aList, void* content, size_t size)
 {
-	ListElement* newel = malloc(sizeof(ListElement));
+	ListElement* newel = Pool_alloc(POOL_LIST_ELEMENT);
 	if (newel)
 		ListAppendNoMalloc(aList, content, newel, size);
 	return newel;
@@ -102,10 +103,25 @@ ListElement* ListAppend(List* aList, void* content, size_t size)
  */
 ListElement* ListInsert(List* aList, void* content, size_t size, ListElement* index)
 {
-	ListElement* newel = malloc(sizeof(ListElement));
+	ListElement* newel = Pool_alloc(POOL_LIST_ELEMENT);
 
-	if (newel == NULL)
-		return newel;
+	if (newel)
+		ListInsertNoMalloc(aList, content, newel, size, index);
+	return newel;
+}
+
+
+/**
+ * Insert an already allocated ListElement and content to a list at a specific position.
+ * @param aList the list to which the item is to be added
+ * @param content the list item content itself
+ * @param newel the ListElement to be used in adding the new item
+ * @param size the size of the element
+ * @param index the position in the list. If NULL, this function is equivalent
+ * to ListAppendNoMalloc.
+ */
+void ListInsertNoMalloc(List* aList, void* content, ListElement* newel, size_t size, ListElement* index)
+{
 	if ( index == NULL )
 		ListAppendNoMalloc(aList, content, newel, size);
 	else
@@ -123,7 +139,6 @@ ListElement* ListInsert(List* aList, void* content, size_t size, ListElement* in
 		++(aList->count);
 		aList->size += size;
 	}
-	return newel;
 }
 
 
@@ -222,7 +237,7 @@ static int ListUnlink(List* aList, void* content, int(*callback)(void*, void*),
     }
 	if (saved == aList->current)
 		saveddeleted = 1;
-	free(aList->current);
+	Pool_free(POOL_LIST_ELEMENT, aList->current);
 	if (saveddeleted)
 		aList->current = next;
 	else
@@ -275,7 +290,7 @@ void* ListDetachHead(List* aList)
 		aList->first = aList->first->next;
 		if (aList->first)
 			aList->first->prev = NULL;
-		free(first);
+		Pool_free(POOL_LIST_ELEMENT, first);
 		--(aList->count);
 	}
 	return content;
@@ -313,7 +328,7 @@ void* ListPopTail(List* aList)
 		aList->last = aList->last->prev;
 		if (aList->last)
 			aList->last->next = NULL;
-		free(last);
+		Pool_free(POOL_LIST_ELEMENT, last);
 		--(aList->count);
 	}
 	return content;
@@ -348,6 +363,30 @@ int ListRemoveItem(List* aList, void* content, int(*callback)(void*, void*))
 }
 
 
+/**
+ * Removes an element added with ListAppendNoMalloc or ListInsertNoMalloc, without searching
+ * the list and without freeing the element or the content.  If the element is the current
+ * one, the next element becomes current, as with ListDetach.
+ * @param aList the list from which the item is to be removed
+ * @param elem the element, which must be in aList
+ */
+void ListDetachElement(List* aList, ListElement* elem)
+{
+	if (elem->prev == NULL)
+		aList->first = elem->next;
+	else
+		elem->prev->next = elem->next;
+	if (elem->next == NULL)
+		aList->last = elem->prev;
+	else
+		elem->next->prev = elem->prev;
+	if (aList->current == elem)
+		aList->current = elem->next;
+	elem->prev = elem->next = NULL;
+	--(aList->count);
+}
+
+
 /**
  * Removes and frees all items in a list, leaving the list ready for new items.
  * @param aList the list to which the operation is to be applied
@@ -363,7 +402,7 @@ void ListEmpty(List* aList)
                         first->content = NULL;
                 }
 		aList->first = first->next;
-		free(first);
+		Pool_free(POOL_LIST_ELEMENT, first);
 	}
 	aList->count = 0;
 	aList->size = 0;
@@ -391,7 +430,7 @@ void ListFreeNoContent(List* aList)
 	{
 		ListElement* first = aList->first;
 		aList->first = first->next;
-		free(first);
+		Pool_free(POOL_LIST_ELEMENT, first);
 	}
 	free(aList);
 }
@@ -23,7 +23,9 @@
 
 
 /**
- * Structure to hold all data for one list element
+ * Structure to hold all data for one list element.  It is either allocated by ListAppend or
+ * ListInsert, or embedded in the content and passed to ListAppendNoMalloc or ListInsertNoMalloc,
+ * in which case the content must be removed with ListDetachElement.
  */
 typedef struct ListElementStruct
 {
@@ -51,6 +53,7 @@ List* ListInitialize(void);
 ListElement* ListAppend(List* aList, void* content, size_t size);
 void ListAppendNoMalloc(List* aList, void* content, ListElement* newel, size_t size);
 ListElement* ListInsert(List* aList, void* content, size_t size, ListElement* index);
+void ListInsertNoMalloc(List* aList, void* content, ListElement* newel, size_t size, ListElement* index);
 
 int ListRemove(List* aList, void* content);
 int ListRemoveItem(List* aList, void* content, int(*callback)(void*, void*));
@@ -60,6 +63,7 @@ void* ListPopTail(List* aList);
 
 int ListDetach(List* aList, void* content);
 int ListDetachItem(List* aList, void* content, int(*callback)(void*, void*));
+void ListDetachElement(List* aList, ListElement* elem);
 
 void ListFree(List* aList);
 void ListEmpty(List* aList);
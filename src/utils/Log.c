@@ -20,7 +20,11 @@
  * @file
  * \brief Logging and tracing module
  *
- *
+ * Each thread records its trace entries in a ring of its own, with no lock: the format, the
+ * arguments as they were passed, copies of the strings among them, and the time.  Nothing is
+ * formatted then.  A writer thread formats and writes out the entries of all the rings, in
+ * time order, when there is somewhere to write them.  Otherwise the rings keep the most recent
+ * entries of each thread, to be written out by Log_dump.
  */
 
 #include "Log.h"
@@ -33,6 +37,7 @@
 #include <stdarg.h>
 #include <time.h>
 #include <string.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <syslog.h>
 #include <sys/stat.h>
@@ -51,25 +56,81 @@ trace_settings_type trace_settings =
                 INVALID_LEVEL
         };
 
-#define MAX_FUNCTION_NAME_LENGTH 256
+#define LOG_MAX_ARGS 12         /* arguments an entry keeps; messages with more are formatted when recorded */
+#define LOG_STRING_SPACE 128    /* bytes an entry keeps for copies of its string arguments */
+#define LOG_FORMAT_CACHE 64     /* formats whose arguments each thread remembers, a power of 2 */
+#define LOG_WRITER_INTERVAL 20  /* milliseconds the writer waits for entries */
+
+/* what an argument is, as it is taken from the variable arguments */
+enum Log_kinds {
+    LOG_ARG_INT, LOG_ARG_LONG, LOG_ARG_LLONG, LOG_ARG_DOUBLE, LOG_ARG_PTR, LOG_ARG_STR
+};
+
+#define LOG_STR_NULL (-1)       /* the offset of a NULL string argument */
+#define LOG_STR_NONE (-2)       /* the offset of a string argument there was no room for */
+
+typedef union {
+    long long i;                /**< integers, and the offsets of strings in the entry */
+    double d;
+    const void *p;
+} Log_arg;
 
 typedef struct {
-    struct timeval ts;
-    int sametime_count;
-    int number;
-    pthread_t thread_id;
-    int depth;
-    char name[MAX_FUNCTION_NAME_LENGTH + 1];
-    int line;
-    int has_rc;
-    int rc;
+    struct timespec ts;
+    const char *format;         /**< the printf format, or NULL if the message is in strings already */
     enum LOG_LEVELS level;
+    int nargs;
+    unsigned char kinds[LOG_MAX_ARGS];
+    Log_arg args[LOG_MAX_ARGS];
+    char strings[LOG_STRING_SPACE]; /**< copies of the string arguments, or the message */
 } traceEntry;
 
-static int start_index = -1,
-        next_index = 0;
-static traceEntry *trace_queue = NULL;
-static int trace_queue_size = 0;
+/* the arguments of a format, worked out once per thread */
+typedef struct {
+    const char *format;
+    int nargs;                  /**< -1 if the format has conversions entries cannot keep */
+    unsigned char kinds[LOG_MAX_ARGS];
+    short limits[LOG_MAX_ARGS]; /**< the precision of string arguments: -1 for none, -2 for the argument before */
+} Log_signature;
+
+/* one conversion of a format */
+typedef struct {
+    const char *start;          /**< the % */
+    const char *end;            /**< just after the conversion character */
+    int stars;                  /**< arguments taken for the width and precision */
+    int kind;                   /**< one of enum Log_kinds, or -1 if entries cannot keep it */
+    int limit;                  /**< the precision, -1 for none or -2 for an argument */
+} Log_spec;
+
+/**
+ * The trace entries of one thread.  The thread adds entries at tail, and takes the oldest off
+ * at head when the ring is full.  The writer, or a dump, takes them off at head, copying each
+ * before it moves head on, and does not keep the copy if the thread has moved head on first.
+ */
+typedef struct Log_ring {
+    struct Log_ring *next;      /**< the rings of all threads */
+    traceEntry *entries;
+    unsigned long size;         /**< a power of 2 */
+    unsigned long head;
+    unsigned long tail;
+    unsigned long lost;         /**< entries taken off full rings, not yet reported */
+    int owned;                  /**< a running thread is recording into it */
+    traceEntry peek;            /**< the oldest entry, taken off by the writer and not yet written */
+    int peeked;
+    Log_signature signatures[LOG_FORMAT_CACHE];
+} Log_ring;
+
+static Log_ring *rings = NULL;  /**< guarded by log_mutex */
+static int log_initialized = 0;
+static __thread Log_ring *thread_ring = NULL;
+static __thread int writing = 0; /**< this thread is writing entries out, and records none */
+static pthread_key_t log_key;
+static pthread_once_t log_once = PTHREAD_ONCE_INIT;
+
+static pthread_t writer;
+static int writer_running = 0;
+static int writer_stop = 0;
+static pthread_cond_t writer_cond = PTHREAD_COND_INITIALIZER;
 
 static FILE *trace_destination = NULL;    /**< flag to indicate if trace is to be sent to a stream */
 static char *trace_destination_name = NULL; /**< the name of the trace file */
@@ -79,18 +140,14 @@ static int max_lines_per_file = 1000; /**< maximum number of lines to write to o
 static enum LOG_LEVELS trace_output_level = INVALID_LEVEL;
 static Log_traceCallback *trace_callback = NULL;
 
-static traceEntry *Log_pretrace(void);
-
-static char *Log_formatTraceEntry(traceEntry *cur_entry);
-
 static void Log_output(enum LOG_LEVELS log_level, const char *msg);
 
-static void Log_posttrace(enum LOG_LEVELS log_level, traceEntry *cur_entry);
+static void Log_startWriter(void);
 
-static void Log_trace(enum LOG_LEVELS log_level, const char *buf);
+static void Log_drain(FILE *dump);
+
+static void Log_freeRings(void);
 
-static int sametime_count = 0;
-struct timeval now_ts, last_ts;
 static char msg_buf[512];
 
 static pthread_mutex_t log_mutex_store = PTHREAD_MUTEX_INITIALIZER;
@@ -102,25 +159,20 @@ int Log_initialize(Log_nameValue *info) {
     char *envval = NULL;
     struct stat buf;
 
-    if ((trace_queue = malloc(sizeof(traceEntry) * trace_settings.max_trace_entries)) == NULL)
-        goto exit;
-    trace_queue_size = trace_settings.max_trace_entries;
-
+    pthread_mutex_lock(log_mutex);
     if ((envval = getenv("MQTT_C_CLIENT_TRACE")) != NULL && strlen(envval) > 0) {
         if (strcmp(envval, "ON") == 0 || (trace_destination = fopen(envval, "w")) == NULL)
             trace_destination = stdout;
         else {
             size_t namelen = 0;
 
-            if ((trace_destination_name = malloc(strlen(envval) + 1)) == NULL) {
-                free(trace_queue);
+            if ((trace_destination_name = malloc(strlen(envval) + 1)) == NULL)
                 goto exit;
-            }
             strcpy(trace_destination_name, envval);
             namelen = strlen(envval) + 3;
             if ((trace_destination_backup_name = malloc(namelen)) == NULL) {
-                free(trace_queue);
                 free(trace_destination_name);
+                trace_destination_name = NULL;
                 goto exit;
             }
             if (snprintf(trace_destination_backup_name, namelen, "%s.0", trace_destination_name) >= namelen)
@@ -168,13 +220,26 @@ int Log_initialize(Log_nameValue *info) {
         }
     }
     Log_output(TRACE_MINIMUM, "=========================================================");
+    log_initialized = 1;
+    if (trace_destination || trace_callback)
+        Log_startWriter();
     exit:
+    pthread_mutex_unlock(log_mutex);
     return rc;
 }
 
 
+/**
+ * Set the function trace entries are given to, as they are written out.  It is called on the
+ * writer thread, and can record entries of its own only once the next ones are being written.
+ * @param callback the function, or NULL for none
+ */
 void Log_setTraceCallback(Log_traceCallback *callback) {
+    pthread_mutex_lock(log_mutex);
     trace_callback = callback;
+    if (callback && log_initialized)
+        Log_startWriter();
+    pthread_mutex_unlock(log_mutex);
 }
 
 
@@ -186,9 +251,17 @@ void Log_setTraceLevel(enum LOG_LEVELS level) {
 
 
 void Log_terminate(void) {
-    free(trace_queue);
-    trace_queue = NULL;
-    trace_queue_size = 0;
+    pthread_mutex_lock(log_mutex);
+    if (writer_running) {
+        writer_stop = 1;
+        pthread_cond_signal(&writer_cond);
+        pthread_mutex_unlock(log_mutex);
+        pthread_join(writer, NULL);
+        pthread_mutex_lock(log_mutex);
+        writer_running = 0;
+    }
+    Log_drain(NULL); /* what the writer had not got to yet */
+    Log_freeRings();
     if (trace_destination) {
         if (trace_destination != stdout)
             fclose(trace_destination);
@@ -202,79 +275,353 @@ void Log_terminate(void) {
         free(trace_destination_backup_name);
         trace_destination_backup_name = NULL;
     }
-    start_index = -1;
-    next_index = 0;
     trace_output_level = INVALID_LEVEL;
-    sametime_count = 0;
+    log_initialized = 0;
+    pthread_mutex_unlock(log_mutex);
+}
+
+
+/* Take a ring off the list and free it, called with log_mutex held */
+static void Log_freeRing(Log_ring *ring) {
+    Log_ring **prev = &rings;
+
+    while (*prev != ring)
+        prev = &(*prev)->next;
+    *prev = ring->next;
+    free(ring->entries);
+    free(ring);
+}
+
+
+/*
+ * Free the rings no running thread records into, and that of the calling thread, once they
+ * have been written out by Log_terminate.  The rings of other threads are freed as they exit.
+ */
+static void Log_freeRings(void) {
+    Log_ring *ring = rings;
+
+    while (ring) {
+        Log_ring *next = ring->next;
+
+        if (!ring->owned || ring == thread_ring)
+            Log_freeRing(ring);
+        ring = next;
+    }
+    if (thread_ring) {
+        pthread_setspecific(log_key, NULL);
+        thread_ring = NULL;
+    }
+}
+
+
+/*
+ * When a thread exits, its ring is left for the writer to empty and the next new thread to take,
+ * or freed if trace has been terminated.
+ */
+static void Log_threadExit(void *n) {
+    Log_ring *ring = n;
+
+    pthread_mutex_lock(log_mutex);
+    if (log_initialized)
+        ring->owned = 0;
+    else
+        Log_freeRing(ring);
+    pthread_mutex_unlock(log_mutex);
 }
 
 
-static traceEntry *Log_pretrace(void) {
-    traceEntry *cur_entry = NULL;
+static void Log_createKey(void) {
+    pthread_key_create(&log_key, Log_threadExit);
+}
+
 
-    /* calling ftime/gettimeofday seems to be comparatively expensive, so we need to limit its use */
-    if (++sametime_count % 20 == 0) {
-        gettimeofday(&now_ts, NULL);
-        if (now_ts.tv_sec != last_ts.tv_sec || now_ts.tv_usec != last_ts.tv_usec) {
-            sametime_count = 0;
-            last_ts = now_ts;
+/* The ring of the calling thread, made or taken over when it first records an entry */
+static Log_ring *Log_getRing(void) {
+    Log_ring *ring;
+
+    pthread_once(&log_once, Log_createKey);
+    pthread_mutex_lock(log_mutex);
+    for (ring = rings; ring && ring->owned; ring = ring->next);
+    if (ring == NULL && (ring = calloc(1, sizeof(Log_ring))) != NULL) {
+        ring->size = 16;
+        while (ring->size < (unsigned long) trace_settings.max_trace_entries)
+            ring->size *= 2;
+        if ((ring->entries = malloc(sizeof(traceEntry) * ring->size)) == NULL) {
+            free(ring);
+            ring = NULL;
+        } else {
+            ring->next = rings;
+            rings = ring;
         }
     }
+    if (ring) {
+        ring->owned = 1;
+        pthread_setspecific(log_key, ring);
+    }
+    pthread_mutex_unlock(log_mutex);
+    thread_ring = ring;
+    return ring;
+}
+
 
-    if (trace_queue_size != trace_settings.max_trace_entries) {
-        traceEntry *new_trace_queue = malloc(sizeof(traceEntry) * trace_settings.max_trace_entries);
-
-        if (new_trace_queue == NULL)
-            goto exit;
-        memcpy(new_trace_queue, trace_queue,
-               min(trace_queue_size, trace_settings.max_trace_entries) * sizeof(traceEntry));
-        free(trace_queue);
-        trace_queue = new_trace_queue;
-        trace_queue_size = trace_settings.max_trace_entries;
-
-        if (start_index > trace_settings.max_trace_entries + 1 ||
-            next_index > trace_settings.max_trace_entries + 1) {
-            start_index = -1;
-            next_index = 0;
+/* Find the conversion after p in a format, returning 0 at the end of the format */
+static int Log_nextSpec(const char *p, Log_spec *spec) {
+    int length = 0;
+
+    for (;;) {
+        while (*p && *p != '%')
+            ++p;
+        if (*p == '\0')
+            return 0;
+        if (p[1] != '%')
+            break;
+        p += 2;
+    }
+    spec->start = p++;
+    spec->stars = 0;
+    spec->limit = -1;
+    while (*p && strchr("-+ #0'", *p))
+        ++p;
+    if (*p == '*') {
+        ++spec->stars;
+        ++p;
+    } else
+        while (*p >= '0' && *p <= '9')
+            ++p;
+    if (*p == '.') {
+        ++p;
+        if (*p == '*') {
+            ++spec->stars;
+            spec->limit = -2;
+            ++p;
+        } else {
+            spec->limit = 0;
+            while (*p >= '0' && *p <= '9')
+                spec->limit = spec->limit * 10 + *p++ - '0';
         }
     }
+    /* 1 for long, 2 for long long, -1 for what entries cannot keep */
+    while (*p && strchr("hlLqjzt", *p)) {
+        length = (*p == 'l' || *p == 'z' || *p == 't') ? length + 1 : (*p == 'h') ? length :
+                 (*p == 'q' || *p == 'j') ? 2 : -1;
+        ++p;
+    }
+    switch (*p) {
+        case 'd': case 'i': case 'u': case 'x': case 'X': case 'o': case 'c':
+            spec->kind = (length == 0) ? LOG_ARG_INT : (length == 1) ? LOG_ARG_LONG :
+                         (length == 2) ? LOG_ARG_LLONG : -1;
+            break;
+        case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+            spec->kind = (length == 0) ? LOG_ARG_DOUBLE : -1;
+            break;
+        case 'p':
+            spec->kind = LOG_ARG_PTR;
+            break;
+        case 's':
+            spec->kind = (length == 0) ? LOG_ARG_STR : -1;
+            break;
+        default:
+            spec->kind = -1;
+            break;
+    }
+    spec->end = (*p) ? p + 1 : p;
+    return 1;
+}
 
-    /* add to trace buffer */
-    cur_entry = &trace_queue[next_index];
-    if (next_index == start_index) /* means the buffer is full */
-    {
-        if (++start_index == trace_settings.max_trace_entries)
-            start_index = 0;
-    } else if (start_index == -1)
-        start_index = 0;
-    if (++next_index == trace_settings.max_trace_entries)
-        next_index = 0;
-    exit:
-    return cur_entry;
+
+/* The arguments of a format, from the thread's cache of them */
+static Log_signature *Log_getSignature(Log_ring *ring, const char *format) {
+    Log_signature *sig = &ring->signatures[((uintptr_t) format >> 3) & (LOG_FORMAT_CACHE - 1)];
+    const char *p = format;
+    Log_spec spec;
+
+    if (sig->format == format)
+        return sig;
+    sig->format = format;
+    sig->nargs = 0;
+    while (sig->nargs >= 0 && Log_nextSpec(p, &spec)) {
+        int i;
+
+        if (spec.kind < 0 || sig->nargs + spec.stars + 1 > LOG_MAX_ARGS) {
+            sig->nargs = -1;
+            break;
+        }
+        for (i = 0; i < spec.stars; ++i) {
+            sig->kinds[sig->nargs] = LOG_ARG_INT;
+            sig->limits[sig->nargs++] = -1;
+        }
+        sig->kinds[sig->nargs] = (unsigned char) spec.kind;
+        sig->limits[sig->nargs++] = (short) spec.limit;
+        p = spec.end;
+    }
+    return sig;
 }
 
+
+/* Record an entry in the calling thread's ring */
+static void Log_record(enum LOG_LEVELS log_level, const char *format, va_list args) {
+    Log_ring *ring = thread_ring;
+    Log_signature *sig;
+    traceEntry *cur_entry;
+    unsigned long head, tail;
+
+    if (!log_initialized || writing || format == NULL || (ring == NULL && (ring = Log_getRing()) == NULL))
+        return;
+    sig = Log_getSignature(ring, format);
+    tail = ring->tail;
+    head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    /* when the ring is full, take the oldest entry off, unless the writer just has */
+    if (tail - head >= ring->size &&
+        __atomic_compare_exchange_n(&ring->head, &head, head + 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        __atomic_add_fetch(&ring->lost, 1, __ATOMIC_RELAXED);
+
+    cur_entry = &ring->entries[tail & (ring->size - 1)];
+    clock_gettime(CLOCK_REALTIME, &cur_entry->ts);
+    cur_entry->level = log_level;
+    if (sig->nargs < 0) {
+        /* formats entries cannot keep the arguments of are formatted now */
+        vsnprintf(cur_entry->strings, sizeof(cur_entry->strings), format, args);
+        cur_entry->format = NULL;
+    } else {
+        size_t used = 0;
+        int i;
+
+        cur_entry->format = format;
+        cur_entry->nargs = sig->nargs;
+        memcpy(cur_entry->kinds, sig->kinds, (size_t) sig->nargs);
+        for (i = 0; i < sig->nargs; ++i) {
+            switch (sig->kinds[i]) {
+                case LOG_ARG_INT:
+                    cur_entry->args[i].i = va_arg(args, int);
+                    break;
+                case LOG_ARG_LONG:
+                    cur_entry->args[i].i = va_arg(args, long);
+                    break;
+                case LOG_ARG_LLONG:
+                    cur_entry->args[i].i = va_arg(args, long long);
+                    break;
+                case LOG_ARG_DOUBLE:
+                    cur_entry->args[i].d = va_arg(args, double);
+                    break;
+                case LOG_ARG_PTR:
+                    cur_entry->args[i].p = va_arg(args, void *);
+                    break;
+                case LOG_ARG_STR: {
+                    const char *str = va_arg(args, const char *);
+                    size_t limit = sizeof(cur_entry->strings) - used;
+
+                    if (sig->limits[i] >= 0 && (size_t) sig->limits[i] < limit)
+                        limit = (size_t) sig->limits[i] + 1;
+                    else if (sig->limits[i] == -2 && i > 0 && cur_entry->args[i - 1].i >= 0 &&
+                             (size_t) cur_entry->args[i - 1].i < limit)
+                        limit = (size_t) cur_entry->args[i - 1].i + 1;
+                    if (str == NULL)
+                        cur_entry->args[i].i = LOG_STR_NULL;
+                    else if (limit == 0)
+                        cur_entry->args[i].i = LOG_STR_NONE;
+                    else {
+                        size_t len = strnlen(str, limit - 1);
+
+                        memcpy(&cur_entry->strings[used], str, len);
+                        cur_entry->strings[used + len] = '\0';
+                        cur_entry->args[i].i = (long long) used;
+                        used += len + 1;
+                    }
+                    break;
+                }
+                default:
+                    break;
+            }
+        }
+    }
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    if (tail + 1 - head == ring->size / 2 && writer_running)
+        pthread_cond_signal(&writer_cond); /* the writer is behind: wake it early */
+}
+
+
+/* Format the message of an entry, as printf would have when it was recorded */
+static void Log_formatMessage(traceEntry *cur_entry, char *buf, size_t size) {
+    const char *p = cur_entry->format;
+    size_t pos = 0;
+    int n = 0;
+    Log_spec spec;
+
+    if (p == NULL) {
+        snprintf(buf, size, "%s", cur_entry->strings);
+        return;
+    }
+    buf[0] = '\0';
+    while (pos < size - 1 && Log_nextSpec(p, &spec) && n + spec.stars < cur_entry->nargs) {
+        char conversion[32];
+        int star[2] = {0, 0}, i, len = (int) (spec.end - spec.start);
+        Log_arg arg;
+        const char *str;
+
+        /* the text before the conversion, with %% as % */
+        while (p < spec.start && pos < size - 1) {
+            buf[pos++] = *p;
+            p += (p[0] == '%' && p[1] == '%') ? 2 : 1;
+        }
+        for (i = 0; i < spec.stars; ++i)
+            star[i] = (int) cur_entry->args[n++].i;
+        arg = cur_entry->args[n++];
+        if (len >= (int) sizeof(conversion))
+            len = sizeof(conversion) - 1;
+        memcpy(conversion, spec.start, (size_t) len);
+        conversion[len] = '\0';
+#define LOG_FORMAT_ARG(value) ((spec.stars == 0) ? snprintf(&buf[pos], size - pos, conversion, value) : \
+        (spec.stars == 1) ? snprintf(&buf[pos], size - pos, conversion, star[0], value) : \
+        snprintf(&buf[pos], size - pos, conversion, star[0], star[1], value))
+        switch (cur_entry->kinds[n - 1]) {
+            case LOG_ARG_INT:
+                len = LOG_FORMAT_ARG((int) arg.i);
+                break;
+            case LOG_ARG_LONG:
+                len = LOG_FORMAT_ARG((long) arg.i);
+                break;
+            case LOG_ARG_LLONG:
+                len = LOG_FORMAT_ARG(arg.i);
+                break;
+            case LOG_ARG_DOUBLE:
+                len = LOG_FORMAT_ARG(arg.d);
+                break;
+            case LOG_ARG_PTR:
+                len = LOG_FORMAT_ARG(arg.p);
+                break;
+            default:
+                str = (arg.i == LOG_STR_NULL) ? "(null)" : (arg.i == LOG_STR_NONE) ? "" : &cur_entry->strings[arg.i];
+                len = LOG_FORMAT_ARG(str);
+                break;
+        }
+#undef LOG_FORMAT_ARG
+        if (len > 0)
+            pos += ((size_t) len < size - pos) ? (size_t) len : size - pos - 1;
+        p = spec.end;
+    }
+    while (*p && pos < size - 1) {
+        buf[pos++] = *p;
+        p += (p[0] == '%' && p[1] == '%') ? 2 : 1;
+    }
+    buf[pos] = '\0';
+}
+
+
+/* Format an entry with its time, as 20261019 120000.123 message */
 static char *Log_formatTraceEntry(traceEntry *cur_entry) {
-    struct tm *timeinfo;
-    int buf_pos = 31;
-    timeinfo = localtime((time_t *) &cur_entry->ts.tv_sec);
-    strftime(&msg_buf[7], 80, "%Y%m%d %H%M%S ", timeinfo);
-    snprintf(&msg_buf[22], sizeof(msg_buf) - 22, ".%.3lu ", cur_entry->ts.tv_usec / 1000L);
-    buf_pos = 27;
-
-    snprintf(msg_buf, sizeof(msg_buf), "(%.4d)", cur_entry->sametime_count);
-    msg_buf[6] = ' ';
-
-    if (cur_entry->has_rc == 2)
-        strncpy(&msg_buf[buf_pos], cur_entry->name, sizeof(msg_buf) - buf_pos);
-    else {
-        const char *format = Messages_get(cur_entry->number, cur_entry->level);
-        if (cur_entry->has_rc == 1)
-            snprintf(&msg_buf[buf_pos], sizeof(msg_buf) - buf_pos, format, cur_entry->thread_id,
-                     cur_entry->depth, "", cur_entry->depth, cur_entry->name, cur_entry->line, cur_entry->rc);
-        else
-            snprintf(&msg_buf[buf_pos], sizeof(msg_buf) - buf_pos, format, cur_entry->thread_id,
-                     cur_entry->depth, "", cur_entry->depth, cur_entry->name, cur_entry->line);
+    static time_t stamp_sec = -1;
+    static char stamp[20];
+    int len;
+
+    if (cur_entry->ts.tv_sec != stamp_sec) {
+        struct tm timeinfo;
+
+        stamp_sec = cur_entry->ts.tv_sec;
+        localtime_r(&stamp_sec, &timeinfo);
+        strftime(stamp, sizeof(stamp), "%Y%m%d %H%M%S", &timeinfo);
     }
+    len = snprintf(msg_buf, sizeof(msg_buf), "%s.%.3ld ", stamp, cur_entry->ts.tv_nsec / 1000000L);
+    Log_formatMessage(cur_entry, &msg_buf[len], sizeof(msg_buf) - len);
     return msg_buf;
 }
 
@@ -301,41 +648,134 @@ static void Log_output(enum LOG_LEVELS log_level, const char *msg) {
 }
 
 
-static void Log_posttrace(enum LOG_LEVELS log_level, traceEntry *cur_entry) {
-    if (((trace_output_level == -1) ? log_level >= trace_settings.trace_level : log_level >= trace_output_level)) {
-        char *msg = NULL;
+/* Take the oldest entry off a ring into its peek entry, returning 0 if it is empty */
+static int Log_take(Log_ring *ring) {
+    unsigned long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+    while (head != __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)) {
+        memcpy(&ring->peek, &ring->entries[head & (ring->size - 1)], sizeof(traceEntry));
+        /* if the thread took the entry off as the ring filled, the copy may be torn: do not keep it */
+        if (__atomic_compare_exchange_n(&ring->head, &head, head + 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            ring->peeked = 1;
+            break;
+        }
+    }
+    return ring->peeked;
+}
+
+
+/*
+ * Write out the entries recorded so far, oldest first across all threads, to the trace
+ * destinations if dump is NULL, or else to dump.  Called with log_mutex held.
+ */
+static void Log_drain(FILE *dump) {
+    struct timespec until;
+
+    clock_gettime(CLOCK_REALTIME, &until); /* not the entries recorded while this goes on */
+    writing = 1;
+    for (;;) {
+        Log_ring *ring, *oldest = NULL;
+        unsigned long lost;
+
+        for (ring = rings; ring; ring = ring->next) {
+            if ((lost = __atomic_exchange_n(&ring->lost, 0, __ATOMIC_RELAXED)) > 0) {
+                snprintf(msg_buf, sizeof(msg_buf), "%lu trace entries lost", lost);
+                if (dump)
+                    fprintf(dump, "%s\n", msg_buf);
+                else
+                    Log_output(LOG_ERROR, msg_buf);
+            }
+            if ((ring->peeked || Log_take(ring)) && (oldest == NULL ||
+                                                     ring->peek.ts.tv_sec < oldest->peek.ts.tv_sec ||
+                                                     (ring->peek.ts.tv_sec == oldest->peek.ts.tv_sec &&
+                                                      ring->peek.ts.tv_nsec < oldest->peek.ts.tv_nsec)))
+                oldest = ring;
+        }
+        if (oldest == NULL || oldest->peek.ts.tv_sec > until.tv_sec ||
+            (oldest->peek.ts.tv_sec == until.tv_sec && oldest->peek.ts.tv_nsec > until.tv_nsec))
+            break;
+        oldest->peeked = 0;
+        if (dump)
+            fprintf(dump, "%s\n", Log_formatTraceEntry(&oldest->peek));
+        else if ((trace_destination || trace_callback) &&
+                 ((trace_output_level == -1) ? oldest->peek.level >= trace_settings.trace_level :
+                  oldest->peek.level >= trace_output_level))
+            Log_output(oldest->peek.level, Log_formatTraceEntry(&oldest->peek));
+    }
+    writing = 0;
+}
+
+
+/* The writer thread: write out what has been recorded every LOG_WRITER_INTERVAL, or sooner if a ring fills */
+static void *Log_writer(void *n) {
+    pthread_mutex_lock(log_mutex);
+    while (!writer_stop) {
+        struct timespec until;
+
+        Log_drain(NULL);
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_nsec += LOG_WRITER_INTERVAL * 1000000L;
+        if (until.tv_nsec >= 1000000000L) {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000L;
+        }
+        if (!writer_stop)
+            pthread_cond_timedwait(&writer_cond, log_mutex, &until);
+    }
+    pthread_mutex_unlock(log_mutex);
+    return NULL;
+}
 
-        if (trace_destination || trace_callback)
-            msg = &Log_formatTraceEntry(cur_entry)[7];
 
-        Log_output(log_level, msg);
+/* Start the writer thread if it is not running, called with log_mutex held */
+static void Log_startWriter(void) {
+    if (!writer_running) {
+        writer_stop = 0;
+        writer_running = (pthread_create(&writer, NULL, Log_writer, NULL) == 0);
     }
 }
 
 
-static void Log_trace(enum LOG_LEVELS log_level, const char *buf) {
-    traceEntry *cur_entry = NULL;
+/**
+ * Write out to the trace destinations everything recorded so far that has not been, without
+ * waiting for the writer thread.
+ */
+void Log_flush(void) {
+    pthread_mutex_lock(log_mutex);
+    Log_drain(NULL);
+    pthread_mutex_unlock(log_mutex);
+}
 
-    if (trace_queue == NULL)
-        return;
 
-    cur_entry = Log_pretrace();
+/**
+ * Write out the entries the threads' rings hold, whatever their level, formatted as they
+ * would be for the trace destinations.  When there is nowhere to write trace to, the rings hold
+ * the most recent entries of each thread, at trace_settings.trace_level and above.
+ * @param stream where to write the entries
+ */
+void Log_dump(FILE *stream) {
+    pthread_mutex_lock(log_mutex);
+    Log_drain(stream);
+    pthread_mutex_unlock(log_mutex);
+}
 
-    memcpy(&(cur_entry->ts), &now_ts, sizeof(now_ts));
-    cur_entry->sametime_count = sametime_count;
 
-    cur_entry->has_rc = 2;
-    strncpy(cur_entry->name, buf, sizeof(cur_entry->name));
-    cur_entry->name[MAX_FUNCTION_NAME_LENGTH] = '\0';
+/* Record an entry with its arguments */
+static void Log_capture(enum LOG_LEVELS log_level, const char *format, ...) {
+    va_list args;
 
-    Log_posttrace(log_level, cur_entry);
+    va_start(args, format);
+    Log_record(log_level, format, args);
+    va_end(args);
 }
 
 
 /**
  * Log a message.  If possible, all messages should be indexed by message number, and
  * the use of the format string should be minimized or negated altogether.  If format is
- * provided, the message number is only used as a message label.
+ * provided, the message number is only used as a message label.  The message is not formatted
+ * here: the format and its arguments are recorded, with copies of any strings, to be formatted
+ * when it is written out.
  * @param log_level the log level of the message
  * @param msgno the id of the message to use if the format string is NULL
  * @param aFormat the printf format string to be used if the message id does not exist
@@ -343,20 +783,13 @@ static void Log_trace(enum LOG_LEVELS log_level, const char *buf) {
  */
 void Log(enum LOG_LEVELS log_level, int msgno, const char *format, ...) {
     if (log_level >= trace_settings.trace_level) {
-        const char *temp = NULL;
         va_list args;
 
-        /* we're using a static character buffer, so we need to make sure only one thread uses it at a time */
-       pthread_mutex_lock(log_mutex);
-        if (format == NULL && (temp = Messages_get(msgno, log_level)) != NULL)
-            format = temp;
-
+        if (format == NULL)
+            format = Messages_get(msgno, log_level);
         va_start(args, format);
-        vsnprintf(msg_buf, sizeof(msg_buf), format, args);
-
-        Log_trace(log_level, msg_buf);
+        Log_record(log_level, format, args);
         va_end(args);
-        pthread_mutex_unlock(log_mutex);
     }
 }
 
@@ -372,34 +805,13 @@ void Log(enum LOG_LEVELS log_level, int msgno, const char *format, ...) {
  */
 void Log_stackTrace(enum LOG_LEVELS log_level, int msgno, pthread_t thread_id, int current_depth, const char *name,
                     int line, int *rc) {
-    traceEntry *cur_entry = NULL;
-
-    if (trace_queue == NULL)
-        return;
-
     if (log_level < trace_settings.trace_level)
         return;
 
-    pthread_mutex_lock(log_mutex);
-    cur_entry = Log_pretrace();
-
-    memcpy(&(cur_entry->ts), &now_ts, sizeof(now_ts));
-    cur_entry->sametime_count = sametime_count;
-    cur_entry->number = msgno;
-    cur_entry->thread_id = thread_id;
-    cur_entry->depth = current_depth;
-    strcpy(cur_entry->name, name);
-    cur_entry->level = log_level;
-    cur_entry->line = line;
     if (rc == NULL)
-        cur_entry->has_rc = 0;
-    else {
-        cur_entry->has_rc = 1;
-        cur_entry->rc = *rc;
-    }
-
-    Log_posttrace(log_level, cur_entry);
-    pthread_mutex_unlock(log_mutex);
+        Log_capture(log_level, Messages_get(msgno, log_level), (unsigned long) thread_id, current_depth, "",
+                    current_depth, name, line);
+    else
+        Log_capture(log_level, Messages_get(msgno, log_level), (unsigned long) thread_id, current_depth, "",
+                    current_depth, name, line, *rc);
 }
-
-
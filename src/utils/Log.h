@@ -19,6 +19,7 @@
 #define LOG_H
 
 #include <pthread.h>
+#include <stdio.h>
 
 enum LOG_LEVELS {
     INVALID_LEVEL = -1,
@@ -33,7 +34,7 @@ enum LOG_LEVELS {
 
 typedef struct {
     enum LOG_LEVELS trace_level;    /**< trace level */
-    int max_trace_entries;        /**< max no of entries in the trace buffer */
+    int max_trace_entries;        /**< max no of entries in the trace ring of each thread */
     enum LOG_LEVELS trace_output_level;        /**< trace level to output to destination */
 } trace_settings_type;
 
@@ -63,4 +64,8 @@ void Log_setTraceCallback(Log_traceCallback *callback);
 
 void Log_setTraceLevel(enum LOG_LEVELS level);
 
+void Log_flush(void);
+
+void Log_dump(FILE *stream);
+
 #endif
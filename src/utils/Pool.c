@@ -0,0 +1,260 @@
+//
+// Created by Administrator on 2026/10/19.
+//
+
+#include "Pool.h"
+#include "TypeDefine.h"
+#include "LinkedList.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#define POOL_ALIGN 64       /* slabs start on a cache line */
+#define POOL_CACHE_MAX 256  /* objects a thread keeps before giving some back to the depot */
+#define POOL_BATCH 64       /* objects moved between a thread and the depot at a time */
+
+#define POOL_ROUND(s) (((s) + 15) & ~(size_t) 15)
+
+typedef struct Pool_object {
+    struct Pool_object *next;
+} Pool_object;
+
+/* a thread's own free list of one type, with the counts not yet added to the pool totals */
+typedef struct {
+    Pool_object *free;
+    int count;
+    unsigned long allocs, hits, frees;
+} Pool_cache;
+
+/* the depot of one type, guarded by pool_mutex */
+typedef struct {
+    const char *name;
+    size_t size;
+    Pool_object *free;
+    int count;
+    void *slabs;            /* chained through their first word */
+    unsigned long slabCount;
+    unsigned long allocs, hits, frees;
+} Pool;
+
+static Pool pools[POOL_TYPES] = {
+        {"ListElement", POOL_ROUND(sizeof(ListElement))},
+        {"Messages", POOL_ROUND(sizeof(Messages))},
+        {"Publications", POOL_ROUND(sizeof(Publications))},
+        {"qEntry", POOL_ROUND(sizeof(qEntry))},
+        {"Publish", POOL_ROUND(sizeof(Publish))},
+        {"Ack", POOL_ROUND(sizeof(Ack))},
+        {"AckRequest", POOL_ROUND(sizeof(AckRequest))},
+        {"pending_write", POOL_ROUND(sizeof(pending_write))}
+};
+
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+size_t Pool_size(Pool_type type) {
+    return pools[type].size;
+}
+
+#if !defined(NO_POOL)
+/* the counts are only added to by their thread, but read by Pool_getStats on any */
+#define POOL_COUNT(n) __atomic_store_n(&(n), (n) + 1, __ATOMIC_RELAXED)
+
+/* a thread's free lists, on the list of all threads' while it runs */
+typedef struct Pool_thread {
+    Pool_cache caches[POOL_TYPES];
+    struct Pool_thread *next;   /* guarded by pool_mutex */
+} Pool_thread;
+
+static pthread_key_t pool_key;
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+static __thread Pool_thread self;
+static __thread int registered = 0;
+static Pool_thread *threads = NULL;
+
+/* Add a thread's counts to the pool totals, called with pool_mutex held */
+static void Pool_fold(Pool *pool, Pool_cache *cache) {
+    pool->allocs += cache->allocs;
+    pool->hits += cache->hits;
+    pool->frees += cache->frees;
+    cache->allocs = cache->hits = cache->frees = 0;
+}
+
+/* Move up to count objects from a thread's free list to the depot, called with pool_mutex held */
+static void Pool_drain(Pool *pool, Pool_cache *cache, int count) {
+    Pool_fold(pool, cache);
+    while (cache->free && count-- > 0) {
+        Pool_object *o = cache->free;
+
+        cache->free = o->next;
+        --cache->count;
+        o->next = pool->free;
+        pool->free = o;
+        ++pool->count;
+    }
+}
+
+/* When a thread exits, its free lists go back to the depot */
+static void Pool_threadExit(void *n) {
+    Pool_thread **prev = &threads;
+    int i;
+
+    pthread_mutex_lock(&pool_mutex);
+    for (i = 0; i < POOL_TYPES; ++i)
+        Pool_drain(&pools[i], &self.caches[i], self.caches[i].count);
+    while (*prev != &self)
+        prev = &(*prev)->next;
+    *prev = self.next;
+    registered = 0;
+    pthread_mutex_unlock(&pool_mutex);
+}
+
+static void Pool_createKey(void) {
+    pthread_key_create(&pool_key, Pool_threadExit);
+}
+
+static void Pool_register(void) {
+    pthread_once(&pool_once, Pool_createKey);
+    pthread_setspecific(pool_key, &self);
+    pthread_mutex_lock(&pool_mutex);
+    self.next = threads;
+    threads = &self;
+    pthread_mutex_unlock(&pool_mutex);
+    registered = 1;
+}
+
+/* Cut a new slab into objects for the depot, called with pool_mutex held */
+static int Pool_carve(Pool *pool) {
+    char *slab = NULL;
+    int i;
+
+    if (posix_memalign((void **) &slab, POOL_ALIGN, POOL_SLAB_SIZE) != 0)
+        return -1;
+    *(void **) slab = pool->slabs;
+    pool->slabs = slab;
+    ++pool->slabCount;
+    /* the first cache line holds the slab chain; hand the objects out in address order */
+    for (i = (int) ((POOL_SLAB_SIZE - POOL_ALIGN) / pool->size) - 1; i >= 0; --i) {
+        Pool_object *o = (Pool_object *) (slab + POOL_ALIGN + (size_t) i * pool->size);
+
+        o->next = pool->free;
+        pool->free = o;
+        ++pool->count;
+    }
+    return 0;
+}
+
+/* Refill a thread's empty free list from the depot */
+static void Pool_refill(Pool *pool, Pool_cache *cache) {
+    int count = POOL_BATCH;
+
+    if (!registered)
+        Pool_register();
+    pthread_mutex_lock(&pool_mutex);
+    Pool_fold(pool, cache);
+    if (pool->free == NULL)
+        Pool_carve(pool);
+    while (pool->free && count-- > 0) {
+        Pool_object *o = pool->free;
+
+        pool->free = o->next;
+        --pool->count;
+        o->next = cache->free;
+        cache->free = o;
+        ++cache->count;
+    }
+    pthread_mutex_unlock(&pool_mutex);
+}
+
+/**
+ * Allocate an object of one of the pooled types.  The contents are not initialized.
+ * @param type the type of object
+ * @return the object, or NULL if memory is exhausted
+ */
+void *Pool_alloc(Pool_type type) {
+    Pool_cache *cache = &self.caches[type];
+    Pool_object *o = NULL;
+
+    if (cache->free)
+        POOL_COUNT(cache->hits);
+    else
+        Pool_refill(&pools[type], cache);
+    if ((o = cache->free) != NULL) {
+        cache->free = o->next;
+        --cache->count;
+        POOL_COUNT(cache->allocs);
+    }
+    return o;
+}
+
+/**
+ * Free an object allocated with Pool_alloc, which may have been allocated on another thread.
+ * @param type the type the object was allocated as
+ * @param p the object, or NULL
+ */
+void Pool_free(Pool_type type, void *p) {
+    Pool_cache *cache = &self.caches[type];
+    Pool_object *o = p;
+
+    if (o == NULL)
+        return;
+    if (!registered)
+        Pool_register();
+    o->next = cache->free;
+    cache->free = o;
+    POOL_COUNT(cache->frees);
+    if (++cache->count > POOL_CACHE_MAX) {
+        pthread_mutex_lock(&pool_mutex);
+        Pool_drain(&pools[type], cache, POOL_BATCH);
+        pthread_mutex_unlock(&pool_mutex);
+    }
+}
+#endif
+
+/**
+ * Carve slabs until the depot holds at least count free objects of a type, so that they can
+ * be allocated later without going to the system.
+ */
+void Pool_reserve(Pool_type type, int count) {
+#if !defined(NO_POOL)
+    pthread_mutex_lock(&pool_mutex);
+    while (pools[type].count < count && Pool_carve(&pools[type]) == 0);
+    pthread_mutex_unlock(&pool_mutex);
+#endif
+}
+
+/**
+ * Get the allocation statistics of the pools, with the counts of every thread that has a free
+ * list.  Those of threads allocating and freeing meanwhile may miss their last few operations.
+ * @param stats array to fill in
+ * @param count the number of entries in stats
+ * @return the number of pools, POOL_TYPES
+ */
+int Pool_getStats(Pool_stats *stats, int count) {
+    int i;
+
+    pthread_mutex_lock(&pool_mutex);
+    for (i = 0; i < POOL_TYPES && i < count; ++i) {
+        Pool *pool = &pools[i];
+
+        memset(&stats[i], '\0', sizeof(Pool_stats));
+        stats[i].name = pool->name;
+        stats[i].size = pool->size;
+#if !defined(NO_POOL)
+        Pool_thread *thread;
+        unsigned long allocs = pool->allocs, hits = pool->hits, frees = pool->frees;
+
+        for (thread = threads; thread; thread = thread->next) {
+            allocs += __atomic_load_n(&thread->caches[i].allocs, __ATOMIC_RELAXED);
+            hits += __atomic_load_n(&thread->caches[i].hits, __ATOMIC_RELAXED);
+            frees += __atomic_load_n(&thread->caches[i].frees, __ATOMIC_RELAXED);
+        }
+        stats[i].allocs = allocs;
+        stats[i].hits = hits;
+        stats[i].inUse = (long) (allocs - frees);
+        stats[i].slabs = pool->slabCount;
+        stats[i].resident = pool->slabCount * POOL_SLAB_SIZE;
+#endif
+    }
+    pthread_mutex_unlock(&pool_mutex);
+    return POOL_TYPES;
+}
@@ -0,0 +1,57 @@
+//
+// Created by Administrator on 2026/10/19.
+//
+// Free lists for the fixed-size structures the protocol allocates and frees for every
+// message.  Objects are carved out of cache-line aligned slabs, which are kept for reuse
+// rather than returned to the system.  Each thread keeps a short free list of its own, so
+// most allocations take no lock; the rest go to a shared depot.
+//
+
+#ifndef MQTT_CLIENT_POOL_H
+#define MQTT_CLIENT_POOL_H
+
+#include <stdlib.h>
+
+/** the pooled structure types */
+typedef enum {
+    POOL_LIST_ELEMENT,  /**< ListElement, for items of lists that do not embed their own */
+    POOL_MESSAGES,      /**< Messages, in-flight and buffered messages */
+    POOL_PUBLICATIONS,  /**< Publications, the stored topic and payload of a message */
+    POOL_QENTRY,        /**< qEntry, received messages waiting for messageArrived */
+    POOL_PUBLISH,       /**< Publish, packets being sent or received */
+    POOL_ACK,           /**< Ack, received PUBACK, PUBREC, PUBREL, PUBCOMP and UNSUBACK packets */
+    POOL_ACK_REQUEST,   /**< AckRequest, acknowledgements waiting for the socket */
+    POOL_PENDING_WRITE, /**< pending_write, QoS 0 publications held for an incomplete write */
+    POOL_TYPES
+} Pool_type;
+
+/** the bytes in a slab */
+#define POOL_SLAB_SIZE 16384
+
+/** allocation statistics of one pool */
+typedef struct {
+    const char *name;
+    size_t size;                /**< bytes in each object, after rounding */
+    unsigned long allocs;       /**< allocations since the process started */
+    unsigned long hits;         /**< allocations served from the thread's own free list, without a lock */
+    long inUse;                 /**< objects allocated and not yet freed */
+    unsigned long slabs;        /**< slabs carved */
+    size_t resident;            /**< bytes held in slabs */
+} Pool_stats;
+
+#if defined(NO_POOL)
+#define Pool_alloc(type) malloc(Pool_size(type))
+#define Pool_free(type, p) free(p)
+#else
+void *Pool_alloc(Pool_type type);
+
+void Pool_free(Pool_type type, void *p);
+#endif
+
+size_t Pool_size(Pool_type type);
+
+void Pool_reserve(Pool_type type, int count);
+
+int Pool_getStats(Pool_stats *stats, int count);
+
+#endif //MQTT_CLIENT_POOL_H
@@ -0,0 +1,233 @@
+//
+// Created by Administrator on 2026/10/19.
+//
+
+#include "Resolver.h"
+#include "LinkedList.h"
+#include "Log.h"
+#include "MQTTTime.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <time.h>
+#include <netinet/in.h>
+
+enum Resolver_states {
+    RESOLVER_PENDING,
+    RESOLVER_DONE,
+    RESOLVER_FAILED
+};
+
+/** a cached lookup */
+typedef struct {
+    char *host;             /**< allocated with the structure */
+    int state;
+    struct timeval expires; /**< when the answer must be looked up again */
+    Resolver_result result;
+} Resolver_entry;
+
+static pthread_mutex_t resolver_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t resolver_cond = PTHREAD_COND_INITIALIZER;
+static List *cache = NULL;
+
+static int Resolver_hostCompare(void *a, void *b) {
+    return strcmp(((Resolver_entry *) a)->host, (char *) b) == 0;
+}
+
+/**
+ * Fill in a result from a getaddrinfo list.  The order getaddrinfo chose (RFC 6724) is kept
+ * within each address family, but the families alternate, starting with the first, as
+ * RFC 8305 section 4 recommends for racing connects.
+ */
+static void Resolver_sort(struct addrinfo *res, Resolver_result *result) {
+    struct addrinfo *first[RESOLVER_MAX_ADDRESSES], *other[RESOLVER_MAX_ADDRESSES];
+    int firstCount = 0, otherCount = 0, i = 0, j = 0;
+    struct addrinfo *cur;
+
+    for (cur = res; cur; cur = cur->ai_next) {
+        if (cur->ai_family != AF_INET && cur->ai_family != AF_INET6)
+            continue;
+        if (cur->ai_family == res->ai_family && firstCount < RESOLVER_MAX_ADDRESSES)
+            first[firstCount++] = cur;
+        else if (cur->ai_family != res->ai_family && otherCount < RESOLVER_MAX_ADDRESSES)
+            other[otherCount++] = cur;
+    }
+    result->count = 0;
+    while ((i < firstCount || j < otherCount) && result->count < RESOLVER_MAX_ADDRESSES) {
+        struct addrinfo *next = NULL;
+
+        if (i < firstCount && (i <= j || j == otherCount))
+            next = first[i++];
+        else
+            next = other[j++];
+        memcpy(&result->addr[result->count], next->ai_addr, next->ai_addrlen);
+        result->len[result->count++] = next->ai_addrlen;
+    }
+}
+
+/* The lookup thread: one per host name being looked up */
+static void *Resolver_run(void *n) {
+    char *host = n;
+    struct addrinfo hints = {AI_ADDRCONFIG, AF_UNSPEC, SOCK_STREAM, IPPROTO_TCP, 0, NULL, NULL, NULL};
+    struct addrinfo *res = NULL;
+    Resolver_result result;
+    int rc;
+
+    memset(&result, '\0', sizeof(result));
+    if ((rc = getaddrinfo(host, NULL, &hints, &res)) == 0) {
+        Resolver_sort(res, &result);
+        freeaddrinfo(res);
+    } else
+        Log(LOG_ERROR, -1, "getaddrinfo failed for addr %s with rc %d", host, rc);
+
+    pthread_mutex_lock(&resolver_mutex);
+    if (cache && ListFindItem(cache, host, Resolver_hostCompare)) {
+        Resolver_entry *e = (Resolver_entry *) (cache->current->content);
+
+        e->state = (rc == 0 && result.count > 0) ? RESOLVER_DONE : RESOLVER_FAILED;
+        e->result = result;
+        e->expires = MQTTTime_now();
+        e->expires.tv_sec += (e->state == RESOLVER_DONE) ? RESOLVER_TTL : RESOLVER_NEGATIVE_TTL;
+        Log(TRACE_MIN, -1, "Resolved %s to %d addresses", host, result.count);
+    }
+    pthread_cond_broadcast(&resolver_cond);
+    pthread_mutex_unlock(&resolver_mutex);
+    free(host);
+    return NULL;
+}
+
+/* Start a lookup thread for an entry, called with resolver_mutex held */
+static void Resolver_start(Resolver_entry *e) {
+    pthread_t thread;
+    pthread_attr_t attr;
+    char *host = malloc(strlen(e->host) + 1);
+
+    e->state = RESOLVER_FAILED;
+    if (host == NULL)
+        return;
+    strcpy(host, e->host);
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, Resolver_run, host) == 0)
+        e->state = RESOLVER_PENDING;
+    else {
+        Log(LOG_ERROR, -1, "Could not start a lookup thread for %s", host);
+        free(host);
+    }
+    pthread_attr_destroy(&attr);
+}
+
+/**
+ * Get the addresses of a host.  Literal addresses are returned at once; names come from the
+ * cache, or from a lookup on another thread which is waited for up to the timeout.
+ * @param host the host name or literal address
+ * @param timeout milliseconds to wait for a lookup; 0 only starts it
+ * @param result returns the addresses, in the order they should be tried
+ * @return 0 on success, RESOLVER_IN_PROGRESS if the lookup has not finished, or -1 on failure
+ */
+int Resolver_lookup(const char *host, long timeout, Resolver_result *result) {
+    struct addrinfo hints = {AI_NUMERICHOST, AF_UNSPEC, SOCK_STREAM, IPPROTO_TCP, 0, NULL, NULL, NULL};
+    struct addrinfo *res = NULL;
+    struct timeval now = MQTTTime_now();
+    Resolver_entry *e = NULL;
+    int rc = -1;
+
+    if (getaddrinfo(host, NULL, &hints, &res) == 0) {
+        Resolver_sort(res, result);
+        freeaddrinfo(res);
+        return (result->count > 0) ? 0 : -1;
+    }
+
+    pthread_mutex_lock(&resolver_mutex);
+    if (cache == NULL && (cache = ListInitialize()) == NULL)
+        goto exit;
+    if (ListFindItem(cache, (void *) host, Resolver_hostCompare))
+        e = (Resolver_entry *) (cache->current->content);
+    else {
+        size_t len = strlen(host) + 1;
+
+        if ((e = malloc(sizeof(Resolver_entry) + len)) == NULL)
+            goto exit;
+        memset(e, '\0', sizeof(Resolver_entry));
+        e->host = (char *) (e + 1);
+        memcpy(e->host, host, len);
+        e->state = RESOLVER_FAILED;
+        ListAppend(cache, e, sizeof(Resolver_entry) + len);
+    }
+    if (e->state != RESOLVER_PENDING && !timercmp(&now, &e->expires, <))
+        Resolver_start(e);
+    if (e->state == RESOLVER_PENDING && timeout > 0) {
+        struct timespec deadline;
+
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += timeout / 1000;
+        deadline.tv_nsec += (timeout % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            ++deadline.tv_sec;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        while (cache && e->state == RESOLVER_PENDING &&
+               pthread_cond_timedwait(&resolver_cond, &resolver_mutex, &deadline) != ETIMEDOUT);
+        if (cache == NULL) /* terminated while waiting */
+            goto exit;
+    }
+    if (e->state == RESOLVER_PENDING)
+        rc = RESOLVER_IN_PROGRESS;
+    else if (e->state == RESOLVER_DONE) {
+        *result = e->result;
+        rc = 0;
+    }
+    exit:
+    pthread_mutex_unlock(&resolver_mutex);
+    return rc;
+}
+
+static int Resolver_sameAddress(const struct sockaddr *a, const struct sockaddr *b) {
+    if (a->sa_family != b->sa_family)
+        return 0;
+    if (a->sa_family == AF_INET)
+        return memcmp(&((struct sockaddr_in *) a)->sin_addr, &((struct sockaddr_in *) b)->sin_addr,
+                      sizeof(struct in_addr)) == 0;
+    return memcmp(&((struct sockaddr_in6 *) a)->sin6_addr, &((struct sockaddr_in6 *) b)->sin6_addr,
+                  sizeof(struct in6_addr)) == 0;
+}
+
+/**
+ * Move an address that has just been connected to to the front of the cached answer for its
+ * host, so the next connect tries it first.
+ */
+void Resolver_prefer(const char *host, const struct sockaddr *addr) {
+    pthread_mutex_lock(&resolver_mutex);
+    if (cache && ListFindItem(cache, (void *) host, Resolver_hostCompare)) {
+        Resolver_entry *e = (Resolver_entry *) (cache->current->content);
+        int i;
+
+        for (i = 1; i < e->result.count; ++i) {
+            if (Resolver_sameAddress((struct sockaddr *) &e->result.addr[i], addr)) {
+                struct sockaddr_storage preferred = e->result.addr[i];
+                socklen_t len = e->result.len[i];
+
+                memmove(&e->result.addr[1], &e->result.addr[0], i * sizeof(struct sockaddr_storage));
+                memmove(&e->result.len[1], &e->result.len[0], i * sizeof(socklen_t));
+                e->result.addr[0] = preferred;
+                e->result.len[0] = len;
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&resolver_mutex);
+}
+
+/* Free the cache.  Lookups still running find no entry to fill in, and just exit */
+void Resolver_terminate(void) {
+    pthread_mutex_lock(&resolver_mutex);
+    if (cache) {
+        ListFree(cache);
+        cache = NULL;
+    }
+    pthread_cond_broadcast(&resolver_cond);
+    pthread_mutex_unlock(&resolver_mutex);
+}
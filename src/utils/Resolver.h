@@ -0,0 +1,37 @@
+//
+// Created by Administrator on 2026/10/19.
+//
+// Host name resolution off the I/O path: lookups run on their own thread, and the answers are
+// kept in a process-wide cache shared by all client handles.
+//
+
+#ifndef MQTT_CLIENT_RESOLVER_H
+#define MQTT_CLIENT_RESOLVER_H
+
+#include <sys/socket.h>
+
+/** the lookup has been started but has not finished within the timeout */
+#define RESOLVER_IN_PROGRESS -23
+
+/** the most addresses kept for one host name */
+#define RESOLVER_MAX_ADDRESSES 8
+
+/** seconds a successful lookup is reused for.  getaddrinfo does not report the record TTL */
+#define RESOLVER_TTL 60
+/** seconds a failed lookup is remembered for */
+#define RESOLVER_NEGATIVE_TTL 5
+
+/** the addresses of a host, in the order they should be tried */
+typedef struct {
+    int count;
+    struct sockaddr_storage addr[RESOLVER_MAX_ADDRESSES];
+    socklen_t len[RESOLVER_MAX_ADDRESSES];
+} Resolver_result;
+
+int Resolver_lookup(const char *host, long timeout, Resolver_result *result);
+
+void Resolver_prefer(const char *host, const struct sockaddr *addr);
+
+void Resolver_terminate(void);
+
+#endif //MQTT_CLIENT_RESOLVER_H
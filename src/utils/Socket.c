@@ -32,11 +32,14 @@
 #include "Log.h"
 #include "SocketBuffer.h"
 #include "Messages.h"
+#include "Resolver.h"
+#include "MQTTTime.h"
 
 #include <stdlib.h>
 #include <string.h>
 #include <signal.h>
 #include <ctype.h>
+#include <sys/sendfile.h>
 #include "Thread.h"
 
 #if defined(USE_SELECT)
@@ -66,6 +69,12 @@ char *Socket_getaddrname(struct sockaddr *sa, SOCKET sock);
 
 int Socket_abortWrite(SOCKET socket);
 
+/* a socket a caller is writing to directly, whose close waits until the write is done */
+typedef struct {
+    SOCKET socket;
+    int closed;     /**< closed while busy: shut down, and to be closed by Socket_clearBusy */
+} busy_socket;
+
 /**
  * Structure to hold all socket data for this module
  */
@@ -116,6 +125,7 @@ void Socket_outInitialize(void) {
     SocketBuffer_initialize();
     mod_s.connect_pending = ListInitialize();
     mod_s.write_pending = ListInitialize();
+    mod_s.busy = ListInitialize();
 
 #if defined(USE_SELECT)
     mod_s.clientsds = ListInitialize();
@@ -123,6 +133,12 @@ void Socket_outInitialize(void) {
     FD_ZERO(&(mod_s.rset));                                                        /* Initialize the descriptor set */
     FD_ZERO(&(mod_s.pending_wset));
     mod_s.maxfdp1 = 0;
+    if (mod_s.wake[0] <= 0 && pipe(mod_s.wake) == 0) {
+        Socket_setnonblocking(mod_s.wake[0]);
+        Socket_setnonblocking(mod_s.wake[1]);
+        FD_SET(mod_s.wake[0], &(mod_s.rset));
+        mod_s.maxfdp1 = mod_s.wake[0] + 1;
+    }
     memcpy((void *) &(mod_s.rset_saved), (void *) &(mod_s.rset), sizeof(mod_s.rset_saved));
 #else
     mod_s.nfds = 0;
@@ -142,6 +158,7 @@ void Socket_outTerminate(void) {
     FUNC_ENTRY;
     ListFree(mod_s.connect_pending);
     ListFree(mod_s.write_pending);
+    ListFree(mod_s.busy);
 #if defined(USE_SELECT)
     ListFree(mod_s.clientsds);
 #else
@@ -265,8 +282,12 @@ exit:
 int isReady(int socket, fd_set *read_set, fd_set *write_set) {
     int rc = 1;
 
-    if (ListFindItem(mod_s.connect_pending, &socket, intcompare) && FD_ISSET(socket, write_set))
+    if (ListFindItem(mod_s.connect_pending, &socket, intcompare) && FD_ISSET(socket, write_set)) {
         ListRemoveItem(mod_s.connect_pending, &socket, intcompare);
+        if (!ListFindItem(mod_s.write_pending, &socket, intcompare))
+            FD_CLR(socket, &(mod_s.pending_wset));
+    } else if (ListFindItem(mod_s.busy, &socket, intcompare))
+        rc = FD_ISSET(socket, read_set); /* read what comes in while a caller writes a long packet */
     else
         rc = FD_ISSET(socket, read_set) && FD_ISSET(socket, write_set) && Socket_noPendingWrites(socket);
     return rc;
@@ -289,6 +310,8 @@ int isReady(int index)
     else if  (ListFindItem(mod_s.connect_pending, socket, intcompare) &&
             (mod_s.saved.fds[index].revents & POLLOUT))
         ListRemoveItem(mod_s.connect_pending, socket, intcompare);
+    else if (ListFindItem(mod_s.busy, socket, intcompare))
+        rc = (mod_s.saved.fds[index].revents & POLLIN); /* read what comes in while a caller writes a long packet */
     else
         rc = (mod_s.saved.fds[index].revents & POLLIN) &&
              (mod_s.saved.fds[index].revents & POLLOUT) &&
@@ -312,7 +335,7 @@ SOCKET Socket_getReadySocket(int more_work, int timeout, pthread_mutex_t *mutex,
     *rc = 0;
     int timeout_ms = 1000;
     pthread_mutex_lock(mutex);
-    if (mod_s.clientsds->count == 0)
+    if (mod_s.clientsds->count == 0 && mod_s.wake[0] <= 0)
         goto exit;
 
     if (more_work)
@@ -331,7 +354,9 @@ SOCKET Socket_getReadySocket(int more_work, int timeout, pthread_mutex_t *mutex,
         int rc1, maxfdp1_saved;
         fd_set pwset;
         struct timeval timeout_tv = {0L, 0L};
+        struct timeval start = MQTTTime_start_clock();
 
+        select_again:
         if (timeout_ms > 0L) {
             timeout_tv.tv_sec = timeout_ms / 1000;
             timeout_tv.tv_usec = (timeout_ms % 1000) * 1000; /* this field is microseconds! */
@@ -354,6 +379,17 @@ SOCKET Socket_getReadySocket(int more_work, int timeout, pthread_mutex_t *mutex,
             goto exit;
         }
         Log(TRACE_MAX, -1, "Return code %d from read select", *rc);
+        if (mod_s.wake[0] > 0 && FD_ISSET(mod_s.wake[0], &(mod_s.rset))) {
+            char drain[64];
+
+            while (read(mod_s.wake[0], drain, sizeof(drain)) > 0);
+            FD_CLR(mod_s.wake[0], &(mod_s.rset));
+            if (--(*rc) == 0 && (int) MQTTTime_elapsed(start) < timeout_ms) {
+                timeout_ms -= (int) MQTTTime_elapsed(start);
+                start = MQTTTime_start_clock();
+                goto select_again; /* only woken: select again with the new socket sets */
+            }
+        }
 
         if (Socket_continueWrites(&pwset, &sock, mutex) == SOCKET_ERROR) {
             *rc = SOCKET_ERROR;
@@ -534,7 +570,10 @@ char *Socket_getdata(SOCKET socket, size_t bytes, size_t *actual_len, int *rc) {
         goto exit;
     }
 
-    buf = SocketBuffer_getQueuedData(socket, bytes, actual_len);
+    if ((buf = SocketBuffer_getQueuedData(socket, bytes, actual_len)) == NULL) {
+        *rc = SOCKET_ERROR;
+        goto exit;
+    }
 
     if ((*rc = recv(socket, buf + (*actual_len), (int) (bytes - (*actual_len)), 0)) == SOCKET_ERROR) {
         *rc = Socket_error("recv - getdata", socket);
@@ -561,13 +600,139 @@ char *Socket_getdata(SOCKET socket, size_t bytes, size_t *actual_len, int *rc) {
 }
 
 
+/**
+ *  Attempts to read a number of bytes from a socket, non-blocking, into a buffer of the caller's
+ *  rather than the socket's queue, for callers which keep their own partial reads.
+ *  @param socket the socket to read from
+ *  @param buf where the data goes
+ *  @param bytes the most bytes to read
+ *  @param actual_len the number of bytes read, returned
+ *  @return TCPSOCKET_COMPLETE if all the bytes were read, TCPSOCKET_INTERRUPTED if fewer were, or
+ *  SOCKET_ERROR
+ */
+int Socket_read(SOCKET socket, char *buf, size_t bytes, size_t *actual_len) {
+    ssize_t count;
+    int rc = TCPSOCKET_INTERRUPTED;
+
+    *actual_len = 0;
+    if ((count = recv(socket, buf, bytes, 0)) == SOCKET_ERROR) {
+        int err = Socket_error("recv - read", socket);
+        if (err != EAGAIN && err != EWOULDBLOCK)
+            rc = SOCKET_ERROR;
+    } else if (count == 0) /* the other end closed the socket */
+        rc = SOCKET_ERROR;
+    else {
+        *actual_len = (size_t) count;
+        if (*actual_len == bytes)
+            rc = TCPSOCKET_COMPLETE;
+    }
+    return rc;
+}
+
+
 /**
  *  Indicate whether any data is pending outbound for a socket.
  *  @return boolean - true == no pending data.
  */
 int Socket_noPendingWrites(SOCKET socket) {
     SOCKET cursock = socket;
-    return ListFindItem(mod_s.write_pending, &cursock, intcompare) == NULL;
+    return ListFindItem(mod_s.write_pending, &cursock, intcompare) == NULL &&
+           ListFindItem(mod_s.busy, &cursock, intcompare) == NULL;
+}
+
+
+/**
+ *  Mark a socket as being written to by a caller which does not hold the client lock, so that
+ *  others see a pending write and leave it alone, but what arrives on it is still read.  If the
+ *  socket is closed meanwhile it is only shut down, so that the number is not reused under the
+ *  writer, and is closed by Socket_clearBusy.
+ *  @param socket the socket, which must have no pending write
+ *  @return 0 or PAHO_MEMORY_ERROR
+ */
+int Socket_setBusy(SOCKET socket) {
+    busy_socket *busy = malloc(sizeof(busy_socket));
+
+    if (busy == NULL)
+        return PAHO_MEMORY_ERROR;
+    busy->socket = socket;
+    busy->closed = 0;
+    ListAppend(mod_s.busy, busy, sizeof(busy_socket));
+    return 0;
+}
+
+
+/**
+ *  End the direct write to a socket marked by Socket_setBusy.
+ *  @param socket the socket
+ *  @return 1 if the socket was closed during the write, and has now been closed for good, else 0
+ */
+int Socket_clearBusy(SOCKET socket) {
+    int closed = 0;
+
+    if (ListFindItem(mod_s.busy, &socket, intcompare)) {
+        busy_socket *busy = (busy_socket *) (mod_s.busy->current->content);
+
+        if ((closed = busy->closed) != 0 && close(socket) == SOCKET_ERROR)
+            Socket_error("close", socket);
+        ListRemove(mod_s.busy, busy);
+    }
+    return closed;
+}
+
+
+/**
+ *  Keep a socket out of the ready-socket selection, for a connect attempt which is driven by
+ *  its caller rather than by Socket_getReadySocket.  Pending writes still continue.
+ *  @param socket the socket
+ *  @return 0 if the socket was found, else SOCKET_ERROR
+ */
+int Socket_hold(SOCKET socket) {
+    int rc = 0;
+
+#if defined(USE_SELECT)
+    FD_CLR(socket, &(mod_s.rset_saved));
+    FD_CLR(socket, &(mod_s.rset));
+    if (ListRemoveItem(mod_s.connect_pending, &socket, intcompare) &&
+        !ListFindItem(mod_s.write_pending, &socket, intcompare))
+        FD_CLR(socket, &(mod_s.pending_wset));
+#else
+    struct pollfd *fd = bsearch(&socket, mod_s.fds, (size_t)mod_s.nfds, sizeof(mod_s.fds[0]), cmpsockfds);
+
+    if (fd)
+        fd->events = 0;
+    ListRemoveItem(mod_s.connect_pending, &socket, intcompare);
+#endif
+    if (!ListFindItem(mod_s.clientsds, &socket, intcompare))
+        rc = SOCKET_ERROR;
+    return rc;
+}
+
+
+/**
+ *  Return a socket kept back by Socket_hold to the ready-socket selection.
+ *  @param socket the socket
+ *  @return 0 if the socket was found, else SOCKET_ERROR
+ */
+int Socket_release(SOCKET socket) {
+    int rc = 0;
+
+    if (!ListFindItem(mod_s.clientsds, &socket, intcompare)) {
+        rc = SOCKET_ERROR;
+        goto exit;
+    }
+#if defined(USE_SELECT)
+    FD_SET(socket, &(mod_s.rset_saved));
+#else
+    {
+        struct pollfd *fd = bsearch(&socket, mod_s.fds, (size_t)mod_s.nfds, sizeof(mod_s.fds[0]), cmpsockfds);
+
+        if (fd)
+            fd->events = POLLIN | POLLOUT | POLLNVAL;
+    }
+#endif
+    Socket_wake();
+exit:
+    return rc;
 }
 
 
@@ -586,7 +751,8 @@ int Socket_writev(SOCKET socket, iobuf *iovecs, int count, unsigned long *bytes)
     rc = writev(socket, iovecs, count);
     if (rc == SOCKET_ERROR) {
         int err = Socket_error("writev - putdatas", socket);
-        if (err == EWOULDBLOCK || err == EAGAIN)
+        /* EINPROGRESS: a TCP Fast Open connect without a cookie has sent a plain SYN */
+        if (err == EWOULDBLOCK || err == EAGAIN || err == EINPROGRESS)
             rc = TCPSOCKET_INTERRUPTED;
     } else
         *bytes = rc;
@@ -594,6 +760,21 @@ int Socket_writev(SOCKET socket, iobuf *iovecs, int count, unsigned long *bytes)
 }
 
 
+/* Put a socket whose write was left incomplete on the pending write list, taking sockmem */
+static int Socket_queuePending(SOCKET socket, SOCKET *sockmem) {
+    *sockmem = socket;
+    if (!ListAppend(mod_s.write_pending, sockmem, sizeof(int))) {
+        free(sockmem);
+        return PAHO_MEMORY_ERROR;
+    }
+#if defined(USE_SELECT)
+    FD_SET(socket, &(mod_s.pending_wset));
+    Socket_wake();
+#endif
+    return TCPSOCKET_INTERRUPTED;
+}
+
+
 /**
  *  Attempts to write a series of buffers to a socket in *one* system call so that they are
  *  sent as one packet.
@@ -644,24 +825,176 @@ int Socket_putdatas(SOCKET socket, char *buf0, size_t buf0len, PacketBuffers buf
                 bytes, total, socket);
 
             SocketBuffer_pendingWrite(socket, bufs.count + 1, iovecs, frees1, total, bytes);
+            rc = Socket_queuePending(socket, sockmem);
+        }
+    }
+    exit:
+    return rc;
+}
 
-            *sockmem = socket;
-            if (!ListAppend(mod_s.write_pending, sockmem, sizeof(int))) {
-                free(sockmem);
-                rc = PAHO_MEMORY_ERROR;
-                goto exit;
-            }
-#if defined(USE_SELECT)
-            FD_SET(socket, &(mod_s.pending_wset));
-#endif
-            rc = TCPSOCKET_INTERRUPTED;
+
+/**
+ *  Write packets held in buffers the caller keeps, with one system call for each IOV_MAX buffers.
+ *  If the socket does not take it all, the rest is copied into one buffer and left as a pending
+ *  write, so the caller's buffers can be reused as soon as this returns.  Nothing is copied when
+ *  the write completes.
+ *  @param socket the socket to write to
+ *  @param iovecs the buffers
+ *  @param count number of buffers
+ *  @return completion code, especially TCPSOCKET_INTERRUPTED
+ */
+int Socket_putdatav(SOCKET socket, struct iovec *iovecs, int count) {
+    unsigned long bytes = 0L;
+    size_t total = 0, skip;
+    SOCKET *sockmem = NULL;
+    char *rest = NULL, *ptr = NULL;
+    iobuf restvec;
+    int frees = 1, rc = TCPSOCKET_COMPLETE, first, n, i;
+
+    if (!Socket_noPendingWrites(socket)) {
+        Log(LOG_SEVERE, -1, "Trying to write to socket %d for which there is already pending output", socket);
+        return SOCKET_ERROR;
+    }
+    for (i = 0; i < count; i++)
+        total += iovecs[i].iov_len;
+    for (first = 0; first < count; first += n) {
+        unsigned long written = 0L;
+        size_t slice = 0;
+
+        n = (count - first > IOV_MAX) ? IOV_MAX : count - first;
+        for (i = first; i < first + n; i++)
+            slice += iovecs[i].iov_len;
+        if ((rc = Socket_writev(socket, &iovecs[first], n, &written)) == SOCKET_ERROR)
+            goto exit;
+        bytes += written;
+        if (written < slice)
+            break;
+    }
+    if (bytes == total) {
+        rc = TCPSOCKET_COMPLETE;
+        goto exit;
+    }
+    if ((sockmem = malloc(sizeof(SOCKET))) == NULL || (ptr = rest = malloc(total - bytes)) == NULL) {
+        free(sockmem);
+        rc = PAHO_MEMORY_ERROR;
+        goto exit;
+    }
+    Log(TRACE_MIN, -1, "Partial write: %lu bytes of %lu actually written on socket %d, copying the rest",
+        bytes, total, socket);
+    for (i = 0, skip = bytes; i < count; i++) {
+        if (skip >= iovecs[i].iov_len) {
+            skip -= iovecs[i].iov_len;
+            continue;
         }
+        memcpy(ptr, (char *) iovecs[i].iov_base + skip, iovecs[i].iov_len - skip);
+        ptr += iovecs[i].iov_len - skip;
+        skip = 0;
     }
+    restvec.iov_base = rest;
+    restvec.iov_len = total - bytes;
+    SocketBuffer_pendingWrite(socket, 1, &restvec, &frees, restvec.iov_len, 0);
+    rc = Socket_queuePending(socket, sockmem);
     exit:
     return rc;
 }
 
 
+/* Wait for a socket to take more data, for up to timeout milliseconds */
+static int Socket_waitWritable(SOCKET socket, int timeout) {
+    struct pollfd pfd;
+    int rc;
+
+    pfd.fd = socket;
+    pfd.events = POLLOUT;
+    pfd.revents = 0;
+    if ((rc = poll(&pfd, 1, timeout)) > 0 && (pfd.revents & (POLLERR | POLLHUP | POLLNVAL)) == 0)
+        return TCPSOCKET_COMPLETE;
+    if (rc < 0 && errno == EINTR)
+        return TCPSOCKET_COMPLETE;
+    Log(LOG_ERROR, -1, "Socket %d %s while waiting to write", socket, (rc == 0) ? "timed out" : "failed");
+    return SOCKET_ERROR;
+}
+
+
+/**
+ *  Write a series of buffers to a socket completely, waiting whenever the socket is full rather
+ *  than leaving the rest as a pending write.  For data too large to be held until the socket
+ *  drains; the socket must have no pending write.
+ *  @param socket the socket to write to
+ *  @param iovecs the buffers, which are updated as they are written
+ *  @param count number of buffers in iovecs
+ *  @param timeout milliseconds to wait for the socket to take more data
+ *  @return TCPSOCKET_COMPLETE or SOCKET_ERROR
+ */
+int Socket_writeFully(SOCKET socket, struct iovec *iovecs, int count, int timeout) {
+    int rc = TCPSOCKET_COMPLETE;
+
+    while (count > 0) {
+        unsigned long bytes = 0L;
+
+        if ((rc = Socket_writev(socket, iovecs, count, &bytes)) == SOCKET_ERROR)
+            break;
+        if (rc == TCPSOCKET_INTERRUPTED) {
+            if ((rc = Socket_waitWritable(socket, timeout)) != TCPSOCKET_COMPLETE)
+                break;
+            continue;
+        }
+        while (count > 0 && bytes >= iovecs->iov_len) {
+            bytes -= iovecs->iov_len;
+            ++iovecs;
+            --count;
+        }
+        if (count > 0) {
+            iovecs->iov_base = (char *) iovecs->iov_base + bytes;
+            iovecs->iov_len -= bytes;
+        }
+        rc = TCPSOCKET_COMPLETE;
+    }
+    return rc;
+}
+
+
+/**
+ *  Send part of a file to a socket with sendfile, so the data is not copied through user space,
+ *  waiting whenever the socket is full.  The socket must have no pending write.
+ *  @param socket the socket to write to
+ *  @param fd the file
+ *  @param offset where to start in the file
+ *  @param len the number of bytes to send
+ *  @param timeout milliseconds to wait for the socket to take more data
+ *  @return TCPSOCKET_COMPLETE, SOCKET_ERROR, or EINVAL if the file cannot be sent with sendfile,
+ *  in which case nothing has been sent
+ */
+int Socket_sendfile(SOCKET socket, int fd, off_t offset, size_t len, int timeout) {
+    int rc = TCPSOCKET_COMPLETE;
+    size_t sent = 0;
+
+    while (sent < len) {
+        ssize_t count = sendfile(socket, fd, &offset, len - sent);
+
+        if (count > 0)
+            sent += (size_t) count;
+        else if (count == 0) {
+            Log(LOG_ERROR, -1, "File %d ended %d bytes short", fd, (int) (len - sent));
+            rc = SOCKET_ERROR;
+            break;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            if ((rc = Socket_waitWritable(socket, timeout)) != TCPSOCKET_COMPLETE)
+                break;
+        } else if (errno != EINTR) {
+            if (sent == 0 && (errno == EINVAL || errno == ENOSYS))
+                rc = EINVAL; /* not a file sendfile can read from: the caller copies it instead */
+            else {
+                Socket_error("sendfile", socket);
+                rc = SOCKET_ERROR;
+            }
+            break;
+        }
+    }
+    return rc;
+}
+
+
 /**
  *  Add a socket to the pending write list, so that it is checked for writing in select.  This is used
  *  in connect processing when the TCP connect is incomplete, as we need to check the socket for both
@@ -695,6 +1028,13 @@ void Socket_clearPendingWrite(SOCKET socket) {
 int Socket_close_only(SOCKET socket) {
     int rc;
 
+    if (ListFindItem(mod_s.busy, &socket, intcompare)) {
+        /* a caller is writing to it: stop the write, and leave the close to Socket_clearBusy */
+        ((busy_socket *) (mod_s.busy->current->content))->closed = 1;
+        if ((rc = shutdown(socket, SHUT_RDWR)) == SOCKET_ERROR)
+            Socket_error("shutdown", socket);
+        return rc;
+    }
 
     if (shutdown(socket, SHUT_WR) == SOCKET_ERROR)
         Socket_error("shutdown", socket);
@@ -740,6 +1080,8 @@ int Socket_close(SOCKET socket) {
         while (ListNextElement(mod_s.clientsds, &cur_clientsds))
             mod_s.maxfdp1 = max(*((int *) (cur_clientsds->content)), mod_s.maxfdp1);
         ++(mod_s.maxfdp1);
+        if (mod_s.wake[0] > 0)
+            mod_s.maxfdp1 = max(mod_s.maxfdp1, mod_s.wake[0] + 1);
         Log(TRACE_MAX, -1, "Reset max fdp1 to %d", mod_s.maxfdp1);
     }
     exit:
@@ -798,29 +1140,113 @@ exit:
 
 
 /**
- *  Create a new socket and TCP connect to an address/port
+ *  Create a new socket and start a TCP connect to one resolved address
+ *  @param sa the address, whose port is overwritten
+ *  @param sa_len the length of the address
+ *  @param addr the address string, for logging
+ *  @param port the TCP port
+ *  @param sock returns the new socket, or SOCKET_ERROR
+ *  @param fastOpen use TCP Fast Open: connect returns at once, and the first write goes with the SYN
+ *  @return completion code 0=good, EINPROGRESS, or an error
+ */
+static int Socket_connectAddress(struct sockaddr_storage *sa, socklen_t sa_len, const char *addr, int port,
+                                 SOCKET *sock, int fastOpen) {
+    int rc = SOCKET_ERROR;
+
+    if (sa->ss_family == AF_INET6)
+        ((struct sockaddr_in6 *) sa)->sin6_port = htons(port);
+    else
+        ((struct sockaddr_in *) sa)->sin_port = htons(port);
+    *sock = socket(sa->ss_family, SOCK_STREAM, 0);
+    if (*sock == INVALID_SOCKET)
+        rc = Socket_error("socket", *sock);
+    else {
+#if defined(NOSIGPIPE)
+        int opt = 1;
+
+        if (setsockopt(*sock, SOL_SOCKET, SO_NOSIGPIPE, (void*)&opt, sizeof(opt)) != 0)
+            Log(LOG_ERROR, -1, "Could not set SO_NOSIGPIPE for socket %d", *sock);
+#endif
+/*#define SMALL_TCP_BUFFER_TESTING
+  This section sets the TCP send buffer to a small amount to provoke TCPSOCKET_INTERRUPTED
+	return codes from send, for testing only!
+*/
+#if defined(SMALL_TCP_BUFFER_TESTING)
+        if (1)
+                {
+                    int optsend = 100; //2 * 1440;
+                    printf("Setting optsend to %d\n", optsend);
+                    if (setsockopt(*sock, SOL_SOCKET, SO_SNDBUF, (void*)&optsend, sizeof(optsend)) != 0)
+                        Log(LOG_ERROR, -1, "Could not set SO_SNDBUF for socket %d", *sock);
+                }
+#endif
+        Log(TRACE_MIN, -1, "New socket %d for %s, port %d", *sock, addr, port);
+        if (Socket_addSocket(*sock) == SOCKET_ERROR)
+            rc = Socket_error("addSocket", *sock);
+        else {
+#if defined(TCP_FASTOPEN_CONNECT)
+            if (fastOpen) {
+                int opt = 1;
+
+                if (setsockopt(*sock, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, (void *) &opt, sizeof(opt)) != 0)
+                    Log(TRACE_MIN, -1, "TCP Fast Open is not available for socket %d", *sock);
+            }
+#endif
+            /* this could complete immediately, even though we are non-blocking */
+            rc = connect(*sock, (struct sockaddr *) sa, sa_len);
+            if (rc == SOCKET_ERROR)
+                rc = Socket_error("connect", *sock);
+            if (rc == EINPROGRESS || rc == EWOULDBLOCK) {
+                SOCKET *pnewSd = (SOCKET *) malloc(sizeof(SOCKET));
+
+                if (!pnewSd) {
+                    rc = PAHO_MEMORY_ERROR;
+                    goto exit;
+                }
+                *pnewSd = *sock;
+                if (!ListAppend(mod_s.connect_pending, pnewSd, sizeof(SOCKET))) {
+                    free(pnewSd);
+                    rc = PAHO_MEMORY_ERROR;
+                    goto exit;
+                }
+                Log(TRACE_MIN, 15, "Connect pending");
+#if defined(USE_SELECT)
+                /* wake up select, so it watches for the connect completing rather than timing out first */
+                FD_SET(*sock, &(mod_s.pending_wset));
+                Socket_wake();
+#endif
+            }
+        }
+        /* Prevent socket leak by closing unusable sockets,
+           as reported in https://github.com/eclipse/paho.mqtt.c/issues/135 */
+        if (rc != 0 && (rc != EINPROGRESS) && (rc != EWOULDBLOCK)) {
+            Socket_close(*sock); /* close socket and remove from our list of sockets */
+            *sock = SOCKET_ERROR; /* as initialized before */
+        }
+    }
+    exit:
+    return rc;
+}
+
+/**
+ *  Create a new socket and TCP connect to an address/port.  Host names are resolved by the
+ *  Resolver module; if the answer is not to hand within the timeout, RESOLVER_IN_PROGRESS is
+ *  returned and the call should be repeated later.  The resolved addresses are tried in turn
+ *  until a connect does not fail immediately.
  *  @param addr the address string
  *  @param port the TCP port
  *  @param sock returns the new socket
- *  @param timeout the timeout in milliseconds
- *  @return completion code 0=good, SOCKET_ERROR=fail
+ *  @param timeout the milliseconds to wait for a host name lookup
+ *  @param fastOpen use TCP Fast Open if the platform supports it
+ *  @return completion code 0=good, SOCKET_ERROR=fail, EINPROGRESS or RESOLVER_IN_PROGRESS
  */
-int Socket_new(const char *addr, size_t addr_len, int port, SOCKET *sock, long timeout) {
-    int type = SOCK_STREAM;
+int Socket_new(const char *addr, size_t addr_len, int port, SOCKET *sock, long timeout, int fastOpen) {
     char *addr_mem;
-    struct sockaddr_in address;
-#if defined(AF_INET6)
-    struct sockaddr_in6 address6;
-#endif
+    Resolver_result addresses;
     int rc = SOCKET_ERROR;
-
-    sa_family_t family = AF_INET;
-    struct addrinfo *result = NULL;
-    struct addrinfo hints = {0, AF_UNSPEC, SOCK_STREAM, IPPROTO_TCP, 0, NULL, NULL, NULL};
+    int i;
 
     *sock = SOCKET_ERROR;
-    memset(&address6, '\0', sizeof(address6));
-
     if (addr[0] == '[') {
         ++addr;
         --addr_len;
@@ -833,105 +1259,19 @@ int Socket_new(const char *addr, size_t addr_len, int port, SOCKET *sock, long t
     memcpy(addr_mem, addr, addr_len);
     addr_mem[addr_len] = '\0';
 
-
-    rc = getaddrinfo(addr_mem, NULL, &hints, &result);
-
-    if (rc == 0) {
-        struct addrinfo *res = result;
-
-        while (res) {    /* prefer ip4 addresses */
-            if (res->ai_family == AF_INET || res->ai_next == NULL)
-                break;
-            res = res->ai_next;
-        }
-
-        if (res == NULL)
-            rc = SOCKET_ERROR;
-        else
-#if defined(AF_INET6)
-        if (res->ai_family == AF_INET6) {
-            address6.sin6_port = htons(port);
-            address6.sin6_family = family = AF_INET6;
-            memcpy(&address6.sin6_addr, &((struct sockaddr_in6 *) (res->ai_addr))->sin6_addr,
-                   sizeof(address6.sin6_addr));
-        } else
-#endif
-        if (res->ai_family == AF_INET) {
-            memset(&address.sin_zero, 0, sizeof(address.sin_zero));
-            address.sin_port = htons(port);
-            address.sin_family = family = AF_INET;
-            address.sin_addr = ((struct sockaddr_in *) (res->ai_addr))->sin_addr;
-        } else
-            rc = SOCKET_ERROR;
-
-        freeaddrinfo(result);
-    } else {
-        Log(LOG_ERROR, -1, "getaddrinfo failed for addr %s with rc %d", addr_mem, rc);
-        rc = SOCKET_ERROR;
+    if ((rc = Resolver_lookup(addr_mem, timeout, &addresses)) == RESOLVER_IN_PROGRESS) {
+        Log(TRACE_MIN, -1, "Waiting for the addresses of %s", addr_mem);
+        goto exit;
     }
-
-    if (rc != 0)
+    if (rc != 0) {
         Log(LOG_ERROR, -1, "%s is not a valid IP address", addr_mem);
-    else {
-        *sock = socket(family, type, 0);
-        if (*sock == INVALID_SOCKET)
-            rc = Socket_error("socket", *sock);
-        else {
-#if defined(NOSIGPIPE)
-            int opt = 1;
-
-            if (setsockopt(*sock, SOL_SOCKET, SO_NOSIGPIPE, (void*)&opt, sizeof(opt)) != 0)
-                Log(LOG_ERROR, -1, "Could not set SO_NOSIGPIPE for socket %d", *sock);
-#endif
-/*#define SMALL_TCP_BUFFER_TESTING
-  This section sets the TCP send buffer to a small amount to provoke TCPSOCKET_INTERRUPTED
-	return codes from send, for testing only!
-*/
-#if defined(SMALL_TCP_BUFFER_TESTING)
-            if (1)
-                    {
-                        int optsend = 100; //2 * 1440;
-                        printf("Setting optsend to %d\n", optsend);
-                        if (setsockopt(*sock, SOL_SOCKET, SO_SNDBUF, (void*)&optsend, sizeof(optsend)) != 0)
-                            Log(LOG_ERROR, -1, "Could not set SO_SNDBUF for socket %d", *sock);
-                    }
-#endif
-            Log(TRACE_MIN, -1, "New socket %d for %s, port %d", *sock, addr, port);
-            if (Socket_addSocket(*sock) == SOCKET_ERROR)
-                rc = Socket_error("addSocket", *sock);
-            else {
-                /* this could complete immediately, even though we are non-blocking */
-                if (family == AF_INET)
-                    rc = connect(*sock, (struct sockaddr *) &address, sizeof(address));
-#if defined(AF_INET6)
-                else
-                    rc = connect(*sock, (struct sockaddr *) &address6, sizeof(address6));
-#endif
-                if (rc == SOCKET_ERROR)
-                    rc = Socket_error("connect", *sock);
-                if (rc == EINPROGRESS || rc == EWOULDBLOCK) {
-                    SOCKET *pnewSd = (SOCKET *) malloc(sizeof(SOCKET));
-
-                    if (!pnewSd) {
-                        rc = PAHO_MEMORY_ERROR;
-                        goto exit;
-                    }
-                    *pnewSd = *sock;
-                    if (!ListAppend(mod_s.connect_pending, pnewSd, sizeof(SOCKET))) {
-                        free(pnewSd);
-                        rc = PAHO_MEMORY_ERROR;
-                        goto exit;
-                    }
-                    Log(TRACE_MIN, 15, "Connect pending");
-                }
-            }
-            /* Prevent socket leak by closing unusable sockets,
-               as reported in https://github.com/eclipse/paho.mqtt.c/issues/135 */
-            if (rc != 0 && (rc != EINPROGRESS) && (rc != EWOULDBLOCK)) {
-                Socket_close(*sock); /* close socket and remove from our list of sockets */
-                *sock = SOCKET_ERROR; /* as initialized before */
-            }
-        }
+        rc = SOCKET_ERROR;
+        goto exit;
+    }
+    for (i = 0; i < addresses.count; ++i) {
+        rc = Socket_connectAddress(&addresses.addr[i], addresses.len[i], addr_mem, port, sock, fastOpen);
+        if (rc == 0 || rc == EINPROGRESS || rc == EWOULDBLOCK || rc == PAHO_MEMORY_ERROR)
+            break;
     }
 
     exit:
@@ -941,6 +1281,18 @@ int Socket_new(const char *addr, size_t addr_len, int port, SOCKET *sock, long t
 }
 
 
+/**
+ *  Interrupt a select in progress on another thread, so that it starts again with the
+ *  current socket sets
+ */
+void Socket_wake(void) {
+#if defined(USE_SELECT)
+    if (mod_s.wake[1] > 0 && write(mod_s.wake[1], "", 1) < 0)
+        ; /* the pipe is full, so select is about to wake anyway */
+#endif
+}
+
+
 static Socket_writeComplete *writecomplete = NULL;
 
 void Socket_setWriteCompleteCallback(Socket_writeComplete *mywritecomplete) {
@@ -57,6 +57,11 @@
 #endif
 
 
+#include <limits.h>
+#if !defined(IOV_MAX)
+#define IOV_MAX 1024 /* the Linux limit, for when limits.h only defines it for XOPEN */
+#endif
+
 #if !defined(max)
 #define max(A, B) ( (A) > (B) ? (A):(B))
 #endif
@@ -71,7 +76,6 @@ typedef struct {
     char **buffers;    /**> array of byte buffers */
     size_t *buflens;   /**> array of lengths of buffers */
     int *frees;        /**> array of flags indicating whether each buffer needs to be freed */
-    uint8_t mask[4];   /**> websocket mask used to mask the buffer data, if any */
 } PacketBuffers;
 
 
@@ -81,6 +85,7 @@ typedef struct {
 typedef struct {
     List *connect_pending; /**< list of sockets for which a connect is pending */
     List *write_pending; /**< list of sockets for which a write is pending */
+    List *busy; /**< sockets being written to directly by a caller without the client lock, see Socket_setBusy */
 
 #if defined(USE_SELECT)
     fd_set rset, /**< socket read set (see select doc) */
@@ -89,6 +94,7 @@ typedef struct {
     List *clientsds; /**< list of client socket descriptors */
     ListElement *cur_clientsds; /**< current client socket descriptor (iterator) */
     fd_set pending_wset; /**< socket pending write set for select */
+    int wake[2]; /**< pipe whose read end is in the read set, to interrupt select when the sets change */
 #else
     unsigned int nfds;         /**< no of file descriptors for poll */
     struct pollfd* fds;        /**< poll read file descriptors */
@@ -112,16 +118,34 @@ int Socket_getch(SOCKET socket, char *c);
 
 char *Socket_getdata(SOCKET socket, size_t bytes, size_t *actual_len, int *rc);
 
+int Socket_read(SOCKET socket, char *buf, size_t bytes, size_t *actual_len);
+
 int Socket_putdatas(SOCKET socket, char *buf0, size_t buf0len, PacketBuffers bufs);
 
+int Socket_putdatav(SOCKET socket, struct iovec *iovecs, int count);
+
+int Socket_writeFully(SOCKET socket, struct iovec *iovecs, int count, int timeout);
+
+int Socket_sendfile(SOCKET socket, int fd, off_t offset, size_t len, int timeout);
+
 int Socket_close(SOCKET socket);
 
-/* able to use GNU's getaddrinfo_a to make timeouts possible */
-int Socket_new(const char *addr, size_t addr_len, int port, SOCKET *socket, long timeout);
+/* host names are looked up on another thread, see Resolver.h */
+int Socket_new(const char *addr, size_t addr_len, int port, SOCKET *socket, long timeout, int fastOpen);
 
 
 int Socket_noPendingWrites(SOCKET socket);
 
+int Socket_setBusy(SOCKET socket);
+
+int Socket_clearBusy(SOCKET socket);
+
+int Socket_hold(SOCKET socket);
+
+int Socket_release(SOCKET socket);
+
+void Socket_wake(void);
+
 char *Socket_getpeer(SOCKET sock);
 
 void Socket_addPendingWrite(SOCKET socket);
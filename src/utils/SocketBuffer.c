@@ -26,93 +26,228 @@
 #include "LinkedList.h"
 #include "Log.h"
 #include "Messages.h"
+#include "MQTTTime.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 
 /**
- * Default input queue buffer
+ * Input buffers, indexed by socket, created on the first read from each socket
  */
-static socket_queue* def_queue;
+static socket_queue** queues = NULL;
 
 /**
- * List of queued input buffers
+ * Number of entries in the queues table
  */
-static List* queues;
+static int queues_len = 0;
 
 /**
  * List of queued write buffers
  */
 static List writes;
 
+/**
+ * Limits the buffer governor works to
+ */
+static struct
+{
+	size_t budget;		/**< most bytes of input buffers allowed across all sockets, 0 for no limit */
+	size_t keepSize;	/**< buffers up to this size are not shrunk while in use */
+	int idleTimeout;	/**< milliseconds after which an unused buffer is released */
+} limits = {0, SOCKETBUFFER_KEEP_SIZE, SOCKETBUFFER_IDLE_TIMEOUT};
+
+static SocketBuffer_stats stats;
+
+static struct timeval lastTrim;
+
 
-int socketcompare(void* a, void* b);
-int SocketBuffer_newDefQ(void);
-void SocketBuffer_freeDefQ(void);
 int pending_socketcompare(void* a, void* b);
 
 
 /**
- * List callback function for comparing socket_queues by socket
- * @param a first integer value
- * @param b second integer value
- * @return boolean indicating whether a and b are equal
+ * Find the input buffer of a socket
+ * @param socket the socket
+ * @return the input buffer, or NULL if the socket has none yet
  */
-int socketcompare(void* a, void* b)
+static socket_queue* SocketBuffer_findQueue(SOCKET socket)
 {
-	return ((socket_queue*)a)->socket == *(int*)b;
+	return (socket >= 0 && socket < queues_len) ? queues[socket] : NULL;
 }
 
 
 /**
- * Create a new default queue when one has just been used.
+ * Find the input buffer of a socket, creating it if this is the first read from the socket
+ * @param socket the socket
+ * @return the input buffer, or NULL if memory is exhausted
  */
-int SocketBuffer_newDefQ(void)
+static socket_queue* SocketBuffer_getQueue(SOCKET socket)
 {
-	int rc = PAHO_MEMORY_ERROR;
+	socket_queue* queue = SocketBuffer_findQueue(socket);
 
-	def_queue = malloc(sizeof(socket_queue));
-	if (def_queue)
+	if (queue || socket < 0)
+		goto exit;
+	if (socket >= queues_len)
 	{
-		def_queue->buflen = 1000;
-		def_queue->buf = malloc(def_queue->buflen);
-		if (def_queue->buf)
-		{
-			def_queue->socket = def_queue->index = 0;
-			def_queue->buflen = def_queue->datalen = def_queue->headerlen = 0;
-			rc = 0;
-		}
+		int newlen = (queues_len * 2 > socket) ? queues_len * 2 : socket + 1;
+		socket_queue** newqueues = realloc(queues, newlen * sizeof(socket_queue*));
+
+		if (newqueues == NULL)
+			goto exit;
+		memset(&newqueues[queues_len], '\0', (newlen - queues_len) * sizeof(socket_queue*));
+		queues = newqueues;
+		queues_len = newlen;
 	}
-	return rc;
+	if ((queue = malloc(sizeof(socket_queue))) == NULL)
+		goto exit;
+	memset(queue, '\0', sizeof(socket_queue));
+	queue->socket = socket;
+	queue->windowStart = queue->lastUsed = MQTTTime_now();
+	queues[socket] = queue;
+exit:
+	return queue;
 }
 
 
 /**
- * Initialize the socketBuffer module
+ * Change the size of the input buffer of a socket, keeping the governor's totals.  The contents
+ * are kept up to the new size.
+ * @param queue the input buffer
+ * @param newlen the new size, 0 to release the buffer
+ * @return 0 on success, PAHO_MEMORY_ERROR if the buffer could not be allocated, in which case
+ * it is unchanged
  */
-int SocketBuffer_initialize(void)
+static int SocketBuffer_resize(socket_queue* queue, size_t newlen)
 {
-	int rc = 0;
+	char* buf = NULL;
+
+	if (newlen > 0 && (buf = realloc(queue->buf, newlen)) == NULL)
+		return PAHO_MEMORY_ERROR;
+	if (newlen == 0)
+		free(queue->buf);
+	if (queue->buflen == 0 && newlen > 0)
+		++stats.buffers;
+	else if (queue->buflen > 0 && newlen == 0)
+		--stats.buffers;
+	SocketBuffer_account((long)newlen - (long)queue->buflen);
+	queue->buf = buf;
+	queue->buflen = newlen;
+	return 0;
+}
+
 
-	rc = SocketBuffer_newDefQ();
-	if (rc == 0)
+/**
+ * Add to or take away from the receive buffer memory in use.  WebSocket frames are counted
+ * through this as well as the socket input buffers.
+ * @param delta the change in bytes
+ */
+void SocketBuffer_account(long delta)
+{
+	stats.current += delta;
+	if (stats.current > stats.peak)
+		stats.peak = stats.current;
+}
+
+
+/**
+ * Check that more receive buffer memory fits within the budget, releasing the buffers not in use
+ * to make room if it does not.  WebSocket frames and compression buffers are checked through
+ * this as well as the socket input buffers.
+ * @param increase the bytes to be added
+ * @return 1 if they fit, else 0, and the refusal is counted
+ */
+int SocketBuffer_withinBudget(size_t increase)
+{
+	if (limits.budget > 0 && stats.current + increase > limits.budget)
+		SocketBuffer_trim(1);
+	if (limits.budget > 0 && stats.current + increase > limits.budget)
 	{
-		if ((queues = ListInitialize()) == NULL)
-			rc = PAHO_MEMORY_ERROR;
+		++stats.refused;
+		return 0;
+	}
+	return 1;
+}
+
+
+/**
+ * Set the limits of the buffer governor
+ * @param budget most bytes of input buffers allowed across all sockets, 0 for no limit.  A read
+ * that needs more fails, which closes its connection
+ * @param keepSize buffers larger than this are shrunk to what their socket has needed over the
+ * last idleTimeout
+ * @param idleTimeout milliseconds without a packet after which a socket's buffer is released
+ */
+void SocketBuffer_setLimits(size_t budget, size_t keepSize, int idleTimeout)
+{
+	limits.budget = budget;
+	limits.keepSize = (keepSize < SOCKETBUFFER_MIN_SIZE) ? SOCKETBUFFER_MIN_SIZE : keepSize;
+	limits.idleTimeout = (idleTimeout > 0) ? idleTimeout : SOCKETBUFFER_IDLE_TIMEOUT;
+}
+
+
+/**
+ * The buffer governor.  Releases the input buffers of sockets which have had no packet for the
+ * idle timeout, and shrinks buffers which have grown for a large packet to what their socket
+ * has needed since.  Buffers holding part of a packet are never touched.  Called regularly
+ * from the client's run loop, when it only does anything every SOCKETBUFFER_TRIM_INTERVAL.
+ * @param force release every buffer not in use now, whatever the timeout, to make room
+ * within the budget
+ */
+void SocketBuffer_trim(int force)
+{
+	struct timeval now = MQTTTime_now();
+	int i;
+
+	if (!force && MQTTTime_difftime(now, lastTrim) < SOCKETBUFFER_TRIM_INTERVAL)
+		return;
+	lastTrim = now;
+	for (i = 0; i < queues_len; ++i)
+	{
+		socket_queue* queue = queues[i];
+
+		if (queue == NULL || queue->buflen == 0 || queue->headerlen > 0 || queue->datalen > 0)
+			continue;
+		if (force || MQTTTime_difftime(now, queue->lastUsed) >= limits.idleTimeout)
+		{
+			Log(TRACE_MIN, -1, "Releasing the %d byte input buffer of socket %d", (int)queue->buflen, queue->socket);
+			SocketBuffer_resize(queue, 0);
+			++stats.trimmed;
+		}
+		else if (MQTTTime_difftime(now, queue->windowStart) >= limits.idleTimeout)
+		{
+			size_t newlen = SOCKETBUFFER_MIN_SIZE;
+
+			while (newlen < queue->highwater)
+				newlen *= 2;
+			if (queue->buflen > limits.keepSize && newlen < queue->buflen &&
+				SocketBuffer_resize(queue, newlen) == 0)
+			{
+				Log(TRACE_MIN, -1, "Shrunk the input buffer of socket %d to %d bytes", queue->socket, (int)newlen);
+				++stats.trimmed;
+			}
+			queue->highwater = 0;
+			queue->windowStart = now;
+		}
 	}
-	ListZero(&writes);
-	return rc;
 }
 
 
 /**
- * Free the default queue memory
+ * Get the receive buffer memory statistics
+ * @param s the structure to fill in
  */
-void SocketBuffer_freeDefQ(void)
+void SocketBuffer_getStats(SocketBuffer_stats* s)
 {
-	free(def_queue->buf);
-	free(def_queue);
-        def_queue = NULL;
+	*s = stats;
+}
+
+
+/**
+ * Initialize the socketBuffer module
+ */
+int SocketBuffer_initialize(void)
+{
+	ListZero(&writes);
+	return 0;
 }
 
 
@@ -121,12 +256,26 @@ void SocketBuffer_freeDefQ(void)
  */
 void SocketBuffer_terminate(void)
 {
-	ListElement* cur = NULL;
-	ListEmpty(&writes);
-	while (ListNextElement(queues, &cur))
-		free(((socket_queue*)(cur->content))->buf);
-	ListFree(queues);
-	SocketBuffer_freeDefQ();
+	int i;
+
+	while (writes.first)
+	{
+		pending_writes* pw = (pending_writes*)(writes.first->content);
+
+		ListDetachElement(&writes, &pw->link);
+		free(pw);
+	}
+	for (i = 0; i < queues_len; ++i)
+	{
+		if (queues[i])
+		{
+			SocketBuffer_resize(queues[i], 0);
+			free(queues[i]);
+		}
+	}
+	free(queues);
+	queues = NULL;
+	queues_len = 0;
 }
 
 
@@ -136,60 +285,60 @@ void SocketBuffer_terminate(void)
  */
 void SocketBuffer_cleanup(SOCKET socket)
 {
+	socket_queue* queue = SocketBuffer_findQueue(socket);
+
 	SocketBuffer_writeComplete(socket); /* clean up write buffers */
-	if (ListFindItem(queues, &socket, socketcompare))
+	if (queue)
 	{
-		free(((socket_queue*)(queues->current->content))->buf);
-		ListRemove(queues, queues->current->content);
-	}
-	if (def_queue->socket == socket)
-	{
-		def_queue->socket = def_queue->index = 0;
-		def_queue->headerlen = def_queue->datalen = 0;
+		SocketBuffer_resize(queue, 0);
+		free(queue);
+		queues[socket] = NULL;
 	}
 }
 
 
 /**
- * Get any queued data for a specific socket
+ * Get any queued data for a specific socket, making the buffer big enough for the whole packet.
+ * The buffer belongs to the socket and is kept between packets, so it grows to the largest
+ * packet seen on that socket, until the governor trims it.  It is only reallocated at the start
+ * of a packet larger than the buffer, so the bytes of a packet being read are never copied.
  * @param socket the socket to get queued data for
  * @param bytes the number of bytes of data to retrieve
  * @param actual_len the actual length returned
- * @return the actual data
+ * @return the actual data, or NULL if memory is exhausted or the budget reached
  */
 char* SocketBuffer_getQueuedData(SOCKET socket, size_t bytes, size_t* actual_len)
 {
-	socket_queue* queue = NULL;
+	socket_queue* queue = SocketBuffer_getQueue(socket);
+	char* buf = NULL;
 
-	if (ListFindItem(queues, &socket, socketcompare))
-	{  /* if there is queued data for this socket, add any data read to it */
-		queue = (socket_queue*)(queues->current->content);
-		*actual_len = queue->datalen;
-	}
-	else
-	{
-		*actual_len = 0;
-		queue = def_queue;
-	}
+	*actual_len = 0;
+	if (queue == NULL)
+		goto exit;
+	*actual_len = queue->datalen;
+	if (bytes > queue->highwater)
+		queue->highwater = bytes;
 	if (bytes > queue->buflen)
 	{
-		if (queue->datalen > 0)
-		{
-			void* newmem = malloc(bytes);
+		size_t newlen = SOCKETBUFFER_MIN_SIZE;
 
-			free(queue->buf);
-			queue->buf = newmem;
-			if (!newmem)
-				goto exit;
-			memcpy(newmem, queue->buf, queue->datalen);
+		while (newlen < bytes)
+			newlen *= 2;
+		if (!SocketBuffer_withinBudget(newlen - queue->buflen))
+		{
+			Log(LOG_ERROR, -1, "A %d byte packet on socket %d would exceed the receive buffer budget of %d bytes",
+				(int)bytes, socket, (int)limits.budget);
+			goto exit;
 		}
-		else
-			queue->buf = realloc(queue->buf, bytes);
-		queue->buflen = bytes;
+		if (queue->datalen == 0) /* nothing to keep, so don't have realloc copy it */
+			SocketBuffer_resize(queue, 0);
+		if (SocketBuffer_resize(queue, newlen) != 0)
+			goto exit;
 	}
+	buf = queue->buf;
 exit:
 	FUNC_EXIT;
-	return queue->buf;
+	return buf;
 }
 
 
@@ -202,10 +351,10 @@ exit:
 int SocketBuffer_getQueuedChar(SOCKET socket, char* c)
 {
 	int rc = SOCKETBUFFER_INTERRUPTED;
+	socket_queue* queue = SocketBuffer_findQueue(socket);
 
-	if (ListFindItem(queues, &socket, socketcompare))
+	if (queue)
 	{  /* if there is queued data for this socket, read that first */
-		socket_queue* queue = (socket_queue*)(queues->current->content);
 		if (queue->index < queue->headerlen)
 		{
 			*c = queue->fixed_header[(queue->index)++];
@@ -233,43 +382,32 @@ exit:
  */
 void SocketBuffer_interrupted(SOCKET socket, size_t actual_len)
 {
-	socket_queue* queue = NULL;
+	socket_queue* queue = SocketBuffer_getQueue(socket);
 
-	if (ListFindItem(queues, &socket, socketcompare))
-		queue = (socket_queue*)(queues->current->content);
-	else /* new saved queue */
+	if (queue)
 	{
-		queue = def_queue;
-		/* if SocketBuffer_queueChar() has not yet been called, then the socket number
-		  in def_queue will not have been set.  Issue #244.
-		  If actual_len == 0 then we may not need to do anything - I'll leave that
-		  optimization for another time. */
-		queue->socket = socket;
-		ListAppend(queues, def_queue, sizeof(socket_queue)+def_queue->buflen);
-		SocketBuffer_newDefQ();
+		queue->index = 0;
+		queue->datalen = actual_len;
 	}
-	queue->index = 0;
-	queue->datalen = actual_len;
 }
 
 
 /**
  * A socket read has now completed so we can get rid of the queue
  * @param socket the socket for which the operation is now complete
- * @return pointer to the default queue data
+ * @return pointer to the data of the packet just read, which stays valid until the next read
+ * from the same socket
  */
 char* SocketBuffer_complete(SOCKET socket)
 {
-	if (ListFindItem(queues, &socket, socketcompare))
-	{
-		socket_queue* queue = (socket_queue*)(queues->current->content);
-		SocketBuffer_freeDefQ();
-		def_queue = queue;
-		ListDetach(queues, queue);
-	}
-	def_queue->socket = def_queue->index = 0;
-	def_queue->headerlen = def_queue->datalen = 0;
-	return def_queue->buf;
+	socket_queue* queue = SocketBuffer_findQueue(socket);
+
+	if (queue == NULL)
+		return NULL;
+	queue->index = 0;
+	queue->headerlen = queue->datalen = 0;
+	queue->lastUsed = MQTTTime_now();
+	return queue->buf;
 }
 
 
@@ -280,33 +418,18 @@ char* SocketBuffer_complete(SOCKET socket)
  */
 void SocketBuffer_queueChar(SOCKET socket, char c)
 {
-	int error = 0;
-	socket_queue* curq = def_queue;
+	socket_queue* curq = SocketBuffer_getQueue(socket);
 
-	if (ListFindItem(queues, &socket, socketcompare))
-		curq = (socket_queue*)(queues->current->content);
-	else if (def_queue->socket == 0)
-	{
-		def_queue->socket = socket;
-		def_queue->index = 0;
-		def_queue->datalen = 0;
-	}
-	else if (def_queue->socket != socket)
-	{
-		Log(LOG_FATAL, -1, "attempt to reuse socket queue");
-		error = 1;
-	}
-	if (curq->index > 4)
-	{
+	if (curq == NULL)
+		Log(LOG_FATAL, -1, "no memory for socket queue");
+	else if (curq->index > 4)
 		Log(LOG_FATAL, -1, "socket queue fixed_header field full");
-		error = 1;
-	}
-	if (!error)
+	else
 	{
 		curq->fixed_header[(curq->index)++] = c;
 		curq->headerlen = curq->index;
+		Log(TRACE_MAX, -1, "queueChar: index is now %d, headerlen %d", curq->index, (int)curq->headerlen);
 	}
-	Log(TRACE_MAX, -1, "queueChar: index is now %d, headerlen %d", curq->index, (int)curq->headerlen);
 }
 
 
@@ -341,7 +464,7 @@ int SocketBuffer_pendingWrite(SOCKET socket, int count, iobuf* iovecs, int* free
 		pw->iovecs[i] = iovecs[i];
 		pw->frees[i] = frees[i];
 	}
-	ListAppend(&writes, pw, sizeof(pw) + total);
+	ListAppendNoMalloc(&writes, pw, &pw->link, sizeof(pw) + total);
 exit:
 	return rc;
 }
@@ -378,7 +501,13 @@ pending_writes* SocketBuffer_getWrite(SOCKET socket)
  */
 int SocketBuffer_writeComplete(SOCKET socket)
 {
-	return ListRemoveItem(&writes, &socket, pending_socketcompare);
+	ListElement* le = ListFindItem(&writes, &socket, pending_socketcompare);
+
+	if (le == NULL)
+		return 0;
+	ListDetachElement(&writes, le);
+	free(le->content);
+	return 1;
 }
 
 
@@ -19,6 +19,28 @@
 #define SOCKETBUFFER_H
 
 #include "Socket.h"
+#include "LinkedList.h"
+
+/** the smallest input buffer allocated for a socket; buffers grow in powers of two from here */
+#define SOCKETBUFFER_MIN_SIZE 1024
+
+/** default for the size above which a buffer is shrunk to what its socket has recently needed */
+#define SOCKETBUFFER_KEEP_SIZE (64 * 1024)
+
+/** default milliseconds without a packet after which a socket's input buffer is released */
+#define SOCKETBUFFER_IDLE_TIMEOUT 10000
+
+/** milliseconds between passes of the buffer governor */
+#define SOCKETBUFFER_TRIM_INTERVAL 1000
+
+/** receive buffer memory, across all sockets */
+typedef struct {
+    size_t current;             /**< bytes held in input buffers, WebSocket frames and compression buffers */
+    size_t peak;                /**< the most held at once */
+    int buffers;                /**< sockets holding an input buffer */
+    unsigned long trimmed;      /**< buffers shrunk or released by the governor */
+    unsigned long refused;      /**< reads failed because the budget was reached */
+} SocketBuffer_stats;
 
 typedef struct iovec iobuf;
 typedef struct {
@@ -29,6 +51,9 @@ typedef struct {
     size_t buflen,            /**< total length of the buffer */
     datalen;            /**< current length of data in buf */
     char *buf;
+    size_t highwater;   /**< the largest packet since windowStart */
+    struct timeval windowStart, /**< when the governor last looked at highwater */
+    lastUsed;           /**< when the last packet was completed */
 } socket_queue;
 
 typedef struct {
@@ -38,6 +63,7 @@ typedef struct {
     size_t bytes;
     iobuf iovecs[5];
     int frees[5];
+    ListElement link;   /**< its place in the list of queued write buffers */
 } pending_writes;
 
 int SocketBuffer_initialize(void);
@@ -64,4 +90,14 @@ int SocketBuffer_writeComplete(SOCKET socket);
 
 pending_writes *SocketBuffer_updateWrite(SOCKET socket, char *topic, char *payload);
 
+void SocketBuffer_setLimits(size_t budget, size_t keepSize, int idleTimeout);
+
+void SocketBuffer_account(long delta);
+
+int SocketBuffer_withinBudget(size_t increase);
+
+void SocketBuffer_trim(int force);
+
+void SocketBuffer_getStats(SocketBuffer_stats *stats);
+
 #endif
@@ -30,21 +30,23 @@
 #include "Thread.h"
 #include <errno.h>
 #include <unistd.h>
+#include <time.h>
 
 /**
  * Start a new thread
  * @param fn the function to run, must be of the correct signature
  * @param parameter pointer to the function parameter, can be NULL
+ * @return the thread, to be joined or detached by the caller, or 0 if it could not be started
  */
-void Thread_start(thread_fn fn, void *parameter) {
+pthread_t Thread_start(thread_fn fn, void *parameter) {
     pthread_t thread = 0;
     pthread_attr_t attr;
     pthread_attr_init(&attr);
-    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
     if (pthread_create(&thread, &attr, fn, parameter) != 0)
         thread = 0;
     pthread_attr_destroy(&attr);
-
+    return thread;
 }
 /**
  * Create a new mutex
@@ -127,20 +129,18 @@ sem_t * Thread_create_sem(int *rc) {
  * @return completion code
  */
 int Thread_wait_sem(sem_t * sem, int timeout) {
-/* sem_timedwait is the obvious call to use, but seemed not to work on the Viper,
- * so I've used trywait in a loop instead. Ian Craggs 23/7/2010
- */
     int rc = -1;
-    int i = 0;
-    useconds_t interval = 10000; /* 10000 microseconds: 10 milliseconds */
-    int count = (1000 * timeout) / interval; /* how many intervals in timeout period */
-    while (++i < count && (rc = sem_trywait(sem)) != 0) {
-        if (rc == -1 && ((rc = errno) != EAGAIN)) {
-            rc = 0;
-            break;
-        }
-        usleep(interval); /* microseconds - .1 of a second */
+    struct timespec deadline;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout / 1000;
+    deadline.tv_nsec += (timeout % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        ++deadline.tv_sec;
+        deadline.tv_nsec -= 1000000000L;
     }
+    while ((rc = sem_timedwait(sem, &deadline)) == -1 && (rc = errno) == EINTR)
+        ;
     return rc;
 }
 
@@ -40,7 +40,7 @@ int Thread_wait_cond(cond_type condvar, int timeout);
 
 int Thread_destroy_cond(cond_type);
 
-extern void Thread_start(thread_fn, void *);
+extern pthread_t Thread_start(thread_fn, void *);
 
 extern pthread_mutex_t* Thread_create_mutex(int *);
 
@@ -18,6 +18,7 @@
 #include <pthread.h>
 #include <stdlib.h>
 #include <semaphore.h>
+#include <sys/types.h>
 
 #define BUILD_TIMESTAMP "2022-11-01T01:05:37Z"
 #define CLIENT_VERSION  "1.3.10"
@@ -39,6 +40,7 @@
 #endif
 
 #define URI_TCP "tcp://"
+#define URI_WS "ws://"
 
 #define MQTT_INVALID_PROPERTY_ID -2
 
@@ -120,6 +122,9 @@ enum msgTypes
 
 #define MQTTCLIENT_BAD_MQTT_VERSION -11
 
+/** The publish was made while disconnected and the offline buffer is full. */
+#define MQTTCLIENT_MAX_BUFFERED_MESSAGES -12
+
 #define MQTTCLIENT_BAD_PROTOCOL -14
 
 #define MQTTCLIENT_BAD_MQTT_OPTION -15
@@ -128,6 +133,21 @@ enum msgTypes
 
 #define MQTTCLIENT_0_LEN_WILL_TOPIC -17
 
+/** This persistence_type value stores in-flight and undelivered messages in the
+ *  append-only log of MQTTPersistence.c, under the directory given as the persistence_context. */
+#define MQTTCLIENT_PERSISTENCE_DEFAULT 0
+
+/** This persistence_type value keeps the session state in memory only. */
+#define MQTTCLIENT_PERSISTENCE_NONE 1
+
+/** The persistence store could not be opened or recovered. */
+#define MQTTCLIENT_PERSISTENCE_ERROR -2
+
+/** Offline buffer drop policies: which message makes room when the buffer is full */
+#define MQTTCLIENT_BUFFER_DROP_OLDEST 0      /**< the oldest buffered message */
+#define MQTTCLIENT_BUFFER_DROP_NEWEST 1      /**< the new message, which the publish call fails */
+#define MQTTCLIENT_BUFFER_DROP_QOS0_FIRST 2  /**< the oldest QoS 0 message, else the oldest message */
+
 #define MQTTVERSION_3_1_1 4
 
 #define MQTT_BAD_SUBSCRIBE 0x80
@@ -145,6 +165,8 @@ enum msgTypes
 #define WAIT_FOR_CONNACK 0x4
 /** Proxy connection in progress */
 #define PROXY_CONNECT_IN_PROGRESS 0x5
+/** Waiting for the host name to be resolved */
+#define RESOLVE_IN_PROGRESS 0x6
 /** Disconnecting */
 #define DISCONNECTING    -2
 
@@ -192,7 +214,25 @@ typedef void* MQTTClient;
 typedef int MQTTClient_deliveryToken;
 
 /**
- * Stored publication data to minimize copying
+ * Read the next piece of a payload for MQTTClient_publishSource.  The offset is given so that a
+ * payload can be read again when its message is resent.
+ * @return the bytes read, up to len, or 0 or less on failure
+ */
+typedef ssize_t MQTTClient_readPayload(void* context, void* buf, size_t len, size_t offset);
+
+/** where MQTTClient_publishSource takes a payload from */
+typedef struct
+{
+    int fd;                         /**< the file to send the payload from, or -1 to call read */
+    off_t offset;                   /**< where the payload starts in fd */
+    size_t len;                     /**< the length of the payload */
+    MQTTClient_readPayload* read;   /**< called for each piece of the payload, when fd is -1 */
+    void* context;                  /**< passed to read */
+} MQTTClient_payloadSource;
+
+/**
+ * Stored publication data to minimize copying.  It is shared by the messages and pending
+ * writes that refer to it, and freed when the last of them lets it go.
  */
 typedef struct
 {
@@ -201,7 +241,8 @@ typedef struct
     char* payload;
     int payloadlen;
     int refcount;
-    unsigned char mask[4];
+    int size;               /**< bytes counted for it in MQTTProtocol.publications_size */
+    MQTTClient_payloadSource* source; /**< where the payload is read from when it is not stored, or NULL */
 } Publications;
 
 
@@ -209,12 +250,54 @@ typedef struct
 {
     /** The eyecatcher for this structure.  must be MQCO. */
     char struct_id[4];
-    /** The version number of this structure.  Must be 0 */
+    /** The version number of this structure.  Must be 0, 1 or 2.
+     *  0 means no offline buffering fields, 1 means no poolReserve */
     int struct_version;
 
     int MQTTVersion;
+    /** Whether publishes made while not connected are buffered and sent on the next connect */
+    int sendWhileDisconnected;
+    /** The maximum number of messages buffered while not connected */
+    int maxBufferedMessages;
+    /** The maximum number of topic and payload bytes buffered while not connected, 0 for no limit */
+    int maxBufferedBytes;
+    /** One of the MQTTCLIENT_BUFFER_DROP_ values */
+    int bufferDropPolicy;
+    /** The number of in-flight messages to set aside pooled memory for at create time, so the
+     *  message path does not go to the system allocator while the pools warm up.  0 for none */
+    int poolReserve;
 } MQTTClient_createOptions;
 
+#define MQTTClient_createOptions_initializer { {'M', 'Q', 'C', 'O'}, 2, MQTTVERSION_3_1_1, 0, 100, 0, \
+MQTTCLIENT_BUFFER_DROP_OLDEST, 0 }
+
+/**
+ * WebSocket permessage-deflate compression (RFC 7692), offered in the upgrade request of ws://
+ * connections.  What the server answers decides what is used.
+ */
+typedef struct
+{
+    /** The eyecatcher for this structure.  must be MQWD. */
+    char struct_id[4];
+    /** The version number of this structure.  Must be 0. */
+    int struct_version;
+    /** The zlib compression level, 1 to 9, or -1 for zlib's default */
+    int level;
+    /** The window the client compresses with, 9 to 15 bits: offered as client_max_window_bits */
+    int clientMaxWindowBits;
+    /** The window asked of the server for what it sends, 8 to 15 bits, or 0 to leave it to the server */
+    int serverMaxWindowBits;
+    /** Compress each message sent on its own, which keeps less memory between messages but
+     *  compresses repeated content less well */
+    int clientNoContextTakeover;
+    /** Ask the server to compress each message it sends on its own */
+    int serverNoContextTakeover;
+    /** Messages shorter than this are sent uncompressed */
+    int threshold;
+} MQTTClient_deflateOptions;
+
+#define MQTTClient_deflateOptions_initializer { {'M', 'Q', 'W', 'D'}, 0, -1, 15, 0, 0, 0, 32 }
+
 typedef struct
 {
     const char* name;
@@ -255,6 +338,33 @@ typedef struct MQTTProperties
 } MQTTProperties;
 #define MQTTProperties_initializer {0, 0, 0, NULL}
 
+/** the highest MQTT 5 property identifier */
+#define MQTTPROPERTY_CODE_MAX MQTTPROPERTY_CODE_SHARED_SUBSCRIPTION_AVAILABLE
+
+/**
+ * The MQTT 5 properties of an inbound packet, indexed where they lie in the packet rather than
+ * copied out of it.  A value is decoded when it is asked for, so the index is only good for as
+ * long as the packet data, which is until the next read from the socket.
+ */
+typedef struct
+{
+    char* data;         /**< the first property, in the packet */
+    int length;         /**< the bytes of properties */
+    int count;          /**< the number of properties */
+    unsigned long long present; /**< bit n is set if property n is in the block */
+    int offsets[MQTTPROPERTY_CODE_MAX + 1]; /**< where the first property n starts, if its bit is set */
+} MQTTPropertyIndex;
+
+/**
+ * MQTT 5 properties encoded once, to be sent as they are with many messages, so that nothing
+ * about them is worked out again for each message.
+ */
+typedef struct
+{
+    char* data;         /**< the encoded properties, without the property length */
+    int length;         /**< the bytes in data */
+} MQTTPropertyBlock;
+
 typedef struct
 {
     /** The eyecatcher for this structure.  must be MQTM. */
@@ -299,6 +409,7 @@ typedef struct
         const char* serverURI;     /**< the serverURI connected to */
         int MQTTVersion;     /**< the MQTT version used to connect with */
         int sessionPresent;  /**< if the MQTT version is 3.1.1, the value of sessionPresent returned in the connack */
+        int connectTime;     /**< milliseconds from the start of the connect to the CONNACK */
     } returned;
     struct
     {
@@ -312,10 +423,35 @@ typedef struct
      */
     const MQTTClient_nameValue* httpHeaders;
 
+    /**
+     * Reconnect when the connection is lost (struct_version >= 9).  The reconnect is driven by
+     * the background thread, so the callbacks must be set.
+     */
+    int automaticReconnect;
+    /** Delay before the second reconnect attempt in milliseconds; the first attempt is immediate.
+     *  The delay then doubles, with random jitter, after each failed attempt. */
+    int minReconnectDelay;
+    /** Upper bound of the reconnect delay in milliseconds */
+    int maxReconnectDelay;
+    /**
+     * With serverURIcount > 0, the milliseconds to wait before starting the connect to the next
+     * serverURI while the earlier ones are still in progress (struct_version >= 10).  0 starts
+     * them all at once.
+     */
+    int connectStagger;
+    /** Use TCP Fast Open where the platform supports it, so the CONNECT can travel with the SYN
+     *  (struct_version >= 11) */
+    int fastOpen;
+    /**
+     * Send the subscriptions made while disconnected, and the messages buffered while
+     * disconnected, straight after the CONNECT instead of waiting for the CONNACK
+     * (struct_version >= 11)
+     */
+    int pipelineConnect;
 } MQTTClient_connectOptions;
 
-#define MQTTClient_connectOptions_initializer { {'M', 'Q', 'T', 'C'}, 8, 60, 1, NULL,  NULL, 30, 0, NULL,\
-0, NULL, MQTTVERSION_3_1_1, {NULL, 0, 0}, {0, NULL}, -1, 0, NULL}
+#define MQTTClient_connectOptions_initializer { {'M', 'Q', 'T', 'C'}, 11, 60, 1, NULL, NULL, 30, 0, 0, NULL,\
+MQTTVERSION_3_1_1, {NULL, 0, 0, 0}, {0, NULL}, -1, NULL, 0, 100, 60000, 250, 0, 0}
 
 /** MQTT version 5.0 response information */
 typedef struct MQTTResponse
@@ -335,8 +471,28 @@ typedef int MQTTClient_messageArrived(void* context, char* topicName, int topicL
 typedef void MQTTClient_deliveryComplete(void* context, MQTTClient_deliveryToken dt);
 
 
+/** a piece of a message delivered as it is read from the socket, see MQTTClient_setStreamCallback */
+typedef struct
+{
+    int msgid;
+    int qos;
+    int retained;
+    int dup;
+    size_t total;       /**< the length of the whole payload */
+    size_t offset;      /**< where this piece starts in the payload */
+    const void *data;   /**< valid only until the callback returns */
+    size_t len;
+} MQTTClient_messagePart;
+
+
+typedef void MQTTClient_partArrived(void* context, char* topicName, int topicLen, MQTTClient_messagePart* part);
+
+
 typedef void MQTTClient_connectionLost(void* context, char* cause);
 
+/** called by MQTTClient_connectMany as each client's connect finishes, with the connect return code */
+typedef void MQTTClient_connectComplete(void* context, MQTTClient handle, int rc);
+
 /**
  * Client publication message data
  */
@@ -351,6 +507,7 @@ typedef struct
     struct timeval lastTouch;		    /**> used for retry and expiry */
     char nextMessageType;	/**> PUBREC, PUBREL, PUBCOMP */
     int len;				/**> length of the whole structure+data */
+    ListElement link;       /**> its place in outboundMsgs, inboundMsgs or bufferedMsgs */
 } Messages;
 
 
@@ -362,7 +519,13 @@ typedef struct
     struct timeval lastPing;
     int websocket; /**< socket has been upgraded to use web sockets */
     char *websocket_key;
+    struct ws_buffer *websocket_in; /**< what a WebSocket connection has received, NULL until it receives */
+    const MQTTClient_deflateOptions *deflateOptions; /**< permessage-deflate to offer, NULL for none */
+    struct WebSocket_deflate *websocket_deflate; /**< the compression contexts, if the server agreed to it */
     const MQTTClient_nameValue* httpHeaders;
+    size_t maxPacketSize;   /**< larger packets are refused before anything is allocated for them, 0 for no limit */
+    size_t streamThreshold; /**< PUBLISH packets larger than this are read in parts, 0 to read every packet whole */
+    struct Publish *stream; /**< the streamed PUBLISH whose parts are being read, if any */
 } networkHandles;
 
 
@@ -428,6 +591,9 @@ typedef struct
     unsigned char rc; /**< connack reason code */
     unsigned int MQTTVersion;  /**< the version of MQTT */
     MQTTProperties properties; /**< MQTT 5.0 properties.  Not used for MQTT < 5.0 */
+    MQTTPropertyIndex propIndex; /**< MQTT 5.0 properties as received */
+    int topicAliasMaximum; /**< MQTT 5.0 Topic Alias Maximum, 0 if the server takes no aliases */
+    int receiveMaximum; /**< MQTT 5.0 Receive Maximum, the QoS 1 and 2 messages the server takes at once */
 } Connack;
 
 
@@ -443,7 +609,7 @@ typedef struct
 /**
  * Data for a publish packet.
  */
-typedef struct
+typedef struct Publish
 {
     Header header;	/**< MQTT header byte */
     char* topic;	/**< topic string */
@@ -453,7 +619,12 @@ typedef struct
     int payloadlen;	/**< payload length */
     int MQTTVersion;  /**< the version of MQTT */
     MQTTProperties properties; /**< MQTT 5.0 properties.  Not used for MQTT < 5.0 */
-    u_int8_t mask[4]; /**< the websockets mask the payload is masked with, if any */
+    size_t total;   /**< for a part of a streamed message, the length of the whole payload, otherwise 0 */
+    size_t offset;  /**< for a part of a streamed message, where its payload starts in the whole */
+    int topicAlias; /**< the MQTT 5.0 topic alias the message is sent or was received with, or 0 */
+    int aliasOnly;  /**< the topic is bound to the alias already, so is left out */
+    MQTTPropertyIndex propIndex; /**< MQTT 5.0 properties of an inbound message, as received */
+    const MQTTPropertyBlock* propBlock; /**< MQTT 5.0 properties encoded ahead, sent instead of properties */
 } Publish;
 
 
@@ -467,10 +638,13 @@ typedef struct
     unsigned char rc; /**< MQTT 5 reason code */
     int MQTTVersion;  /**< the version of MQTT */
     MQTTProperties properties; /**< MQTT 5.0 properties.  Not used for MQTT < 5.0 */
+    MQTTPropertyIndex propIndex; /**< MQTT 5.0 properties as received */
 } Ack;
 
 typedef Ack Puback;
 
+typedef Ack Pubrel;
+
 
 /**
  * Data for a suback packet.
@@ -481,6 +655,7 @@ typedef struct
     int msgId;		/**< MQTT message id */
     int MQTTVersion;  /**< the version of MQTT */
     MQTTProperties properties; /**< MQTT 5.0 properties.  Not used for MQTT < 5.0 */
+    MQTTPropertyIndex propIndex; /**< MQTT 5.0 properties as received */
     List* qoss;		/**< list of granted QoSs (MQTT 3/4) / reason codes (MQTT 5) */
 } Suback;
 
@@ -488,12 +663,22 @@ typedef struct
 {
     SOCKET socket;
     Publications* p;
+    ListElement link;
 } pending_write;
 
+/** an acknowledgement queued until the socket can take it */
+typedef struct
+{
+    int messageId;
+    int ackType;
+    ListElement link;
+} AckRequest;
+
 
 typedef struct
 {
-    List publications;
+    int publications;           /**< stored publications, across all clients */
+    size_t publications_size;   /**< heap storage used by them */
     unsigned int msgs_received;
     unsigned int msgs_sent;
     List pending_writes; /* for qos 0 writes not complete */
@@ -519,6 +704,7 @@ typedef struct
     const void* password;					/**< MQTT v3.1 binary password */
     unsigned int connected : 1;		/**< whether it is currently connected */
     unsigned int good : 1; 			  /**< if we have an error on the socket we turn this off */
+    unsigned int fastOpen : 1;      /**< connect with TCP Fast Open */
     signed int connect_state : 4;
     networkHandles net;             /**< network info for this client */
     int msgID;                      /**< the MQTT message id */
@@ -531,9 +717,16 @@ typedef struct
     int connect_sent;               /**< the current number of outbound messages on reconnect that we've sent */
     List* messageQueue;             /**< inbound complete but undelivered messages */
     List* outboundQueue;            /**< outbound queued messages */
+    List* bufferedMsgs;             /**< publishes made while not connected, sent on the next connect */
+    size_t bufferedBytes;           /**< topic and payload bytes in bufferedMsgs */
     unsigned int qentry_seqno;
+    struct MQTTPersistence_store* persistence; /**< append-only store for the lists above, if any */
     void* context;                  /**< calling context - used when calling disconnect_internal */
     int MQTTVersion;                /**< the version of MQTT being used, 3, 4 or 5 */
+    int topicAliasMaximum;          /**< the most topic aliases the server takes on this connection */
+    struct MQTTTopicAlias_table* topicAliases; /**< the outbound topic aliases of this connection, if any */
+    struct MQTTTopicAlias_inbound* inboundAliases; /**< the topic aliases the server has bound, if any */
+    int receiveMaximum;             /**< the server's Receive Maximum on this connection */
 } Clients;
 
 
@@ -546,22 +739,46 @@ typedef struct {
     char *topicName;
     int topicLen;
     unsigned int seqno; /* only used on restore */
+    ListElement link; /* its place in messageQueue */
 } qEntry;
 
 
+/** a topic validated once by MQTTClient_prepareTopic, for publishing to repeatedly */
+typedef struct {
+    void *client;                   /**< the client it was prepared for */
+    char *topic;                    /**< allocated with the structure */
+    int topiclen;
+    unsigned int hash;              /**< for looking up its topic alias */
+    MQTTProperties properties;      /**< MQTT 5 properties sent with every message, kept for resends */
+    MQTTPropertyBlock block;        /**< the same properties, encoded */
+} MQTTClient_preparedTopic;
+
+typedef MQTTClient_preparedTopic *MQTTClient_topic;
+
+
+/** a topic subscribed to, kept so it can be renewed after a reconnect */
+typedef struct {
+    char *topic;    /**< allocated with the structure */
+    int qos;
+} MQTTClient_subscription;
+
+
 /** @brief raw uuid type */
 typedef unsigned char uuid_t[16];
 
 typedef struct {
     char *serverURI;
     const char *currentServerURI; /* when using HA options, set the currently used serverURI */
+    char *connectedURI;           /* copy of the HA serverURI that won the last connect */
     int websocket;
     Clients *c;
     MQTTClient_messageArrived *ma;
     MQTTClient_deliveryComplete *dc;
+    MQTTClient_partArrived *pa;
     void *context;
     MQTTClient_published *published;
     void *published_context; /* the context to be associated with the disconnected callback*/
+    pthread_mutex_t *connect_mutex; /* held for the whole of a connect of this client */
     sem_t *connect_sem;
     int rc; /* getsockopt return code in connect */
     sem_t *connack_sem;
@@ -569,6 +786,30 @@ typedef struct {
     MQTTPacket *pack;
 
     unsigned long commandTimeout;
+    int sendWhileDisconnected;  /**< buffer publishes made while not connected */
+    int maxBufferedMessages;
+    size_t maxBufferedBytes;    /**< 0 for no limit */
+    int bufferDropPolicy;       /**< one of the MQTTCLIENT_BUFFER_DROP_ values */
+    MQTTClient_connectionLost *cl;
+    List *subscriptions;        /**< topics subscribed to, for resubscribing after a reconnect */
+    struct timeval connectTime; /**< when the current connection was started */
+    int automaticReconnect;
+    int reconnecting;           /**< waiting for, or making, a reconnect attempt */
+    int reconnectAttempts;      /**< failed attempts since the connection was lost */
+    int minReconnectDelay;      /**< milliseconds */
+    int maxReconnectDelay;      /**< milliseconds */
+    int reconnectDelay;         /**< milliseconds from reconnectTime to the next attempt */
+    struct timeval reconnectTime; /**< when the current delay, or attempt, started */
+    unsigned int reconnectSeed; /**< for the jitter */
+    int connectTimeout;         /**< milliseconds */
+    int pipelineConnect;        /**< send subscriptions and buffered messages behind the CONNECT */
+    int pipelined;              /**< the subscriptions have been sent behind the current CONNECT */
+    int resubscribeId;          /**< message id of the resubscribe whose SUBACK is outstanding */
+    int connectPending;         /**< being connected by MQTTClient_connectMany, driven by the run thread */
+    int connectRc;              /**< the result, once connectPending is cleared */
+    sem_t *connectDone_sem;     /**< posted when connectPending is cleared */
+    int topicAliases;           /**< the most MQTT 5 topic aliases to send on a connection, 0 for none */
+    MQTTClient_deflateOptions deflate; /**< the permessage-deflate offer of ws:// connections, if net.deflateOptions is set */
 } MQTTClients;
 
 #endif /* _MUTEX_TYPE_H_ */
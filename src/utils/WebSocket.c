@@ -6,8 +6,9 @@
 #include "Base64.h"
 #include "Log.h"
 #include "SHA1.h"
-#include "LinkedList.h"
 #include "SocketBuffer.h"
+#include "WebSocketMask.h"
+#include "WebSocketDeflate.h"
 #include <endian.h>
 #include "Socket.h"
 #include <limits.h>
@@ -26,36 +27,47 @@ void uuid_generate(uuid_t out) {
     }
 }
 
-/** raw websocket frame data */
-struct ws_frame {
-    size_t len; /**< length of frame */
-    size_t pos; /**< current position within the buffer */
-};
+/** the smallest receive buffer */
+#define WS_BUFFER_MIN 1024
 
-/** Current frame being processed */
-struct ws_frame *last_frame = NULL;
+/** the longest upgrade response read */
+#define WS_RESPONSE_MAX (8 * 1024)
 
-/** Holds any received websocket frames, to be process */
-static List *in_frames = NULL;
+/** the first header bit reserved for extensions, which permessage-deflate sets on compressed messages */
+#define WS_RSV1 0x40
 
-static char *frame_buffer = NULL;
-static size_t frame_buffer_len = 0;
-static size_t frame_buffer_index = 0;
-static size_t frame_buffer_data_len = 0;
+/**
+ * The receive buffer of a connection, made when it first receives.  Frames are read into it
+ * straight from the socket and their payloads are unmasked where they lie, so that the MQTT
+ * decoder reads packets out of it with no more copies.  The payload of the data frames read so
+ * far runs from start to end, with the packet being decoded starting at start and read up to
+ * pos.  A frame not all read yet runs from end to len.  The frames of a compressed message are
+ * inflated into the payload as each comes in.
+ */
+typedef struct ws_buffer {
+    char *buf;
+    size_t size;    /**< the size of buf */
+    size_t start;   /**< the start of the packet being decoded */
+    size_t pos;     /**< how far the packet being decoded has been read */
+    size_t end;     /**< the end of the payload received */
+    size_t len;     /**< the end of the data received */
+    int compressed; /**< the message being received is compressed */
+    size_t inflated; /**< what the compressed message being received has inflated to so far */
+} ws_buffer;
 
 /* static function declarations */
 static const char *WebSocket_strcasefind(
         const char *buf, const char *str, size_t len);
 
-static char *WebSocket_getRawSocketData(
-        networkHandles *net, size_t bytes, size_t *actual_len, int *rc);
-
-static void WebSocket_rewindData(void);
-
 static void WebSocket_pong(
         networkHandles *net, char *app_data, size_t app_data_len);
 
-static int WebSocket_receiveFrame(networkHandles *net, size_t *actual_len);
+static ws_buffer *WebSocket_buffer(networkHandles *net);
+
+static int WebSocket_receiveFrame(networkHandles *net, ws_buffer *in);
+
+static int WebSocket_inflateFrame(networkHandles *net, ws_buffer *in, const char *payload, size_t payload_len,
+                                  int fin);
 
 
 size_t WebSocket_calculateFrameHeaderSize(networkHandles *net, int mask_data, size_t data_len) {
@@ -65,7 +77,7 @@ size_t WebSocket_calculateFrameHeaderSize(networkHandles *net, int mask_data, si
             ret = 2; /* header 2 bytes */
         else if (data_len < 65536u)
             ret = 4; /* for extra 2-bytes for payload length */
-        else if (data_len < 0xFFFFFFFFFFFFFFFF)
+        else
             ret = 10; /* for extra 8-bytes for payload length */
         if (mask_data & 0x1)
             ret += sizeof(uint32_t); /* for mask */
@@ -78,127 +90,130 @@ struct frameData {
     size_t wsbuf0len;
 };
 
+/* Make the masking key of a frame, since we are a client */
+static void WebSocket_newMask(uint8_t mask[4]) {
+    mask[0] = (rand() % UINT8_MAX);
+    mask[1] = (rand() % UINT8_MAX);
+    mask[2] = (rand() % UINT8_MAX);
+    mask[3] = (rand() % UINT8_MAX);
+}
+
+/* Write the header of a final frame, returning its length.  opcode may have WS_RSV1 set. */
+static size_t WebSocket_writeHeader(char *buf, int opcode, int mask_data, size_t data_len, const uint8_t mask[4]) {
+    size_t buf_len = 0u;
+
+    /* 1st byte */
+    buf[buf_len] = (char) (1 << 7); /* final flag */
+    /* 3 bits reserved for negotiation of protocol */
+    buf[buf_len] |= (char) (opcode & (WS_RSV1 | 0x0F)); /* op code */
+    ++buf_len;
+
+    /* 2nd byte */
+    buf[buf_len] = (char) ((mask_data & 0x1) << 7); /* masking bit */
+
+    /* payload length */
+    if (data_len < 126u)
+        buf[buf_len++] |= data_len & 0x7F;
+
+        /* 3rd byte & 4th bytes - extended payload length */
+    else if (data_len < 65536u) {
+        uint16_t len = htobe16((uint16_t) data_len);
+        buf[buf_len++] |= (126u & 0x7F);
+        memcpy(&buf[buf_len], &len, 2u);
+        buf_len += 2;
+    } else {
+        uint64_t len = htobe64((uint64_t) data_len);
+        buf[buf_len++] |= (127u & 0x7F);
+        memcpy(&buf[buf_len], &len, 8);
+        buf_len += 8;
+    }
+
+    if (mask_data) {
+        /* copy masking key into ws header */
+        memcpy(&buf[buf_len], mask, sizeof(uint32_t));
+        buf_len += sizeof(uint32_t);
+    }
+    return buf_len;
+}
+
+/*
+ * Build a frame of buf0 and the buffers after it.  The data is masked as it is copied into the
+ * frame, so the caller's buffers are left as they are, and the frame can be written, or left
+ * as a pending write, by itself.
+ */
 static struct frameData WebSocket_buildFrame(networkHandles *net, int opcode, int mask_data,
-                                             char **pbuf0, size_t *pbuf0len, PacketBuffers *bufs) {
-    int buf_len = 0u;
+                                             const char *buf0, size_t buf0len, PacketBuffers *bufs) {
     struct frameData rc;
-    int new_mask = 0;
+    uint8_t mask[4] = {0u, 0u, 0u, 0u};
     memset(&rc, '\0', sizeof(rc));
     if (net->websocket) {
         size_t ws_header_size = 0u;
         size_t data_len = 0L;
+        size_t pos;
         int i;
 
         /* Calculate total length of MQTT buffers */
-        data_len = *pbuf0len;
+        data_len = buf0len;
         for (i = 0; i < bufs->count; ++i)
             data_len += bufs->buflens[i];
 
         /* add space for websocket frame header */
         ws_header_size = WebSocket_calculateFrameHeaderSize(net, mask_data, data_len);
-        if (*pbuf0) {
-            rc.wsbuf0len = *pbuf0len + ws_header_size;
-            rc.wsbuf0 = malloc(rc.wsbuf0len);
-            if (rc.wsbuf0 == NULL)
-                goto exit;
-            memcpy(&rc.wsbuf0[ws_header_size], *pbuf0, *pbuf0len);
-        } else {
-            rc.wsbuf0 = malloc(ws_header_size);
-            if (rc.wsbuf0 == NULL)
-                goto exit;
-            rc.wsbuf0len = ws_header_size;
-        }
-
-        if (mask_data && (bufs->mask[0] == 0)) {
-            /* generate mask, since we are a client */
-
-            bufs->mask[0] = (rand() % UINT8_MAX);
-            bufs->mask[1] = (rand() % UINT8_MAX);
-            bufs->mask[2] = (rand() % UINT8_MAX);
-            bufs->mask[3] = (rand() % UINT8_MAX);
-            new_mask = 1;
-        }
-
-        /* 1st byte */
-        rc.wsbuf0[buf_len] = (char) (1 << 7); /* final flag */
-        /* 3 bits reserved for negotiation of protocol */
-        rc.wsbuf0[buf_len] |= (char) (opcode & 0x0F); /* op code */
-        ++buf_len;
-
-        /* 2nd byte */
-        rc.wsbuf0[buf_len] = (char) ((mask_data & 0x1) << 7); /* masking bit */
-
-        /* payload length */
-        if (data_len < 126u)
-            rc.wsbuf0[buf_len++] |= data_len & 0x7F;
-
-            /* 3rd byte & 4th bytes - extended payload length */
-        else if (data_len < 65536u) {
-            uint16_t len = htobe16((uint16_t) data_len);
-            rc.wsbuf0[buf_len++] |= (126u & 0x7F);
-            memcpy(&rc.wsbuf0[buf_len], &len, 2u);
-            buf_len += 2;
-        } else if (data_len < 0xFFFFFFFFFFFFFFFF) {
-            uint64_t len = htobe64((uint64_t) data_len);
-            rc.wsbuf0[buf_len++] |= (127u & 0x7F);
-            memcpy(&rc.wsbuf0[buf_len], &len, 8);
-            buf_len += 8;
-        } else {
-            Log(TRACE_PROTOCOL, 1, "Data too large for websocket frame");
-            buf_len = -1;
-        }
-
-        if (mask_data) {
-            size_t idx = 0u;
-
-            /* copy masking key into ws header */
-            memcpy(&rc.wsbuf0[buf_len], &bufs->mask, sizeof(uint32_t));
-            buf_len += sizeof(uint32_t);
-
-            /* mask packet fixed header */
-            for (i = (int) ws_header_size; i < (int) rc.wsbuf0len; ++i, ++idx)
-                rc.wsbuf0[i] ^= bufs->mask[idx % 4];
+        rc.wsbuf0len = ws_header_size + data_len;
+        if ((rc.wsbuf0 = malloc(rc.wsbuf0len)) == NULL)
+            goto exit;
 
-            /* variable data buffers */
-            for (i = 0; i < bufs->count; ++i) {
-                size_t j;
+        if (mask_data)
+            WebSocket_newMask(mask);
+        WebSocket_writeHeader(rc.wsbuf0, opcode, mask_data, data_len, mask);
 
-                if (new_mask == 0 && (i == 2 || i == bufs->count - 1))
-                    /* topic (2) and payload (last) buffers are already masked */
-                    break;
-                for (j = 0u; j < bufs->buflens[i]; ++j, ++idx) {
-                    bufs->buffers[i][j] ^= bufs->mask[idx % 4];
-                }
-            }
+        /* an all zero mask copies the data as it is */
+        WebSocket_mask(&rc.wsbuf0[ws_header_size], buf0, buf0len, mask, 0);
+        pos = buf0len;
+        for (i = 0; i < bufs->count; ++i) {
+            WebSocket_mask(&rc.wsbuf0[ws_header_size + pos], bufs->buffers[i], bufs->buflens[i], mask, pos);
+            pos += bufs->buflens[i];
         }
     }
     exit:
     return rc;
 }
 
-
-static void WebSocket_unmaskData(size_t idx, PacketBuffers *bufs) {
-    int i;
-    for (i = 0; i < bufs->count; ++i) {
-        size_t j;
-        for (j = 0u; j < bufs->buflens[i]; ++j, ++idx)
-            bufs->buffers[i][j] ^= bufs->mask[idx % 4];
-    }
-    /* show that the mask has been removed */
-    bufs->mask[0] = bufs->mask[1] = bufs->mask[2] = bufs->mask[3] = 0;
-}
-
-int WebSocket_connect(networkHandles *net, int ssl, const char *uri) {
+/**
+ * Send the request to upgrade a connection to a WebSocket.
+ * @param net the network handle of the connection
+ * @param ssl whether the connection uses TLS, for the Origin header
+ * @param uri the serverURI, which starts with the host name
+ * @param hostname_len the length of the host name
+ * @param port the port
+ * @param topic the path of the request, or NULL for "/mqtt"
+ * @return 1 when the request has been sent, otherwise SOCKET_ERROR or PAHO_MEMORY_ERROR
+ */
+int WebSocket_connect(networkHandles *net, int ssl, const char *uri, size_t hostname_len, int port,
+                      const char *topic) {
     int rc;
     char *buf = NULL;
     char *headers_buf = NULL;
     const MQTTClient_nameValue *headers = net->httpHeaders;
+    char extensions[160];
     int i, buf_len = 0;
     int headers_buf_len = 0;
-    size_t hostname_len;
-    int port = 80;
-    const char *topic = NULL;
     uuid_t uuid;
+
+    if (net->websocket_in) {
+        /* a new connection: nothing received on the one before is wanted */
+        ws_buffer *in = net->websocket_in;
+
+        in->start = in->pos = in->end = in->len = 0u;
+        in->compressed = 0;
+        in->inflated = 0u;
+    }
+    /* nor what was compressed on it: the new one starts afresh, if it compresses at all */
+    WebSocket_deflateFree(net->websocket_deflate);
+    net->websocket_deflate = NULL;
+    if (WebSocket_deflateOffer(net->deflateOptions, extensions, sizeof(extensions)) == 0u)
+        extensions[0] = '\0';
+
     /* Generate UUID */
     if (net->websocket_key == NULL)
         net->websocket_key = malloc(25u);
@@ -211,8 +226,6 @@ int WebSocket_connect(networkHandles *net, int ssl, const char *uri) {
 
     uuid_generate(uuid);
     Base64_encode(net->websocket_key, 25u, uuid, sizeof(uuid_t));
-    //todo 确认
-//    hostname_len = MQTTProtocol_addressPort(uri, &port, &topic, ssl ? WSS_DEFAULT_PORT : WS_DEFAULT_PORT);
 
     /* if no topic, use default */
     if (!topic)
@@ -252,11 +265,13 @@ int WebSocket_connect(networkHandles *net, int ssl, const char *uri) {
                            "Sec-WebSocket-Version: 13\r\n"
                            "Sec-WebSocket-Protocol: mqtt\r\n"
                            "%s"
+                           "%s"
                            "\r\n", topic,
                            (int) hostname_len, uri, port,
-                           HTTP_PROTOCOL(0),
+                           HTTP_PROTOCOL(ssl),
                            (int) hostname_len, uri, port,
                            net->websocket_key,
+                           extensions,
                            headers_buf ? headers_buf : "");
 
         if (i == 0 && buf_len > 0) {
@@ -272,10 +287,11 @@ int WebSocket_connect(networkHandles *net, int ssl, const char *uri) {
         free(headers_buf);
 
     if (buf) {
-        PacketBuffers nulbufs = {0, NULL, NULL, NULL, {0, 0, 0, 0}};
-        Socket_putdatas(net->socket, buf, buf_len, nulbufs);
-        free(buf);
-        rc = 1;
+        PacketBuffers nulbufs = {0, NULL, NULL, NULL};
+        rc = Socket_putdatas(net->socket, buf, buf_len, nulbufs);
+        if (rc != TCPSOCKET_INTERRUPTED)
+            free(buf); /* otherwise the socket keeps it until it is written */
+        rc = (rc == SOCKET_ERROR) ? SOCKET_ERROR : 1;
     } else {
         free(net->websocket_key);
         net->websocket_key = NULL;
@@ -287,7 +303,7 @@ int WebSocket_connect(networkHandles *net, int ssl, const char *uri) {
 
 void WebSocket_close(networkHandles *net, int status_code, const char *reason) {
     struct frameData fd;
-    PacketBuffers nulbufs = {0, NULL, NULL, NULL, {0, 0, 0, 0}};
+    PacketBuffers nulbufs = {0, NULL, NULL, NULL};
 
     if (net->websocket) {
         char *buf0;
@@ -314,10 +330,9 @@ void WebSocket_close(networkHandles *net, int status_code, const char *reason) {
         if (reason)
             strcpy(&buf0[sizeof(uint16_t)], reason);
 
-        fd = WebSocket_buildFrame(net, WebSocket_OP_CLOSE, mask_data, &buf0, &buf0len, &nulbufs);
-        Socket_putdatas(net->socket, fd.wsbuf0, fd.wsbuf0len, nulbufs);
-
-        free(fd.wsbuf0); /* free temporary ws header */
+        fd = WebSocket_buildFrame(net, WebSocket_OP_CLOSE, mask_data, buf0, buf0len, &nulbufs);
+        if (fd.wsbuf0 && Socket_putdatas(net->socket, fd.wsbuf0, fd.wsbuf0len, nulbufs) != TCPSOCKET_INTERRUPTED)
+            free(fd.wsbuf0); /* otherwise the socket keeps the frame until it is written */
 
         /* websocket connection is now closed */
         net->websocket = 0;
@@ -334,29 +349,16 @@ void WebSocket_close(networkHandles *net, int status_code, const char *reason) {
 int WebSocket_getch(networkHandles *net, char *c) {
     int rc = SOCKET_ERROR;
     if (net->websocket) {
-        struct ws_frame *frame = NULL;
-
-        if (in_frames && in_frames->first)
-            frame = in_frames->first->content;
+        ws_buffer *in = WebSocket_buffer(net);
 
-        if (!frame || frame->len == frame->pos) {
-            size_t actual_len = 0u;
-            rc = WebSocket_receiveFrame(net, &actual_len);
-            if (rc != TCPSOCKET_COMPLETE)
+        if (in == NULL)
+            goto exit;
+        while (in->pos == in->end) {
+            if ((rc = WebSocket_receiveFrame(net, in)) != TCPSOCKET_COMPLETE)
                 goto exit;
-
-            /* we got a frame, let take off the top of queue */
-            if (in_frames->first)
-                frame = in_frames->first->content;
-        }
-
-        /* set current working frame */
-        if (frame && frame->len > frame->pos) {
-            unsigned char *buf =
-                    (unsigned char *) frame + sizeof(struct ws_frame);
-            *c = buf[frame->pos++];
-            rc = TCPSOCKET_COMPLETE;
         }
+        *c = in->buf[in->pos++];
+        rc = TCPSOCKET_COMPLETE;
     } else
         rc = Socket_getch(net->socket, c);
 
@@ -364,85 +366,53 @@ int WebSocket_getch(networkHandles *net, char *c) {
     return rc;
 }
 
-size_t WebSocket_framePos() {
-    if (in_frames && in_frames->first) {
-        struct ws_frame *frame = in_frames->first->content;
-        return frame->pos;
-    } else {
-        return 0;
-    }
+/**
+ * Start reading the next packet, which releases the data of the packet before it.
+ * @param net the network handle of the connection
+ */
+void WebSocket_packetStart(networkHandles *net) {
+    if (net->websocket && net->websocket_in)
+        net->websocket_in->start = net->websocket_in->pos;
 }
 
-void WebSocket_framePosSeekTo(size_t pos) {
-    if (in_frames && in_frames->first) {
-        struct ws_frame *frame = in_frames->first->content;
-        frame->pos = pos;
-    }
+/**
+ * Go back to the start of a packet which has not all been received, to read it again from
+ * there once the rest is in.
+ * @param net the network handle of the connection
+ */
+void WebSocket_packetRewind(networkHandles *net) {
+    if (net->websocket && net->websocket_in)
+        net->websocket_in->pos = net->websocket_in->start;
 }
 
+/**
+ * Read data from a connection.  Over WebSockets, the data is not copied: what is returned points
+ * into the receive buffer, and stays valid until the next packet is started.
+ * @param net the network handle of the connection
+ * @param bytes the number of bytes wanted
+ * @param actual_len the number of bytes there, returned, which is less than bytes if the rest
+ * has not been received yet
+ * @return the data, or NULL on error
+ */
 char *WebSocket_getdata(networkHandles *net, size_t bytes, size_t *actual_len) {
     char *rv = NULL;
     int rc;
     if (net->websocket) {
-        struct ws_frame *frame = NULL;
-
-        if (bytes == 0u) {
-            /* done with current frame, move it to last frame */
-            if (in_frames && in_frames->first)
-                frame = in_frames->first->content;
-
-            /* return the data from the next frame, if we have one */
-            if (frame && frame->pos == frame->len) {
-                rv = (char *) frame +
-                     sizeof(struct ws_frame) + frame->pos;
-                *actual_len = frame->len - frame->pos;
-
-                if (last_frame)
-                    free(last_frame);
-                last_frame = ListDetachHead(in_frames);
-            }
-            goto exit;
-        }
-
-        /* look at the first websocket frame */
-        if (in_frames && in_frames->first)
-            frame = in_frames->first->content;
-
-        /* no current frame, so let's go receive one for the network */
-        if (!frame) {
-            const int rc =
-                    WebSocket_receiveFrame(net, actual_len);
-
-            if (rc == TCPSOCKET_COMPLETE && in_frames && in_frames->first)
-                frame = in_frames->first->content;
-        }
+        ws_buffer *in = WebSocket_buffer(net);
 
-        if (frame) {
-            rv = (char *) frame + sizeof(struct ws_frame) + frame->pos;
-            *actual_len = frame->len - frame->pos; /* use the rest of the frame */
-
-
-            while (*actual_len < bytes) {
-                const int rc = WebSocket_receiveFrame(net, actual_len);
-
-                if (rc != TCPSOCKET_COMPLETE) {
-                    goto exit;
-                }
-
-                /* refresh pointers */
-                frame = in_frames->first->content;
-                rv = (char *) frame + sizeof(struct ws_frame) + frame->pos;
-                *actual_len = frame->len - frame->pos; /* use the rest of the frame */
-
-            } /* end while */
-
-            if (*actual_len > bytes) {
-                frame->pos += bytes;
-            } else if (*actual_len == bytes && in_frames) {
-                if (last_frame)
-                    free(last_frame);
-                last_frame = ListDetachHead(in_frames);
-            }
+        if (in == NULL)
+            goto exit;
+        rc = TCPSOCKET_COMPLETE;
+        while (in->end - in->pos < bytes && rc == TCPSOCKET_COMPLETE)
+            rc = WebSocket_receiveFrame(net, in);
+        if (rc == SOCKET_ERROR || in->buf == NULL)
+            goto exit;
+        rv = &in->buf[in->pos];
+        if (in->end - in->pos < bytes)
+            *actual_len = in->end - in->pos;
+        else {
+            *actual_len = bytes;
+            in->pos += bytes;
         }
     } else
         rv = Socket_getdata(net->socket, bytes, actual_len, &rc);
@@ -451,115 +421,92 @@ char *WebSocket_getdata(networkHandles *net, size_t bytes, size_t *actual_len) {
     return rv;
 }
 
-void WebSocket_rewindData(void) {
-    frame_buffer_index = 0;
+/* The receive buffer of a connection, made if it has none yet, or NULL if there is no memory */
+static ws_buffer *WebSocket_buffer(networkHandles *net) {
+    if (net->websocket_in == NULL && (net->websocket_in = calloc(1, sizeof(ws_buffer))) != NULL)
+        SocketBuffer_account((long) sizeof(ws_buffer));
+    return net->websocket_in;
 }
 
-char *WebSocket_getRawSocketData(networkHandles *net, size_t bytes, size_t *actual_len, int *rc) {
-    char *rv = NULL;
-
-    size_t bytes_requested = bytes;
-
-    if (bytes > 0) {
-        if (frame_buffer_data_len - frame_buffer_index >= bytes) {
-            *actual_len = bytes;
-            rv = frame_buffer + frame_buffer_index;
-            frame_buffer_index += bytes;
-            *rc = (int) bytes;
-            goto exit;
-        } else {
-            bytes = bytes - (frame_buffer_data_len - frame_buffer_index);
-        }
+/* Make room in the buffer for bytes more data, within the receive buffer budget, returning 0 or PAHO_MEMORY_ERROR */
+static int WebSocket_reserve(ws_buffer *in, size_t bytes) {
+    int rc = 0;
+
+    if (in->start == in->len)
+        in->start = in->pos = in->end = in->len = 0u; /* nothing left to keep */
+    else if (in->start > 0u && in->len + bytes > in->size) {
+        /* drop the packets already read, rather than grow the buffer to keep them */
+        memmove(in->buf, &in->buf[in->start], in->len - in->start);
+        in->pos -= in->start;
+        in->end -= in->start;
+        in->len -= in->start;
+        in->start = 0u;
     }
+    if (in->len + bytes > in->size) {
+        size_t size = (in->size > 0u) ? in->size : WS_BUFFER_MIN;
+        char *buf;
 
-    *actual_len = 0;
-
-    // not enough data in the buffer, get data from socket
-    rv = Socket_getdata(net->socket, bytes, actual_len, rc);
-
-    if (*rc == 0) {
-        *rc = SOCKET_ERROR;
-        goto exit;
-    }
-
-    // clear buffer
-    if (bytes == 0) {
-        frame_buffer_index = 0;
-        frame_buffer_data_len = 0;
-        frame_buffer_len = 0;
-
-        if (frame_buffer) {
-            free(frame_buffer);
-            frame_buffer = NULL;
-        }
-    }
-        // append data to the buffer
-    else if (rv != NULL && *actual_len != 0U) {
-        // no buffer allocated
-        if (!frame_buffer) {
-            if ((frame_buffer = (char *) malloc(*actual_len)) == NULL) {
-                rv = NULL;
-                goto exit;
-            }
-            memcpy(frame_buffer, rv, *actual_len);
-
-            frame_buffer_index = 0;
-            frame_buffer_data_len = *actual_len;
-            frame_buffer_len = *actual_len;
+        if (bytes > SIZE_MAX / 2u - in->len) {
+            rc = PAHO_MEMORY_ERROR; /* no buffer could hold it */
+            goto exit;
         }
-            // buffer size is big enough
-        else if (frame_buffer_data_len + *actual_len < frame_buffer_len) {
-            memcpy(frame_buffer + frame_buffer_data_len, rv, *actual_len);
-            frame_buffer_data_len += *actual_len;
+        while (size < in->len + bytes)
+            size *= 2;
+        if (!SocketBuffer_withinBudget(size - in->size)) {
+            Log(LOG_ERROR, -1, "A %lu byte WebSocket buffer would exceed the receive buffer budget",
+                (unsigned long) size);
+            rc = PAHO_MEMORY_ERROR;
+            goto exit;
         }
-            // resize buffer
-        else {
-            frame_buffer = realloc(frame_buffer, frame_buffer_data_len + *actual_len);
-            frame_buffer_len = frame_buffer_data_len + *actual_len;
-
-            memcpy(frame_buffer + frame_buffer_data_len, rv, *actual_len);
-            frame_buffer_data_len += *actual_len;
+        if ((buf = realloc(in->buf, size)) == NULL) {
+            rc = PAHO_MEMORY_ERROR;
+            goto exit;
         }
+        SocketBuffer_account((long) size - (long) in->size);
+        in->buf = buf;
+        in->size = size;
+    }
+    exit:
+    return rc;
+}
 
-        SocketBuffer_complete(net->socket);
-    } else
-        goto exit;
+/*
+ * Read from the socket until there are bytes of the frame being read.  No more than that is
+ * read, so that nothing is left waiting in the buffer that select would not report.
+ */
+static int WebSocket_fill(networkHandles *net, ws_buffer *in, size_t bytes) {
+    int rc = TCPSOCKET_COMPLETE;
+    size_t have = in->len - in->end;
 
-    bytes = bytes_requested;
+    if (have < bytes) {
+        size_t actual_len = 0u;
 
-    // if possible, return data from the buffer
-    if (bytes > 0) {
-        if (frame_buffer_data_len - frame_buffer_index >= bytes) {
-            *actual_len = bytes;
-            rv = frame_buffer + frame_buffer_index;
-            frame_buffer_index += bytes;
-        } else {
-            *actual_len = frame_buffer_data_len - frame_buffer_index;
-            rv = frame_buffer + frame_buffer_index;
-            frame_buffer_index += *actual_len;
+        if (WebSocket_reserve(in, bytes - have) != 0) {
+            rc = SOCKET_ERROR;
+            goto exit;
         }
+        rc = Socket_read(net->socket, &in->buf[in->len], bytes - have, &actual_len);
+        in->len += actual_len;
     }
     exit:
-    return rv;
+    return rc;
 }
 
 void WebSocket_pong(networkHandles *net, char *app_data, size_t app_data_len) {
     if (net->websocket) {
-        char *buf0 = NULL;
-        size_t buf0len = 0;
         int freeData = 0;
         struct frameData fd;
         const int mask_data = 1; /* all frames from client must be masked */
-        PacketBuffers appbuf = {1, &app_data, &app_data_len, &freeData, {0, 0, 0, 0}};
+        PacketBuffers appbuf = {1, &app_data, &app_data_len, &freeData};
+        PacketBuffers nulbufs = {0, NULL, NULL, NULL};
 
-        fd = WebSocket_buildFrame(net, WebSocket_OP_PONG, mask_data, &buf0, &buf0len, &appbuf);
+        /* the frame holds a copy of the ping data, which is freed once this returns */
+        fd = WebSocket_buildFrame(net, WebSocket_OP_PONG, mask_data, NULL, 0u, &appbuf);
 
         Log(TRACE_PROTOCOL, 1, "Sending WebSocket PONG");
 
-        Socket_putdatas(net->socket, fd.wsbuf0, fd.wsbuf0len /*header_len + app_data_len*/, appbuf);
-
-        free(fd.wsbuf0);
-        free(buf0);
+        if (fd.wsbuf0 && Socket_putdatas(net->socket, fd.wsbuf0, fd.wsbuf0len, nulbufs) != TCPSOCKET_INTERRUPTED)
+            free(fd.wsbuf0);
     }
 }
 
@@ -568,16 +515,33 @@ int WebSocket_putdatas(networkHandles *net, char **buf0, size_t *buf0len, Packet
     int rc;
 
     if (net->websocket) {
+        PacketBuffers nulbufs = {0, NULL, NULL, NULL};
         struct frameData wsdata;
+        size_t deflated_len = 0u;
+        char *deflated = NULL;
+        int i;
 
-        wsdata = WebSocket_buildFrame(net, WebSocket_OP_BINARY, mask_data, buf0, buf0len, bufs);
+        if (net->websocket_deflate)
+            deflated = WebSocket_deflateMessage(net->websocket_deflate, *buf0, *buf0len, bufs, &deflated_len);
+        if (deflated)
+            wsdata = WebSocket_buildFrame(net, WebSocket_OP_BINARY | WS_RSV1, mask_data, deflated, deflated_len,
+                                          &nulbufs);
+        else
+            wsdata = WebSocket_buildFrame(net, WebSocket_OP_BINARY, mask_data, *buf0, *buf0len, bufs);
+        if (wsdata.wsbuf0 == NULL)
+            return SOCKET_ERROR;
 
-        rc = Socket_putdatas(net->socket, wsdata.wsbuf0, wsdata.wsbuf0len, *bufs);
+        rc = Socket_putdatas(net->socket, wsdata.wsbuf0, wsdata.wsbuf0len, nulbufs);
 
-        if (rc != TCPSOCKET_INTERRUPTED) {
-            if (mask_data)
-                WebSocket_unmaskData(*buf0len, bufs);
-            free(wsdata.wsbuf0); /* free temporary ws header */
+        if (rc != TCPSOCKET_INTERRUPTED)
+            free(wsdata.wsbuf0);
+        else {
+            /* the socket keeps the frame, which holds a copy of everything: free what it would have kept */
+            free(*buf0);
+            for (i = 0; i < bufs->count; ++i) {
+                if (bufs->frees[i])
+                    free(bufs->buffers[i]);
+            }
         }
     } else {
 
@@ -587,199 +551,180 @@ int WebSocket_putdatas(networkHandles *net, char **buf0, size_t *buf0len, Packet
     return rc;
 }
 
-int WebSocket_receiveFrame(networkHandles *net, size_t *actual_len) {
-    struct ws_frame *res = NULL;
-    int rc = TCPSOCKET_COMPLETE;
-    int opcode = 0;
+/**
+ * Write data to a connection completely, waiting whenever the socket is full.  Over WebSockets
+ * the data goes as one binary frame, and is masked in place, but not compressed.  For the pieces
+ * of a packet too large to be held for a pending write.
+ * @param net the network handle of the connection, which must have no pending write
+ * @param buf the data
+ * @param len the length of the data
+ * @param timeout milliseconds to wait for the socket to take more data
+ * @return TCPSOCKET_COMPLETE or SOCKET_ERROR
+ */
+int WebSocket_putdataFully(networkHandles *net, char *buf, size_t len, int timeout) {
+    struct iovec iovecs[2];
+    char header[14];
+    int count = 0;
+
+    if (net->websocket) {
+        uint8_t mask[4];
 
-    if (!in_frames)
-        in_frames = ListInitialize();
+        WebSocket_newMask(mask);
+        iovecs[count].iov_base = header;
+        iovecs[count++].iov_len = WebSocket_writeHeader(header, WebSocket_OP_BINARY, 1, len, mask);
+        WebSocket_mask(buf, buf, len, mask, 0);
+    }
+    iovecs[count].iov_base = buf;
+    iovecs[count++].iov_len = len;
+    return Socket_writeFully(net->socket, iovecs, count, timeout);
+}
 
-    /* see if there is frame currently on queue */
-    if (in_frames->first)
-        res = in_frames->first->content;
+/*
+ * Read frames until a data frame is in, answering pings on the way.  Each frame is read where
+ * it lies in the buffer, and its payload unmasked there, then joined onto the payload before it
+ * by moving whichever of the two is shorter over the frame header, or inflated onto it if it is
+ * compressed.
+ */
+static int WebSocket_receiveFrame(networkHandles *net, ws_buffer *in) {
+    int rc;
+    int opcode;
 
-    //while( !res )
-    //{
-    opcode = WebSocket_OP_BINARY;
     do {
-        /* obtain all frames in the sequence */
-        int is_final = 0;
-        while (is_final == 0) {
-            char *b;
-            size_t len = 0u;
-            int tmp_opcode;
-            int has_mask;
-            size_t cur_len = 0u;
-            uint8_t mask[4] = {0u, 0u, 0u, 0u};
-            size_t payload_len;
-            int rcs; /* socket return code */
-
-            b = WebSocket_getRawSocketData(net, 2u, &len, &rcs);
-            if (rcs == SOCKET_ERROR) {
-                rc = rcs;
-                goto exit;
-            }
-            if (!b) {
-                rc = TCPSOCKET_INTERRUPTED;
-                goto exit;
-            } else if (len < 2u) {
-                rc = TCPSOCKET_INTERRUPTED;
-                goto exit;
-            }
+        unsigned char *b;
+        char *payload;
+        size_t header_len = 2u;
+        size_t payload_len;
+        size_t pending;
+        int has_mask, fin, rsv;
+
+        if ((rc = WebSocket_fill(net, in, 2u)) != TCPSOCKET_COMPLETE)
+            goto exit;
+        b = (unsigned char *) &in->buf[in->end];
+        fin = b[0] >> 7;
+        rsv = b[0] & 0x70;
+        opcode = b[0] & 0x0F;
+        has_mask = b[1] >> 7;
+        payload_len = b[1] & 0x7F;
+
+        /* invalid websocket packet must return error */
+        if (opcode > WebSocket_OP_PONG ||
+            (opcode > WebSocket_OP_BINARY && opcode < WebSocket_OP_CLOSE)) {
+            rc = SOCKET_ERROR;
+            goto exit;
+        }
+        /* RSV1 marks the first frame of a compressed message, if compression was agreed */
+        if ((rsv & ~WS_RSV1) != 0 || (rsv != 0 && (net->websocket_deflate == NULL ||
+                                                    opcode == WebSocket_OP_CONTINUE || opcode >= WebSocket_OP_CLOSE))) {
+            Log(TRACE_PROTOCOL, -1, "WebSocket frame with reserved bits %x", rsv);
+            rc = SOCKET_ERROR;
+            goto exit;
+        }
 
-            /* 1st byte */
-            is_final = (b[0] & 0xFF) >> 7;
-            tmp_opcode = (b[0] & 0x0F);
+        /* 126 and 127 mean the length follows, in 2 or 8 bytes, then the masking key if any */
+        if (payload_len == 126)
+            header_len += 2u;
+        else if (payload_len == 127)
+            header_len += 8u;
+        if (has_mask)
+            header_len += sizeof(uint32_t);
+        if ((rc = WebSocket_fill(net, in, header_len)) != TCPSOCKET_COMPLETE)
+            goto exit;
+        b = (unsigned char *) &in->buf[in->end];
+        if (payload_len == 126) {
+            uint16_t len16;
+
+            memcpy(&len16, &b[2], sizeof(len16));
+            payload_len = be16toh(len16);
+        } else if (payload_len == 127) {
+            uint64_t len64;
+
+            memcpy(&len64, &b[2], sizeof(len64));
+            len64 = be64toh(len64);
+            payload_len = (len64 > SIZE_MAX) ? SIZE_MAX : (size_t) len64;
+        }
+        /* refuse frames larger than any packet we take, before anything is allocated for them */
+        if ((net->maxPacketSize > 0u && payload_len > net->maxPacketSize + 5u) ||
+            payload_len > SIZE_MAX - in->len - header_len) {
+            Log(TRACE_PROTOCOL, -1, "WebSocket frame of %lu bytes refused", (unsigned long) payload_len);
+            rc = SOCKET_ERROR;
+            goto exit;
+        }
 
-            if (tmp_opcode) /* not a continuation frame */
-                opcode = tmp_opcode;
+        if ((rc = WebSocket_fill(net, in, header_len + payload_len)) != TCPSOCKET_COMPLETE)
+            goto exit;
+        b = (unsigned char *) &in->buf[in->end];
+        payload = (char *) &b[header_len];
+        if (has_mask)
+            WebSocket_mask(payload, payload, payload_len, &b[header_len - sizeof(uint32_t)], 0);
 
-            /* invalid websocket packet must return error */
-            if (opcode < WebSocket_OP_CONTINUE ||
-                opcode > WebSocket_OP_PONG ||
-                (opcode > WebSocket_OP_BINARY &&
-                 opcode < WebSocket_OP_CLOSE)) {
-                rc = SOCKET_ERROR;
+        if (opcode == WebSocket_OP_CLOSE) {
+            /* server end closed websocket connection */
+            WebSocket_close(net, WebSocket_CLOSE_GOING_AWAY, NULL);
+            rc = SOCKET_ERROR; /* closes socket */
+            goto exit;
+        } else if (opcode == WebSocket_OP_PING || opcode == WebSocket_OP_PONG) {
+            /* respond to a "ping" with a "pong", then discard the frame */
+            if (opcode == WebSocket_OP_PING)
+                WebSocket_pong(net, payload, payload_len);
+            in->len = in->end;
+        } else if ((in->compressed = (opcode == WebSocket_OP_CONTINUE) ? in->compressed : (rsv != 0))) {
+            if ((rc = WebSocket_inflateFrame(net, in, payload, payload_len, fin)) != TCPSOCKET_COMPLETE)
                 goto exit;
+        } else {
+            pending = in->end - in->start;
+            if (pending <= payload_len) {
+                memmove(&in->buf[in->start + header_len], &in->buf[in->start], pending);
+                in->start += header_len;
+                in->pos += header_len;
+                in->end = in->len;
+            } else {
+                memmove(&in->buf[in->end], payload, payload_len);
+                in->end += payload_len;
+                in->len = in->end;
             }
+        }
+    } while (opcode == WebSocket_OP_PING || opcode == WebSocket_OP_PONG);
 
-            /* 2nd byte */
-            has_mask = (b[1] & 0xFF) >> 7;
-            payload_len = (b[1] & 0x7F);
-
-            /* determine payload length */
-            if (payload_len == 126) {
-                /* If 126, the following 2 bytes interpreted as a
-                      16-bit unsigned integer are the payload length. */
-                b = WebSocket_getRawSocketData(net, 2u, &len, &rcs);
-                if (rcs == SOCKET_ERROR) {
-                    rc = rcs;
-                    goto exit;
-                }
-                if (!b) {
-                    rc = SOCKET_ERROR;
-                    goto exit;
-                } else if (len < 2u) {
-                    rc = TCPSOCKET_INTERRUPTED;
-                    goto exit;
-                }
-                /* convert from big endian 16 to host */
-                payload_len = be16toh(*(uint16_t *) b);
-            } else if (payload_len == 127) {
-                /* If 127, the following 8 bytes interpreted as a 64-bit unsigned integer (the
-                     most significant bit MUST be 0) are the payload length */
-                b = WebSocket_getRawSocketData(net, 8u, &len, &rcs);
-                if (rcs == SOCKET_ERROR) {
-                    rc = rcs;
-                    goto exit;
-                }
-                if (!b) {
-                    rc = SOCKET_ERROR;
-                    goto exit;
-                } else if (len < 8u) {
-                    rc = TCPSOCKET_INTERRUPTED;
-                    goto exit;
-                }
-                /* convert from big-endian 64 to host */
-                payload_len = (size_t) be64toh(*(uint64_t *) b);
-            }
-
-            if (has_mask) {
-                uint8_t mask[4];
-                b = WebSocket_getRawSocketData(net, 4u, &len, &rcs);
-                if (rcs == SOCKET_ERROR) {
-                    rc = rcs;
-                    goto exit;
-                }
-                if (!b) {
-                    rc = SOCKET_ERROR;
-                    goto exit;
-                }
-                if (len < 4u) {
-                    rc = TCPSOCKET_INTERRUPTED;
-                    goto exit;
-                }
-                memcpy(&mask[0], b, sizeof(uint32_t));
-            }
-
-            /* use the socket buffer to read in the whole websocket frame */
-            b = WebSocket_getRawSocketData(net, payload_len, &len, &rcs);
-            if (rcs == SOCKET_ERROR) {
-                rc = rcs;
-                goto exit;
-            }
-            if (!b) {
-                rc = SOCKET_ERROR;
-                goto exit;
-            }
-            if (len < payload_len) {
-                rc = TCPSOCKET_INTERRUPTED;
-                goto exit;
-            }
+    exit:
+    return rc;
+}
 
-            /* unmask data */
-            if (has_mask) {
-                size_t i;
-                for (i = 0u; i < payload_len; ++i)
-                    b[i] ^= mask[i % 4];
-            }
+/*
+ * Inflate the payload of a frame of a compressed message onto the payload before it, dropping
+ * the frame.  A message may not inflate to more than the largest packet the connection takes.
+ */
+static int WebSocket_inflateFrame(networkHandles *net, ws_buffer *in, const char *payload, size_t payload_len,
+                                  int fin) {
+    int rc = SOCKET_ERROR, done = 0;
 
-            if (res)
-                cur_len = res->len;
+    if (WebSocket_inflateStart(net->websocket_deflate, payload, payload_len, fin) != 0)
+        goto exit;
+    in->len = in->end;
+    while (done == 0) {
+        size_t produced = 0u;
 
-            if (res == NULL) {
-                if ((res = malloc(sizeof(struct ws_frame) + cur_len + len)) == NULL) {
-                    rc = PAHO_MEMORY_ERROR;
-                    goto exit;
-                }
-                res->pos = 0u;
-            } else {
-                if ((res = realloc(res, sizeof(struct ws_frame) + cur_len + len)) == NULL) {
-                    rc = PAHO_MEMORY_ERROR;
-                    goto exit;
-                }
-            }
-            if (in_frames && in_frames->first)
-                in_frames->first->content = res; /* realloc moves the data */
-            memcpy((unsigned char *) res + sizeof(struct ws_frame) + cur_len, b, len);
-            res->len = cur_len + len;
-
-            WebSocket_getRawSocketData(net, 0u, &len, &rcs);
-            if (rcs == SOCKET_ERROR) {
-                rc = rcs;
-                goto exit;
-            }
+        if (WebSocket_reserve(in, WS_BUFFER_MIN) != 0)
+            goto exit;
+        done = WebSocket_inflate(net->websocket_deflate, &in->buf[in->end], in->size - in->end, &produced);
+        in->end += produced;
+        in->len = in->end;
+        in->inflated += produced;
+        if (done < 0) {
+            Log(TRACE_PROTOCOL, -1, "WebSocket compressed message could not be inflated");
+            goto exit;
         }
-
-        if (opcode == WebSocket_OP_PING || opcode == WebSocket_OP_PONG) {
-            /* respond to a "ping" with a "pong" */
-            if (opcode == WebSocket_OP_PING)
-                WebSocket_pong(net,
-                               (char *) res + sizeof(struct ws_frame),
-                               res->len);
-
-            /* discard message */
-            free(res);
-            res = NULL;
-        } else if (opcode == WebSocket_OP_CLOSE) {
-            /* server end closed websocket connection */
-            free(res);
-            WebSocket_close(net, WebSocket_CLOSE_GOING_AWAY, NULL);
-            rc = SOCKET_ERROR; /* closes socket */
+        if (net->maxPacketSize > 0u && in->inflated > net->maxPacketSize + 5u) {
+            Log(TRACE_PROTOCOL, -1, "WebSocket compressed message inflates to more than %lu bytes",
+                (unsigned long) net->maxPacketSize);
             goto exit;
         }
-    } while (opcode == WebSocket_OP_PING || opcode == WebSocket_OP_PONG);
-    //}
-
-    if (in_frames->count == 0)
-        ListAppend(in_frames, res, sizeof(struct ws_frame) + res->len);
-    *actual_len = res->len - res->pos;
-
-    exit:
-    if (rc == TCPSOCKET_INTERRUPTED) {
-        WebSocket_rewindData();
     }
+    if (fin) {
+        in->compressed = 0;
+        in->inflated = 0u;
+    }
+    rc = TCPSOCKET_COMPLETE;
+    exit:
     return rc;
 }
 
@@ -798,46 +743,65 @@ const char *WebSocket_strcasefind(const char *buf, const char *str, size_t len)
 }
 
 /**
- * releases resources used by the websocket sub-system
+ * Shrink the receive buffer of a connection once a large packet has been read out of it and
+ * handled, and its compression buffers once a large message has gone through them, so that one
+ * large message does not stay resident until the next one arrives.  Called
+ * between packets by the buffer governor.
+ * @param net the network handle of the connection
  */
-void WebSocket_terminate(void) {
-    /* clean up and un-processed websocket frames */
-    if (in_frames) {
-        struct ws_frame *f = ListDetachHead(in_frames);
-        while (f) {
-            free(f);
-            f = ListDetachHead(in_frames);
+void WebSocket_trim(networkHandles *net) {
+    ws_buffer *in = net->websocket_in;
+
+    if (in && in->pos == in->len) {
+        in->start = in->pos = in->end = in->len = 0u;
+        if (in->size > SOCKETBUFFER_KEEP_SIZE) {
+            SocketBuffer_account(-(long) in->size);
+            free(in->buf);
+            in->buf = NULL;
+            in->size = 0u;
         }
-        ListFree(in_frames);
-        in_frames = NULL;
-    }
-    if (last_frame) {
-        free(last_frame);
-        last_frame = NULL;
-    }
-
-    if (frame_buffer) {
-        free(frame_buffer);
-        frame_buffer = NULL;
     }
+    WebSocket_deflateTrim(net->websocket_deflate);
+}
 
-    frame_buffer_len = 0;
-    frame_buffer_index = 0;
-    frame_buffer_data_len = 0;
-
+/**
+ * releases resources used by the websocket sub-system
+ */
+void WebSocket_terminate(void) {
     Socket_outTerminate();
 }
 
+/**
+ * Release the receive buffer and compression contexts of a connection, when its network handle
+ * is done with.
+ * @param net the network handle of the connection
+ */
+void WebSocket_free(networkHandles *net) {
+    ws_buffer *in = net->websocket_in;
+
+    WebSocket_deflateFree(net->websocket_deflate);
+    net->websocket_deflate = NULL;
+    if (in) {
+        SocketBuffer_account(-(long) (sizeof(ws_buffer) + in->size));
+        free(in->buf);
+        free(in);
+        net->websocket_in = NULL;
+    }
+}
+
 int WebSocket_upgrade(networkHandles *net) {
     static const char *const ws_guid =
             "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
     int rc = SOCKET_ERROR;
     if (net->websocket_key) {
+        ws_buffer *in = WebSocket_buffer(net);
         SHA_CTX ctx;
         char ws_key[62u] = {0};
         unsigned char sha_hash[SHA1_DIGEST_LENGTH];
         size_t rcv = 0u;
-        char *read_buf;
+        const char *read_buf;
+        const char *p;
+        const char *ext;
 
         /* calculate the expected websocket key, expected from server */
         snprintf(ws_key, sizeof(ws_key), "%s%s", net->websocket_key, ws_guid);
@@ -846,90 +810,98 @@ int WebSocket_upgrade(networkHandles *net) {
         SHA1_Final(sha_hash, &ctx);
         Base64_encode(ws_key, sizeof(ws_key), sha_hash, SHA1_DIGEST_LENGTH);
 
-        read_buf = WebSocket_getRawSocketData(net, 12u, &rcv, &rc);
-        if (rc == SOCKET_ERROR)
+        if (in == NULL)
             goto exit;
 
-        if ((read_buf == NULL) || rcv < 12u) {
-            Log(TRACE_PROTOCOL, 1, "WebSocket upgrade read not complete %lu", rcv);
-            rc = TCPSOCKET_INTERRUPTED;
-            goto exit;
-        }
+        /* read the response into the receive buffer, up to the blank line which ends it */
+        while ((p = WebSocket_strcasefind(&in->buf[in->end], "\r\n\r\n", in->len - in->end)) == NULL) {
+            size_t actual_len = 0u;
 
-        if (strncmp(read_buf, "HTTP/1.1", 8u) == 0) {
-            if (strncmp(&read_buf[9], "101", 3u) != 0) {
-                Log(TRACE_PROTOCOL, 1, "WebSocket HTTP rc %.3s", &read_buf[9]);
+            if (in->len - in->end > WS_RESPONSE_MAX || WebSocket_reserve(in, WS_BUFFER_MIN) != 0) {
                 rc = SOCKET_ERROR;
                 goto exit;
             }
-        }
-
-        if (strncmp(read_buf, "HTTP/1.1 101", 12u) == 0) {
-            const char *p;
-
-            read_buf = WebSocket_getRawSocketData(net, 1024u, &rcv, &rc);
+            rc = Socket_read(net->socket, &in->buf[in->len], in->size - in->len, &actual_len);
+            in->len += actual_len;
             if (rc == SOCKET_ERROR)
                 goto exit;
-
-            /* Did we read the whole response? */
-            if (read_buf && rcv > 4 && memcmp(&read_buf[rcv - 4], "\r\n\r\n", 4) != 0) {
-                Log(TRACE_PROTOCOL, -1, "WebSocket HTTP upgrade response read not complete %lu", rcv);
-                rc = SOCKET_ERROR;
+            if (rc == TCPSOCKET_INTERRUPTED &&
+                WebSocket_strcasefind(&in->buf[in->end], "\r\n\r\n", in->len - in->end) == NULL) {
+                Log(TRACE_PROTOCOL, -1, "WebSocket HTTP upgrade response read not complete %lu",
+                    (unsigned long) (in->len - in->end));
                 goto exit;
             }
+        }
+        read_buf = &in->buf[in->end];
+        rcv = (size_t) (p - read_buf) + 4u;
 
-            /* check for upgrade */
-            p = WebSocket_strcasefind(
-                    read_buf, "Connection", rcv);
-            if (p) {
-                const char *eol;
-                eol = memchr(p, '\n', rcv - (read_buf - p));
-                if (eol)
-                    p = WebSocket_strcasefind(
-                            p, "Upgrade", eol - p);
-                else
-                    p = NULL;
-            }
+        if (rcv < 12u || strncmp(read_buf, "HTTP/1.1 101", 12u) != 0) {
+            Log(TRACE_PROTOCOL, 1, "WebSocket HTTP rc %.3s", (rcv < 12u) ? "" : &read_buf[9]);
+            rc = SOCKET_ERROR;
+            goto exit;
+        }
+
+        /* check for upgrade */
+        p = WebSocket_strcasefind(read_buf, "Connection", rcv);
+        if (p) {
+            const char *eol;
+            eol = memchr(p, '\n', rcv - (p - read_buf));
+            if (eol)
+                p = WebSocket_strcasefind(p, "Upgrade", eol - p);
+            else
+                p = NULL;
+        }
 
-            /* check key hash */
-            if (p)
-                p = WebSocket_strcasefind(read_buf,
-                                          "sec-websocket-accept", rcv);
-            if (p) {
-                const char *eol;
-                eol = memchr(p, '\n', rcv - (read_buf - p));
-                if (eol) {
-                    p = memchr(p, ':', eol - p);
-                    if (p) {
-                        size_t hash_len = eol - p - 1;
-                        while (*p == ':' || *p == ' ') {
-                            ++p;
-                            --hash_len;
-                        }
-
-                        if (strncmp(p, ws_key, hash_len) != 0)
-                            p = NULL;
+        /* check key hash */
+        if (p)
+            p = WebSocket_strcasefind(read_buf, "sec-websocket-accept", rcv);
+        if (p) {
+            const char *eol;
+            eol = memchr(p, '\n', rcv - (p - read_buf));
+            if (eol) {
+                p = memchr(p, ':', eol - p);
+                if (p) {
+                    size_t hash_len = eol - p - 1;
+                    while (*p == ':' || *p == ' ') {
+                        ++p;
+                        --hash_len;
                     }
-                } else
-                    p = NULL;
-            }
 
-            if (p) {
-                net->websocket = 1;
-                Log(TRACE_PROTOCOL, 1, "WebSocket connection upgraded");
-                rc = 1;
-            } else {
-                Log(TRACE_PROTOCOL, 1, "WebSocket failed to upgrade connection");
-                rc = SOCKET_ERROR;
-            }
+                    if (strncmp(p, ws_key, hash_len) != 0)
+                        p = NULL;
+                }
+            } else
+                p = NULL;
+        }
+
+        /* the server's answer to the permessage-deflate offer, if it took it up */
+        if (p && (ext = WebSocket_strcasefind(read_buf, "sec-websocket-extensions:", rcv)) != NULL) {
+            const char *eol = memchr(ext, '\n', rcv - (ext - read_buf));
+            size_t ext_len;
 
-            if (net->websocket_key) {
-                free(net->websocket_key);
-                net->websocket_key = NULL;
+            ext += 25;
+            ext_len = (eol == NULL) ? 0u : (size_t) (eol - ext) - (eol[-1] == '\r');
+            if (WebSocket_deflateAccept(net->deflateOptions, ext, ext_len, &net->websocket_deflate) != 0) {
+                Log(TRACE_PROTOCOL, 1, "WebSocket extensions %.*s not accepted", (int) ext_len, ext);
+                p = NULL;
             }
-            /* indicate that we done with the packet */
-            WebSocket_getRawSocketData(net, 0u, &rcv, &rc);
         }
+
+        if (p) {
+            net->websocket = 1;
+            Log(TRACE_PROTOCOL, 1, "WebSocket connection upgraded");
+            rc = 1;
+        } else {
+            Log(TRACE_PROTOCOL, 1, "WebSocket failed to upgrade connection");
+            rc = SOCKET_ERROR;
+        }
+
+        if (net->websocket_key) {
+            free(net->websocket_key);
+            net->websocket_key = NULL;
+        }
+        /* done with the response: anything after it is the start of the first frame */
+        in->start = in->pos = in->end = in->end + rcv;
     }
     exit:
     return rc;
@@ -8,20 +8,31 @@
 void WebSocket_close(networkHandles *net, int status_code, const char *reason);
 
 /* sends upgrade request */
-int WebSocket_connect(networkHandles *net, int ssl, const char *uri);
+int WebSocket_connect(networkHandles *net, int ssl, const char *uri, size_t hostname_len, int port,
+                      const char *topic);
 
 /* obtain data from network socket */
 int WebSocket_getch(networkHandles *net, char *c);
 
 char *WebSocket_getdata(networkHandles *net, size_t bytes, size_t *actual_len);
 
-size_t WebSocket_framePos();
+/* start reading the next packet, or go back to the start of one not all received */
+void WebSocket_packetStart(networkHandles *net);
 
-void WebSocket_framePosSeekTo(size_t);
+void WebSocket_packetRewind(networkHandles *net);
 
 /* send data out, in websocket format only if required */
 int WebSocket_putdatas(networkHandles *net, char **buf0, size_t *buf0len, PacketBuffers *bufs);
 
+/* send a piece of a large packet out, waiting for the socket rather than leaving a pending write */
+int WebSocket_putdataFully(networkHandles *net, char *buf, size_t len, int timeout);
+
+/* shrinks the receive buffer of a connection, once a packet has been handled */
+void WebSocket_trim(networkHandles *net);
+
+/* releases the receive buffer of a connection */
+void WebSocket_free(networkHandles *net);
+
 /* releases any resources used by the websocket system */
 void WebSocket_terminate(void);
 
@@ -0,0 +1,384 @@
+//
+// Created by Administrator on 2026/10/19.
+//
+
+#include "WebSocketDeflate.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "Log.h"
+#include "SocketBuffer.h"
+
+#if defined(WEBSOCKET_DEFLATE)
+
+#include <zlib.h>
+
+/** the end of a flushed deflate block, which is left off the messages sent and put back on those received */
+static const char deflate_tail[4] = {0x00, 0x00, (char) 0xff, (char) 0xff};
+
+/**
+ * The compression contexts of a connection which agreed to permessage-deflate.  Compressed
+ * messages are built in out, which is kept from one to the next.  The payload of a compressed
+ * frame is copied into in to be inflated, since what it is inflated into is the receive buffer
+ * it was read into, which may move as it grows.  Both count towards the receive buffer budget,
+ * and are released by WebSocket_deflateTrim once a large message has gone through them.
+ */
+struct WebSocket_deflate {
+    z_stream deflate;
+    z_stream inflate;
+    int clientNoContextTakeover;    /**< start each message sent afresh */
+    int serverNoContextTakeover;    /**< start each message received afresh */
+    size_t threshold;               /**< messages shorter than this are sent uncompressed */
+    char *out;
+    size_t outsize;
+    char *in;
+    size_t insize;
+    int fin;                        /**< what is in in ends a message */
+};
+
+/**
+ * Write the Sec-WebSocket-Extensions header of the upgrade request, offering permessage-deflate.
+ * @param options what to offer
+ * @param buf where the header goes
+ * @param len the size of buf
+ * @return the length of the header, or 0 if nothing is offered
+ */
+size_t WebSocket_deflateOffer(const MQTTClient_deflateOptions *options, char *buf, size_t len) {
+    int rc = 0;
+
+    if (options == NULL || len == 0u)
+        goto exit;
+    rc = snprintf(buf, len, "Sec-WebSocket-Extensions: permessage-deflate");
+    if (options->clientMaxWindowBits >= 9 && options->clientMaxWindowBits < 15)
+        rc += snprintf(&buf[rc], len - rc, "; client_max_window_bits=%d", options->clientMaxWindowBits);
+    else
+        rc += snprintf(&buf[rc], len - rc, "; client_max_window_bits");
+    if (options->serverMaxWindowBits >= 8 && options->serverMaxWindowBits <= 15)
+        rc += snprintf(&buf[rc], len - rc, "; server_max_window_bits=%d", options->serverMaxWindowBits);
+    if (options->clientNoContextTakeover)
+        rc += snprintf(&buf[rc], len - rc, "; client_no_context_takeover");
+    if (options->serverNoContextTakeover)
+        rc += snprintf(&buf[rc], len - rc, "; server_no_context_takeover");
+    rc += snprintf(&buf[rc], len - rc, "\r\n");
+    if ((size_t) rc >= len)
+        rc = 0;
+    exit:
+    return (size_t) rc;
+}
+
+/* The window bits of an extension parameter, which may be quoted, or -1 if it is not 8 to 15 */
+static int WebSocket_deflateBits(const char *value, size_t len) {
+    int bits = 0;
+    size_t i = 0u;
+
+    if (len >= 2u && value[0] == '"' && value[len - 1] == '"') {
+        ++value;
+        len -= 2u;
+    }
+    for (; i < len && i < 2u && value[i] >= '0' && value[i] <= '9'; ++i)
+        bits = bits * 10 + value[i] - '0';
+    return (i == len && bits >= 8 && bits <= 15) ? bits : -1;
+}
+
+/**
+ * Take the server's answer to the permessage-deflate offer, from the Sec-WebSocket-Extensions
+ * header of the upgrade response, and make the compression contexts it calls for.  The answer
+ * must be permessage-deflate, with no parameter which was not offered or which asks for what
+ * this end cannot do, and if it is not the connection has to fail.
+ * @param options what was offered, NULL if nothing was
+ * @param value the header value
+ * @param len the length of the value
+ * @param deflate returns the compression contexts
+ * @return 0, or -1 if the answer cannot be accepted
+ */
+int WebSocket_deflateAccept(const MQTTClient_deflateOptions *options, const char *value, size_t len,
+                            WebSocket_deflate **deflate) {
+    WebSocket_deflate *d = NULL;
+    const char *end = &value[len];
+    int clientBits, serverBits = 15, rc = -1;
+    int clientReset, serverReset = 0;
+    int level, first = 1;
+
+    if (options == NULL)
+        goto exit;
+    clientBits = (options->clientMaxWindowBits >= 9 && options->clientMaxWindowBits <= 15) ?
+                 options->clientMaxWindowBits : 15;
+    clientReset = options->clientNoContextTakeover;
+    level = (options->level >= 1 && options->level <= 9) ? options->level : Z_DEFAULT_COMPRESSION;
+
+    while (value < end) {
+        const char *param, *eq;
+        size_t param_len;
+
+        /* each parameter, without the spaces around it */
+        while (value < end && (*value == ' ' || *value == '\t'))
+            ++value;
+        param = value;
+        while (value < end && *value != ';' && *value != ',')
+            ++value;
+        if (value < end && *value == ',') {
+            Log(TRACE_PROTOCOL, -1, "WebSocket server answered with more than one extension");
+            goto exit;
+        }
+        param_len = (size_t) (value - param);
+        while (param_len > 0u && (param[param_len - 1] == ' ' || param[param_len - 1] == '\t'))
+            --param_len;
+        if (value < end)
+            ++value;
+        eq = memchr(param, '=', param_len);
+
+        if (param_len == 0u && !first)
+            continue;
+        if (first) {
+            /* the extension, then its parameters */
+            if (param_len != 18u || strncasecmp(param, "permessage-deflate", 18u) != 0)
+                goto exit;
+            first = 0;
+        } else if (param_len == 26u && strncasecmp(param, "client_no_context_takeover", 26u) == 0)
+            clientReset = 1;
+        else if (param_len == 26u && strncasecmp(param, "server_no_context_takeover", 26u) == 0)
+            serverReset = 1;
+        else if (eq && (size_t) (eq - param) == 22u && strncasecmp(param, "client_max_window_bits", 22u) == 0) {
+            int bits = WebSocket_deflateBits(&eq[1], param_len - 23u);
+
+            /* zlib makes 9 bit streams when asked for 8, which a peer with an 8 bit window cannot read */
+            if (bits < 9)
+                goto exit;
+            if (bits < clientBits)
+                clientBits = bits;
+        } else if (eq && (size_t) (eq - param) == 22u && strncasecmp(param, "server_max_window_bits", 22u) == 0) {
+            serverBits = WebSocket_deflateBits(&eq[1], param_len - 23u);
+            if (serverBits < 0 || (options->serverMaxWindowBits >= 8 && serverBits > options->serverMaxWindowBits))
+                goto exit;
+        } else {
+            Log(TRACE_PROTOCOL, -1, "WebSocket permessage-deflate parameter %.*s not accepted", (int) param_len, param);
+            goto exit;
+        }
+    }
+
+    if ((d = calloc(1, sizeof(WebSocket_deflate))) == NULL)
+        goto exit;
+    if (deflateInit2(&d->deflate, level, Z_DEFLATED, -clientBits, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        free(d);
+        d = NULL;
+        goto exit;
+    }
+    if (inflateInit2(&d->inflate, -serverBits) != Z_OK) {
+        deflateEnd(&d->deflate);
+        free(d);
+        d = NULL;
+        goto exit;
+    }
+    d->clientNoContextTakeover = clientReset;
+    d->serverNoContextTakeover = serverReset;
+    d->threshold = (options->threshold > 0) ? (size_t) options->threshold : 0u;
+    Log(TRACE_PROTOCOL, -1, "WebSocket permessage-deflate window bits %d/%d%s%s", clientBits, serverBits,
+        clientReset ? ", client_no_context_takeover" : "", serverReset ? ", server_no_context_takeover" : "");
+    rc = 0;
+    exit:
+    *deflate = d;
+    return rc;
+}
+
+/* Make room for bytes more compressed data after what is in out already, within the budget */
+static int WebSocket_deflateGrow(WebSocket_deflate *d, size_t bytes) {
+    size_t used = d->outsize - d->deflate.avail_out;
+    size_t size = (d->outsize > 0u) ? d->outsize : 256u;
+    char *out;
+
+    while (size < used + bytes)
+        size *= 2;
+    if (size > d->outsize) {
+        if (!SocketBuffer_withinBudget(size - d->outsize) || (out = realloc(d->out, size)) == NULL)
+            return -1;
+        SocketBuffer_account((long) size - (long) d->outsize);
+        d->out = out;
+        d->outsize = size;
+    }
+    d->deflate.next_out = (Bytef *) &d->out[used];
+    d->deflate.avail_out = (uInt) (d->outsize - used);
+    return 0;
+}
+
+/**
+ * Compress a message, of buf0 then the buffers after it.
+ * @param d the compression contexts of the connection
+ * @param buf0 the first buffer
+ * @param buf0len the length of buf0
+ * @param bufs the buffers after it
+ * @param len returns the length of the compressed message
+ * @return the compressed message, which stays valid until the next one is compressed, or NULL
+ * if the message is to be sent as it is, because it is short or it could not be compressed,
+ * which includes there being no room for it within the budget
+ */
+char *WebSocket_deflateMessage(WebSocket_deflate *d, const char *buf0, size_t buf0len,
+                               const PacketBuffers *bufs, size_t *len) {
+    size_t total = buf0len;
+    char *rv = NULL;
+    int i, zrc = Z_OK;
+
+    for (i = 0; i < bufs->count; ++i)
+        total += bufs->buflens[i];
+    if (d == NULL || total < d->threshold)
+        goto exit;
+
+    d->deflate.avail_out = (uInt) d->outsize;
+    if (WebSocket_deflateGrow(d, deflateBound(&d->deflate, (uLong) total) + 16u) != 0)
+        goto error;
+    for (i = -1; i < bufs->count; ++i) {
+        d->deflate.next_in = (Bytef *) ((i < 0) ? buf0 : bufs->buffers[i]);
+        d->deflate.avail_in = (uInt) ((i < 0) ? buf0len : bufs->buflens[i]);
+        do {
+            if (d->deflate.avail_out == 0u && WebSocket_deflateGrow(d, d->outsize) != 0)
+                goto error;
+            zrc = deflate(&d->deflate, (i == bufs->count - 1) ? Z_SYNC_FLUSH : Z_NO_FLUSH);
+        } while (zrc == Z_OK && (d->deflate.avail_in > 0u || d->deflate.avail_out == 0u));
+        if (zrc != Z_OK && zrc != Z_BUF_ERROR)
+            goto error;
+    }
+    *len = d->outsize - d->deflate.avail_out;
+    if (*len < sizeof(deflate_tail) || memcmp(&d->out[*len - sizeof(deflate_tail)], deflate_tail, sizeof(deflate_tail)) != 0)
+        goto error;
+    *len -= sizeof(deflate_tail);
+    rv = d->out;
+    if (d->clientNoContextTakeover)
+        deflateReset(&d->deflate);
+    goto exit;
+
+    error:
+    /* the stream holds part of a message the other end will not see, so the next must not refer to it */
+    deflateReset(&d->deflate);
+    exit:
+    return rv;
+}
+
+/**
+ * Give the payload of a compressed frame to be inflated.
+ * @param d the compression contexts of the connection
+ * @param data the payload
+ * @param len the length of the payload
+ * @param fin whether the frame ends its message
+ * @return 0, or -1 if there is no memory, or no room within the receive buffer budget
+ */
+int WebSocket_inflateStart(WebSocket_deflate *d, const char *data, size_t len, int fin) {
+    size_t need = len + (fin ? sizeof(deflate_tail) : 0u);
+
+    if (need > d->insize) {
+        char *in = NULL;
+
+        if (!SocketBuffer_withinBudget(need - d->insize) || (in = realloc(d->in, need)) == NULL) {
+            Log(LOG_ERROR, -1, "No room to inflate a %lu byte WebSocket frame", (unsigned long) len);
+            return -1;
+        }
+        SocketBuffer_account((long) need - (long) d->insize);
+        d->in = in;
+        d->insize = need;
+    }
+    memcpy(d->in, data, len);
+    if (fin)
+        memcpy(&d->in[len], deflate_tail, sizeof(deflate_tail));
+    d->inflate.next_in = (Bytef *) d->in;
+    d->inflate.avail_in = (uInt) need;
+    d->fin = fin;
+    return 0;
+}
+
+/**
+ * Inflate what was given to WebSocket_inflateStart, as far as there is room for.
+ * @param d the compression contexts of the connection
+ * @param out where the data goes
+ * @param outlen the room there
+ * @param produced returns the number of bytes put there
+ * @return 1 when it is all inflated, 0 if there is more to come once there is more room, or
+ * -1 if the data is not a deflate stream
+ */
+int WebSocket_inflate(WebSocket_deflate *d, char *out, size_t outlen, size_t *produced) {
+    int rc = -1, zrc;
+
+    d->inflate.next_out = (Bytef *) out;
+    d->inflate.avail_out = (uInt) outlen;
+    zrc = inflate(&d->inflate, Z_SYNC_FLUSH);
+    *produced = outlen - d->inflate.avail_out;
+    if (zrc != Z_OK && zrc != Z_BUF_ERROR)
+        goto exit;
+    if (d->inflate.avail_in > 0u || d->inflate.avail_out == 0u)
+        rc = 0;
+    else {
+        rc = 1;
+        if (d->fin && d->serverNoContextTakeover)
+            inflateReset(&d->inflate);
+    }
+    exit:
+    return rc;
+}
+
+/**
+ * Release the compression buffers of a connection if a large message has left them larger than
+ * SOCKETBUFFER_KEEP_SIZE, when nothing is being inflated from them.
+ * @param d the contexts, may be NULL
+ */
+void WebSocket_deflateTrim(WebSocket_deflate *d) {
+    if (d && d->outsize > SOCKETBUFFER_KEEP_SIZE) {
+        SocketBuffer_account(-(long) d->outsize);
+        free(d->out);
+        d->out = NULL;
+        d->outsize = 0u;
+    }
+    if (d && d->insize > SOCKETBUFFER_KEEP_SIZE && d->inflate.avail_in == 0u) {
+        SocketBuffer_account(-(long) d->insize);
+        free(d->in);
+        d->in = NULL;
+        d->insize = 0u;
+    }
+}
+
+/**
+ * Release the compression contexts of a connection.
+ * @param d the contexts, may be NULL
+ */
+void WebSocket_deflateFree(WebSocket_deflate *d) {
+    if (d) {
+        SocketBuffer_account(-(long) (d->outsize + d->insize));
+        deflateEnd(&d->deflate);
+        inflateEnd(&d->inflate);
+        free(d->out);
+        free(d->in);
+        free(d);
+    }
+}
+
+#else
+
+size_t WebSocket_deflateOffer(const MQTTClient_deflateOptions *options, char *buf, size_t len) {
+    return 0u;
+}
+
+int WebSocket_deflateAccept(const MQTTClient_deflateOptions *options, const char *value, size_t len,
+                            WebSocket_deflate **deflate) {
+    *deflate = NULL;
+    return -1; /* nothing was offered */
+}
+
+char *WebSocket_deflateMessage(WebSocket_deflate *d, const char *buf0, size_t buf0len,
+                               const PacketBuffers *bufs, size_t *len) {
+    return NULL;
+}
+
+int WebSocket_inflateStart(WebSocket_deflate *d, const char *data, size_t len, int fin) {
+    return -1;
+}
+
+int WebSocket_inflate(WebSocket_deflate *d, char *out, size_t outlen, size_t *produced) {
+    *produced = 0u;
+    return -1;
+}
+
+void WebSocket_deflateTrim(WebSocket_deflate *d) {
+}
+
+void WebSocket_deflateFree(WebSocket_deflate *d) {
+}
+
+#endif
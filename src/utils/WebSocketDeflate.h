@@ -0,0 +1,35 @@
+//
+// Created by Administrator on 2026/10/19.
+//
+// WebSocket permessage-deflate (RFC 7692): the extension offered in the upgrade request, the
+// server's answer to it, and the deflate and inflate contexts of a connection which agreed to
+// it.  A compressed message is sent as the deflate stream of its data, flushed and without the
+// 0x00 0x00 0xff 0xff that ends the flush, in frames with RSV1 set on the first.  Built with
+// zlib when WEBSOCKET_DEFLATE is defined; otherwise nothing is offered.
+//
+
+#ifndef MQTT_CLIENT_WEBSOCKETDEFLATE_H
+#define MQTT_CLIENT_WEBSOCKETDEFLATE_H
+
+#include <stddef.h>
+#include "Socket.h"
+
+typedef struct WebSocket_deflate WebSocket_deflate;
+
+size_t WebSocket_deflateOffer(const MQTTClient_deflateOptions *options, char *buf, size_t len);
+
+int WebSocket_deflateAccept(const MQTTClient_deflateOptions *options, const char *value, size_t len,
+                            WebSocket_deflate **deflate);
+
+char *WebSocket_deflateMessage(WebSocket_deflate *d, const char *buf0, size_t buf0len,
+                               const PacketBuffers *bufs, size_t *len);
+
+int WebSocket_inflateStart(WebSocket_deflate *d, const char *data, size_t len, int fin);
+
+int WebSocket_inflate(WebSocket_deflate *d, char *out, size_t outlen, size_t *produced);
+
+void WebSocket_deflateTrim(WebSocket_deflate *d);
+
+void WebSocket_deflateFree(WebSocket_deflate *d);
+
+#endif //MQTT_CLIENT_WEBSOCKETDEFLATE_H
@@ -0,0 +1,156 @@
+//
+// Created by Administrator on 2026/10/19.
+//
+
+#include "WebSocketMask.h"
+
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define WEBSOCKETMASK_X86 1
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define WEBSOCKETMASK_NEON 1
+#endif
+
+/*
+ * Each kernel masks len bytes with a key already turned to the phase of the first byte, so that
+ * byte i uses key[i % 4].  On x86, which is little endian, the key as a 32 bit integer repeated
+ * across a vector lays the key bytes out in that order.  Vector kernels leave what does not fill a vector to the word kernel,
+ * which starts on a multiple of 4 and so keeps the phase.
+ */
+typedef void (*WebSocket_maskFn)(unsigned char *dst, const unsigned char *src, size_t len,
+                                 const unsigned char key[4]);
+
+static void WebSocket_maskWords(unsigned char *dst, const unsigned char *src, size_t len,
+                                const unsigned char key[4]) {
+    unsigned char key8[8];
+    uint64_t k, w;
+    size_t i = 0;
+
+    memcpy(key8, key, 4);
+    memcpy(&key8[4], key, 4);
+    memcpy(&k, key8, sizeof(k));
+    for (; i + sizeof(w) <= len; i += sizeof(w)) {
+        memcpy(&w, &src[i], sizeof(w));
+        w ^= k;
+        memcpy(&dst[i], &w, sizeof(w));
+    }
+    for (; i < len; ++i)
+        dst[i] = src[i] ^ key[i % 4];
+}
+
+#if defined(WEBSOCKETMASK_X86)
+
+__attribute__((target("sse2")))
+static void WebSocket_maskSSE2(unsigned char *dst, const unsigned char *src, size_t len,
+                               const unsigned char key[4]) {
+    int32_t key32;
+    __m128i k;
+    size_t i;
+
+    memcpy(&key32, key, sizeof(key32));
+    k = _mm_set1_epi32(key32);
+    for (i = 0; i + 16 <= len; i += 16)
+        _mm_storeu_si128((__m128i *) &dst[i], _mm_xor_si128(_mm_loadu_si128((const __m128i *) &src[i]), k));
+    WebSocket_maskWords(&dst[i], &src[i], len - i, key);
+}
+
+__attribute__((target("avx2")))
+static void WebSocket_maskAVX2(unsigned char *dst, const unsigned char *src, size_t len,
+                               const unsigned char key[4]) {
+    int32_t key32;
+    __m256i k;
+    size_t i;
+
+    memcpy(&key32, key, sizeof(key32));
+    k = _mm256_set1_epi32(key32);
+    for (i = 0; i + 64 <= len; i += 64) {
+        __m256i a = _mm256_loadu_si256((const __m256i *) &src[i]);
+        __m256i b = _mm256_loadu_si256((const __m256i *) &src[i + 32]);
+
+        _mm256_storeu_si256((__m256i *) &dst[i], _mm256_xor_si256(a, k));
+        _mm256_storeu_si256((__m256i *) &dst[i + 32], _mm256_xor_si256(b, k));
+    }
+    for (; i + 32 <= len; i += 32)
+        _mm256_storeu_si256((__m256i *) &dst[i], _mm256_xor_si256(_mm256_loadu_si256((const __m256i *) &src[i]), k));
+    WebSocket_maskWords(&dst[i], &src[i], len - i, key);
+}
+
+#elif defined(WEBSOCKETMASK_NEON)
+
+static void WebSocket_maskNEON(unsigned char *dst, const unsigned char *src, size_t len,
+                               const unsigned char key[4]) {
+    unsigned char key16[16];
+    uint8x16_t k;
+    size_t i;
+
+    for (i = 0; i < sizeof(key16); ++i)
+        key16[i] = key[i % 4];
+    k = vld1q_u8(key16);
+    for (i = 0; i + 16 <= len; i += 16)
+        vst1q_u8(&dst[i], veorq_u8(vld1q_u8(&src[i]), k));
+    WebSocket_maskWords(&dst[i], &src[i], len - i, key);
+}
+
+#endif
+
+static WebSocket_maskFn maskFn = NULL;
+static const char *maskName = NULL;
+
+/* Choose the kernel for this processor */
+static void WebSocket_maskSelect(void) {
+#if defined(WEBSOCKETMASK_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        maskName = "avx2";
+        maskFn = WebSocket_maskAVX2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        maskName = "sse2";
+        maskFn = WebSocket_maskSSE2;
+    } else {
+        maskName = "word";
+        maskFn = WebSocket_maskWords;
+    }
+#elif defined(WEBSOCKETMASK_NEON)
+    maskName = "neon";
+    maskFn = WebSocket_maskNEON;
+#else
+    maskName = "word";
+    maskFn = WebSocket_maskWords;
+#endif
+}
+
+/* below this, setting up a vector kernel costs more than it saves */
+#define WEBSOCKETMASK_VECTOR_MIN 32
+
+/**
+ * Mask or unmask WebSocket frame data.
+ * @param dst where the result goes, which may be src itself
+ * @param src the data
+ * @param len the length of the data
+ * @param mask the masking key of the frame
+ * @param phase the position of the data in the frame payload, which decides the key byte it starts on
+ */
+void WebSocket_mask(char *dst, const char *src, size_t len, const uint8_t mask[4], size_t phase) {
+    unsigned char key[4];
+    int i;
+
+    if (maskFn == NULL)
+        WebSocket_maskSelect();
+    for (i = 0; i < 4; ++i)
+        key[i] = mask[(phase + i) % 4];
+    (len < WEBSOCKETMASK_VECTOR_MIN ? WebSocket_maskWords : maskFn)((unsigned char *) dst,
+                                                                   (const unsigned char *) src, len, key);
+}
+
+/**
+ * The name of the masking kernel in use, for benchmarks and traces.
+ * @return "avx2", "sse2", "neon" or "word"
+ */
+const char *WebSocket_maskKernel(void) {
+    if (maskFn == NULL)
+        WebSocket_maskSelect();
+    return maskName;
+}
@@ -0,0 +1,19 @@
+//
+// Created by Administrator on 2026/10/19.
+//
+// WebSocket masking: the XOR of frame data with the four byte masking key.  The work is done
+// 16 or 32 bytes at a time with SSE2, AVX2 or NEON where the processor has them, chosen when
+// first used, and a word at a time otherwise.
+//
+
+#ifndef MQTT_CLIENT_WEBSOCKETMASK_H
+#define MQTT_CLIENT_WEBSOCKETMASK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+void WebSocket_mask(char *dst, const char *src, size_t len, const uint8_t mask[4], size_t phase);
+
+const char *WebSocket_maskKernel(void);
+
+#endif //MQTT_CLIENT_WEBSOCKETMASK_H